@@ -0,0 +1,57 @@
+#include "FileWatcher.h"
+
+namespace PBEngine
+{
+    FileWatcher::FileWatcher(std::chrono::milliseconds interval) :
+        interval(interval)
+    {
+        thread = std::thread(&FileWatcher::PollLoop, this);
+    }
+
+    FileWatcher::~FileWatcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        stopCondition.notify_all();
+        thread.join();
+    }
+
+    void FileWatcher::Watch(const std::string& path)
+    {
+        std::error_code error;
+        WatchedFile file;
+        file.path = path;
+        file.writeTime = std::filesystem::last_write_time(path, error);
+        file.exists = !error;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        files.push_back(file);
+    }
+
+    void FileWatcher::PollLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopCondition.wait_for(lock, interval, [this]() { return stopping; }))
+        {
+            for (WatchedFile& file : files)
+            {
+                // Editors often save by deleting and renaming, so a missing file is skipped rather than reported
+                std::error_code error;
+                const std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(file.path, error);
+                if (error)
+                {
+                    file.exists = false;
+                    continue;
+                }
+                if (!file.exists || writeTime != file.writeTime)
+                {
+                    file.writeTime = writeTime;
+                    file.exists = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
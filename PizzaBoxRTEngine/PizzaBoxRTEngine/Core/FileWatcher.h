@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace PBEngine
+{
+    /*
+        Polls the modification time of a handful of files on its own thread. Nothing is called back,
+        the owner checks ConsumeChanges whenever it's a good time to react, e.g. once per frame.
+    */
+    class FileWatcher
+    {
+    public:
+        explicit FileWatcher(std::chrono::milliseconds interval = std::chrono::milliseconds(250));
+        FileWatcher(const FileWatcher&) = delete;
+        FileWatcher& operator=(const FileWatcher&) = delete;
+        // Stops the polling thread
+        ~FileWatcher();
+
+        // Starts watching a file, a file that doesn't exist yet counts as changed once it shows up
+        void Watch(const std::string& path);
+
+        // True when any watched file changed since the last call
+        bool ConsumeChanges() { return changed.exchange(false); }
+
+    private:
+        struct WatchedFile
+        {
+            std::string path;
+            std::filesystem::file_time_type writeTime;
+            bool exists;
+        };
+
+        void PollLoop();
+
+        std::chrono::milliseconds interval;
+        std::vector<WatchedFile> files;
+        std::atomic<bool> changed{ false };
+        std::mutex mutex;
+        std::condition_variable stopCondition;
+        bool stopping = false;
+        std::thread thread;
+    };
+}
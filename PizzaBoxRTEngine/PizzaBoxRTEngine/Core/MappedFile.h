@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace PBEngine
+{
+    /*
+        Read only view of a whole file mapped into memory. Pages are only read from disk when they are
+        first touched, so opening is close to free no matter how large the file is.
+    */
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        MappedFile(MappedFile&& other) noexcept;
+        MappedFile& operator=(MappedFile&& other) noexcept;
+        ~MappedFile();
+
+        /**
+         * @brief Maps the file, closing whatever was mapped before
+         * @return false when the file doesn't exist, is empty or can't be mapped
+         */
+        bool Open(const std::string& path);
+        void Close();
+
+        bool IsOpen() const { return data != nullptr; }
+        const uint8_t* GetData() const { return data; }
+        uint64_t GetSize() const { return size; }
+
+    private:
+        const uint8_t* data = nullptr;
+        uint64_t size = 0;
+#ifdef _WIN32
+        void* fileHandle = nullptr;
+        void* mappingHandle = nullptr;
+#endif
+    };
+}
@@ -0,0 +1,137 @@
+#include "TaskSystem.h"
+#include "Trace.h"
+
+#include <algorithm>
+
+namespace PBEngine
+{
+    TaskSystem::TaskSystem(uint32_t threadCount)
+    {
+        if (threadCount == 0)
+        {
+            uint32_t hardwareThreads = std::thread::hardware_concurrency();
+            threadCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+        }
+
+        workers.reserve(threadCount);
+        for (uint32_t i = 0; i < threadCount; i++)
+        {
+            workers.emplace_back([this, i]() { WorkerLoop(i); });
+        }
+    }
+
+    TaskSystem::~TaskSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueCondition.notify_all();
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    void TaskSystem::Submit(std::function<void()> task, TaskGroup* group)
+    {
+        if (group)
+        {
+            group->pending.fetch_add(1, std::memory_order_relaxed);
+        }
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            queue.push_back({ std::move(task), group });
+        }
+        queueCondition.notify_one();
+    }
+
+    void TaskSystem::Run(Task& task)
+    {
+        task.function();
+        if (task.group)
+        {
+            task.group->pending.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    bool TaskSystem::TryRunOne()
+    {
+        Task task;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (queue.empty())
+            {
+                return false;
+            }
+            // Newest first keeps recursive work (like BVH subtrees) depth first and cache friendly
+            task = std::move(queue.back());
+            queue.pop_back();
+        }
+        Run(task);
+        return true;
+    }
+
+    void TaskSystem::WorkerLoop(uint32_t index)
+    {
+        GetTracer().SetThreadName("Worker " + std::to_string(index));
+        while (true)
+        {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCondition.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (stopping && queue.empty())
+                {
+                    return;
+                }
+                // Workers take the oldest tasks, which tend to be the biggest ones
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            Run(task);
+        }
+    }
+
+    void TaskSystem::Wait(TaskGroup& group)
+    {
+        while (group.pending.load(std::memory_order_acquire) != 0)
+        {
+            if (!TryRunOne())
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void TaskSystem::ParallelFor(uint32_t count, const std::function<void(uint32_t)>& function)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+
+        std::atomic<uint32_t> next{ 0 };
+        auto worker = [&]() {
+            for (uint32_t i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+            {
+                function(i);
+            }
+        };
+
+        TaskGroup group;
+        uint32_t helpers = std::min<uint32_t>(static_cast<uint32_t>(workers.size()), count - 1);
+        for (uint32_t i = 0; i < helpers; i++)
+        {
+            Submit(worker, &group);
+        }
+        worker();
+        Wait(group);
+    }
+
+    TaskSystem& GetTaskSystem()
+    {
+        static TaskSystem taskSystem;
+        return taskSystem;
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace PBEngine
+{
+    /*
+        Counts the tasks of one batch that haven't finished yet, so callers can wait on just their own work
+    */
+    struct TaskGroup
+    {
+        std::atomic<uint32_t> pending{ 0 };
+    };
+
+    /*
+        A fixed pool of worker threads pulling tasks from a shared queue.
+        Waiting threads run queued tasks themselves, so tasks may safely submit and wait on more tasks.
+    */
+    class TaskSystem
+    {
+    public:
+        /**
+         * @brief Starts the worker threads
+         * @param threadCount The number of workers, 0 uses one per hardware thread minus the calling thread
+         */
+        explicit TaskSystem(uint32_t threadCount = 0);
+        TaskSystem(const TaskSystem&) = delete;
+        TaskSystem& operator=(const TaskSystem&) = delete;
+        ~TaskSystem();
+
+        /**
+         * @brief Queues a task to run on any worker
+         * @param task The work to run
+         * @param group Optional group that tracks when the task has finished
+         */
+        void Submit(std::function<void()> task, TaskGroup* group = nullptr);
+
+        /**
+         * @brief Blocks until every task in the group has finished, running queued tasks in the meantime
+         */
+        void Wait(TaskGroup& group);
+
+        /**
+         * @brief Calls function(i) for every i in [0, count), spread over the workers and the calling thread
+         */
+        void ParallelFor(uint32_t count, const std::function<void(uint32_t)>& function);
+
+        // Worker threads plus the thread that waits
+        uint32_t GetThreadCount() const { return static_cast<uint32_t>(workers.size()) + 1; }
+
+    private:
+        struct Task
+        {
+            std::function<void()> function;
+            TaskGroup* group;
+        };
+
+        void WorkerLoop(uint32_t index);
+        bool TryRunOne();
+        static void Run(Task& task);
+
+        std::vector<std::thread> workers;
+        std::deque<Task> queue;
+        std::mutex queueMutex;
+        std::condition_variable queueCondition;
+        bool stopping = false;
+    };
+
+    // The engine wide task system, created on first use
+    TaskSystem& GetTaskSystem();
+}
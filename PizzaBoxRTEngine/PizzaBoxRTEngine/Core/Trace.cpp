@@ -0,0 +1,165 @@
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+namespace PBEngine
+{
+    namespace
+    {
+        // Chrome trace timestamps are microseconds
+        void WriteMicroseconds(std::ofstream& file, uint64_t nanoseconds)
+        {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%llu.%03llu", static_cast<unsigned long long>(nanoseconds / 1000),
+                static_cast<unsigned long long>(nanoseconds % 1000));
+            file << buffer;
+        }
+
+        void WriteEscaped(std::ofstream& file, const char* text)
+        {
+            for (; *text; text++)
+            {
+                if (*text == '"' || *text == '\\')
+                {
+                    file << '\\';
+                }
+                file << *text;
+            }
+        }
+
+        // The two processes the tracks are grouped under
+        constexpr int CpuProcess = 1;
+        constexpr int GpuProcess = 2;
+    }
+
+    uint64_t Tracer::Now()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    uint32_t Tracer::GetThreadId()
+    {
+        // Handed out on a thread's first event, only ever touched with the mutex held
+        thread_local uint32_t id = UINT32_MAX;
+        if (id == UINT32_MAX)
+        {
+            id = static_cast<uint32_t>(threadNames.size());
+            threadNames.push_back("Thread " + std::to_string(id));
+        }
+        return id;
+    }
+
+    void Tracer::Push(Event&& event)
+    {
+        if (events.size() >= MaxEvents)
+        {
+            droppedEvents++;
+            return;
+        }
+        events.push_back(std::move(event));
+    }
+
+    void Tracer::AddCpuEvent(const char* name, uint64_t start, uint64_t end)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Push({ name, std::string(), start, end, GetThreadId(), false });
+    }
+
+    void Tracer::AddGpuEvent(const std::string& name, const std::string& queue, uint64_t start, uint64_t end)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint32_t track = 0;
+        while (track < gpuTracks.size() && gpuTracks[track] != queue)
+        {
+            track++;
+        }
+        if (track == gpuTracks.size())
+        {
+            gpuTracks.push_back(queue);
+        }
+        Push({ nullptr, name, start, end, track, true });
+    }
+
+    void Tracer::SetThreadName(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        threadNames[GetThreadId()] = name;
+    }
+
+    void Tracer::Clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.clear();
+        droppedEvents = 0;
+    }
+
+    size_t Tracer::GetEventCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return events.size();
+    }
+
+    bool Tracer::WriteChromeTrace(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream file(path);
+        if (!file)
+        {
+            fprintf(stderr, "Couldn't write the trace to %s\n", path.c_str());
+            return false;
+        }
+
+        // Timestamps start at the first event so the numbers stay readable
+        uint64_t origin = UINT64_MAX;
+        for (const Event& event : events)
+        {
+            origin = std::min(origin, event.start);
+        }
+
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        file << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" << CpuProcess << ",\"args\":{\"name\":\"CPU\"}},\n";
+        file << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" << GpuProcess << ",\"args\":{\"name\":\"GPU\"}}";
+        for (size_t i = 0; i < threadNames.size(); i++)
+        {
+            file << ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << CpuProcess << ",\"tid\":" << i << ",\"args\":{\"name\":\"";
+            WriteEscaped(file, threadNames[i].c_str());
+            file << "\"}}";
+        }
+        for (size_t i = 0; i < gpuTracks.size(); i++)
+        {
+            file << ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << GpuProcess << ",\"tid\":" << i << ",\"args\":{\"name\":\"";
+            WriteEscaped(file, gpuTracks[i].c_str());
+            file << "\"}}";
+        }
+
+        // Complete events, one per span
+        for (const Event& event : events)
+        {
+            file << ",\n{\"ph\":\"X\",\"name\":\"";
+            WriteEscaped(file, event.gpu ? event.dynamicName.c_str() : event.name);
+            file << "\",\"pid\":" << (event.gpu ? GpuProcess : CpuProcess) << ",\"tid\":" << event.track << ",\"ts\":";
+            WriteMicroseconds(file, event.start - origin);
+            file << ",\"dur\":";
+            WriteMicroseconds(file, event.end > event.start ? event.end - event.start : 0);
+            file << "}";
+        }
+        file << "\n]}\n";
+
+        if (droppedEvents > 0)
+        {
+            fprintf(stderr, "The trace was full, %llu events were dropped\n", static_cast<unsigned long long>(droppedEvents));
+        }
+        printf("Wrote %zu trace events to %s\n", events.size(), path.c_str());
+        return static_cast<bool>(file);
+    }
+
+    Tracer& GetTracer()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+}
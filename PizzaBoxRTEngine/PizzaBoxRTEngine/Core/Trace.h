@@ -0,0 +1,114 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace PBEngine
+{
+    /*
+        Collects timed events from every thread and the GPU queues and writes them as a Chrome trace
+        (JSON array format), which chrome://tracing and ui.perfetto.dev both open.
+
+        Recording is switched on and off at runtime. While it's off a PB_TRACE_SCOPE costs one relaxed
+        atomic load, and defining PB_DISABLE_TRACING compiles the scopes out entirely.
+    */
+    class Tracer
+    {
+    public:
+        // Events kept before new ones are dropped, about 64 MB
+        static constexpr size_t MaxEvents = 1u << 20;
+
+        bool IsEnabled() const { return enabled.load(std::memory_order_relaxed); }
+        void SetEnabled(bool enable) { enabled.store(enable, std::memory_order_relaxed); }
+
+        // Nanoseconds on the steady clock, the time base of every event
+        static uint64_t Now();
+
+        /**
+         * @brief Records a span on the calling thread
+         * @param name Has to stay valid until the trace is written, string literals are what PB_TRACE_SCOPE passes
+         */
+        void AddCpuEvent(const char* name, uint64_t start, uint64_t end);
+
+        // Records a span on the track of a GPU queue, which shows up as its own row next to the threads
+        void AddGpuEvent(const std::string& name, const std::string& queue, uint64_t start, uint64_t end);
+
+        // Name the calling thread gets in the trace, threads without one are numbered
+        void SetThreadName(const std::string& name);
+
+        /**
+         * @brief Writes every event recorded so far, recording carries on afterwards
+         * @return false when the file couldn't be written
+         */
+        bool WriteChromeTrace(const std::string& path);
+
+        void Clear();
+
+        size_t GetEventCount();
+
+    private:
+        struct Event
+        {
+            // Exactly one of the two names is used, CPU events point at literals to stay allocation free
+            const char* name;
+            std::string dynamicName;
+            uint64_t start;
+            uint64_t end;
+            // Thread id for CPU events, index into gpuTracks for GPU events
+            uint32_t track;
+            bool gpu;
+        };
+
+        uint32_t GetThreadId();
+        void Push(Event&& event);
+
+        std::atomic<bool> enabled{ false };
+        std::mutex mutex;
+        std::vector<Event> events;
+        std::vector<std::string> threadNames;
+        std::vector<std::string> gpuTracks;
+        uint64_t droppedEvents = 0;
+    };
+
+    Tracer& GetTracer();
+
+    /*
+        Times its own lifetime as a CPU event, use it through PB_TRACE_SCOPE
+    */
+    class TraceScope
+    {
+    public:
+        explicit TraceScope(const char* name) :
+            name(GetTracer().IsEnabled() ? name : nullptr),
+            start(this->name ? Tracer::Now() : 0)
+        {
+        }
+
+        ~TraceScope()
+        {
+            if (name)
+            {
+                GetTracer().AddCpuEvent(name, start, Tracer::Now());
+            }
+        }
+
+        TraceScope(const TraceScope&) = delete;
+        TraceScope& operator=(const TraceScope&) = delete;
+
+    private:
+        const char* name;
+        uint64_t start;
+    };
+}
+
+#define PB_TRACE_CONCAT_INNER(a, b) a##b
+#define PB_TRACE_CONCAT(a, b) PB_TRACE_CONCAT_INNER(a, b)
+
+#ifdef PB_DISABLE_TRACING
+#define PB_TRACE_SCOPE(name)
+#else
+// Times the rest of the enclosing block, name has to be a string literal
+#define PB_TRACE_SCOPE(name) ::PBEngine::TraceScope PB_TRACE_CONCAT(pbTraceScope, __LINE__)(name)
+#endif
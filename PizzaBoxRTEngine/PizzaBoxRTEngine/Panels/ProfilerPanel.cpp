@@ -0,0 +1,205 @@
+#include "ProfilerPanel.h"
+#include <Core/Trace.h>
+#include <algorithm>
+#include <cfloat>
+#include <fstream>
+
+namespace PBEngine
+{
+	ProfilerPanel::ProfilerPanel(const Viewport& viewport) : viewport(viewport) {}
+
+	Backend_FullRT* ProfilerPanel::GetBackend() const
+	{
+		if (!viewport.renderer)
+		{
+			return nullptr;
+		}
+		return dynamic_cast<Backend_FullRT*>(viewport.renderer->renderingBackend.get());
+	}
+
+	void ProfilerPanel::Record(Backend_FullRT& backend)
+	{
+		if (backend.profiledFrames == lastProfiledFrame)
+		{
+			return;
+		}
+		lastProfiledFrame = backend.profiledFrames;
+
+		Sample sample;
+		sample.frame = backend.frameIndex;
+		sample.cpuMilliseconds = backend.cpuFrameMilliseconds;
+		sample.raysPerSecond = backend.GetRaysPerSecond();
+		sample.regions = backend.frameProfiler.GetRegions();
+		// TLAS updates only happen on some frames, so they're only added when there's a new one
+		if (backend.profiledUpdates != lastProfiledUpdate)
+		{
+			lastProfiledUpdate = backend.profiledUpdates;
+			const std::vector<GpuProfiler::Region>& updates = backend.updateProfiler.GetRegions();
+			sample.regions.insert(sample.regions.end(), updates.begin(), updates.end());
+		}
+
+		history.push_back(std::move(sample));
+		while (history.size() > historySize)
+		{
+			history.pop_front();
+		}
+	}
+
+	void ProfilerPanel::Show() {
+		ImGui::Begin("Profiler");
+
+		Backend_FullRT* backend = GetBackend();
+		if (backend == nullptr)
+		{
+			ImGui::TextUnformatted("No ray tracing renderer");
+			ImGui::End();
+			return;
+		}
+		Record(*backend);
+
+		ImGui::Text("CPU frame: %.2f ms", backend->cpuFrameMilliseconds);
+		ImGui::Text("Rays: %.1f M/s", backend->GetRaysPerSecond() / 1000000.0);
+		if (backend->IsConverged())
+		{
+			ImGui::SameLine();
+			ImGui::TextUnformatted("(converged, not rendering)");
+		}
+
+		if (!backend->frameProfiler.IsEnabled())
+		{
+			ImGui::TextUnformatted("The render queue doesn't support timestamps");
+		}
+		else if (ImGui::BeginTable("GPU passes", 2, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
+		{
+			ImGui::TableSetupColumn("Pass");
+			ImGui::TableSetupColumn("GPU ms");
+			ImGui::TableHeadersRow();
+			for (const GpuProfiler* profiler : { &backend->frameProfiler, &backend->updateProfiler })
+			{
+				for (const GpuProfiler::Region& region : profiler->GetRegions())
+				{
+					ImGui::TableNextRow();
+					ImGui::TableNextColumn();
+					ImGui::TextUnformatted(region.name.c_str());
+					ImGui::TableNextColumn();
+					ImGui::Text("%.3f", region.milliseconds);
+				}
+			}
+			ImGui::EndTable();
+		}
+
+		// Frame times over the history, GPU trace time next to the CPU side
+		std::vector<float> cpu_times;
+		std::vector<float> trace_times;
+		for (const Sample& sample : history)
+		{
+			cpu_times.push_back(static_cast<float>(sample.cpuMilliseconds));
+			float trace = 0.0f;
+			for (const GpuProfiler::Region& region : sample.regions)
+			{
+				if (region.name == "Trace rays")
+				{
+					trace = static_cast<float>(region.milliseconds);
+				}
+			}
+			trace_times.push_back(trace);
+		}
+		if (!history.empty())
+		{
+			ImGui::PlotLines("CPU frame ms", cpu_times.data(), static_cast<int>(cpu_times.size()), 0, nullptr, 0.0f,
+				FLT_MAX, ImVec2(0, 60));
+			ImGui::PlotLines("GPU trace ms", trace_times.data(), static_cast<int>(trace_times.size()), 0, nullptr, 0.0f,
+				FLT_MAX, ImVec2(0, 60));
+		}
+
+		ImGui::InputText("##csv path", csvPath, sizeof(csvPath));
+		ImGui::SameLine();
+		if (ImGui::Button("Export CSV"))
+		{
+			exportStatus = ExportCSV(csvPath) ? "Wrote " + std::to_string(history.size()) + " frames to " + csvPath :
+				std::string("Couldn't write ") + csvPath;
+		}
+		if (!exportStatus.empty())
+		{
+			ImGui::TextUnformatted(exportStatus.c_str());
+		}
+
+		// CPU scopes and GPU passes on one timeline, for chrome://tracing or ui.perfetto.dev
+		Tracer& tracer = GetTracer();
+		bool recording = tracer.IsEnabled();
+		if (ImGui::Checkbox("Record trace", &recording))
+		{
+			tracer.SetEnabled(recording);
+		}
+		ImGui::SameLine();
+		ImGui::Text("%zu events", tracer.GetEventCount());
+		ImGui::InputText("##trace path", tracePath, sizeof(tracePath));
+		ImGui::SameLine();
+		if (ImGui::Button("Save trace"))
+		{
+			traceStatus = tracer.WriteChromeTrace(tracePath) ? std::string("Wrote ") + tracePath :
+				std::string("Couldn't write ") + tracePath;
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Clear trace"))
+		{
+			tracer.Clear();
+		}
+		if (!traceStatus.empty())
+		{
+			ImGui::TextUnformatted(traceStatus.c_str());
+		}
+
+		ImGui::End();
+	}
+
+	bool ProfilerPanel::ExportCSV(const std::string& path) const
+	{
+		std::ofstream file(path);
+		if (!file)
+		{
+			return false;
+		}
+
+		// Every pass that shows up anywhere in the history gets a column, empty on frames without it
+		std::vector<std::string> passes;
+		for (const Sample& sample : history)
+		{
+			for (const GpuProfiler::Region& region : sample.regions)
+			{
+				if (std::find(passes.begin(), passes.end(), region.name) == passes.end())
+				{
+					passes.push_back(region.name);
+				}
+			}
+		}
+
+		file << "frame,cpu_ms,rays_per_second";
+		for (const std::string& pass : passes)
+		{
+			file << ",\"" << pass << " ms\"";
+		}
+		file << "\n";
+
+		for (const Sample& sample : history)
+		{
+			file << sample.frame << "," << sample.cpuMilliseconds << "," << sample.raysPerSecond;
+			for (const std::string& pass : passes)
+			{
+				file << ",";
+				for (const GpuProfiler::Region& region : sample.regions)
+				{
+					if (region.name == pass)
+					{
+						file << region.milliseconds;
+						break;
+					}
+				}
+			}
+			file << "\n";
+		}
+		return static_cast<bool>(file);
+	}
+
+	ProfilerPanel::~ProfilerPanel() {}
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "Panel.h"
+#include "Viewport.h"
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace PBEngine
+{
+	/*
+		Shows where the viewport's frames spend their time: GPU time per pass from the renderer's
+		timestamp queries, CPU frame time and rays per second, with a history that can be saved as CSV.
+		It also switches trace recording on and off and saves the trace.
+	*/
+	class ProfilerPanel : public Panel {
+	public:
+		explicit ProfilerPanel(const Viewport& viewport);
+		void Show() override;
+		~ProfilerPanel() override;
+
+		/**
+		 * @brief Writes the recorded history, one row per frame and one column per pass
+		 * @return false when the file couldn't be written
+		 */
+		bool ExportCSV(const std::string& path) const;
+
+		// Frames kept for the graph and the CSV export
+		size_t historySize = 1024;
+
+	private:
+		struct Sample
+		{
+			uint32_t frame;
+			double cpuMilliseconds;
+			double raysPerSecond;
+			std::vector<GpuProfiler::Region> regions;
+		};
+
+		Backend_FullRT* GetBackend() const;
+		// Copies the newest resolved times into the history
+		void Record(Backend_FullRT& backend);
+
+		const Viewport& viewport;
+		std::deque<Sample> history;
+		uint32_t lastProfiledFrame = 0;
+		uint32_t lastProfiledUpdate = 0;
+		char csvPath[256] = "profile.csv";
+		std::string exportStatus;
+		char tracePath[256] = "trace.json";
+		std::string traceStatus;
+	};
+}
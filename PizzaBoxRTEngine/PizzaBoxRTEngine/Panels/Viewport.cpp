@@ -1,18 +1,17 @@
 #include "Viewport.h"
+#include <Core/Trace.h>
 //#include "Panel.h"
 
 namespace PBEngine
 {
-	VkDescriptorSet ImageDS;
-
 	Viewport::Viewport() {}
 
 	void Viewport::Show() {
 		ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0, 0));
 		ImGui::Begin("Viewport");
 
-		height = ImGui::GetContentRegionAvail().x;
-		width = ImGui::GetContentRegionAvail().y;
+		width = ImGui::GetContentRegionAvail().x;
+		height = ImGui::GetContentRegionAvail().y;
 
 		if (renderer.get())
 		{
@@ -20,10 +19,21 @@ namespace PBEngine
 			if (derivedRenderer != nullptr)
 			{
 				derivedRenderer->Render();
-				if (derivedRenderer->draw_cmd_buffers.size() != 0)
+				if (!derivedRenderer->frames.empty())
 				{
-					ImGui::Image((ImTextureID)ImageDS, ImVec2(derivedRenderer->storage_image.height,
-						derivedRenderer->storage_image.width));
+					UpdateTextures(*derivedRenderer);
+
+					// The traced region is the top left corner of a possibly bigger image
+					const Backend_FullRT::StorageImage& output = derivedRenderer->GetOutputImage();
+					const float render_width = static_cast<float>(derivedRenderer->renderWidth);
+					const float render_height = static_cast<float>(derivedRenderer->renderHeight);
+					ImGui::Image((ImTextureID)frameTextures[derivedRenderer->lastSubmittedFrame],
+						ImVec2(render_width, render_height), ImVec2(0.0f, 0.0f),
+						ImVec2(render_width / output.width, render_height / output.height));
+					if (ImGui::IsItemHovered())
+					{
+						UpdateCamera(derivedRenderer->camera);
+					}
 				}
 			}
 		}
@@ -33,27 +43,74 @@ namespace PBEngine
 
 		if (!renderer)
 		{
-			renderer = std::make_unique<Renderer>(&width, &height);
-			Backend_FullRT* derivedRenderer = dynamic_cast<Backend_FullRT*>(renderer.get()->renderingBackend.get());
-			if (derivedRenderer != nullptr)
-			{
-				ImageDS = ImGui_ImplVulkan_AddTexture(derivedRenderer->viewImage.sampler, derivedRenderer->viewImage.view,
-					VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-			}
+			renderer = std::make_unique<Renderer>(&width, &height, Backend::RendererBackendType_FullRT, App::g_ScenePath);
+		}
+	}
+
+	void Viewport::UpdateTextures(Backend_FullRT& renderer)
+	{
+		if (textureGeneration == renderer.GetImageGeneration() && frameTextures.size() == renderer.frames.size())
+		{
+			return;
+		}
+
+		ReleaseTextures();
+		for (const Backend_FullRT::FrameData& frame : renderer.frames)
+		{
+			frameTextures.push_back(ImGui_ImplVulkan_AddTexture(renderer.outputSampler, frame.storage_image.view,
+				Backend_FullRT::OutputImageLayout));
 		}
+		textureGeneration = renderer.GetImageGeneration();
+	}
+
+	void Viewport::ReleaseTextures()
+	{
+		// Earlier UI frames may still be drawing with the old descriptor sets
+		DeletionQueue& deletionQueue = GetDeletionQueue();
+		for (VkDescriptorSet texture : frameTextures)
+		{
+			deletionQueue.EnqueueDescriptorSet(deletionQueue.GetNextValue(), App::g_DescriptorPool, texture);
+		}
+		frameTextures.clear();
+	}
+
+	void Viewport::UpdateCamera(Camera& camera)
+	{
+		ImGuiIO& io = ImGui::GetIO();
+
+		// Wheel changes how fast WASD moves, so both small and huge scenes stay navigable
+		if (io.MouseWheel != 0.0f)
+		{
+			cameraSpeed *= io.MouseWheel > 0.0f ? 1.25f : 0.8f;
+		}
+
+		if (!ImGui::IsMouseDown(ImGuiMouseButton_Right))
+		{
+			return;
+		}
+		camera.Rotate(-io.MouseDelta.x * lookSensitivity, -io.MouseDelta.y * lookSensitivity);
+
+		glm::vec3 move(0.0f);
+		if (ImGui::IsKeyDown(ImGuiKey_W)) move.z += 1.0f;
+		if (ImGui::IsKeyDown(ImGuiKey_S)) move.z -= 1.0f;
+		if (ImGui::IsKeyDown(ImGuiKey_D)) move.x += 1.0f;
+		if (ImGui::IsKeyDown(ImGuiKey_A)) move.x -= 1.0f;
+		if (ImGui::IsKeyDown(ImGuiKey_E)) move.y += 1.0f;
+		if (ImGui::IsKeyDown(ImGuiKey_Q)) move.y -= 1.0f;
+		const float speed = cameraSpeed * (io.KeyShift ? 4.0f : 1.0f);
+		camera.Move(move * speed * io.DeltaTime);
 	}
 
 	void Viewport::PreRender()
 	{
+		PB_TRACE_SCOPE("Viewport::PreRender");
 		if (renderer)
 		{
 			Backend_FullRT* derivedRenderer = dynamic_cast<Backend_FullRT*>(renderer.get()->renderingBackend.get());
 			if (derivedRenderer != nullptr)
 			{
-				vkQueueWaitIdle(GetRenderQueue());
-				derivedRenderer->ResizeViewImage();
-				ImageDS = ImGui_ImplVulkan_AddTexture(derivedRenderer->viewImage.sampler, derivedRenderer->viewImage.view,
-					VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+				// Never waits on the GPU, Show registers the new images when they were replaced
+				derivedRenderer->ResizeImages();
 			}
 		}
 	}
@@ -62,5 +119,9 @@ namespace PBEngine
 
 	}
 
-	Viewport::~Viewport() {}
+	Viewport::~Viewport()
+	{
+		// Panels go before the deletion queue is flushed and the descriptor pool destroyed
+		ReleaseTextures();
+	}
 }
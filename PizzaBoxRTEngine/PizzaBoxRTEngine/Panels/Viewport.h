@@ -15,5 +15,25 @@ namespace PBEngine
 
 		float width;
 		float height;
+
+		// World units per second the camera flies at, changed with the mouse wheel
+		float cameraSpeed = 2.0f;
+		// Radians per pixel of mouse movement
+		float lookSensitivity = 0.003f;
+
+	private:
+		// Right mouse drag looks around, WASD moves and QE go down and up while it's held
+		void UpdateCamera(Camera& camera);
+
+		// Registers every frame's storage image with ImGui again once the renderer has replaced them
+		void UpdateTextures(Backend_FullRT& renderer);
+
+		// Hands the current textures to the deletion queue
+		void ReleaseTextures();
+
+		// One ImGui texture per frame in flight, drawn straight from the image the frame traced into
+		std::vector<VkDescriptorSet> frameTextures;
+		// Image generation of the renderer the textures were made for
+		uint32_t textureGeneration = UINT32_MAX;
 	};
 }
@@ -0,0 +1,530 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <Core/TaskSystem.h>
+
+namespace PBEngine
+{
+    namespace
+    {
+        constexpr uint32_t MaxBins = 32;
+        // Work is split into chunks of this many primitives whenever a pass runs in parallel
+        constexpr uint32_t ChunkSize = 16384;
+        // Nodes bigger than this bin their primitives on several threads
+        constexpr uint32_t ParallelBinningThreshold = 4 * ChunkSize;
+        // Traversal uses a fixed size stack
+        constexpr uint32_t MaxTraversalDepth = 256;
+
+        // Primitives are partitioned by value so the build streams through memory instead of
+        // chasing indices into per triangle arrays
+        struct PrimitiveRef
+        {
+            AABB bounds;
+            uint32_t primitive;
+
+            float Centroid(int axis) const { return (bounds.min[axis] + bounds.max[axis]) * 0.5f; }
+        };
+
+        struct Bin
+        {
+            AABB bounds;
+            AABB centroidBounds;
+            uint32_t count = 0;
+        };
+
+        struct BinSet
+        {
+            Bin bins[3][MaxBins];
+        };
+
+        inline uint32_t BinIndex(float centroid, float centroidMin, float scale, uint32_t binCount)
+        {
+            int bin = static_cast<int>((centroid - centroidMin) * scale);
+            bin = bin < 0 ? 0 : bin;
+            return static_cast<uint32_t>(bin) < binCount ? static_cast<uint32_t>(bin) : binCount - 1;
+        }
+    }
+
+    struct BVH::BuildContext
+    {
+        BVHBuildSettings settings;
+        std::vector<PrimitiveRef> refs;
+        std::atomic<uint32_t> nodeCount{ 1 };
+        std::atomic<uint32_t> maxDepth{ 0 };
+        TaskGroup group;
+
+        static void ComputeBounds(const PrimitiveRef* range, uint32_t count, AABB& bounds, AABB& centroidBounds)
+        {
+            for (uint32_t i = 0; i < count; i++)
+            {
+                const float centroid[3] = { range[i].Centroid(0), range[i].Centroid(1), range[i].Centroid(2) };
+                bounds.Grow(range[i].bounds);
+                centroidBounds.Grow(centroid);
+            }
+        }
+
+        void BinRange(const PrimitiveRef* range, uint32_t count, const AABB& centroidBounds, const float* scale,
+            BinSet& binSet) const
+        {
+            const uint32_t binCount = settings.binCount;
+            for (uint32_t i = 0; i < count; i++)
+            {
+                const float centroid[3] = { range[i].Centroid(0), range[i].Centroid(1), range[i].Centroid(2) };
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    Bin& bin = binSet.bins[axis][BinIndex(centroid[axis], centroidBounds.min[axis], scale[axis], binCount)];
+                    bin.bounds.Grow(range[i].bounds);
+                    bin.centroidBounds.Grow(centroid);
+                    bin.count++;
+                }
+            }
+        }
+    };
+
+    void BVH::Build(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+        const BVHBuildSettings& settings)
+    {
+        Build(vertices.data(), indices.data(), static_cast<uint32_t>(indices.size()), settings);
+    }
+
+    void BVH::Build(const Vertex* vertexData, const uint32_t* indexData, uint32_t indexCount,
+        const BVHBuildSettings& settings)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        vertices = vertexData;
+        indices = indexData;
+        stats = BVHBuildStats();
+        nodes.clear();
+        primitiveIndices.clear();
+
+        const uint32_t triangleCount = indexCount / 3;
+        if (triangleCount == 0)
+        {
+            return;
+        }
+
+        BuildContext context;
+        context.settings = settings;
+        context.settings.binCount = std::clamp<uint32_t>(settings.binCount, 2, MaxBins);
+        context.settings.maxLeafSize = std::max<uint32_t>(settings.maxLeafSize, 1);
+        context.refs.resize(triangleCount);
+        primitiveIndices.resize(triangleCount);
+
+        TaskSystem& taskSystem = GetTaskSystem();
+        const uint32_t chunkCount = (triangleCount + ChunkSize - 1) / ChunkSize;
+
+        // Per triangle bounds, which is all the build looks at from here on
+        taskSystem.ParallelFor(chunkCount, [&](uint32_t chunk) {
+            const uint32_t end = std::min(triangleCount, (chunk + 1) * ChunkSize);
+            for (uint32_t i = chunk * ChunkSize; i < end; i++)
+            {
+                AABB bounds;
+                bounds.Grow(vertices[indices[i * 3 + 0]].pos);
+                bounds.Grow(vertices[indices[i * 3 + 1]].pos);
+                bounds.Grow(vertices[indices[i * 3 + 2]].pos);
+                context.refs[i] = { bounds, i };
+            }
+        });
+
+        std::vector<AABB> chunkBounds(chunkCount);
+        std::vector<AABB> chunkCentroidBounds(chunkCount);
+        taskSystem.ParallelFor(chunkCount, [&](uint32_t chunk) {
+            const uint32_t first = chunk * ChunkSize;
+            const uint32_t count = std::min(triangleCount, first + ChunkSize) - first;
+            BuildContext::ComputeBounds(context.refs.data() + first, count, chunkBounds[chunk], chunkCentroidBounds[chunk]);
+        });
+
+        AABB rootBounds;
+        AABB rootCentroidBounds;
+        for (uint32_t chunk = 0; chunk < chunkCount; chunk++)
+        {
+            rootBounds.Grow(chunkBounds[chunk]);
+            rootCentroidBounds.Grow(chunkCentroidBounds[chunk]);
+        }
+
+        // A binary tree over N leaves never needs more than 2N - 1 nodes
+        nodes.resize(static_cast<size_t>(triangleCount) * 2 - 1);
+        BVHNode& root = nodes[0];
+        std::copy(rootBounds.min, rootBounds.min + 3, root.boundsMin);
+        std::copy(rootBounds.max, rootBounds.max + 3, root.boundsMax);
+        root.leftFirst = 0;
+        root.count = triangleCount;
+
+        Subdivide(context, 0, rootCentroidBounds, 0);
+        taskSystem.Wait(context.group);
+
+        nodes.resize(context.nodeCount.load());
+        nodes.shrink_to_fit();
+        taskSystem.ParallelFor(chunkCount, [&](uint32_t chunk) {
+            const uint32_t end = std::min(triangleCount, (chunk + 1) * ChunkSize);
+            for (uint32_t i = chunk * ChunkSize; i < end; i++)
+            {
+                primitiveIndices[i] = context.refs[i].primitive;
+            }
+        });
+
+        stats.nodeCount = static_cast<uint32_t>(nodes.size());
+        stats.maxDepth = context.maxDepth.load();
+        for (const BVHNode& node : nodes)
+        {
+            stats.leafCount += node.IsLeaf() ? 1 : 0;
+        }
+        stats.sahCost = ComputeSAHCost(context.settings) / std::max(rootBounds.Area(), FLT_MIN);
+        stats.buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool BVH::Load(const Vertex* vertexData, const uint32_t* indexData, const BVHNode* nodeData, uint32_t nodeCount,
+        const uint32_t* primitiveData, uint32_t triangleCount)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        vertices = vertexData;
+        indices = indexData;
+        stats = BVHBuildStats();
+        nodes.clear();
+        primitiveIndices.clear();
+
+        if (nodeCount == 0 || triangleCount == 0)
+        {
+            return false;
+        }
+
+        // Walk the tree once, a bad child or primitive range would otherwise be read out of bounds
+        // during traversal and a tree deeper than the traversal stack would overflow it
+        struct StackEntry
+        {
+            uint32_t node;
+            uint32_t depth;
+        };
+        std::vector<StackEntry> stack = { { 0, 0 } };
+        uint32_t visited = 0;
+        uint64_t leafPrimitives = 0;
+        bool valid = true;
+        while (valid && !stack.empty())
+        {
+            const StackEntry entry = stack.back();
+            stack.pop_back();
+            visited++;
+            stats.maxDepth = std::max(stats.maxDepth, entry.depth);
+
+            const BVHNode& node = nodeData[entry.node];
+            if (entry.depth >= MaxTraversalDepth || visited > nodeCount)
+            {
+                valid = false;
+            }
+            else if (node.IsLeaf())
+            {
+                valid = static_cast<uint64_t>(node.leftFirst) + node.count <= triangleCount;
+                leafPrimitives += node.count;
+                stats.leafCount++;
+            }
+            else if (node.leftFirst <= entry.node || static_cast<uint64_t>(node.leftFirst) + 1 >= nodeCount)
+            {
+                valid = false;
+            }
+            else
+            {
+                stack.push_back({ node.leftFirst, entry.depth + 1 });
+                stack.push_back({ node.leftFirst + 1, entry.depth + 1 });
+            }
+        }
+        valid = valid && visited == nodeCount && leafPrimitives == triangleCount;
+        for (uint32_t i = 0; valid && i < triangleCount; i++)
+        {
+            valid = primitiveData[i] < triangleCount;
+        }
+        if (!valid)
+        {
+            stats = BVHBuildStats();
+            return false;
+        }
+
+        nodes.assign(nodeData, nodeData + nodeCount);
+        primitiveIndices.assign(primitiveData, primitiveData + triangleCount);
+
+        AABB rootBounds;
+        rootBounds.Grow(nodes[0].boundsMin);
+        rootBounds.Grow(nodes[0].boundsMax);
+        stats.nodeCount = nodeCount;
+        stats.sahCost = ComputeSAHCost(BVHBuildSettings()) / std::max(rootBounds.Area(), FLT_MIN);
+        stats.buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    void BVH::Subdivide(BuildContext& context, uint32_t nodeIndex, const AABB& centroidBounds, uint32_t depth)
+    {
+        const BVHBuildSettings& settings = context.settings;
+        BVHNode& node = nodes[nodeIndex];
+        const uint32_t first = node.leftFirst;
+        const uint32_t count = node.count;
+        PrimitiveRef* refs = context.refs.data() + first;
+
+        uint32_t previousDepth = context.maxDepth.load(std::memory_order_relaxed);
+        while (depth > previousDepth && !context.maxDepth.compare_exchange_weak(previousDepth, depth))
+        {
+        }
+
+        // Leaves past this depth would overflow the traversal stack
+        if (count <= 1 || depth + 1 >= MaxTraversalDepth)
+        {
+            return;
+        }
+
+        // Bin the centroids along every axis
+        const uint32_t binCount = settings.binCount;
+        float scale[3];
+        bool canSplit = false;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+            scale[axis] = extent > 0.0f ? static_cast<float>(binCount) / extent : 0.0f;
+            canSplit |= extent > 0.0f;
+        }
+
+        BinSet binSet;
+        if (canSplit)
+        {
+            if (count >= ParallelBinningThreshold)
+            {
+                const uint32_t chunkCount = (count + ChunkSize - 1) / ChunkSize;
+                std::vector<BinSet> chunkBins(chunkCount);
+                GetTaskSystem().ParallelFor(chunkCount, [&](uint32_t chunk) {
+                    const uint32_t chunkFirst = chunk * ChunkSize;
+                    const uint32_t chunkEnd = std::min(count, chunkFirst + ChunkSize);
+                    context.BinRange(refs + chunkFirst, chunkEnd - chunkFirst, centroidBounds, scale, chunkBins[chunk]);
+                });
+                for (const BinSet& chunk : chunkBins)
+                {
+                    for (int axis = 0; axis < 3; axis++)
+                    {
+                        for (uint32_t b = 0; b < binCount; b++)
+                        {
+                            binSet.bins[axis][b].bounds.Grow(chunk.bins[axis][b].bounds);
+                            binSet.bins[axis][b].centroidBounds.Grow(chunk.bins[axis][b].centroidBounds);
+                            binSet.bins[axis][b].count += chunk.bins[axis][b].count;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                context.BinRange(refs, count, centroidBounds, scale, binSet);
+            }
+        }
+
+        // Sweep the bins from both sides and evaluate the SAH at every bin boundary
+        AABB nodeBounds;
+        std::copy(node.boundsMin, node.boundsMin + 3, nodeBounds.min);
+        std::copy(node.boundsMax, node.boundsMax + 3, nodeBounds.max);
+        const float nodeArea = nodeBounds.Area() > 0.0f ? nodeBounds.Area() : 1.0f;
+
+        float bestCost = FLT_MAX;
+        int bestAxis = -1;
+        uint32_t bestSplit = 0;
+        for (int axis = 0; axis < 3 && canSplit; axis++)
+        {
+            if (scale[axis] == 0.0f)
+            {
+                continue;
+            }
+
+            float rightArea[MaxBins];
+            uint32_t rightCount[MaxBins];
+            AABB accumulated;
+            uint32_t accumulatedCount = 0;
+            for (uint32_t b = binCount - 1; b > 0; b--)
+            {
+                accumulated.Grow(binSet.bins[axis][b].bounds);
+                accumulatedCount += binSet.bins[axis][b].count;
+                rightArea[b] = accumulated.Area();
+                rightCount[b] = accumulatedCount;
+            }
+
+            accumulated = AABB();
+            accumulatedCount = 0;
+            for (uint32_t b = 0; b < binCount - 1; b++)
+            {
+                accumulated.Grow(binSet.bins[axis][b].bounds);
+                accumulatedCount += binSet.bins[axis][b].count;
+                if (accumulatedCount == 0 || rightCount[b + 1] == 0)
+                {
+                    continue;
+                }
+
+                const float cost = settings.traversalCost + settings.intersectionCost *
+                    (accumulated.Area() * accumulatedCount + rightArea[b + 1] * rightCount[b + 1]) / nodeArea;
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        const float leafCost = settings.intersectionCost * count;
+        if (count <= settings.maxLeafSize && (bestAxis == -1 || leafCost <= bestCost))
+        {
+            return;
+        }
+
+        uint32_t leftCount = 0;
+        AABB leftBounds, rightBounds, leftCentroids, rightCentroids;
+        if (bestAxis != -1)
+        {
+            const float centroidMin = centroidBounds.min[bestAxis];
+            const float axisScale = scale[bestAxis];
+            PrimitiveRef* middle = std::partition(refs, refs + count, [&](const PrimitiveRef& ref) {
+                return BinIndex(ref.Centroid(bestAxis), centroidMin, axisScale, binCount) <= bestSplit;
+            });
+            leftCount = static_cast<uint32_t>(middle - refs);
+
+            for (uint32_t b = 0; b < binCount; b++)
+            {
+                const Bin& bin = binSet.bins[bestAxis][b];
+                (b <= bestSplit ? leftBounds : rightBounds).Grow(bin.bounds);
+                (b <= bestSplit ? leftCentroids : rightCentroids).Grow(bin.centroidBounds);
+            }
+        }
+        else
+        {
+            // Every centroid is in the same spot, so just split the list in half
+            leftCount = count / 2;
+            BuildContext::ComputeBounds(refs, leftCount, leftBounds, leftCentroids);
+            BuildContext::ComputeBounds(refs + leftCount, count - leftCount, rightBounds, rightCentroids);
+        }
+
+        const uint32_t leftIndex = context.nodeCount.fetch_add(2);
+        BVHNode& left = nodes[leftIndex];
+        BVHNode& right = nodes[leftIndex + 1];
+        std::copy(leftBounds.min, leftBounds.min + 3, left.boundsMin);
+        std::copy(leftBounds.max, leftBounds.max + 3, left.boundsMax);
+        left.leftFirst = first;
+        left.count = leftCount;
+        std::copy(rightBounds.min, rightBounds.min + 3, right.boundsMin);
+        std::copy(rightBounds.max, rightBounds.max + 3, right.boundsMax);
+        right.leftFirst = first + leftCount;
+        right.count = count - leftCount;
+
+        node.leftFirst = leftIndex;
+        node.count = 0;
+
+        if (count > settings.parallelThreshold)
+        {
+            GetTaskSystem().Submit([this, &context, leftIndex, leftCentroids, depth]() {
+                Subdivide(context, leftIndex, leftCentroids, depth + 1);
+            }, &context.group);
+        }
+        else
+        {
+            Subdivide(context, leftIndex, leftCentroids, depth + 1);
+        }
+        Subdivide(context, leftIndex + 1, rightCentroids, depth + 1);
+    }
+
+    float BVH::ComputeSAHCost(const BVHBuildSettings& settings) const
+    {
+        // Sum of every node's area weighted by what it costs to visit it
+        float cost = 0.0f;
+        for (const BVHNode& node : nodes)
+        {
+            AABB bounds;
+            std::copy(node.boundsMin, node.boundsMin + 3, bounds.min);
+            std::copy(node.boundsMax, node.boundsMax + 3, bounds.max);
+            cost += bounds.Area() * (node.IsLeaf() ? settings.intersectionCost * node.count : settings.traversalCost);
+        }
+        return cost;
+    }
+
+    static inline float IntersectAABB(const Ray& ray, const float* invDirection, const BVHNode& node)
+    {
+        float tNear = ray.tMin;
+        float tFar = ray.tMax;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float t0 = (node.boundsMin[axis] - ray.origin[axis]) * invDirection[axis];
+            float t1 = (node.boundsMax[axis] - ray.origin[axis]) * invDirection[axis];
+            if (t0 > t1)
+            {
+                std::swap(t0, t1);
+            }
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        return tNear <= tFar ? tNear : FLT_MAX;
+    }
+
+    bool BVH::Intersect(Ray& ray, Hit& hit) const
+    {
+        if (nodes.empty())
+        {
+            return false;
+        }
+
+        const float invDirection[3] = { 1.0f / ray.direction[0], 1.0f / ray.direction[1], 1.0f / ray.direction[2] };
+
+        struct StackEntry
+        {
+            uint32_t node;
+            float tNear;
+        };
+        StackEntry stack[MaxTraversalDepth];
+        uint32_t stackSize = 0;
+
+        bool found = false;
+        if (IntersectAABB(ray, invDirection, nodes[0]) == FLT_MAX)
+        {
+            return false;
+        }
+        stack[stackSize++] = { 0, ray.tMin };
+
+        while (stackSize > 0)
+        {
+            const StackEntry entry = stack[--stackSize];
+            // Skip nodes that a hit found since they were pushed has already ruled out
+            if (entry.tNear >= ray.tMax)
+            {
+                continue;
+            }
+
+            const BVHNode& node = nodes[entry.node];
+            if (node.IsLeaf())
+            {
+                for (uint32_t i = 0; i < node.count; i++)
+                {
+                    const uint32_t primitive = primitiveIndices[node.leftFirst + i];
+                    found |= IntersectTriangle(ray,
+                        vertices[indices[primitive * 3 + 0]].pos,
+                        vertices[indices[primitive * 3 + 1]].pos,
+                        vertices[indices[primitive * 3 + 2]].pos,
+                        primitive, hit);
+                }
+                continue;
+            }
+
+            // Push the far child first so the near one is visited next
+            uint32_t nearChild = node.leftFirst;
+            uint32_t farChild = node.leftFirst + 1;
+            float nearT = IntersectAABB(ray, invDirection, nodes[nearChild]);
+            float farT = IntersectAABB(ray, invDirection, nodes[farChild]);
+            if (farT < nearT)
+            {
+                std::swap(nearChild, farChild);
+                std::swap(nearT, farT);
+            }
+            if (farT != FLT_MAX)
+            {
+                stack[stackSize++] = { farChild, farT };
+            }
+            if (nearT != FLT_MAX)
+            {
+                stack[stackSize++] = { nearChild, nearT };
+            }
+        }
+
+        return found;
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+#include "../RenderData/Vertex.h"
+#include "Ray.h"
+
+namespace PBEngine
+{
+    struct AABB
+    {
+        float min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+        float max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+        void Grow(const float* point)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                min[axis] = point[axis] < min[axis] ? point[axis] : min[axis];
+                max[axis] = point[axis] > max[axis] ? point[axis] : max[axis];
+            }
+        }
+
+        void Grow(const AABB& other)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                min[axis] = other.min[axis] < min[axis] ? other.min[axis] : min[axis];
+                max[axis] = other.max[axis] > max[axis] ? other.max[axis] : max[axis];
+            }
+        }
+
+        bool IsEmpty() const { return min[0] > max[0]; }
+
+        float Area() const
+        {
+            if (IsEmpty())
+            {
+                return 0.0f;
+            }
+            const float extent[3] = { max[0] - min[0], max[1] - min[1], max[2] - min[2] };
+            return 2.0f * (extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0]);
+        }
+    };
+
+    /*
+        32 byte binary BVH node. Inner nodes (count == 0) store their two children next to each other
+        starting at leftFirst, leaves store count primitives starting at primitiveIndices[leftFirst].
+    */
+    struct BVHNode
+    {
+        float boundsMin[3];
+        uint32_t leftFirst;
+        float boundsMax[3];
+        uint32_t count;
+
+        bool IsLeaf() const { return count != 0; }
+    };
+
+    struct BVHBuildSettings
+    {
+        uint32_t binCount = 16;
+        // Nodes with more primitives than this are always split
+        uint32_t maxLeafSize = 8;
+        float traversalCost = 1.0f;
+        float intersectionCost = 1.0f;
+        // Nodes bigger than this build their children as separate tasks
+        uint32_t parallelThreshold = 8192;
+    };
+
+    struct BVHBuildStats
+    {
+        double buildSeconds = 0.0;
+        // Expected cost of a random ray relative to the root, lower is better
+        float sahCost = 0.0f;
+        uint32_t nodeCount = 0;
+        uint32_t leafCount = 0;
+        uint32_t maxDepth = 0;
+    };
+
+    /*
+        Engine owned bounding volume hierarchy over an indexed triangle mesh, built top down with a
+        binned surface area heuristic. Subtrees are built in parallel on the task system and the binning
+        of large nodes near the root is split across threads as well.
+    */
+    class BVH
+    {
+    public:
+        /**
+         * @brief Builds the hierarchy. The vertex and index data must outlive the BVH since traversal reads it directly.
+         * @param vertices Vertex positions, as uploaded for the BLAS
+         * @param indices Three indices per triangle
+         * @param indexCount The number of indices
+         */
+        void Build(const Vertex* vertices, const uint32_t* indices, uint32_t indexCount,
+            const BVHBuildSettings& settings = BVHBuildSettings());
+        void Build(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+            const BVHBuildSettings& settings = BVHBuildSettings());
+
+        /**
+         * @brief Takes over a hierarchy that was built earlier, e.g. one stored in a scene file, instead of building it.
+         * The nodes are checked to form a tree over exactly triangleCount triangles that traversal can walk.
+         * @return false when the nodes don't describe a usable tree, the BVH is left empty then
+         */
+        bool Load(const Vertex* vertices, const uint32_t* indices, const BVHNode* nodes, uint32_t nodeCount,
+            const uint32_t* primitiveIndices, uint32_t triangleCount);
+
+        /**
+         * @brief Finds the closest triangle along the ray, shortening ray.tMax on every hit
+         * @return Whether anything was hit
+         */
+        bool Intersect(Ray& ray, Hit& hit) const;
+
+        const BVHBuildStats& GetStats() const { return stats; }
+        uint32_t GetTriangleCount() const { return static_cast<uint32_t>(primitiveIndices.size()); }
+
+        std::vector<BVHNode> nodes;
+        // Triangle ids in leaf order
+        std::vector<uint32_t> primitiveIndices;
+
+        const Vertex* vertices = nullptr;
+        const uint32_t* indices = nullptr;
+
+    private:
+        struct BuildContext;
+        void Subdivide(BuildContext& context, uint32_t nodeIndex, const AABB& centroidBounds, uint32_t depth);
+        float ComputeSAHCost(const BVHBuildSettings& settings) const;
+
+        BVHBuildStats stats;
+    };
+}
@@ -0,0 +1,265 @@
+#include "Backend_CPU.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <glm/geometric.hpp>
+#include <glm/vec4.hpp>
+#include <Core/TaskSystem.h>
+#include "../ImageWriter.h"
+#include "../RenderData/MeshLoader.h"
+#include "../RenderData/SceneFile.h"
+
+namespace PBEngine
+{
+    // Packs a colour so its bytes come out in the B8G8R8A8 order of the GPU storage images
+    static uint32_t PackColour(float r, float g, float b, float a)
+    {
+        auto channel = [](float value) {
+            value = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+            return static_cast<uint32_t>(value * 255.0f + 0.5f);
+        };
+        return channel(b) | (channel(g) << 8) | (channel(r) << 16) | (channel(a) << 24);
+    }
+
+    Backend_CPU::~Backend_CPU()
+    {
+        CleanupBackend();
+    }
+
+    bool Backend_CPU::Init(float *width, float *height)
+    {
+        viewportWidth = width;
+        viewportHeight = height;
+
+        // Same geometry the AccelerationStructures upload for the GPU path, merged into one mesh
+        bool bvhLoaded = false;
+        if (IsSceneFilePath(scenePath))
+        {
+            if (!LoadSceneFile(bvhLoaded))
+            {
+                fprintf(stderr, "Couldn't load %s, rendering the built in triangle instead\n", scenePath.c_str());
+            }
+        }
+        else
+        {
+            std::vector<MeshData> meshes;
+            MeshLoadStats loadStats;
+            if (!scenePath.empty() && !LoadMeshFile(scenePath, meshes, &loadStats))
+            {
+                fprintf(stderr, "Couldn't load %s, rendering the built in triangle instead\n", scenePath.c_str());
+            }
+            for (MeshData& mesh : meshes)
+            {
+                const uint32_t vertexOffset = static_cast<uint32_t>(vertices.size());
+                vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+                for (uint32_t index : mesh.indices)
+                {
+                    triangleIndices.push_back(vertexOffset + index);
+                }
+                mesh = MeshData();
+            }
+            if (!meshes.empty())
+            {
+                printf("Scene %s: %zu meshes, parsed in %.2f ms on %u threads\n", scenePath.c_str(), meshes.size(),
+                    loadStats.parseSeconds * 1000.0, loadStats.threadCount);
+            }
+        }
+        if (triangleIndices.empty())
+        {
+            vertices = triangleVertices;
+            triangleIndices = indices;
+        }
+
+        if (!bvhLoaded)
+        {
+            bvh.Build(vertices, triangleIndices);
+        }
+        const BVHBuildStats& stats = bvh.GetStats();
+        printf("BVH: %u triangles, %u nodes, %u leaves, depth %u, SAH cost %.2f, %s in %.2f ms\n",
+            bvh.GetTriangleCount(), stats.nodeCount, stats.leafCount, stats.maxDepth, stats.sahCost,
+            bvhLoaded ? "loaded" : "built", stats.buildSeconds * 1000.0);
+
+        wideBVH.Build(bvh);
+        printf("BVH%u (%s): %zu nodes, %zu triangle blocks\n", wideBVH.GetWidth(),
+            GetSimdLevelName(wideBVH.GetSimdLevel()), wideBVH.GetNodeCount(), wideBVH.GetBlockCount());
+
+        return true;
+    }
+
+    bool Backend_CPU::LoadSceneFile(bool& bvhLoaded)
+    {
+        auto start = std::chrono::steady_clock::now();
+        SceneFile file;
+        if (!file.Open(scenePath))
+        {
+            return false;
+        }
+
+        // Traversal needs a single mesh, so every instance is merged in with its transform applied.
+        // That's the same order the converter built the stored BVH in.
+        const SceneFileHeader& header = file.GetHeader();
+        for (uint32_t i = 0; i < file.GetInstanceCount(); i++)
+        {
+            const SceneFileInstance& instance = file.GetInstance(i);
+            const SceneFileMesh& mesh = file.GetMesh(instance.mesh);
+            const Vertex* meshVertices = file.GetVertices(instance.mesh);
+            const uint32_t* meshIndices = file.GetIndices(instance.mesh);
+            const float* m = instance.transform;
+
+            const uint32_t vertexOffset = static_cast<uint32_t>(vertices.size());
+            vertices.resize(vertices.size() + mesh.vertexCount);
+            for (uint32_t v = 0; v < mesh.vertexCount; v++)
+            {
+                const float* p = meshVertices[v].pos;
+                float* out = vertices[vertexOffset + v].pos;
+                out[0] = m[0] * p[0] + m[1] * p[1] + m[2] * p[2] + m[3];
+                out[1] = m[4] * p[0] + m[5] * p[1] + m[6] * p[2] + m[7];
+                out[2] = m[8] * p[0] + m[9] * p[1] + m[10] * p[2] + m[11];
+            }
+            triangleIndices.reserve(triangleIndices.size() + mesh.indexCount);
+            // SceneFile::Open already checked every index against its mesh's vertices
+            for (uint32_t index = 0; index < mesh.indexCount; index++)
+            {
+                triangleIndices.push_back(vertexOffset + meshIndices[index]);
+            }
+        }
+        printf("Scene %s: %u meshes, %u instances, loaded in %.2f ms\n", scenePath.c_str(), file.GetMeshCount(),
+            file.GetInstanceCount(), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0);
+
+        if (file.HasBVH())
+        {
+            bvhLoaded = header.bvhTriangleCount == triangleIndices.size() / 3 &&
+                bvh.Load(vertices.data(), triangleIndices.data(), file.GetBVHNodes(), header.bvhNodeCount,
+                    file.GetBVHPrimitiveIndices(), header.bvhTriangleCount);
+            if (!bvhLoaded)
+            {
+                fprintf(stderr, "%s: stored BVH doesn't match the scene, building a new one\n", scenePath.c_str());
+            }
+        }
+        return true;
+    }
+
+    Hit Backend_CPU::TraceRay(Ray& ray) const
+    {
+        Hit hit{};
+        wideBVH.Intersect(ray, hit);
+        return hit;
+    }
+
+    void Backend_CPU::GeneratePrimaryRay(uint32_t x, uint32_t y, Ray& ray) const
+    {
+        // Mirrors Shaders/raygen.rgen for its first sample, which goes through the pixel centre without jitter
+        const float u = (static_cast<float>(x) + 0.5f) / static_cast<float>(width);
+        const float v = (static_cast<float>(y) + 0.5f) / static_cast<float>(height);
+        const float dx = u * 2.0f - 1.0f;
+        const float dy = v * 2.0f - 1.0f;
+
+        const glm::vec4 origin = viewInverse * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        const glm::vec4 target = projInverse * glm::vec4(dx, dy, 1.0f, 1.0f);
+        const glm::vec4 direction = viewInverse * glm::vec4(glm::normalize(glm::vec3(target)), 0.0f);
+
+        ray = Ray{};
+        ray.origin[0] = origin.x;
+        ray.origin[1] = origin.y;
+        ray.origin[2] = origin.z;
+        ray.direction[0] = direction.x;
+        ray.direction[1] = direction.y;
+        ray.direction[2] = direction.z;
+        ray.tMin = 0.001f;
+        ray.tMax = 10000.0f;
+    }
+
+    void Backend_CPU::Shade(uint32_t x, uint32_t y, const Hit& hit)
+    {
+        // Closest hit and miss shaders
+        framebuffer[static_cast<size_t>(y) * width + x] = hit.IsHit()
+            ? PackColour(0.0f, 1.0f, 0.0f, 1.0f)
+            : PackColour(51.0f / 255.0f, 51.0f / 255.0f, 51.0f / 255.0f, 1.0f);
+    }
+
+    void Backend_CPU::RenderTile(uint32_t tileX, uint32_t tileY)
+    {
+        const uint32_t xEnd = std::min(width, (tileX + 1) * tileSize);
+        const uint32_t yEnd = std::min(height, (tileY + 1) * tileSize);
+        const uint32_t packetWidth = usePacketTraversal ? wideBVH.GetPacketWidth() : 1;
+
+        Ray rays[MaxPacketWidth];
+        Hit hits[MaxPacketWidth];
+        for (uint32_t y = tileY * tileSize; y < yEnd; y++)
+        {
+            for (uint32_t x = tileX * tileSize; x < xEnd; x += packetWidth)
+            {
+                const uint32_t count = std::min(packetWidth, xEnd - x);
+                for (uint32_t i = 0; i < count; i++)
+                {
+                    GeneratePrimaryRay(x + i, y, rays[i]);
+                    hits[i] = Hit{};
+                }
+
+                if (count == 1)
+                {
+                    hits[0] = TraceRay(rays[0]);
+                }
+                else
+                {
+                    wideBVH.IntersectPacket(rays, hits, count);
+                }
+
+                for (uint32_t i = 0; i < count; i++)
+                {
+                    Shade(x + i, y, hits[i]);
+                }
+            }
+        }
+    }
+
+    bool Backend_CPU::Render()
+    {
+        width = static_cast<uint32_t>(truncf(*viewportWidth));
+        height = static_cast<uint32_t>(truncf(*viewportHeight));
+        if (width == 0 || height == 0)
+        {
+            return false;
+        }
+        framebuffer.resize(static_cast<size_t>(width) * height);
+
+        camera.SetAspectRatio(static_cast<float>(width) / static_cast<float>(height));
+        viewInverse = camera.GetViewInverse();
+        projInverse = camera.GetProjectionInverse();
+
+        auto start = std::chrono::steady_clock::now();
+
+        const uint32_t tilesX = (width + tileSize - 1) / tileSize;
+        const uint32_t tilesY = (height + tileSize - 1) / tileSize;
+        GetTaskSystem().ParallelFor(tilesX * tilesY, [&](uint32_t tile) {
+            RenderTile(tile % tilesX, tile / tilesX);
+        });
+
+        frameSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        raysTraced = static_cast<uint64_t>(width) * height;
+        raysPerSecond = frameSeconds > 0.0 ? raysTraced / frameSeconds : 0.0;
+
+        return true;
+    }
+
+    bool Backend_CPU::SaveImage(const std::string& path)
+    {
+        if (framebuffer.empty())
+        {
+            return false;
+        }
+        return WritePPM(path, width, height, reinterpret_cast<const uint8_t*>(framebuffer.data()), width * 4, true);
+    }
+
+    bool Backend_CPU::CleanupBackend()
+    {
+        framebuffer.clear();
+        bvh = BVH();
+        wideBVH.Build(bvh);
+        vertices.clear();
+        triangleIndices.clear();
+        return true;
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "../Renderer.h"
+#include "../RenderData/Vertex.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "Ray.h"
+#include <string>
+#include <vector>
+
+namespace PBEngine
+{
+    /*
+        Multithreaded CPU reference ray tracer. It consumes the same vertex/index data as the
+        AccelerationStructure and mirrors the GPU shaders, so its output can be used as a
+        deterministic ground truth for Backend_FullRT and works on machines without a GPU.
+    */
+    class Backend_CPU : public Backend {
+    public:
+        ~Backend_CPU() override;
+        bool Init(float *width, float *height) override;
+        bool Render() override;
+        bool CleanupBackend() override;
+        const RendererBackendType backendType = RendererBackendType_Custom;
+
+        /*
+            Writes the last rendered frame to disk as a PPM file
+        */
+        bool SaveImage(const std::string& path);
+
+        float *viewportWidth;
+        float *viewportHeight;
+
+        // B8G8R8A8 like the GPU storage images, one uint32_t per pixel, rows top to bottom
+        std::vector<uint32_t> framebuffer;
+        uint32_t width = 0;
+        uint32_t height = 0;
+
+        // Square tiles are handed out to the worker threads one at a time
+        uint32_t tileSize = 16;
+        // Trace neighbouring primary rays together as packets instead of one at a time
+        bool usePacketTraversal = true;
+
+        // Same camera as Backend_FullRT, so both backends render the same view of the scene
+        Camera camera;
+
+        // Statistics of the last call to Render
+        double frameSeconds = 0.0;
+        uint64_t raysTraced = 0;
+        double raysPerSecond = 0.0;
+
+    private:
+        static constexpr uint32_t MaxPacketWidth = 8;
+
+        void RenderTile(uint32_t tileX, uint32_t tileY);
+        void GeneratePrimaryRay(uint32_t x, uint32_t y, Ray& ray) const;
+        void Shade(uint32_t x, uint32_t y, const Hit& hit);
+        Hit TraceRay(Ray& ray) const;
+        // Merges the instances of a .pbscene file and takes over its stored BVH when it has one
+        bool LoadSceneFile(bool& bvhLoaded);
+
+        // Taken from the camera at the start of each Render, like the GPU's frame uniforms
+        glm::mat4 viewInverse{ 1.0f };
+        glm::mat4 projInverse{ 1.0f };
+
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> triangleIndices;
+        BVH bvh;
+        WideBVH wideBVH;
+    };
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+
+namespace PBEngine
+{
+    struct Ray
+    {
+        float origin[3];
+        float direction[3];
+        float tMin;
+        float tMax;
+    };
+
+    struct Hit
+    {
+        float t;
+        float u;
+        float v;
+        uint32_t primitive = UINT32_MAX;
+
+        bool IsHit() const { return primitive != UINT32_MAX; }
+    };
+
+    /*
+        Moller-Trumbore ray/triangle test without back face culling, matching
+        VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR on the GPU path.
+        Only updates hit when the intersection is closer than ray.tMax, and then shortens the ray.
+    */
+    inline bool IntersectTriangle(Ray& ray, const float* v0, const float* v1, const float* v2, uint32_t primitive,
+        Hit& hit)
+    {
+        const float e1[3] = { v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2] };
+        const float e2[3] = { v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2] };
+
+        // p = direction x e2
+        const float p[3] = {
+            ray.direction[1] * e2[2] - ray.direction[2] * e2[1],
+            ray.direction[2] * e2[0] - ray.direction[0] * e2[2],
+            ray.direction[0] * e2[1] - ray.direction[1] * e2[0] };
+        const float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+        if (std::fabs(det) < 1e-12f)
+        {
+            return false;
+        }
+        const float invDet = 1.0f / det;
+
+        const float s[3] = { ray.origin[0] - v0[0], ray.origin[1] - v0[1], ray.origin[2] - v0[2] };
+        const float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+        if (u < 0.0f || u > 1.0f)
+        {
+            return false;
+        }
+
+        // q = s x e1
+        const float q[3] = {
+            s[1] * e1[2] - s[2] * e1[1],
+            s[2] * e1[0] - s[0] * e1[2],
+            s[0] * e1[1] - s[1] * e1[0] };
+        const float v = (ray.direction[0] * q[0] + ray.direction[1] * q[1] + ray.direction[2] * q[2]) * invDet;
+        if (v < 0.0f || u + v > 1.0f)
+        {
+            return false;
+        }
+
+        const float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+        if (t < ray.tMin || t >= ray.tMax)
+        {
+            return false;
+        }
+
+        ray.tMax = t;
+        hit.t = t;
+        hit.u = u;
+        hit.v = v;
+        hit.primitive = primitive;
+        return true;
+    }
+}
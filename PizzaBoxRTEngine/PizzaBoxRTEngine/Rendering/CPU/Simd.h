@@ -0,0 +1,143 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PB_SIMD_SSE 1
+#include <immintrin.h>
+#else
+#define PB_SIMD_SSE 0
+#endif
+
+#if defined(__AVX2__)
+#define PB_SIMD_AVX2 1
+#else
+#define PB_SIMD_AVX2 0
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/*
+    Thin wrappers over the SIMD registers used by the CPU traversal kernels so the kernels can be
+    written once as templates. Everything here lives in an anonymous namespace on purpose: this header
+    is compiled both with and without -mavx2, and inline functions shared between those translation
+    units could otherwise be merged by the linker into a copy that uses instructions the CPU lacks.
+
+    Comparisons return masks of the same type, which are only meant to be combined with And and
+    consumed by MoveMask or Select.
+*/
+namespace PBEngine
+{
+    namespace
+    {
+        inline uint32_t FirstBit(uint32_t mask)
+        {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return static_cast<uint32_t>(index);
+#else
+            return static_cast<uint32_t>(__builtin_ctz(mask));
+#endif
+        }
+
+        // Plain C++ fallback for platforms without SSE, four lanes wide to match the BVH4 layout
+        struct ScalarFloat4
+        {
+            static constexpr uint32_t Width = 4;
+            float v[4];
+
+            static ScalarFloat4 Load(const float* p) { return { { p[0], p[1], p[2], p[3] } }; }
+            static ScalarFloat4 Broadcast(float f) { return { { f, f, f, f } }; }
+            void Store(float* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+        };
+
+        template<typename Op>
+        inline ScalarFloat4 Apply(const ScalarFloat4& a, const ScalarFloat4& b, Op op)
+        {
+            return { { op(a.v[0], b.v[0]), op(a.v[1], b.v[1]), op(a.v[2], b.v[2]), op(a.v[3], b.v[3]) } };
+        }
+
+        inline ScalarFloat4 operator+(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return x + y; }); }
+        inline ScalarFloat4 operator-(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return x - y; }); }
+        inline ScalarFloat4 operator*(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return x * y; }); }
+        inline ScalarFloat4 operator/(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return x / y; }); }
+        inline ScalarFloat4 Min(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return x < y ? x : y; }); }
+        inline ScalarFloat4 Max(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return x > y ? x : y; }); }
+        inline ScalarFloat4 CmpLess(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return x < y ? 1.0f : 0.0f; }); }
+        inline ScalarFloat4 CmpLessEqual(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return x <= y ? 1.0f : 0.0f; }); }
+        inline ScalarFloat4 CmpGreaterEqual(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return x >= y ? 1.0f : 0.0f; }); }
+        inline ScalarFloat4 And(const ScalarFloat4& a, const ScalarFloat4& b) { return Apply(a, b, [](float x, float y) { return (x != 0.0f && y != 0.0f) ? 1.0f : 0.0f; }); }
+        inline ScalarFloat4 Select(const ScalarFloat4& mask, const ScalarFloat4& a, const ScalarFloat4& b)
+        {
+            ScalarFloat4 result;
+            for (int i = 0; i < 4; i++)
+            {
+                result.v[i] = mask.v[i] != 0.0f ? a.v[i] : b.v[i];
+            }
+            return result;
+        }
+        inline ScalarFloat4 Abs(const ScalarFloat4& a) { return { { std::fabs(a.v[0]), std::fabs(a.v[1]), std::fabs(a.v[2]), std::fabs(a.v[3]) } }; }
+        inline uint32_t MoveMask(const ScalarFloat4& mask)
+        {
+            return (mask.v[0] != 0.0f ? 1u : 0u) | (mask.v[1] != 0.0f ? 2u : 0u) | (mask.v[2] != 0.0f ? 4u : 0u) | (mask.v[3] != 0.0f ? 8u : 0u);
+        }
+
+#if PB_SIMD_SSE
+        struct SimdFloat4
+        {
+            static constexpr uint32_t Width = 4;
+            __m128 v;
+
+            static SimdFloat4 Load(const float* p) { return { _mm_load_ps(p) }; }
+            static SimdFloat4 Broadcast(float f) { return { _mm_set1_ps(f) }; }
+            void Store(float* p) const { _mm_store_ps(p, v); }
+        };
+
+        inline SimdFloat4 operator+(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_add_ps(a.v, b.v) }; }
+        inline SimdFloat4 operator-(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_sub_ps(a.v, b.v) }; }
+        inline SimdFloat4 operator*(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_mul_ps(a.v, b.v) }; }
+        inline SimdFloat4 operator/(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_div_ps(a.v, b.v) }; }
+        inline SimdFloat4 Min(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_min_ps(a.v, b.v) }; }
+        inline SimdFloat4 Max(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_max_ps(a.v, b.v) }; }
+        inline SimdFloat4 CmpLess(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+        inline SimdFloat4 CmpLessEqual(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_cmple_ps(a.v, b.v) }; }
+        inline SimdFloat4 CmpGreaterEqual(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+        inline SimdFloat4 And(const SimdFloat4& a, const SimdFloat4& b) { return { _mm_and_ps(a.v, b.v) }; }
+        inline SimdFloat4 Select(const SimdFloat4& mask, const SimdFloat4& a, const SimdFloat4& b)
+        {
+            return { _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)) };
+        }
+        inline SimdFloat4 Abs(const SimdFloat4& a) { return { _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v) }; }
+        inline uint32_t MoveMask(const SimdFloat4& mask) { return static_cast<uint32_t>(_mm_movemask_ps(mask.v)); }
+#endif
+
+#if PB_SIMD_AVX2
+        struct SimdFloat8
+        {
+            static constexpr uint32_t Width = 8;
+            __m256 v;
+
+            static SimdFloat8 Load(const float* p) { return { _mm256_load_ps(p) }; }
+            static SimdFloat8 Broadcast(float f) { return { _mm256_set1_ps(f) }; }
+            void Store(float* p) const { _mm256_store_ps(p, v); }
+        };
+
+        inline SimdFloat8 operator+(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_add_ps(a.v, b.v) }; }
+        inline SimdFloat8 operator-(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_sub_ps(a.v, b.v) }; }
+        inline SimdFloat8 operator*(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_mul_ps(a.v, b.v) }; }
+        inline SimdFloat8 operator/(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_div_ps(a.v, b.v) }; }
+        inline SimdFloat8 Min(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_min_ps(a.v, b.v) }; }
+        inline SimdFloat8 Max(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_max_ps(a.v, b.v) }; }
+        inline SimdFloat8 CmpLess(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+        inline SimdFloat8 CmpLessEqual(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+        inline SimdFloat8 CmpGreaterEqual(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+        inline SimdFloat8 And(const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_and_ps(a.v, b.v) }; }
+        inline SimdFloat8 Select(const SimdFloat8& mask, const SimdFloat8& a, const SimdFloat8& b) { return { _mm256_blendv_ps(b.v, a.v, mask.v) }; }
+        inline SimdFloat8 Abs(const SimdFloat8& a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v) }; }
+        inline uint32_t MoveMask(const SimdFloat8& mask) { return static_cast<uint32_t>(_mm256_movemask_ps(mask.v)); }
+#endif
+    }
+}
@@ -0,0 +1,274 @@
+#include "WideBVH.h"
+#include "WideBVHKernels.h"
+
+#if PB_SIMD_SSE && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace PBEngine
+{
+    SimdLevel DetectSimdLevel()
+    {
+#if PB_SIMD_SSE
+        bool hasAVX2 = false;
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] >= 7)
+        {
+            __cpuid(info, 1);
+            const bool osSavesYmm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+            const bool hasAVX = (info[2] & (1 << 28)) != 0;
+            __cpuidex(info, 7, 0);
+            hasAVX2 = osSavesYmm && hasAVX && (info[1] & (1 << 5)) != 0;
+        }
+#else
+        __builtin_cpu_init();
+        hasAVX2 = __builtin_cpu_supports("avx2");
+#endif
+        if (hasAVX2 && AreAVX2KernelsAvailable())
+        {
+            return SimdLevel_AVX2;
+        }
+        return SimdLevel_SSE;
+#else
+        return SimdLevel_Scalar;
+#endif
+    }
+
+    const char* GetSimdLevelName(SimdLevel level)
+    {
+        switch (level)
+        {
+        case SimdLevel_AVX2:
+            return "AVX2";
+        case SimdLevel_SSE:
+            return "SSE";
+        default:
+            return "Scalar";
+        }
+    }
+
+    namespace
+    {
+        float BinaryNodeArea(const BVHNode& node)
+        {
+            AABB bounds;
+            bounds.Grow(node.boundsMin);
+            bounds.Grow(node.boundsMax);
+            return bounds.Area();
+        }
+
+        // Packs the triangles of a binary leaf into blocks of Width, returns the first block
+        template<uint32_t Width>
+        uint32_t EmitLeaf(const BVH& bvh, const BVHNode& leaf, std::vector<TriangleBlock<Width>>& blocks)
+        {
+            const uint32_t firstBlock = static_cast<uint32_t>(blocks.size());
+            for (uint32_t i = 0; i < leaf.count; i++)
+            {
+                const uint32_t lane = i % Width;
+                if (lane == 0)
+                {
+                    TriangleBlock<Width> block = {};
+                    for (uint32_t l = 0; l < Width; l++)
+                    {
+                        block.primitive[l] = UINT32_MAX;
+                    }
+                    blocks.push_back(block);
+                }
+
+                TriangleBlock<Width>& block = blocks.back();
+                const uint32_t primitive = bvh.primitiveIndices[leaf.leftFirst + i];
+                const float* v0 = bvh.vertices[bvh.indices[primitive * 3 + 0]].pos;
+                const float* v1 = bvh.vertices[bvh.indices[primitive * 3 + 1]].pos;
+                const float* v2 = bvh.vertices[bvh.indices[primitive * 3 + 2]].pos;
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    block.v0[axis][lane] = v0[axis];
+                    block.e1[axis][lane] = v1[axis] - v0[axis];
+                    block.e2[axis][lane] = v2[axis] - v0[axis];
+                }
+                block.primitive[lane] = primitive;
+            }
+            return firstBlock;
+        }
+
+        template<uint32_t Width>
+        void CollapseNode(const BVH& bvh, uint32_t binaryIndex, uint32_t wideIndex,
+            std::vector<WideBVHNode<Width>>& nodes, std::vector<TriangleBlock<Width>>& blocks)
+        {
+            // Open the largest inner child until the node is full or only leaves are left
+            uint32_t children[Width];
+            uint32_t childCount = 0;
+            const BVHNode& binaryNode = bvh.nodes[binaryIndex];
+            if (binaryNode.IsLeaf())
+            {
+                children[childCount++] = binaryIndex;
+            }
+            else
+            {
+                children[childCount++] = binaryNode.leftFirst;
+                children[childCount++] = binaryNode.leftFirst + 1;
+            }
+
+            while (childCount < Width)
+            {
+                int largest = -1;
+                float largestArea = -1.0f;
+                for (uint32_t i = 0; i < childCount; i++)
+                {
+                    const BVHNode& child = bvh.nodes[children[i]];
+                    const float area = BinaryNodeArea(child);
+                    if (!child.IsLeaf() && area > largestArea)
+                    {
+                        largest = static_cast<int>(i);
+                        largestArea = area;
+                    }
+                }
+                if (largest < 0)
+                {
+                    break;
+                }
+
+                const uint32_t leftFirst = bvh.nodes[children[largest]].leftFirst;
+                children[largest] = leftFirst;
+                children[childCount++] = leftFirst + 1;
+            }
+
+            // Filled locally since the recursion below grows the node array
+            WideBVHNode<Width> node = {};
+            node.childCount = childCount;
+            uint32_t innerChildren[Width];
+            uint32_t innerCount = 0;
+            for (uint32_t i = 0; i < childCount; i++)
+            {
+                const BVHNode& child = bvh.nodes[children[i]];
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    node.boundsMin[axis][i] = child.boundsMin[axis];
+                    node.boundsMax[axis][i] = child.boundsMax[axis];
+                }
+
+                if (child.IsLeaf())
+                {
+                    node.child[i] = EmitLeaf(bvh, child, blocks);
+                    node.blockCount[i] = (child.count + Width - 1) / Width;
+                }
+                else
+                {
+                    node.child[i] = static_cast<uint32_t>(nodes.size());
+                    node.blockCount[i] = 0;
+                    nodes.emplace_back();
+                    innerChildren[innerCount++] = i;
+                }
+            }
+            nodes[wideIndex] = node;
+
+            for (uint32_t i = 0; i < innerCount; i++)
+            {
+                CollapseNode(bvh, children[innerChildren[i]], node.child[innerChildren[i]], nodes, blocks);
+            }
+        }
+
+        template<uint32_t Width>
+        void Collapse(const BVH& bvh, std::vector<WideBVHNode<Width>>& nodes, std::vector<TriangleBlock<Width>>& blocks)
+        {
+            nodes.clear();
+            blocks.clear();
+            if (bvh.nodes.empty())
+            {
+                return;
+            }
+
+            nodes.reserve(bvh.nodes.size() / (Width - 1) + 1);
+            blocks.reserve(bvh.GetTriangleCount() / Width + bvh.GetStats().leafCount);
+            nodes.emplace_back();
+            CollapseNode(bvh, 0, 0, nodes, blocks);
+        }
+    }
+
+    WideBVH::WideBVH() = default;
+    WideBVH::~WideBVH() = default;
+
+    void WideBVH::Build(const BVH& bvh, SimdLevel level)
+    {
+        simdLevel = level;
+        if (simdLevel == SimdLevel_AVX2 && !AreAVX2KernelsAvailable())
+        {
+            simdLevel = SimdLevel_SSE;
+        }
+#if !PB_SIMD_SSE
+        simdLevel = SimdLevel_Scalar;
+#endif
+
+        nodes4.clear();
+        blocks4.clear();
+        nodes8.clear();
+        blocks8.clear();
+        if (simdLevel == SimdLevel_AVX2)
+        {
+            Collapse(bvh, nodes8, blocks8);
+        }
+        else
+        {
+            Collapse(bvh, nodes4, blocks4);
+        }
+    }
+
+    bool WideBVH::Intersect(Ray& ray, Hit& hit) const
+    {
+        switch (simdLevel)
+        {
+        case SimdLevel_AVX2:
+            return !nodes8.empty() && IntersectClosest8_AVX2(nodes8.data(), blocks8.data(), ray, hit);
+#if PB_SIMD_SSE
+        case SimdLevel_SSE:
+            return !nodes4.empty() && IntersectClosest<SimdFloat4>(nodes4.data(), blocks4.data(), ray, hit);
+#endif
+        default:
+            return !nodes4.empty() && IntersectClosest<ScalarFloat4>(nodes4.data(), blocks4.data(), ray, hit);
+        }
+    }
+
+    void WideBVH::IntersectPacket(Ray* rays, Hit* hits, uint32_t count) const
+    {
+        switch (simdLevel)
+        {
+        case SimdLevel_AVX2:
+            if (!nodes8.empty())
+            {
+                IntersectPacket8_AVX2(nodes8.data(), blocks8.data(), rays, hits, count);
+            }
+            break;
+#if PB_SIMD_SSE
+        case SimdLevel_SSE:
+            if (!nodes4.empty())
+            {
+                PBEngine::IntersectPacket<SimdFloat4, 4>(nodes4.data(), blocks4.data(), rays, hits, count);
+            }
+            break;
+#endif
+        default:
+            if (!nodes4.empty())
+            {
+                PBEngine::IntersectPacket<ScalarFloat4, 4>(nodes4.data(), blocks4.data(), rays, hits, count);
+            }
+            break;
+        }
+    }
+
+    uint32_t WideBVH::GetWidth() const
+    {
+        return simdLevel == SimdLevel_AVX2 ? 8 : 4;
+    }
+
+    size_t WideBVH::GetNodeCount() const
+    {
+        return simdLevel == SimdLevel_AVX2 ? nodes8.size() : nodes4.size();
+    }
+
+    size_t WideBVH::GetBlockCount() const
+    {
+        return simdLevel == SimdLevel_AVX2 ? blocks8.size() : blocks4.size();
+    }
+}
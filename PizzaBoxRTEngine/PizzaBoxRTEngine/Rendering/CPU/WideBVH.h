@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "BVH.h"
+#include "Ray.h"
+
+namespace PBEngine
+{
+    template<uint32_t Width> struct WideBVHNode;
+    template<uint32_t Width> struct TriangleBlock;
+
+    enum SimdLevel
+    {
+        SimdLevel_Scalar,
+        SimdLevel_SSE,
+        SimdLevel_AVX2
+    };
+
+    /*
+        Best instruction set the CPU (and OS) supports that we also have kernels for
+    */
+    SimdLevel DetectSimdLevel();
+    const char* GetSimdLevelName(SimdLevel level);
+
+    /*
+        BVH4/BVH8 collapsed from a binary BVH, with child bounds and leaf triangles stored in structure
+        of arrays form for SIMD traversal. The width follows the instruction set picked at build time:
+        8 wide for AVX2, 4 wide for SSE and the scalar fallback.
+    */
+    class WideBVH
+    {
+    public:
+        WideBVH();
+        ~WideBVH();
+        WideBVH(const WideBVH&) = delete;
+        WideBVH& operator=(const WideBVH&) = delete;
+
+        /**
+         * @brief Collapses a finished binary BVH. The triangles are copied, so the binary BVH and its
+         * vertex data can be released afterwards.
+         * @param level Instruction set to use, defaults to the best one available
+         */
+        void Build(const BVH& bvh, SimdLevel level = DetectSimdLevel());
+
+        /**
+         * @brief Finds the closest triangle along the ray, shortening ray.tMax on every hit
+         * @return Whether anything was hit
+         */
+        bool Intersect(Ray& ray, Hit& hit) const;
+
+        /**
+         * @brief Traces a packet of coherent rays (like neighbouring primary rays) together.
+         * Results are the same as calling Intersect on every ray.
+         * @param count Number of rays, at most GetPacketWidth()
+         */
+        void IntersectPacket(Ray* rays, Hit* hits, uint32_t count) const;
+
+        uint32_t GetWidth() const;
+        uint32_t GetPacketWidth() const { return GetWidth(); }
+        SimdLevel GetSimdLevel() const { return simdLevel; }
+        size_t GetNodeCount() const;
+        size_t GetBlockCount() const;
+
+    private:
+        SimdLevel simdLevel = SimdLevel_Scalar;
+
+        std::vector<WideBVHNode<4>> nodes4;
+        std::vector<TriangleBlock<4>> blocks4;
+        std::vector<WideBVHNode<8>> nodes8;
+        std::vector<TriangleBlock<8>> blocks8;
+    };
+}
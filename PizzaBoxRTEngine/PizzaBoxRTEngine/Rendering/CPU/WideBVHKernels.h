@@ -0,0 +1,386 @@
+#pragma once
+#include <cfloat>
+#include <cstdint>
+#include "Ray.h"
+#include "Simd.h"
+
+/*
+    Node layout and traversal kernels shared by WideBVH.cpp and WideBVH_AVX2.cpp. Only include this
+    from those two files, the kernels are instantiated once per instruction set.
+*/
+namespace PBEngine
+{
+    /*
+        Collapsed BVH node holding up to Width children in structure of arrays form, so one ray can be
+        tested against every child box with a single pass of SIMD instructions. Children are packed
+        at the front, the first childCount lanes are valid.
+    */
+    template<uint32_t Width>
+    struct alignas(Width * sizeof(float)) WideBVHNode
+    {
+        float boundsMin[3][Width];
+        float boundsMax[3][Width];
+        // Inner children: index of the child node. Leaves: index of the first triangle block
+        uint32_t child[Width];
+        // Number of triangle blocks for leaves, 0 for inner children
+        uint32_t blockCount[Width];
+        uint32_t childCount;
+    };
+
+    /*
+        Width triangles stored as a vertex and two edges per lane, ready for Moller-Trumbore. Unused
+        lanes have zero edges, which the determinant test rejects, and an invalid primitive id.
+    */
+    template<uint32_t Width>
+    struct alignas(Width * sizeof(float)) TriangleBlock
+    {
+        float v0[3][Width];
+        float e1[3][Width];
+        float e2[3][Width];
+        uint32_t primitive[Width];
+    };
+
+    // Implemented in WideBVH_AVX2.cpp, the only file built with AVX2 enabled
+    bool AreAVX2KernelsAvailable();
+    bool IntersectClosest8_AVX2(const WideBVHNode<8>* nodes, const TriangleBlock<8>* blocks, Ray& ray, Hit& hit);
+    void IntersectPacket8_AVX2(const WideBVHNode<8>* nodes, const TriangleBlock<8>* blocks, Ray* rays, Hit* hits,
+        uint32_t count);
+
+    namespace
+    {
+        // Upper bound for the traversal stack, deep enough for any tree the binary builder produces
+        constexpr uint32_t MaxWideStackSize = 1024;
+
+        // Avoids 0 * inf = NaN in the slab test for axis aligned rays
+        inline float SafeReciprocal(float value)
+        {
+            const float minimum = 1e-20f;
+            if (value > -minimum && value < minimum)
+            {
+                value = value < 0.0f ? -minimum : minimum;
+            }
+            return 1.0f / value;
+        }
+
+        template<typename V>
+        inline V Dot(const V* a, const V* b)
+        {
+            return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+        }
+
+        template<typename V>
+        inline void Cross(const V* a, const V* b, V* result)
+        {
+            result[0] = a[1] * b[2] - a[2] * b[1];
+            result[1] = a[2] * b[0] - a[0] * b[2];
+            result[2] = a[0] * b[1] - a[1] * b[0];
+        }
+
+        /*
+            Moller-Trumbore over a full register, either one ray against Width triangles or Width rays
+            against one broadcast triangle. Same tests as IntersectTriangle in Ray.h.
+        */
+        template<typename V>
+        inline V IntersectTriangles(const V* v0, const V* e1, const V* e2, const V* origin, const V* direction,
+            const V& tMin, const V& tMax, V& t, V& u, V& v)
+        {
+            V p[3];
+            Cross(direction, e2, p);
+            const V det = Dot(e1, p);
+            const V invDet = V::Broadcast(1.0f) / det;
+
+            const V s[3] = { origin[0] - v0[0], origin[1] - v0[1], origin[2] - v0[2] };
+            u = Dot(s, p) * invDet;
+
+            V q[3];
+            Cross(s, e1, q);
+            v = Dot(direction, q) * invDet;
+            t = Dot(e2, q) * invDet;
+
+            const V zero = V::Broadcast(0.0f);
+            const V one = V::Broadcast(1.0f);
+            V mask = CmpGreaterEqual(Abs(det), V::Broadcast(1e-12f));
+            mask = And(mask, And(CmpGreaterEqual(u, zero), CmpLessEqual(u, one)));
+            mask = And(mask, And(CmpGreaterEqual(v, zero), CmpLessEqual(u + v, one)));
+            mask = And(mask, And(CmpGreaterEqual(t, tMin), CmpLess(t, tMax)));
+            return mask;
+        }
+
+        // Slab test of Width rays (or one broadcast ray) against boxes, returns tNear and the hit mask
+        template<typename V>
+        inline V IntersectBoxes(const V* boundsMin, const V* boundsMax, const V* origin, const V* invDirection,
+            const V& tMin, const V& tMax, V& tNear)
+        {
+            V t0[3], t1[3];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                t0[axis] = (boundsMin[axis] - origin[axis]) * invDirection[axis];
+                t1[axis] = (boundsMax[axis] - origin[axis]) * invDirection[axis];
+            }
+            tNear = Max(Max(Min(t0[0], t1[0]), Min(t0[1], t1[1])), Max(Min(t0[2], t1[2]), tMin));
+            const V tFar = Min(Min(Max(t0[0], t1[0]), Max(t0[1], t1[1])), Min(Max(t0[2], t1[2]), tMax));
+            return CmpLessEqual(tNear, tFar);
+        }
+
+        struct WideStackEntry
+        {
+            uint32_t node;
+            float tNear;
+        };
+
+        // Pushes entries so the one with the smallest tNear ends up on top of the stack
+        inline void PushSorted(WideStackEntry* stack, uint32_t& stackSize, WideStackEntry* entries, uint32_t count)
+        {
+            for (uint32_t i = 1; i < count; i++)
+            {
+                const WideStackEntry entry = entries[i];
+                uint32_t j = i;
+                for (; j > 0 && entries[j - 1].tNear < entry.tNear; j--)
+                {
+                    entries[j] = entries[j - 1];
+                }
+                entries[j] = entry;
+            }
+            for (uint32_t i = 0; i < count; i++)
+            {
+                stack[stackSize++] = entries[i];
+            }
+        }
+
+        /*
+            Closest hit for a single ray. Each node tests the ray against all of its children at once,
+            leaves test the ray against a whole triangle block at once.
+        */
+        template<typename V>
+        bool IntersectClosest(const WideBVHNode<V::Width>* nodes, const TriangleBlock<V::Width>* blocks, Ray& ray,
+            Hit& hit)
+        {
+            constexpr uint32_t Width = V::Width;
+
+            const V origin[3] = { V::Broadcast(ray.origin[0]), V::Broadcast(ray.origin[1]), V::Broadcast(ray.origin[2]) };
+            const V direction[3] = { V::Broadcast(ray.direction[0]), V::Broadcast(ray.direction[1]), V::Broadcast(ray.direction[2]) };
+            const V invDirection[3] = {
+                V::Broadcast(SafeReciprocal(ray.direction[0])),
+                V::Broadcast(SafeReciprocal(ray.direction[1])),
+                V::Broadcast(SafeReciprocal(ray.direction[2])) };
+            const V tMin = V::Broadcast(ray.tMin);
+
+            WideStackEntry stack[MaxWideStackSize];
+            uint32_t stackSize = 0;
+            stack[stackSize++] = { 0, ray.tMin };
+
+            bool found = false;
+            while (stackSize > 0)
+            {
+                const WideStackEntry entry = stack[--stackSize];
+                if (entry.tNear >= ray.tMax)
+                {
+                    continue;
+                }
+
+                const WideBVHNode<Width>& node = nodes[entry.node];
+                const V boundsMin[3] = { V::Load(node.boundsMin[0]), V::Load(node.boundsMin[1]), V::Load(node.boundsMin[2]) };
+                const V boundsMax[3] = { V::Load(node.boundsMax[0]), V::Load(node.boundsMax[1]), V::Load(node.boundsMax[2]) };
+                V tNear;
+                uint32_t mask = MoveMask(IntersectBoxes(boundsMin, boundsMax, origin, invDirection, tMin,
+                    V::Broadcast(ray.tMax), tNear));
+                mask &= (1u << node.childCount) - 1;
+                if (mask == 0)
+                {
+                    continue;
+                }
+
+                alignas(Width * sizeof(float)) float nearDistances[Width];
+                tNear.Store(nearDistances);
+
+                WideStackEntry innerChildren[Width];
+                uint32_t innerCount = 0;
+                while (mask != 0)
+                {
+                    const uint32_t i = FirstBit(mask);
+                    mask &= mask - 1;
+
+                    if (node.blockCount[i] == 0)
+                    {
+                        innerChildren[innerCount++] = { node.child[i], nearDistances[i] };
+                        continue;
+                    }
+
+                    for (uint32_t b = 0; b < node.blockCount[i]; b++)
+                    {
+                        const TriangleBlock<Width>& block = blocks[node.child[i] + b];
+                        const V v0[3] = { V::Load(block.v0[0]), V::Load(block.v0[1]), V::Load(block.v0[2]) };
+                        const V e1[3] = { V::Load(block.e1[0]), V::Load(block.e1[1]), V::Load(block.e1[2]) };
+                        const V e2[3] = { V::Load(block.e2[0]), V::Load(block.e2[1]), V::Load(block.e2[2]) };
+                        V t, u, v;
+                        uint32_t hitMask = MoveMask(IntersectTriangles(v0, e1, e2, origin, direction, tMin,
+                            V::Broadcast(ray.tMax), t, u, v));
+                        if (hitMask == 0)
+                        {
+                            continue;
+                        }
+
+                        alignas(Width * sizeof(float)) float ts[Width], us[Width], vs[Width];
+                        t.Store(ts);
+                        u.Store(us);
+                        v.Store(vs);
+                        uint32_t closest = FirstBit(hitMask);
+                        for (uint32_t lanes = hitMask & (hitMask - 1); lanes != 0; lanes &= lanes - 1)
+                        {
+                            const uint32_t lane = FirstBit(lanes);
+                            closest = ts[lane] < ts[closest] ? lane : closest;
+                        }
+
+                        ray.tMax = ts[closest];
+                        hit.t = ts[closest];
+                        hit.u = us[closest];
+                        hit.v = vs[closest];
+                        hit.primitive = block.primitive[closest];
+                        found = true;
+                    }
+                }
+
+                PushSorted(stack, stackSize, innerChildren, innerCount);
+            }
+
+            return found;
+        }
+
+        /*
+            Closest hit for a packet of up to V::Width coherent rays, one ray per lane. Nodes are
+            visited when any ray in the packet hits them, which pays off for primary rays where
+            neighbouring pixels walk almost the same path through the tree.
+        */
+        template<typename V, uint32_t NodeWidth>
+        void IntersectPacket(const WideBVHNode<NodeWidth>* nodes, const TriangleBlock<NodeWidth>* blocks, Ray* rays,
+            Hit* hits, uint32_t count)
+        {
+            constexpr uint32_t Width = V::Width;
+
+            alignas(Width * sizeof(float)) float lanes[9][Width];
+            alignas(Width * sizeof(float)) float laneTMin[Width], laneTMax[Width];
+            for (uint32_t i = 0; i < Width; i++)
+            {
+                // Missing lanes repeat the first ray with an empty interval so they never hit anything
+                const Ray& ray = rays[i < count ? i : 0];
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    lanes[axis][i] = ray.origin[axis];
+                    lanes[3 + axis][i] = ray.direction[axis];
+                    lanes[6 + axis][i] = SafeReciprocal(ray.direction[axis]);
+                }
+                laneTMin[i] = ray.tMin;
+                laneTMax[i] = i < count ? ray.tMax : -FLT_MAX;
+            }
+
+            const V origin[3] = { V::Load(lanes[0]), V::Load(lanes[1]), V::Load(lanes[2]) };
+            const V direction[3] = { V::Load(lanes[3]), V::Load(lanes[4]), V::Load(lanes[5]) };
+            const V invDirection[3] = { V::Load(lanes[6]), V::Load(lanes[7]), V::Load(lanes[8]) };
+            const V tMin = V::Load(laneTMin);
+            V tMax = V::Load(laneTMax);
+            V hitU = V::Broadcast(0.0f);
+            V hitV = V::Broadcast(0.0f);
+            uint32_t primitives[Width];
+            uint32_t hitLanes = 0;
+
+            WideStackEntry stack[MaxWideStackSize];
+            uint32_t stackSize = 0;
+            stack[stackSize++] = { 0, -FLT_MAX };
+            float packetTMax = FLT_MAX;
+
+            while (stackSize > 0)
+            {
+                const WideStackEntry entry = stack[--stackSize];
+                if (entry.tNear >= packetTMax)
+                {
+                    continue;
+                }
+
+                const WideBVHNode<NodeWidth>& node = nodes[entry.node];
+                WideStackEntry innerChildren[NodeWidth];
+                uint32_t innerCount = 0;
+                for (uint32_t c = 0; c < node.childCount; c++)
+                {
+                    const V boundsMin[3] = {
+                        V::Broadcast(node.boundsMin[0][c]), V::Broadcast(node.boundsMin[1][c]), V::Broadcast(node.boundsMin[2][c]) };
+                    const V boundsMax[3] = {
+                        V::Broadcast(node.boundsMax[0][c]), V::Broadcast(node.boundsMax[1][c]), V::Broadcast(node.boundsMax[2][c]) };
+                    V tNear;
+                    const V boxMask = IntersectBoxes(boundsMin, boundsMax, origin, invDirection, tMin, tMax, tNear);
+                    const uint32_t mask = MoveMask(boxMask);
+                    if (mask == 0)
+                    {
+                        continue;
+                    }
+
+                    if (node.blockCount[c] == 0)
+                    {
+                        alignas(Width * sizeof(float)) float nearDistances[Width];
+                        tNear.Store(nearDistances);
+                        float closest = FLT_MAX;
+                        for (uint32_t bits = mask; bits != 0; bits &= bits - 1)
+                        {
+                            const float distance = nearDistances[FirstBit(bits)];
+                            closest = distance < closest ? distance : closest;
+                        }
+                        innerChildren[innerCount++] = { node.child[c], closest };
+                        continue;
+                    }
+
+                    for (uint32_t b = 0; b < node.blockCount[c]; b++)
+                    {
+                        const TriangleBlock<NodeWidth>& block = blocks[node.child[c] + b];
+                        for (uint32_t lane = 0; lane < NodeWidth && block.primitive[lane] != UINT32_MAX; lane++)
+                        {
+                            const V v0[3] = { V::Broadcast(block.v0[0][lane]), V::Broadcast(block.v0[1][lane]), V::Broadcast(block.v0[2][lane]) };
+                            const V e1[3] = { V::Broadcast(block.e1[0][lane]), V::Broadcast(block.e1[1][lane]), V::Broadcast(block.e1[2][lane]) };
+                            const V e2[3] = { V::Broadcast(block.e2[0][lane]), V::Broadcast(block.e2[1][lane]), V::Broadcast(block.e2[2][lane]) };
+                            V t, u, v;
+                            const V hitMask = IntersectTriangles(v0, e1, e2, origin, direction, tMin, tMax, t, u, v);
+                            uint32_t bits = MoveMask(hitMask);
+                            if (bits == 0)
+                            {
+                                continue;
+                            }
+
+                            tMax = Select(hitMask, t, tMax);
+                            hitU = Select(hitMask, u, hitU);
+                            hitV = Select(hitMask, v, hitV);
+                            hitLanes |= bits;
+                            for (; bits != 0; bits &= bits - 1)
+                            {
+                                primitives[FirstBit(bits)] = block.primitive[lane];
+                            }
+                        }
+                    }
+
+                    alignas(Width * sizeof(float)) float tMaxLanes[Width];
+                    tMax.Store(tMaxLanes);
+                    packetTMax = -FLT_MAX;
+                    for (uint32_t i = 0; i < count; i++)
+                    {
+                        packetTMax = tMaxLanes[i] > packetTMax ? tMaxLanes[i] : packetTMax;
+                    }
+                }
+
+                PushSorted(stack, stackSize, innerChildren, innerCount);
+            }
+
+            alignas(Width * sizeof(float)) float ts[Width], us[Width], vs[Width];
+            tMax.Store(ts);
+            hitU.Store(us);
+            hitV.Store(vs);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if ((hitLanes >> i) & 1u)
+                {
+                    rays[i].tMax = ts[i];
+                    hits[i].t = ts[i];
+                    hits[i].u = us[i];
+                    hits[i].v = vs[i];
+                    hits[i].primitive = primitives[i];
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,34 @@
+// Built with AVX2 enabled (see CMakeLists.txt). Only called after DetectSimdLevel has confirmed
+// the CPU supports it, so nothing outside of the kernels may live in this file.
+#include "WideBVHKernels.h"
+
+namespace PBEngine
+{
+    bool AreAVX2KernelsAvailable()
+    {
+        return PB_SIMD_AVX2 != 0;
+    }
+
+#if PB_SIMD_AVX2
+    bool IntersectClosest8_AVX2(const WideBVHNode<8>* nodes, const TriangleBlock<8>* blocks, Ray& ray, Hit& hit)
+    {
+        return IntersectClosest<SimdFloat8>(nodes, blocks, ray, hit);
+    }
+
+    void IntersectPacket8_AVX2(const WideBVHNode<8>* nodes, const TriangleBlock<8>* blocks, Ray* rays, Hit* hits,
+        uint32_t count)
+    {
+        IntersectPacket<SimdFloat8, 8>(nodes, blocks, rays, hits, count);
+    }
+#else
+    // Compiled without AVX2, AreAVX2KernelsAvailable keeps these from ever being called
+    bool IntersectClosest8_AVX2(const WideBVHNode<8>*, const TriangleBlock<8>*, Ray&, Hit&)
+    {
+        return false;
+    }
+
+    void IntersectPacket8_AVX2(const WideBVHNode<8>*, const TriangleBlock<8>*, Ray*, Hit*, uint32_t)
+    {
+    }
+#endif
+}
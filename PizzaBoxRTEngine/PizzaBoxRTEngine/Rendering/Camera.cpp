@@ -0,0 +1,83 @@
+#include "Camera.h"
+
+#include <algorithm>
+#include <cmath>
+#include <glm/geometric.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/matrix.hpp>
+
+namespace PBEngine
+{
+    namespace
+    {
+        const glm::vec3 WorldUp{ 0.0f, 1.0f, 0.0f };
+        // Looking exactly along the up axis would leave lookAt without a right vector
+        constexpr float MaxPitch = 1.5533430f;
+    }
+
+    void Camera::SetPosition(const glm::vec3& position)
+    {
+        if (position != this->position)
+        {
+            this->position = position;
+            version++;
+        }
+    }
+
+    void Camera::SetRotation(float yaw, float pitch)
+    {
+        pitch = std::clamp(pitch, -MaxPitch, MaxPitch);
+        if (yaw != this->yaw || pitch != this->pitch)
+        {
+            this->yaw = yaw;
+            this->pitch = pitch;
+            version++;
+        }
+    }
+
+    void Camera::Move(const glm::vec3& local)
+    {
+        SetPosition(position + GetRight() * local.x + WorldUp * local.y + GetForward() * local.z);
+    }
+
+    void Camera::SetVerticalFov(float fov)
+    {
+        if (fov != verticalFov)
+        {
+            verticalFov = fov;
+            version++;
+        }
+    }
+
+    void Camera::SetAspectRatio(float aspectRatio)
+    {
+        if (aspectRatio > 0.0f && aspectRatio != this->aspectRatio)
+        {
+            this->aspectRatio = aspectRatio;
+            version++;
+        }
+    }
+
+    glm::vec3 Camera::GetForward() const
+    {
+        return glm::vec3(std::sin(yaw) * std::cos(pitch), std::sin(pitch), std::cos(yaw) * std::cos(pitch));
+    }
+
+    glm::vec3 Camera::GetRight() const
+    {
+        return glm::normalize(glm::cross(GetForward(), WorldUp));
+    }
+
+    glm::mat4 Camera::GetViewInverse() const
+    {
+        return glm::inverse(glm::lookAt(position, position + GetForward(), WorldUp));
+    }
+
+    glm::mat4 Camera::GetProjectionInverse() const
+    {
+        // Only directions come out of the inverse, so the clip planes don't matter
+        glm::mat4 projection = glm::perspective(verticalFov, aspectRatio, 0.1f, 1000.0f);
+        projection[1][1] *= -1.0f;
+        return glm::inverse(projection);
+    }
+}
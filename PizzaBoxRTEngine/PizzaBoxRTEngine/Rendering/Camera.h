@@ -0,0 +1,60 @@
+#pragma once
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <cstdint>
+
+namespace PBEngine
+{
+    /*
+        Perspective fly camera that the ray generation shader shoots its primary rays from.
+
+        Every setter bumps the version when it actually changes something, so a renderer can tell that
+        its accumulated samples belong to an old view by comparing against the version it last saw.
+    */
+    class Camera
+    {
+    public:
+        void SetPosition(const glm::vec3& position);
+        const glm::vec3& GetPosition() const { return position; }
+
+        /**
+         * @brief Sets the orientation, pitch is clamped to just short of straight up and down
+         * @param yaw Radians around the world up axis, 0 looks down +z
+         * @param pitch Radians above the horizon
+         */
+        void SetRotation(float yaw, float pitch);
+        void Rotate(float yawDelta, float pitchDelta) { SetRotation(yaw + yawDelta, pitch + pitchDelta); }
+        float GetYaw() const { return yaw; }
+        float GetPitch() const { return pitch; }
+
+        /**
+         * @brief Moves relative to the way the camera faces
+         * @param local x to the right, y up along the world axis and z forwards
+         */
+        void Move(const glm::vec3& local);
+
+        // Vertical field of view in radians
+        void SetVerticalFov(float fov);
+        float GetVerticalFov() const { return verticalFov; }
+
+        // Width over height of the image the rays go to
+        void SetAspectRatio(float aspectRatio);
+
+        glm::vec3 GetForward() const;
+        glm::vec3 GetRight() const;
+
+        glm::mat4 GetViewInverse() const;
+        // With Vulkan's downwards y, so row 0 of the image is the top of the view
+        glm::mat4 GetProjectionInverse() const;
+
+        uint32_t GetVersion() const { return version; }
+
+    private:
+        glm::vec3 position{ 0.0f, 0.0f, -2.5f };
+        float yaw = 0.0f;
+        float pitch = 0.0f;
+        float verticalFov = 1.0471976f;
+        float aspectRatio = 1.0f;
+        uint32_t version = 0;
+    };
+}
@@ -0,0 +1,39 @@
+#include "ImageWriter.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace PBEngine
+{
+    bool WritePPM(const std::string& path, uint32_t width, uint32_t height, const uint8_t* pixels,
+        uint32_t rowPitch, bool bgra)
+    {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            fprintf(stderr, "Couldn't open %s for writing\n", path.c_str());
+            return false;
+        }
+
+        fprintf(file, "P6\n%u %u\n255\n", width, height);
+
+        // Repack one row at a time so the whole image never needs a second copy
+        std::vector<uint8_t> row(static_cast<size_t>(width) * 3);
+        const int red = bgra ? 2 : 0;
+        const int blue = bgra ? 0 : 2;
+        for (uint32_t y = 0; y < height; y++)
+        {
+            const uint8_t* src = pixels + static_cast<size_t>(y) * rowPitch;
+            for (uint32_t x = 0; x < width; x++)
+            {
+                row[x * 3 + 0] = src[x * 4 + red];
+                row[x * 3 + 1] = src[x * 4 + 1];
+                row[x * 3 + 2] = src[x * 4 + blue];
+            }
+            fwrite(row.data(), 1, row.size(), file);
+        }
+
+        fclose(file);
+        return true;
+    }
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace PBEngine
+{
+    /*
+        Writes 8 bit per channel pixels to disk as a binary PPM (P6) file, dropping the alpha channel.
+        rowPitch is in bytes, and bgra swaps the red and blue channels for B8G8R8A8 images.
+    */
+    bool WritePPM(const std::string& path, uint32_t width, uint32_t height, const uint8_t* pixels,
+        uint32_t rowPitch, bool bgra);
+}
@@ -1,8 +1,10 @@
 #include "AccelerationStructure.h"
 #include <vulkan/vulkan_core.h>
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <VulkanHelp/Buffer.h>
+#include <VulkanHelp/UploadManager.h>
 #include "app.h"
 
 namespace PBEngine
@@ -13,7 +15,14 @@ namespace PBEngine
         buffer(std::move(other.buffer)),
         vertexBuffer(std::move(other.vertexBuffer)),
         indexBuffer(std::move(other.indexBuffer)),
-        indexCount(other.indexCount)
+        indexCount(other.indexCount),
+        uploadSeconds(other.uploadSeconds),
+        buildSeconds(other.buildSeconds),
+        buildFlags(other.buildFlags),
+        storageSize(other.storageSize),
+        hostBuild(other.hostBuild),
+        geometry(other.geometry),
+        buildSizes(other.buildSizes)
     {
         // Leave other in valid empty state
         other.handle = VK_NULL_HANDLE;
@@ -22,6 +31,7 @@ namespace PBEngine
         other.vertexBuffer = nullptr;
         other.indexBuffer = nullptr;
         other.indexCount = 0;
+        other.storageSize = 0;
     }
 
     /*
@@ -45,21 +55,11 @@ namespace PBEngine
         buffer_create_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
         check_vk_result(vkCreateBuffer(GetDevice(), &buffer_create_info, nullptr, &scratch_buffer.handle));
 
-        VkMemoryRequirements memory_requirements = {};
-        vkGetBufferMemoryRequirements(GetDevice(), scratch_buffer.handle, &memory_requirements);
-
-        VkMemoryAllocateFlagsInfo memory_allocate_flags_info = {};
-        memory_allocate_flags_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-        memory_allocate_flags_info.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-
-        VkBool32 memTypeFound = false;
-        VkMemoryAllocateInfo memory_allocate_info = {};
-        memory_allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        memory_allocate_info.pNext = &memory_allocate_flags_info;
-        memory_allocate_info.allocationSize = memory_requirements.size;
-        memory_allocate_info.memoryTypeIndex = GetMemoryType(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GetPhysicalDevice(), &memTypeFound);
-        check_vk_result(vkAllocateMemory(GetDevice(), &memory_allocate_info, nullptr, &scratch_buffer.memory));
-        check_vk_result(vkBindBufferMemory(GetDevice(), scratch_buffer.handle, scratch_buffer.memory, 0));
+        // Sub-allocated ranges are at least 256 byte aligned, which covers minAccelerationStructureScratchOffsetAlignment
+        if (!GetMemoryAllocator().AllocateForBuffer(scratch_buffer.handle, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scratch_buffer.allocation))
+        {
+            std::cerr << "Failed to allocate scratch buffer memory." << std::endl;
+        }
 
         VkBufferDeviceAddressInfoKHR buffer_device_address_info{};
         buffer_device_address_info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
@@ -71,118 +71,126 @@ namespace PBEngine
 
     void AccelerationStructure::delete_scratch_buffer(ScratchBuffer& scratch_buffer)
     {
-        if (scratch_buffer.memory != VK_NULL_HANDLE)
-        {
-            vkFreeMemory(GetDevice(), scratch_buffer.memory, nullptr);
-        }
         if (scratch_buffer.handle != VK_NULL_HANDLE)
         {
             vkDestroyBuffer(GetDevice(), scratch_buffer.handle, nullptr);
         }
+        GetMemoryAllocator().Free(scratch_buffer.allocation);
     }
 
-    AccelerationStructure::AccelerationStructure()
+    AccelerationStructure::AccelerationStructure() :
+        AccelerationStructure(triangleVertices.data(), static_cast<uint32_t>(triangleVertices.size()),
+            indices.data(), static_cast<uint32_t>(indices.size()))
     {
-        size_t vertex_buffer_size = triangleVertices.size() * sizeof(Vertex);
-        size_t index_buffer_size = indices.size() * sizeof(uint32_t);
+    }
 
-        // Create buffers for the bottom level geometry
-        const VkBufferUsageFlags bufferUsageFlags = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
-        const VkMemoryPropertyFlags bufferMemoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    AccelerationStructure::AccelerationStructure(const Vertex* vertices, uint32_t vertexCount, const uint32_t* indices,
+        uint32_t indexCount, bool build, bool allowCompaction, bool hostBuild) :
+        indexCount(indexCount),
+        hostBuild(hostBuild)
+    {
+        if (allowCompaction && !hostBuild)
+        {
+            buildFlags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+        }
+
+        auto upload_start = std::chrono::steady_clock::now();
+        size_t vertex_buffer_size = static_cast<size_t>(vertexCount) * sizeof(Vertex);
+        size_t index_buffer_size = static_cast<size_t>(indexCount) * sizeof(uint32_t);
+
+        // Create buffers for the bottom level geometry. Device builds read it from device local memory filled through
+        // the upload manager's staging ring, host builds need to see it themselves.
+        const VkBufferUsageFlags bufferUsageFlags = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        const VkMemoryPropertyFlags bufferMemoryFlags = hostBuild ?
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT : GetUploadManager().GetDeviceLocalProperties();
 
-        void* triangleVoid = const_cast<void*>(reinterpret_cast<const void*>(triangleVertices.data()));
         vertexBuffer = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(), vertex_buffer_size, bufferUsageFlags, bufferMemoryFlags);
-        vertexBuffer->update(triangleVoid, vertex_buffer_size);
+        GetUploadManager().Upload(*vertexBuffer, vertices, vertex_buffer_size);
 
-        void* indexVoid = const_cast<void*>(reinterpret_cast<const void*>(indices.data()));
         indexBuffer = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(), index_buffer_size, bufferUsageFlags, bufferMemoryFlags);
-        indexBuffer->update(indexVoid, index_buffer_size);
-
-        // Setup a single transformation matrix that can be used to transform the whole geometry for a single bottom level acceleration structure
-        VkTransformMatrixKHR transform_matrix = {
-            1.0f, 0.0f, 0.0f, 0.0f,
-            0.0f, 1.0f, 0.0f, 0.0f,
-            0.0f, 0.0f, 1.0f, 0.0f };
-        std::unique_ptr<Buffer> transform_matrix_buffer = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(), sizeof(transform_matrix), bufferUsageFlags, bufferMemoryFlags);
-        transform_matrix_buffer->update(&transform_matrix, sizeof(transform_matrix));
-
-        VkDeviceOrHostAddressConstKHR vertex_data_device_address{};
-        VkDeviceOrHostAddressConstKHR index_data_device_address{};
-        VkDeviceOrHostAddressConstKHR transform_matrix_device_address{};
-
-        vertex_data_device_address.deviceAddress = get_buffer_device_address(vertexBuffer->get_handle());
-        index_data_device_address.deviceAddress = get_buffer_device_address(indexBuffer->get_handle());
-        transform_matrix_device_address.deviceAddress = get_buffer_device_address(transform_matrix_buffer->get_handle());
-
-        VkAccelerationStructureGeometryKHR acceleration_structure_geometry{};
-        acceleration_structure_geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-        acceleration_structure_geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-        acceleration_structure_geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-        acceleration_structure_geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
-        acceleration_structure_geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-        acceleration_structure_geometry.geometry.triangles.vertexData = vertex_data_device_address;
-        acceleration_structure_geometry.geometry.triangles.maxVertex = 3;
-        acceleration_structure_geometry.geometry.triangles.vertexStride = sizeof(Vertex);
-        acceleration_structure_geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
-        acceleration_structure_geometry.geometry.triangles.indexData = index_data_device_address;
-        acceleration_structure_geometry.geometry.triangles.transformData = transform_matrix_device_address;
+        GetUploadManager().Upload(*indexBuffer, indices, index_buffer_size);
+        uploadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - upload_start).count();
+
+        // No transform data, instances place the geometry through the TLAS instead
+        geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+        geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+        geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+        geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+        geometry.geometry.triangles.maxVertex = vertexCount > 0 ? vertexCount - 1 : 0;
+        geometry.geometry.triangles.vertexStride = sizeof(Vertex);
+        geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
+        if (hostBuild)
+        {
+            // Host builds read the geometry through the persistently mapped buffers
+            geometry.geometry.triangles.vertexData.hostAddress = vertexBuffer->map();
+            geometry.geometry.triangles.indexData.hostAddress = indexBuffer->map();
+        }
+        else
+        {
+            geometry.geometry.triangles.vertexData.deviceAddress = get_buffer_device_address(vertexBuffer->get_handle());
+            geometry.geometry.triangles.indexData.deviceAddress = get_buffer_device_address(indexBuffer->get_handle());
+        }
 
         // Get the size requirements for buffers involved in the acceleration structure build process
         VkAccelerationStructureBuildGeometryInfoKHR acceleration_structure_build_geometry_info{};
         acceleration_structure_build_geometry_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
         acceleration_structure_build_geometry_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        acceleration_structure_build_geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        acceleration_structure_build_geometry_info.flags = buildFlags;
         acceleration_structure_build_geometry_info.geometryCount = 1;
-        acceleration_structure_build_geometry_info.pGeometries = &acceleration_structure_geometry;
+        acceleration_structure_build_geometry_info.pGeometries = &geometry;
 
-        const uint32_t primitive_count = 1;
+        const uint32_t primitive_count = indexCount / 3;
 
-        VkAccelerationStructureBuildSizesInfoKHR acceleration_structure_build_sizes_info{};
-        acceleration_structure_build_sizes_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        buildSizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
         vkGetAccelerationStructureBuildSizesKHR(
             GetDevice(),
-            VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+            hostBuild ? VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR : VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
             &acceleration_structure_build_geometry_info,
             &primitive_count,
-            &acceleration_structure_build_sizes_info);
+            &buildSizes);
 
-        // Create a buffer to hold the acceleration structure
+        // Create a buffer to hold the acceleration structure, the host can only build into memory it can see
+        storageSize = buildSizes.accelerationStructureSize;
         buffer = std::make_unique<Buffer>(
             GetDevice(),
             GetPhysicalDevice(),
-            acceleration_structure_build_sizes_info.accelerationStructureSize,
+            buildSizes.accelerationStructureSize,
             VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR,
-            0);
+            hostBuild ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT : 0);
 
         // Create the acceleration structure
         VkAccelerationStructureCreateInfoKHR acceleration_structure_create_info{};
         acceleration_structure_create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
         acceleration_structure_create_info.buffer = buffer->get_handle();
-        acceleration_structure_create_info.size = acceleration_structure_build_sizes_info.accelerationStructureSize;
+        acceleration_structure_create_info.size = buildSizes.accelerationStructureSize;
         acceleration_structure_create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
         vkCreateAccelerationStructureKHR(GetDevice(), &acceleration_structure_create_info, nullptr, &handle);
 
-        // The actual build process starts here
-
-        // Create a scratch buffer as a temporary storage for the acceleration structure build
-        ScratchBuffer scratch_buffer = create_scratch_buffer(acceleration_structure_build_sizes_info.buildScratchSize);
+        if (!build)
+        {
+            return;
+        }
+        auto build_start = std::chrono::steady_clock::now();
 
-        VkAccelerationStructureBuildGeometryInfoKHR acceleration_build_geometry_info{};
-        acceleration_build_geometry_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        acceleration_build_geometry_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        acceleration_build_geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        acceleration_build_geometry_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        acceleration_build_geometry_info.dstAccelerationStructure = handle;
-        acceleration_build_geometry_info.geometryCount = 1;
-        acceleration_build_geometry_info.pGeometries = &acceleration_structure_geometry;
-        acceleration_build_geometry_info.scratchData.deviceAddress = scratch_buffer.device_address;
+        if (hostBuild)
+        {
+            // Without a deferred operation the build runs to completion on this thread
+            std::vector<uint8_t> scratch(buildSizes.buildScratchSize);
+            VkAccelerationStructureBuildGeometryInfoKHR build_info{};
+            VkAccelerationStructureBuildRangeInfoKHR build_range{};
+            GetHostBuild(scratch.data(), build_info, build_range);
+            const VkAccelerationStructureBuildRangeInfoKHR* range_info = &build_range;
+            check_vk_result(vkBuildAccelerationStructuresKHR(GetDevice(), VK_NULL_HANDLE, 1, &build_info, &range_info));
+
+            FinishBuild();
+            buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+            return;
+        }
 
-        VkAccelerationStructureBuildRangeInfoKHR acceleration_structure_build_range_info;
-        acceleration_structure_build_range_info.primitiveCount = 1;
-        acceleration_structure_build_range_info.primitiveOffset = 0;
-        acceleration_structure_build_range_info.firstVertex = 0;
-        acceleration_structure_build_range_info.transformOffset = 0;
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR*> acceleration_build_structure_range_infos = { &acceleration_structure_build_range_info };
+        // Create a scratch buffer as a temporary storage for the acceleration structure build
+        ScratchBuffer scratch_buffer = create_scratch_buffer(buildSizes.buildScratchSize);
 
         // Build the acceleration structure on the device via a one-time command buffer submission
         // Some implementations may support acceleration structure building on the host (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands), but we prefer device builds
@@ -207,14 +215,11 @@ namespace PBEngine
         cmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
         vkBeginCommandBuffer(commandBuffer, &cmdBufferBeginInfo);
 
-        vkCmdBuildAccelerationStructuresKHR(
-            commandBuffer,
-            1,
-            &acceleration_build_geometry_info,
-            acceleration_build_structure_range_infos.data());
+        RecordBuild(commandBuffer, scratch_buffer.device_address);
 
-        // Flush command buffer
+        // Flush command buffer, the geometry copies go to the same queue first
         check_vk_result(vkEndCommandBuffer(commandBuffer));
+        GetUploadManager().Flush();
         VkSubmitInfo submit_info{};
         submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
         submit_info.commandBufferCount = 1;
@@ -229,9 +234,9 @@ namespace PBEngine
         check_vk_result(vkCreateFence(GetDevice(), &fence_info, nullptr, &fence));
 
         // Submit to the queue
-        VkResult result = vkQueueSubmit(GetComputeQueue(), 1, &submit_info, fence);
-        // Wait for the fence to signal that command buffer has finished executing
-        check_vk_result(vkWaitForFences(GetDevice(), 1, &fence, VK_TRUE, 1000));
+        check_vk_result(vkQueueSubmit(GetComputeQueue(), 1, &submit_info, fence));
+        // Wait for the fence to signal that command buffer has finished executing, big meshes take a while
+        check_vk_result(vkWaitForFences(GetDevice(), 1, &fence, VK_TRUE, UINT64_MAX));
 
         vkDestroyFence(GetDevice(), fence, nullptr);
         vkFreeCommandBuffers(GetDevice(), commandPool, 1, &commandBuffer);
@@ -239,6 +244,65 @@ namespace PBEngine
 
         delete_scratch_buffer(scratch_buffer);
 
+        // The TLAS build and the traces that read this run on the ray tracing queue
+        ReleaseToRenderQueue();
+        GetUploadManager().Flush();
+
+        FinishBuild();
+        buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+    }
+
+    void AccelerationStructure::RecordBuild(VkCommandBuffer commandBuffer, VkDeviceAddress scratchAddress)
+    {
+        VkAccelerationStructureBuildGeometryInfoKHR acceleration_build_geometry_info{};
+        acceleration_build_geometry_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        acceleration_build_geometry_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        acceleration_build_geometry_info.flags = buildFlags;
+        acceleration_build_geometry_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        acceleration_build_geometry_info.dstAccelerationStructure = handle;
+        acceleration_build_geometry_info.geometryCount = 1;
+        acceleration_build_geometry_info.pGeometries = &geometry;
+        acceleration_build_geometry_info.scratchData.deviceAddress = scratchAddress;
+
+        VkAccelerationStructureBuildRangeInfoKHR acceleration_structure_build_range_info{};
+        acceleration_structure_build_range_info.primitiveCount = indexCount / 3;
+        const VkAccelerationStructureBuildRangeInfoKHR* range_info = &acceleration_structure_build_range_info;
+
+        vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &acceleration_build_geometry_info, &range_info);
+    }
+
+    void AccelerationStructure::GetHostBuild(void* scratch, VkAccelerationStructureBuildGeometryInfoKHR& info,
+        VkAccelerationStructureBuildRangeInfoKHR& range) const
+    {
+        info = {};
+        info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        info.flags = buildFlags;
+        info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        info.dstAccelerationStructure = handle;
+        info.geometryCount = 1;
+        info.pGeometries = &geometry;
+        info.scratchData.hostAddress = scratch;
+
+        range = {};
+        range.primitiveCount = indexCount / 3;
+    }
+
+    void AccelerationStructure::ReleaseToRenderQueue()
+    {
+        if (hostBuild)
+        {
+            return;
+        }
+        const uint32_t render_family = GetApp().g_QueueFamily[0];
+        GetUploadManager().Release(*buffer, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR | VK_ACCESS_TRANSFER_WRITE_BIT,
+            render_family);
+        GetUploadManager().Release(*vertexBuffer, VK_ACCESS_TRANSFER_WRITE_BIT, render_family);
+        GetUploadManager().Release(*indexBuffer, VK_ACCESS_TRANSFER_WRITE_BIT, render_family);
+    }
+
+    void AccelerationStructure::FinishBuild()
+    {
         // Get the bottom acceleration structure's handle, which will be used during the top level acceleration build
         VkAccelerationStructureDeviceAddressInfoKHR acceleration_device_address_info{};
         acceleration_device_address_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
@@ -246,6 +310,19 @@ namespace PBEngine
         deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(GetDevice(), &acceleration_device_address_info);
     }
 
+    void AccelerationStructure::ReplaceWithCompacted(VkAccelerationStructureKHR compactedHandle,
+        std::unique_ptr<Buffer> compactedBuffer, VkDeviceSize compactedSize)
+    {
+        if (handle)
+        {
+            vkDestroyAccelerationStructureKHR(GetDevice(), handle, nullptr);
+        }
+        handle = compactedHandle;
+        buffer = std::move(compactedBuffer);
+        storageSize = compactedSize;
+        FinishBuild();
+    }
+
     AccelerationStructure::~AccelerationStructure()
     {
         if (buffer)
@@ -4,6 +4,7 @@
 #include <vector>
 #include <VulkanHelp/Buffer.h>
 #include <memory>
+#include "Vertex.h"
 
 namespace PBEngine
 {
@@ -11,24 +12,24 @@ namespace PBEngine
     {
         uint64_t       device_address;
         VkBuffer       handle;
-        VkDeviceMemory memory;
+        Allocation     allocation;
     };
 
-    struct Vertex
-    {
-        float pos[3];
-    };
-
-    // Define the vertex data for the triangle
-    const std::vector<Vertex> triangleVertices = {
-        {{-0.5f, -0.5f, 0.0f}},
-        {{0.5f, -0.5f, 0.0f}},
-        {{0.0f,  0.5f, 0.0f}}};
-    const std::vector<uint32_t> indices = { 0, 1, 2 };
-
     class AccelerationStructure {
     public:
+        // Builds the built in triangle
         AccelerationStructure();
+
+        /**
+         * @brief Uploads the geometry and builds a bottom level acceleration structure from it
+         * @param indices Three indices per triangle
+         * @param build False only uploads and creates the handle, the build is then recorded by a BLASBuilder
+         * @param allowCompaction Builds with ALLOW_COMPACTION so a BLASBuilder can shrink it afterwards
+         * @param hostBuild Places the structure in host visible memory and builds it on the CPU,
+         * needs the accelerationStructureHostCommands feature. Compaction isn't supported on this path.
+         */
+        AccelerationStructure(const Vertex* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount,
+            bool build = true, bool allowCompaction = false, bool hostBuild = false);
         AccelerationStructure(AccelerationStructure&&);
         AccelerationStructure(const AccelerationStructure&) = delete;
         ~AccelerationStructure();
@@ -41,7 +42,58 @@ namespace PBEngine
         std::unique_ptr<Buffer> indexBuffer;
         uint32_t indexCount;
 
+        // Time spent copying the geometry into its buffers and building on the GPU
+        double uploadSeconds = 0.0;
+        double buildSeconds = 0.0;
+
+        // Scratch memory the build needs, valid once the geometry has been uploaded
+        VkDeviceSize GetBuildScratchSize() const { return buildSizes.buildScratchSize; }
+
+        /**
+         * @brief Records the build into a command buffer. Geometry and handle have to outlive the submission.
+         * @param scratchAddress Device address of at least GetBuildScratchSize bytes nothing else uses during the build
+         */
+        void RecordBuild(VkCommandBuffer commandBuffer, VkDeviceAddress scratchAddress);
+
+        /**
+         * @brief Fills in a build for vkBuildAccelerationStructuresKHR, only for structures created with hostBuild.
+         * The structs, the scratch memory and this structure have to stay put until a deferred build has finished.
+         * @param scratch At least GetBuildScratchSize bytes of host memory nothing else uses during the build
+         */
+        void GetHostBuild(void* scratch, VkAccelerationStructureBuildGeometryInfoKHR& info,
+            VkAccelerationStructureBuildRangeInfoKHR& range) const;
+
+        bool IsHostBuild() const { return hostBuild; }
+
+        /**
+         * @brief Fetches the device address once the recorded build has finished executing
+         */
+        void FinishBuild();
+
+        /**
+         * @brief Swaps in a compacted copy of this structure and destroys the original.
+         * The copy has to have finished executing, FinishBuild is called for the new handle.
+         */
+        void ReplaceWithCompacted(VkAccelerationStructureKHR compactedHandle, std::unique_ptr<Buffer> compactedBuffer,
+            VkDeviceSize compactedSize);
+
+        /**
+         * @brief Queues the hand over of the structure and its geometry from the compute family that built them
+         * to the ray tracing queue's family, goes out with the upload manager's next Flush. Only for device builds
+         * that have finished recording, host builds never belong to a queue.
+         */
+        void ReleaseToRenderQueue();
+
+        // Bytes the structure itself occupies, without the geometry buffers
+        VkDeviceSize GetStorageSize() const { return storageSize; }
+
     private:
+        VkBuildAccelerationStructureFlagsKHR buildFlags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        VkDeviceSize storageSize = 0;
+        bool hostBuild = false;
+        VkAccelerationStructureGeometryKHR geometry{};
+        VkAccelerationStructureBuildSizesInfoKHR buildSizes{};
+
         uint64_t get_buffer_device_address(VkBuffer buffer);
         ScratchBuffer create_scratch_buffer(VkDeviceSize size);
         void delete_scratch_buffer(ScratchBuffer& scratch_buffer);
@@ -0,0 +1,414 @@
+#include "BLASBuilder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <Core/TaskSystem.h>
+#include <Core/Trace.h>
+#include <VulkanHelp/UploadManager.h>
+#include "app.h"
+
+namespace PBEngine
+{
+    namespace
+    {
+        VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment)
+        {
+            return (value + alignment - 1) / alignment * alignment;
+        }
+    }
+
+    BLASBuilder::BLASBuilder(bool compact, VkDeviceSize scratchBudget, bool hostBuild) :
+        compact(compact && !hostBuild),
+        hostBuild(hostBuild),
+        scratchBudget(scratchBudget)
+    {
+        VkPhysicalDeviceAccelerationStructurePropertiesKHR acceleration_structure_properties{};
+        acceleration_structure_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+        VkPhysicalDeviceProperties2 device_properties{};
+        device_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        device_properties.pNext = &acceleration_structure_properties;
+        vkGetPhysicalDeviceProperties2(GetPhysicalDevice(), &device_properties);
+        scratchAlignment = std::max<VkDeviceSize>(acceleration_structure_properties.minAccelerationStructureScratchOffsetAlignment, 1);
+    }
+
+    BLASBuilder::~BLASBuilder()
+    {
+        if (completion.valid())
+        {
+            completion.wait();
+        }
+        ReleaseSubmission();
+    }
+
+    uint32_t BLASBuilder::Add(const Vertex* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount)
+    {
+        PB_TRACE_SCOPE("BLASBuilder::Add");
+        structures.emplace_back(vertices, vertexCount, indices, indexCount, false, compact, hostBuild);
+        stats.uploadSeconds += structures.back().uploadSeconds;
+        stats.structureCount = static_cast<uint32_t>(structures.size());
+        return static_cast<uint32_t>(structures.size() - 1);
+    }
+
+    std::shared_future<void> BLASBuilder::Submit()
+    {
+        PB_TRACE_SCOPE("BLASBuilder::Submit");
+        if (completion.valid())
+        {
+            std::cerr << "BLASBuilder::Submit called twice, the builds are already submitted" << std::endl;
+            return completion;
+        }
+        if (structures.empty())
+        {
+            std::promise<void> done;
+            done.set_value();
+            completion = done.get_future().share();
+            return completion;
+        }
+        auto build_start = std::chrono::steady_clock::now();
+
+        // One scratch buffer for everything, as big as the budget allows but at least as big as the largest build
+        VkDeviceSize largest = 0;
+        VkDeviceSize total = 0;
+        for (const AccelerationStructure& structure : structures)
+        {
+            const VkDeviceSize size = AlignUp(structure.GetBuildScratchSize(), scratchAlignment);
+            largest = std::max(largest, size);
+            total += size;
+        }
+        stats.scratchSize = std::max(largest, std::min(total, scratchBudget));
+
+        if (hostBuild)
+        {
+            hostScratch.resize(static_cast<size_t>(stats.scratchSize));
+            completion = std::async(std::launch::async, [this, build_start]() {
+                BuildOnHost();
+                stats.buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+            }).share();
+            return completion;
+        }
+        scratchBuffer = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(), stats.scratchSize,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        const VkDeviceAddress scratch_address = scratchBuffer->get_device_address();
+
+        VkCommandPoolCreateInfo poolCreateInfo = {};
+        poolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolCreateInfo.queueFamilyIndex = GetApp().g_QueueFamily[1];
+        poolCreateInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        check_vk_result(vkCreateCommandPool(GetDevice(), &poolCreateInfo, nullptr, &commandPool));
+
+        VkCommandBufferAllocateInfo commandBufferAllocateInfo = {};
+        commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commandBufferAllocateInfo.commandPool = commandPool;
+        commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        commandBufferAllocateInfo.commandBufferCount = 1;
+        check_vk_result(vkAllocateCommandBuffers(GetDevice(), &commandBufferAllocateInfo, &commandBuffer));
+
+        VkCommandBufferBeginInfo cmdBufferBeginInfo = {};
+        cmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        cmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        check_vk_result(vkBeginCommandBuffer(commandBuffer, &cmdBufferBeginInfo));
+
+        // Builds without a barrier between them may run concurrently, so each one in a batch gets its
+        // own slice of the scratch buffer. The barrier lets the next batch reuse the memory.
+        VkMemoryBarrier scratch_barrier{};
+        scratch_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        scratch_barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        scratch_barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+
+        profiler.Init(1, 1, GetApp().g_QueueFamily[1], "Compute queue");
+        profiler.BeginSlot(commandBuffer, 0);
+        const uint32_t build_region = profiler.BeginRegion(commandBuffer, 0, "BLAS build");
+
+        VkDeviceSize scratch_offset = 0;
+        stats.batchCount = 1;
+        for (AccelerationStructure& structure : structures)
+        {
+            const VkDeviceSize size = AlignUp(structure.GetBuildScratchSize(), scratchAlignment);
+            if (scratch_offset + size > stats.scratchSize)
+            {
+                vkCmdPipelineBarrier(commandBuffer,
+                    VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                    0, 1, &scratch_barrier, 0, nullptr, 0, nullptr);
+                scratch_offset = 0;
+                stats.batchCount++;
+            }
+            structure.RecordBuild(commandBuffer, scratch_address + scratch_offset);
+            scratch_offset += size;
+        }
+        profiler.EndRegion(commandBuffer, 0, build_region);
+
+        if (compact)
+        {
+            VkQueryPoolCreateInfo query_pool_info{};
+            query_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            query_pool_info.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+            query_pool_info.queryCount = static_cast<uint32_t>(structures.size());
+            check_vk_result(vkCreateQueryPool(GetDevice(), &query_pool_info, nullptr, &queryPool));
+
+            std::vector<VkAccelerationStructureKHR> handles;
+            handles.reserve(structures.size());
+            for (const AccelerationStructure& structure : structures)
+            {
+                handles.push_back(structure.handle);
+            }
+
+            // The sizes can only be read once the builds have written the structures
+            VkMemoryBarrier build_barrier{};
+            build_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            build_barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+            build_barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+            vkCmdPipelineBarrier(commandBuffer,
+                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                0, 1, &build_barrier, 0, nullptr, 0, nullptr);
+            vkCmdResetQueryPool(commandBuffer, queryPool, 0, query_pool_info.queryCount);
+            vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, query_pool_info.queryCount, handles.data(),
+                VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, queryPool, 0);
+        }
+        check_vk_result(vkEndCommandBuffer(commandBuffer));
+
+        VkFenceCreateInfo fence_info{};
+        fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        check_vk_result(vkCreateFence(GetDevice(), &fence_info, nullptr, &fence));
+
+        VkSubmitInfo submit_info{};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &commandBuffer;
+        // The geometry copies of every Add are still queued, they go to the same queue ahead of the builds
+        GetUploadManager().Flush();
+        check_vk_result(vkQueueSubmit(GetComputeQueue(), 1, &submit_info, fence));
+        profiler.MarkSubmitted(0);
+
+        // Only the fence wait happens off this thread, everything touching the queue is done by now
+        completion = std::async(std::launch::async, [this, build_start]() {
+            PB_TRACE_SCOPE("Wait for BLAS build");
+            check_vk_result(vkWaitForFences(GetDevice(), 1, &fence, VK_TRUE, UINT64_MAX));
+            for (AccelerationStructure& structure : structures)
+            {
+                structure.FinishBuild();
+            }
+            stats.buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+            if (profiler.Resolve(0))
+            {
+                stats.gpuBuildSeconds = profiler.GetMilliseconds("BLAS build") / 1000.0;
+            }
+        }).share();
+        return completion;
+    }
+
+    void BLASBuilder::BuildOnHost()
+    {
+        PB_TRACE_SCOPE("BLASBuilder::BuildOnHost");
+        TaskSystem& task_system = GetTaskSystem();
+        std::vector<VkAccelerationStructureBuildGeometryInfoKHR> build_infos(structures.size());
+        std::vector<VkAccelerationStructureBuildRangeInfoKHR> build_ranges(structures.size());
+        std::vector<VkDeferredOperationKHR> operations;
+
+        size_t first = 0;
+        stats.batchCount = 0;
+        while (first < structures.size())
+        {
+            // Same batching as on the device, builds running at the same time need their own part of the scratch memory
+            size_t last = first;
+            VkDeviceSize scratch_offset = 0;
+            while (last < structures.size())
+            {
+                const VkDeviceSize size = AlignUp(structures[last].GetBuildScratchSize(), scratchAlignment);
+                if (last > first && scratch_offset + size > stats.scratchSize)
+                {
+                    break;
+                }
+                structures[last].GetHostBuild(hostScratch.data() + scratch_offset, build_infos[last], build_ranges[last]);
+                scratch_offset += size;
+                last++;
+            }
+            stats.batchCount++;
+
+            // Every build is started here and then joined by as many workers as the driver can make use of
+            TaskGroup group;
+            operations.clear();
+            for (size_t i = first; i < last; i++)
+            {
+                VkDeferredOperationKHR operation = VK_NULL_HANDLE;
+                check_vk_result(vkCreateDeferredOperationKHR(GetDevice(), nullptr, &operation));
+                const VkAccelerationStructureBuildRangeInfoKHR* range_info = &build_ranges[i];
+                VkResult result = vkBuildAccelerationStructuresKHR(GetDevice(), operation, 1, &build_infos[i], &range_info);
+                if (result == VK_OPERATION_NOT_DEFERRED_KHR)
+                {
+                    // The driver built it on the spot
+                    vkDestroyDeferredOperationKHR(GetDevice(), operation, nullptr);
+                    continue;
+                }
+                if (result != VK_OPERATION_DEFERRED_KHR)
+                {
+                    check_vk_result(result);
+                    vkDestroyDeferredOperationKHR(GetDevice(), operation, nullptr);
+                    continue;
+                }
+                operations.push_back(operation);
+
+                const uint32_t concurrency = std::max(1u,
+                    std::min(vkGetDeferredOperationMaxConcurrencyKHR(GetDevice(), operation), task_system.GetThreadCount()));
+                for (uint32_t worker = 0; worker < concurrency; worker++)
+                {
+                    task_system.Submit([operation]() {
+                        // THREAD_IDLE means there's no work for this thread right now but more may come
+                        VkResult join_result = vkDeferredOperationJoinKHR(GetDevice(), operation);
+                        while (join_result == VK_THREAD_IDLE_KHR)
+                        {
+                            std::this_thread::yield();
+                            join_result = vkDeferredOperationJoinKHR(GetDevice(), operation);
+                        }
+                        if (join_result != VK_SUCCESS && join_result != VK_THREAD_DONE_KHR)
+                        {
+                            check_vk_result(join_result);
+                        }
+                    }, &group);
+                }
+            }
+            task_system.Wait(group);
+
+            for (VkDeferredOperationKHR operation : operations)
+            {
+                check_vk_result(vkGetDeferredOperationResultKHR(GetDevice(), operation));
+                vkDestroyDeferredOperationKHR(GetDevice(), operation, nullptr);
+            }
+            first = last;
+        }
+
+        for (AccelerationStructure& structure : structures)
+        {
+            structure.FinishBuild();
+        }
+    }
+
+    std::vector<AccelerationStructure> BLASBuilder::TakeResults()
+    {
+        PB_TRACE_SCOPE("BLASBuilder::TakeResults");
+        if (!completion.valid())
+        {
+            Submit();
+        }
+        completion.wait();
+        if (compact && queryPool != VK_NULL_HANDLE)
+        {
+            Compact();
+        }
+        // Built and compacted on the compute family, the TLAS build and the traces read them on the ray tracing queue
+        if (!hostBuild)
+        {
+            for (AccelerationStructure& structure : structures)
+            {
+                structure.ReleaseToRenderQueue();
+            }
+            GetUploadManager().Flush();
+        }
+        ReleaseSubmission();
+        return std::move(structures);
+    }
+
+    void BLASBuilder::Compact()
+    {
+        PB_TRACE_SCOPE("BLASBuilder::Compact");
+        auto compact_start = std::chrono::steady_clock::now();
+
+        std::vector<VkDeviceSize> compacted_sizes(structures.size());
+        check_vk_result(vkGetQueryPoolResults(GetDevice(), queryPool, 0, static_cast<uint32_t>(compacted_sizes.size()),
+            compacted_sizes.size() * sizeof(VkDeviceSize), compacted_sizes.data(), sizeof(VkDeviceSize),
+            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+
+        // The command buffer from the build has finished, so the pool can be recycled for the copies
+        check_vk_result(vkResetCommandPool(GetDevice(), commandPool, 0));
+        check_vk_result(vkResetFences(GetDevice(), 1, &fence));
+
+        VkCommandBufferBeginInfo cmdBufferBeginInfo = {};
+        cmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        cmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        check_vk_result(vkBeginCommandBuffer(commandBuffer, &cmdBufferBeginInfo));
+
+        struct CompactedStructure
+        {
+            VkAccelerationStructureKHR handle = VK_NULL_HANDLE;
+            std::unique_ptr<Buffer> buffer;
+        };
+        std::vector<CompactedStructure> compacted(structures.size());
+        compactions.resize(structures.size());
+        for (size_t i = 0; i < structures.size(); i++)
+        {
+            compactions[i].originalSize = structures[i].GetStorageSize();
+            compactions[i].compactedSize = compacted_sizes[i];
+            // Nothing to gain, keep the original
+            if (compacted_sizes[i] == 0 || compacted_sizes[i] >= structures[i].GetStorageSize())
+            {
+                compactions[i].compactedSize = compactions[i].originalSize;
+                continue;
+            }
+
+            compacted[i].buffer = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(), compacted_sizes[i],
+                VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, 0);
+
+            VkAccelerationStructureCreateInfoKHR acceleration_structure_create_info{};
+            acceleration_structure_create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+            acceleration_structure_create_info.buffer = compacted[i].buffer->get_handle();
+            acceleration_structure_create_info.size = compacted_sizes[i];
+            acceleration_structure_create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+            check_vk_result(vkCreateAccelerationStructureKHR(GetDevice(), &acceleration_structure_create_info, nullptr,
+                &compacted[i].handle));
+
+            VkCopyAccelerationStructureInfoKHR copy_info{};
+            copy_info.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+            copy_info.src = structures[i].handle;
+            copy_info.dst = compacted[i].handle;
+            copy_info.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+            vkCmdCopyAccelerationStructureKHR(commandBuffer, &copy_info);
+        }
+        check_vk_result(vkEndCommandBuffer(commandBuffer));
+
+        VkSubmitInfo submit_info{};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &commandBuffer;
+        check_vk_result(vkQueueSubmit(GetComputeQueue(), 1, &submit_info, fence));
+        check_vk_result(vkWaitForFences(GetDevice(), 1, &fence, VK_TRUE, UINT64_MAX));
+
+        // Copies are done, the originals and their memory can go
+        for (size_t i = 0; i < structures.size(); i++)
+        {
+            if (compacted[i].handle != VK_NULL_HANDLE)
+            {
+                structures[i].ReplaceWithCompacted(compacted[i].handle, std::move(compacted[i].buffer), compacted_sizes[i]);
+            }
+            stats.originalBytes += compactions[i].originalSize;
+            stats.compactedBytes += compactions[i].compactedSize;
+        }
+        stats.compactSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - compact_start).count();
+    }
+
+    void BLASBuilder::ReleaseSubmission()
+    {
+        if (queryPool != VK_NULL_HANDLE)
+        {
+            vkDestroyQueryPool(GetDevice(), queryPool, nullptr);
+            queryPool = VK_NULL_HANDLE;
+        }
+        if (fence != VK_NULL_HANDLE)
+        {
+            vkDestroyFence(GetDevice(), fence, nullptr);
+            fence = VK_NULL_HANDLE;
+        }
+        if (commandPool != VK_NULL_HANDLE)
+        {
+            // Frees the command buffer along with it
+            vkDestroyCommandPool(GetDevice(), commandPool, nullptr);
+            commandPool = VK_NULL_HANDLE;
+            commandBuffer = VK_NULL_HANDLE;
+        }
+        profiler.Destroy();
+        scratchBuffer.reset();
+        hostScratch.clear();
+        hostScratch.shrink_to_fit();
+    }
+}
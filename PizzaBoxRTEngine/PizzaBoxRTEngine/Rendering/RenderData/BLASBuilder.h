@@ -0,0 +1,123 @@
+#pragma once
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <vector>
+#include <VulkanHelp/vk_common.h>
+#include <VulkanHelp/Buffer.h>
+#include <VulkanHelp/GpuProfiler.h>
+#include "AccelerationStructure.h"
+
+namespace PBEngine
+{
+    struct BLASBuildStats
+    {
+        uint32_t structureCount = 0;
+        // Groups of builds that fit into the scratch buffer together, separated by a barrier
+        uint32_t batchCount = 0;
+        VkDeviceSize scratchSize = 0;
+        // Copying the geometry into the structures' buffers, on the thread calling Add
+        double uploadSeconds = 0.0;
+        // From Submit until the fence signalled
+        double buildSeconds = 0.0;
+        // Between the first and last build on the GPU, 0 for host builds or without timestamp support
+        double gpuBuildSeconds = 0.0;
+
+        // Only filled in when compaction is enabled
+        VkDeviceSize originalBytes = 0;
+        VkDeviceSize compactedBytes = 0;
+        double compactSeconds = 0.0;
+    };
+
+    struct BLASCompaction
+    {
+        VkDeviceSize originalSize = 0;
+        VkDeviceSize compactedSize = 0;
+    };
+
+    /*
+        Builds many bottom level acceleration structures with a single submission to the compute queue.
+        Every build shares one scratch buffer, builds that fit into it side by side run together and
+        the next batch waits on a barrier before it reuses the memory.
+
+            BLASBuilder builder;
+            for (const MeshData& mesh : meshes)
+                builder.Add(...);
+            builder.Submit();
+            std::vector<AccelerationStructure> structures = builder.TakeResults();
+
+        With compaction enabled the build also queries the compacted sizes, and TakeResults copies every
+        structure into a buffer of exactly that size before handing it over. That's a second submission
+        and wait on the thread calling TakeResults, in exchange for usually a third to half less memory.
+
+
+        Host builds skip the queue entirely. Each structure is built by vkBuildAccelerationStructuresKHR
+        as a deferred operation that the task system's workers join, so loading on a CPU only node or
+        a software driver uses every core, and the GPU keeps rendering while the builds run.
+    */
+    class BLASBuilder
+    {
+    public:
+        static constexpr VkDeviceSize DefaultScratchBudget = 256ull * 1024 * 1024;
+
+        /**
+         * @param compact Shrink every structure to its compacted size before TakeResults returns it
+         * @param scratchBudget Upper bound for the shared scratch buffer. It still grows to fit the largest single build.
+         * @param hostBuild Build on CPU threads through deferred host operations, needs accelerationStructureHostCommands.
+         * Compaction is skipped for host builds.
+         */
+        explicit BLASBuilder(bool compact = false, VkDeviceSize scratchBudget = DefaultScratchBudget, bool hostBuild = false);
+        BLASBuilder(const BLASBuilder&) = delete;
+        BLASBuilder& operator=(const BLASBuilder&) = delete;
+        // Waits for a submitted build, the structures it was building are destroyed with it
+        ~BLASBuilder();
+
+        /**
+         * @brief Uploads the geometry straight away and queues its build, the source data can be freed afterwards
+         * @return Index of the structure in TakeResults
+         */
+        uint32_t Add(const Vertex* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount);
+
+        /**
+         * @brief Records every queued build into one command buffer and submits it to the compute queue,
+         * or hands them to the task system for host builds.
+         * Returns right away, the future becomes ready once the builds are done and the device addresses are known.
+         */
+        std::shared_future<void> Submit();
+
+        /**
+         * @brief Waits for the submitted builds, compacts them if enabled and hands over the structures
+         * in the order they were added
+         */
+        std::vector<AccelerationStructure> TakeResults();
+
+        const BLASBuildStats& GetStats() const { return stats; }
+        // Sizes before and after compaction in the order the structures were added, empty without compaction
+        const std::vector<BLASCompaction>& GetCompactions() const { return compactions; }
+
+    private:
+        // Runs on the thread behind the completion future, one budget sized batch of deferred builds at a time
+        void BuildOnHost();
+        void Compact();
+        void ReleaseSubmission();
+
+        bool compact;
+        bool hostBuild;
+        VkDeviceSize scratchBudget;
+        VkDeviceSize scratchAlignment = 256;
+
+        std::vector<AccelerationStructure> structures;
+        BLASBuildStats stats;
+        std::vector<BLASCompaction> compactions;
+
+        std::unique_ptr<Buffer> scratchBuffer;
+        std::vector<uint8_t> hostScratch;
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+        // One VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR query per structure
+        VkQueryPool queryPool = VK_NULL_HANDLE;
+        GpuProfiler profiler;
+        std::shared_future<void> completion;
+    };
+}
@@ -0,0 +1,1328 @@
+#include "MeshLoader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <Core/TaskSystem.h>
+
+namespace PBEngine
+{
+    namespace
+    {
+        bool ReadFile(const std::string& path, std::vector<char>& data)
+        {
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            if (!file)
+            {
+                return false;
+            }
+            data.resize(static_cast<size_t>(file.tellg()));
+            file.seekg(0);
+            return static_cast<bool>(file.read(data.data(), data.size()));
+        }
+
+        std::string GetLowerExtension(const std::string& path)
+        {
+            std::string extension = std::filesystem::path(path).extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(),
+                [](unsigned char c) { return static_cast<char>(tolower(c)); });
+            return extension;
+        }
+
+        inline bool IsSpace(char c)
+        {
+            return c == ' ' || c == '\t';
+        }
+
+        inline const char* SkipSpaces(const char* p, const char* end)
+        {
+            while (p < end && IsSpace(*p))
+            {
+                p++;
+            }
+            return p;
+        }
+
+#pragma region OBJ
+        struct ObjGroup
+        {
+            std::string name;
+            // Index into the face indices where the group starts, first of the chunk and later of the whole file
+            size_t firstIndex;
+            bool isObject;
+        };
+
+        /*
+            Everything one task pulled out of its part of the file. Negative OBJ indices count back from the
+            last vertex so far, which depends on the chunks before this one. Those are stored relative to the
+            chunk's first vertex and fixed up once every chunk knows where its vertices start.
+        */
+        struct ObjChunk
+        {
+            std::vector<Vertex> positions;
+            std::vector<uint32_t> indices;
+            std::vector<size_t> relativeIndices;
+            std::vector<ObjGroup> groups;
+            uint32_t skippedLines = 0;
+            bool badIndex = false;
+        };
+
+        inline bool ParseFloat(const char*& p, const char* end, float& value)
+        {
+            p = SkipSpaces(p, end);
+            // from_chars doesn't take a leading plus
+            if (p < end && *p == '+')
+            {
+                p++;
+            }
+            std::from_chars_result result = std::from_chars(p, end, value);
+            if (result.ec == std::errc::result_out_of_range)
+            {
+                // Denormals and the like, close enough to nothing
+                value = 0.0f;
+            }
+            else if (result.ec != std::errc())
+            {
+                return false;
+            }
+            p = result.ptr;
+            return true;
+        }
+
+        void ParseObjChunk(const char* begin, const char* end, ObjChunk& chunk)
+        {
+            std::vector<int64_t> polygon;
+            const char* p = begin;
+            while (p < end)
+            {
+                const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+                if (lineEnd == nullptr)
+                {
+                    lineEnd = end;
+                }
+                const char* line = SkipSpaces(p, lineEnd);
+                const char* last = lineEnd;
+                while (last > line && (last[-1] == '\r' || IsSpace(last[-1])))
+                {
+                    last--;
+                }
+                p = lineEnd < end ? lineEnd + 1 : end;
+
+                if (line == last || line[0] == '#')
+                {
+                    continue;
+                }
+                const bool singleLetter = last - line == 1 || IsSpace(line[1]);
+
+                if (line[0] == 'v' && singleLetter)
+                {
+                    Vertex vertex;
+                    const char* q = line + 1;
+                    if (ParseFloat(q, last, vertex.pos[0]) && ParseFloat(q, last, vertex.pos[1]) &&
+                        ParseFloat(q, last, vertex.pos[2]))
+                    {
+                        chunk.positions.push_back(vertex);
+                    }
+                    else
+                    {
+                        // Still counts as a vertex, or every index after it would be off by one
+                        chunk.positions.push_back(Vertex{});
+                        chunk.skippedLines++;
+                    }
+                }
+                else if (line[0] == 'f' && singleLetter)
+                {
+                    polygon.clear();
+                    bool valid = true;
+                    const char* q = line + 1;
+                    while (true)
+                    {
+                        q = SkipSpaces(q, last);
+                        if (q >= last)
+                        {
+                            break;
+                        }
+                        if (*q == '+')
+                        {
+                            q++;
+                        }
+                        int64_t index = 0;
+                        std::from_chars_result result = std::from_chars(q, last, index);
+                        if (result.ec != std::errc() || index == 0)
+                        {
+                            valid = false;
+                            break;
+                        }
+                        // Texture coordinate and normal indices aren't used
+                        q = result.ptr;
+                        while (q < last && !IsSpace(*q))
+                        {
+                            q++;
+                        }
+                        polygon.push_back(index);
+                    }
+                    if (!valid || polygon.size() < 3)
+                    {
+                        chunk.skippedLines++;
+                        continue;
+                    }
+
+                    const int64_t localCount = static_cast<int64_t>(chunk.positions.size());
+                    auto AddIndex = [&](int64_t index) {
+                        if (index > 0)
+                        {
+                            chunk.badIndex |= index > static_cast<int64_t>(UINT32_MAX);
+                            chunk.indices.push_back(static_cast<uint32_t>(index - 1));
+                        }
+                        else
+                        {
+                            chunk.relativeIndices.push_back(chunk.indices.size());
+                            chunk.indices.push_back(static_cast<uint32_t>(static_cast<int32_t>(localCount + index)));
+                        }
+                    };
+                    // Fan triangulation, fine for the convex polygons exporters write
+                    for (size_t i = 1; i + 1 < polygon.size(); i++)
+                    {
+                        AddIndex(polygon[0]);
+                        AddIndex(polygon[i]);
+                        AddIndex(polygon[i + 1]);
+                    }
+                }
+                else if ((line[0] == 'o' || line[0] == 'g') && singleLetter)
+                {
+                    const char* name = SkipSpaces(line + 1, last);
+                    chunk.groups.push_back({ std::string(name, last), chunk.indices.size(), line[0] == 'o' });
+                }
+                // vt, vn, s, usemtl, mtllib and friends carry nothing the renderer uses yet
+            }
+        }
+#pragma endregion
+
+#pragma region JSON
+        /*
+            Just enough JSON for glTF documents
+        */
+        struct JsonValue
+        {
+            enum Type { Null, Bool, Number, String, Array, Object };
+
+            Type type = Null;
+            bool boolean = false;
+            double number = 0.0;
+            std::string string;
+            std::vector<JsonValue> array;
+            std::vector<std::pair<std::string, JsonValue>> members;
+
+            const JsonValue* Find(const char* key) const
+            {
+                for (const auto& member : members)
+                {
+                    if (member.first == key)
+                    {
+                        return &member.second;
+                    }
+                }
+                return nullptr;
+            }
+
+            /*
+                Every integer glTF uses is a count, offset or index, so anything that isn't a whole number in
+                [0, 2^53] comes back as -1. Callers treat negative results as invalid.
+            */
+            int64_t AsInt() const
+            {
+                constexpr double MaxExactInteger = 9007199254740992.0;
+                // Written so NaN fails as well
+                if (type != Number || !(number >= 0.0 && number <= MaxExactInteger) || number != std::floor(number))
+                {
+                    return -1;
+                }
+                return static_cast<int64_t>(number);
+            }
+
+            // fallback when the key is missing, -1 when it holds anything but a valid integer
+            int64_t GetInt(const char* key, int64_t fallback) const
+            {
+                const JsonValue* value = Find(key);
+                return value != nullptr ? value->AsInt() : fallback;
+            }
+
+            std::string GetString(const char* key) const
+            {
+                const JsonValue* value = Find(key);
+                return value != nullptr && value->type == String ? value->string : std::string();
+            }
+
+            const std::vector<JsonValue>& GetArray(const char* key) const
+            {
+                static const std::vector<JsonValue> empty;
+                const JsonValue* value = Find(key);
+                return value != nullptr && value->type == Array ? value->array : empty;
+            }
+        };
+
+        class JsonParser
+        {
+        public:
+            JsonParser(const char* begin, const char* end) : p(begin), end(end) {}
+
+            bool Parse(JsonValue& value)
+            {
+                if (!ParseValue(value, 0))
+                {
+                    return false;
+                }
+                SkipWhitespace();
+                return p == end;
+            }
+
+        private:
+            static constexpr int MaxDepth = 256;
+
+            void SkipWhitespace()
+            {
+                while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+                {
+                    p++;
+                }
+            }
+
+            bool Match(const char* literal)
+            {
+                size_t length = strlen(literal);
+                if (static_cast<size_t>(end - p) < length || memcmp(p, literal, length) != 0)
+                {
+                    return false;
+                }
+                p += length;
+                return true;
+            }
+
+            static void AppendUtf8(std::string& out, uint32_t codepoint)
+            {
+                if (codepoint < 0x80)
+                {
+                    out += static_cast<char>(codepoint);
+                }
+                else if (codepoint < 0x800)
+                {
+                    out += static_cast<char>(0xC0 | (codepoint >> 6));
+                    out += static_cast<char>(0x80 | (codepoint & 0x3F));
+                }
+                else if (codepoint < 0x10000)
+                {
+                    out += static_cast<char>(0xE0 | (codepoint >> 12));
+                    out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+                    out += static_cast<char>(0x80 | (codepoint & 0x3F));
+                }
+                else
+                {
+                    out += static_cast<char>(0xF0 | (codepoint >> 18));
+                    out += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+                    out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+                    out += static_cast<char>(0x80 | (codepoint & 0x3F));
+                }
+            }
+
+            bool ParseHex4(uint32_t& value)
+            {
+                if (end - p < 4)
+                {
+                    return false;
+                }
+                std::from_chars_result result = std::from_chars(p, p + 4, value, 16);
+                if (result.ec != std::errc() || result.ptr != p + 4)
+                {
+                    return false;
+                }
+                p += 4;
+                return true;
+            }
+
+            bool ParseString(std::string& out)
+            {
+                // Opening quote has already been checked
+                p++;
+                while (p < end && *p != '"')
+                {
+                    if (*p != '\\')
+                    {
+                        out += *p++;
+                        continue;
+                    }
+                    if (++p >= end)
+                    {
+                        return false;
+                    }
+                    char escape = *p++;
+                    switch (escape)
+                    {
+                    case '"': out += '"'; break;
+                    case '\\': out += '\\'; break;
+                    case '/': out += '/'; break;
+                    case 'b': out += '\b'; break;
+                    case 'f': out += '\f'; break;
+                    case 'n': out += '\n'; break;
+                    case 'r': out += '\r'; break;
+                    case 't': out += '\t'; break;
+                    case 'u':
+                    {
+                        uint32_t codepoint;
+                        if (!ParseHex4(codepoint))
+                        {
+                            return false;
+                        }
+                        // Characters outside the BMP come as a surrogate pair, halves on their own aren't characters
+                        if (codepoint >= 0xDC00 && codepoint < 0xE000)
+                        {
+                            return false;
+                        }
+                        if (codepoint >= 0xD800 && codepoint < 0xDC00)
+                        {
+                            uint32_t low;
+                            if (!Match("\\u") || !ParseHex4(low) || low < 0xDC00 || low >= 0xE000)
+                            {
+                                return false;
+                            }
+                            codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                        }
+                        AppendUtf8(out, codepoint);
+                        break;
+                    }
+                    default:
+                        return false;
+                    }
+                }
+                if (p >= end)
+                {
+                    return false;
+                }
+                p++;
+                return true;
+            }
+
+            bool ParseValue(JsonValue& value, int depth)
+            {
+                if (depth > MaxDepth)
+                {
+                    return false;
+                }
+                SkipWhitespace();
+                if (p >= end)
+                {
+                    return false;
+                }
+
+                switch (*p)
+                {
+                case '{':
+                {
+                    value.type = JsonValue::Object;
+                    p++;
+                    SkipWhitespace();
+                    if (p < end && *p == '}')
+                    {
+                        p++;
+                        return true;
+                    }
+                    while (true)
+                    {
+                        SkipWhitespace();
+                        if (p >= end || *p != '"')
+                        {
+                            return false;
+                        }
+                        std::pair<std::string, JsonValue> member;
+                        if (!ParseString(member.first))
+                        {
+                            return false;
+                        }
+                        SkipWhitespace();
+                        if (p >= end || *p++ != ':' || !ParseValue(member.second, depth + 1))
+                        {
+                            return false;
+                        }
+                        value.members.push_back(std::move(member));
+                        SkipWhitespace();
+                        if (p < end && *p == ',')
+                        {
+                            p++;
+                            continue;
+                        }
+                        if (p < end && *p == '}')
+                        {
+                            p++;
+                            return true;
+                        }
+                        return false;
+                    }
+                }
+                case '[':
+                {
+                    value.type = JsonValue::Array;
+                    p++;
+                    SkipWhitespace();
+                    if (p < end && *p == ']')
+                    {
+                        p++;
+                        return true;
+                    }
+                    while (true)
+                    {
+                        value.array.emplace_back();
+                        if (!ParseValue(value.array.back(), depth + 1))
+                        {
+                            return false;
+                        }
+                        SkipWhitespace();
+                        if (p < end && *p == ',')
+                        {
+                            p++;
+                            continue;
+                        }
+                        if (p < end && *p == ']')
+                        {
+                            p++;
+                            return true;
+                        }
+                        return false;
+                    }
+                }
+                case '"':
+                    value.type = JsonValue::String;
+                    return ParseString(value.string);
+                case 't':
+                    value.type = JsonValue::Bool;
+                    value.boolean = true;
+                    return Match("true");
+                case 'f':
+                    value.type = JsonValue::Bool;
+                    return Match("false");
+                case 'n':
+                    return Match("null");
+                default:
+                {
+                    value.type = JsonValue::Number;
+                    std::from_chars_result result = std::from_chars(p, end, value.number);
+                    if (result.ec != std::errc())
+                    {
+                        return false;
+                    }
+                    p = result.ptr;
+                    return true;
+                }
+                }
+            }
+
+            const char* p;
+            const char* end;
+        };
+#pragma endregion
+
+#pragma region glTF
+        constexpr uint32_t GlbMagic = 0x46546C67; // "glTF"
+        constexpr uint32_t GlbChunkJson = 0x4E4F534A;
+        constexpr uint32_t GlbChunkBin = 0x004E4942;
+
+        constexpr int64_t ComponentUnsignedByte = 5121;
+        constexpr int64_t ComponentUnsignedShort = 5123;
+        constexpr int64_t ComponentUnsignedInt = 5125;
+        constexpr int64_t ComponentFloat = 5126;
+        constexpr int64_t ModeTriangles = 4;
+
+        // Column major like glTF
+        struct Matrix4
+        {
+            float m[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+
+            Matrix4 operator*(const Matrix4& other) const
+            {
+                Matrix4 result;
+                for (int column = 0; column < 4; column++)
+                {
+                    for (int row = 0; row < 4; row++)
+                    {
+                        float sum = 0.0f;
+                        for (int k = 0; k < 4; k++)
+                        {
+                            sum += m[k * 4 + row] * other.m[column * 4 + k];
+                        }
+                        result.m[column * 4 + row] = sum;
+                    }
+                }
+                return result;
+            }
+
+            bool IsIdentity() const
+            {
+                static const Matrix4 identity;
+                return memcmp(m, identity.m, sizeof(m)) == 0;
+            }
+        };
+
+        struct GltfDocument
+        {
+            JsonValue json;
+            std::vector<std::vector<uint8_t>> buffers;
+        };
+
+        // One node that references a mesh, with its world transform
+        struct GltfInstance
+        {
+            int64_t node;
+            int64_t mesh;
+            Matrix4 transform;
+        };
+
+        bool DecodeBase64(const char* p, const char* end, std::vector<uint8_t>& out)
+        {
+            auto Decode = [](char c) -> int {
+                if (c >= 'A' && c <= 'Z') return c - 'A';
+                if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+                if (c >= '0' && c <= '9') return c - '0' + 52;
+                if (c == '+' || c == '-') return 62;
+                if (c == '/' || c == '_') return 63;
+                return -1;
+            };
+
+            out.reserve((end - p) / 4 * 3);
+            uint32_t bits = 0;
+            int bitCount = 0;
+            for (; p < end && *p != '='; p++)
+            {
+                int value = Decode(*p);
+                if (value < 0)
+                {
+                    return false;
+                }
+                bits = (bits << 6) | static_cast<uint32_t>(value);
+                bitCount += 6;
+                if (bitCount >= 8)
+                {
+                    bitCount -= 8;
+                    out.push_back(static_cast<uint8_t>(bits >> bitCount));
+                }
+            }
+            return true;
+        }
+
+        std::string DecodeUri(const std::string& uri)
+        {
+            std::string out;
+            for (size_t i = 0; i < uri.size(); i++)
+            {
+                unsigned int value;
+                if (uri[i] == '%' && i + 2 < uri.size() &&
+                    std::from_chars(uri.data() + i + 1, uri.data() + i + 3, value, 16).ec == std::errc())
+                {
+                    out += static_cast<char>(value);
+                    i += 2;
+                }
+                else
+                {
+                    out += uri[i];
+                }
+            }
+            return out;
+        }
+
+        bool LoadGltfBuffers(const std::string& path, std::vector<uint8_t>* glbBinary, GltfDocument& document)
+        {
+            const std::vector<JsonValue>& buffers = document.json.GetArray("buffers");
+            document.buffers.resize(buffers.size());
+            for (size_t i = 0; i < buffers.size(); i++)
+            {
+                std::vector<uint8_t>& data = document.buffers[i];
+                const std::string uri = buffers[i].GetString("uri");
+                if (uri.empty())
+                {
+                    // Only the first buffer of a .glb may live in the binary chunk
+                    if (i != 0 || glbBinary == nullptr)
+                    {
+                        fprintf(stderr, "[mesh loader] Buffer %zu of %s has no uri\n", i, path.c_str());
+                        return false;
+                    }
+                    data = std::move(*glbBinary);
+                }
+                else if (uri.compare(0, 5, "data:") == 0)
+                {
+                    size_t comma = uri.find(',');
+                    if (comma == std::string::npos || uri.find(";base64") > comma ||
+                        !DecodeBase64(uri.data() + comma + 1, uri.data() + uri.size(), data))
+                    {
+                        fprintf(stderr, "[mesh loader] Buffer %zu of %s has a data uri that isn't base64\n", i, path.c_str());
+                        return false;
+                    }
+                }
+                else
+                {
+                    std::filesystem::path bufferPath = std::filesystem::path(path).parent_path() / DecodeUri(uri);
+                    std::vector<char> file;
+                    if (!ReadFile(bufferPath.string(), file))
+                    {
+                        fprintf(stderr, "[mesh loader] Couldn't read %s\n", bufferPath.string().c_str());
+                        return false;
+                    }
+                    data.assign(file.begin(), file.end());
+                }
+
+                const int64_t byteLength = buffers[i].GetInt("byteLength", 0);
+                if (byteLength < 0 || data.size() < static_cast<uint64_t>(byteLength))
+                {
+                    fprintf(stderr, "[mesh loader] Buffer %zu of %s is shorter than its byteLength\n", i, path.c_str());
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /*
+            Resolves an accessor to a pointer to its first element and the stride between elements,
+            after checking that every element lies inside its buffer
+        */
+        bool GetAccessorData(const GltfDocument& document, int64_t accessorIndex, int64_t componentType,
+            const char* type, uint32_t elementSize, const uint8_t*& data, size_t& stride, size_t& count)
+        {
+            const std::vector<JsonValue>& accessors = document.json.GetArray("accessors");
+            if (accessorIndex < 0 || accessorIndex >= static_cast<int64_t>(accessors.size()))
+            {
+                return false;
+            }
+            const JsonValue& accessor = accessors[accessorIndex];
+            if (accessor.GetInt("componentType", 0) != componentType || accessor.GetString("type") != type ||
+                accessor.Find("sparse") != nullptr)
+            {
+                return false;
+            }
+
+            const std::vector<JsonValue>& bufferViews = document.json.GetArray("bufferViews");
+            const int64_t viewIndex = accessor.GetInt("bufferView", -1);
+            if (viewIndex < 0 || viewIndex >= static_cast<int64_t>(bufferViews.size()))
+            {
+                return false;
+            }
+            const JsonValue& view = bufferViews[viewIndex];
+            const int64_t bufferIndex = view.GetInt("buffer", -1);
+            if (bufferIndex < 0 || bufferIndex >= static_cast<int64_t>(document.buffers.size()))
+            {
+                return false;
+            }
+            const std::vector<uint8_t>& buffer = document.buffers[bufferIndex];
+
+            const int64_t viewOffsetValue = view.GetInt("byteOffset", 0);
+            const int64_t viewLengthValue = view.GetInt("byteLength", 0);
+            const int64_t accessorOffsetValue = accessor.GetInt("byteOffset", 0);
+            const int64_t countValue = accessor.GetInt("count", 0);
+            const int64_t strideValue = view.GetInt("byteStride", 0);
+            if (viewOffsetValue < 0 || viewLengthValue < 0 || accessorOffsetValue < 0 || countValue < 0 || strideValue < 0)
+            {
+                return false;
+            }
+            const uint64_t viewOffset = static_cast<uint64_t>(viewOffsetValue);
+            const uint64_t viewLength = static_cast<uint64_t>(viewLengthValue);
+            const uint64_t accessorOffset = static_cast<uint64_t>(accessorOffsetValue);
+            const uint64_t elementCount = static_cast<uint64_t>(countValue);
+            const uint64_t elementStride = strideValue == 0 ? elementSize : static_cast<uint64_t>(strideValue);
+
+            // The values come straight from the file, so every bound is checked in a form that can't wrap
+            const uint64_t bufferSize = buffer.size();
+            if (viewOffset > bufferSize || viewLength > bufferSize - viewOffset || elementStride < elementSize)
+            {
+                return false;
+            }
+            if (elementCount > 0)
+            {
+                if (accessorOffset > viewLength || elementSize > viewLength - accessorOffset)
+                {
+                    return false;
+                }
+                if (elementCount - 1 > (viewLength - accessorOffset - elementSize) / elementStride)
+                {
+                    return false;
+                }
+            }
+            count = static_cast<size_t>(elementCount);
+            stride = static_cast<size_t>(elementStride);
+            data = buffer.data() + viewOffset + accessorOffset;
+            return true;
+        }
+
+        bool ReadPositions(const GltfDocument& document, int64_t accessor, const Matrix4& transform,
+            std::vector<Vertex>& vertices)
+        {
+            const uint8_t* data;
+            size_t stride, count;
+            if (!GetAccessorData(document, accessor, ComponentFloat, "VEC3", sizeof(float) * 3, data, stride, count))
+            {
+                return false;
+            }
+
+            const size_t first = vertices.size();
+            vertices.resize(first + count);
+            const bool identity = transform.IsIdentity();
+            const float* m = transform.m;
+            for (size_t i = 0; i < count; i++)
+            {
+                float p[3];
+                memcpy(p, data + i * stride, sizeof(p));
+                Vertex& vertex = vertices[first + i];
+                if (identity)
+                {
+                    memcpy(vertex.pos, p, sizeof(p));
+                    continue;
+                }
+                for (int row = 0; row < 3; row++)
+                {
+                    vertex.pos[row] = m[row] * p[0] + m[4 + row] * p[1] + m[8 + row] * p[2] + m[12 + row];
+                }
+            }
+            return true;
+        }
+
+        bool ReadIndices(const GltfDocument& document, int64_t accessor, uint32_t vertexOffset, uint32_t vertexCount,
+            std::vector<uint32_t>& indices)
+        {
+            const JsonValue* accessorJson = nullptr;
+            const std::vector<JsonValue>& accessors = document.json.GetArray("accessors");
+            if (accessor >= 0 && accessor < static_cast<int64_t>(accessors.size()))
+            {
+                accessorJson = &accessors[accessor];
+            }
+            if (accessorJson == nullptr)
+            {
+                return false;
+            }
+
+            const int64_t componentType = accessorJson->GetInt("componentType", 0);
+            uint32_t componentSize = 4;
+            if (componentType == ComponentUnsignedByte)
+            {
+                componentSize = 1;
+            }
+            else if (componentType == ComponentUnsignedShort)
+            {
+                componentSize = 2;
+            }
+            else if (componentType != ComponentUnsignedInt)
+            {
+                return false;
+            }
+
+            const uint8_t* data;
+            size_t stride, count;
+            if (!GetAccessorData(document, accessor, componentType, "SCALAR", componentSize, data, stride, count))
+            {
+                return false;
+            }
+
+            count -= count % 3;
+            const size_t first = indices.size();
+            indices.resize(first + count);
+            for (size_t i = 0; i < count; i++)
+            {
+                const uint8_t* element = data + i * stride;
+                uint32_t index;
+                if (componentSize == 1)
+                {
+                    index = *element;
+                }
+                else if (componentSize == 2)
+                {
+                    uint16_t value;
+                    memcpy(&value, element, sizeof(value));
+                    index = value;
+                }
+                else
+                {
+                    memcpy(&index, element, sizeof(index));
+                }
+                if (index >= vertexCount)
+                {
+                    indices.resize(first);
+                    return false;
+                }
+                indices[first + i] = vertexOffset + index;
+            }
+            return true;
+        }
+
+        Matrix4 GetLocalTransform(const JsonValue& node)
+        {
+            Matrix4 local;
+            const std::vector<JsonValue>& matrix = node.GetArray("matrix");
+            if (matrix.size() == 16)
+            {
+                for (int i = 0; i < 16; i++)
+                {
+                    local.m[i] = static_cast<float>(matrix[i].number);
+                }
+                return local;
+            }
+
+            float t[3] = { 0, 0, 0 }, r[4] = { 0, 0, 0, 1 }, s[3] = { 1, 1, 1 };
+            const std::vector<JsonValue>& translation = node.GetArray("translation");
+            const std::vector<JsonValue>& rotation = node.GetArray("rotation");
+            const std::vector<JsonValue>& scale = node.GetArray("scale");
+            for (size_t i = 0; i < 3 && translation.size() == 3; i++) t[i] = static_cast<float>(translation[i].number);
+            for (size_t i = 0; i < 4 && rotation.size() == 4; i++) r[i] = static_cast<float>(rotation[i].number);
+            for (size_t i = 0; i < 3 && scale.size() == 3; i++) s[i] = static_cast<float>(scale[i].number);
+
+            // T * R * S with the rotation quaternion stored as x, y, z, w
+            const float x = r[0], y = r[1], z = r[2], w = r[3];
+            const float rotationMatrix[9] = {
+                1 - 2 * (y * y + z * z), 2 * (x * y + z * w), 2 * (x * z - y * w),
+                2 * (x * y - z * w), 1 - 2 * (x * x + z * z), 2 * (y * z + x * w),
+                2 * (x * z + y * w), 2 * (y * z - x * w), 1 - 2 * (x * x + y * y) };
+            for (int column = 0; column < 3; column++)
+            {
+                for (int row = 0; row < 3; row++)
+                {
+                    local.m[column * 4 + row] = rotationMatrix[column * 3 + row] * s[column];
+                }
+            }
+            local.m[12] = t[0];
+            local.m[13] = t[1];
+            local.m[14] = t[2];
+            return local;
+        }
+
+        void CollectInstances(const JsonValue& json, std::vector<GltfInstance>& instances)
+        {
+            const std::vector<JsonValue>& nodes = json.GetArray("nodes");
+            const std::vector<JsonValue>& scenes = json.GetArray("scenes");
+
+            std::vector<int64_t> roots;
+            if (!scenes.empty())
+            {
+                int64_t sceneIndex = json.GetInt("scene", 0);
+                if (sceneIndex < 0 || sceneIndex >= static_cast<int64_t>(scenes.size()))
+                {
+                    sceneIndex = 0;
+                }
+                for (const JsonValue& root : scenes[sceneIndex].GetArray("nodes"))
+                {
+                    roots.push_back(root.AsInt());
+                }
+            }
+            else
+            {
+                // No scene, every node that isn't somebody's child is a root
+                std::vector<bool> isChild(nodes.size(), false);
+                for (const JsonValue& node : nodes)
+                {
+                    for (const JsonValue& child : node.GetArray("children"))
+                    {
+                        int64_t index = child.AsInt();
+                        if (index >= 0 && index < static_cast<int64_t>(nodes.size()))
+                        {
+                            isChild[index] = true;
+                        }
+                    }
+                }
+                for (size_t i = 0; i < nodes.size(); i++)
+                {
+                    if (!isChild[i])
+                    {
+                        roots.push_back(static_cast<int64_t>(i));
+                    }
+                }
+            }
+
+            // Node hierarchies are trees, the visit count only guards against broken files with cycles
+            std::vector<std::pair<int64_t, Matrix4>> stack;
+            for (auto it = roots.rbegin(); it != roots.rend(); ++it)
+            {
+                stack.push_back({ *it, Matrix4() });
+            }
+            size_t visits = 0;
+            while (!stack.empty() && visits++ <= nodes.size() * 4)
+            {
+                auto [nodeIndex, parent] = stack.back();
+                stack.pop_back();
+                if (nodeIndex < 0 || nodeIndex >= static_cast<int64_t>(nodes.size()))
+                {
+                    continue;
+                }
+                const JsonValue& node = nodes[nodeIndex];
+                const Matrix4 world = parent * GetLocalTransform(node);
+                const int64_t mesh = node.GetInt("mesh", -1);
+                if (mesh >= 0)
+                {
+                    instances.push_back({ nodeIndex, mesh, world });
+                }
+                // Reversed so children come out of the stack in file order
+                const std::vector<JsonValue>& children = node.GetArray("children");
+                for (auto it = children.rbegin(); it != children.rend(); ++it)
+                {
+                    stack.push_back({ it->AsInt(), world });
+                }
+            }
+        }
+#pragma endregion
+    }
+
+    bool LoadOBJ(const std::string& path, std::vector<MeshData>& meshes, MeshLoadStats* stats)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<char> data;
+        if (!ReadFile(path, data))
+        {
+            fprintf(stderr, "[mesh loader] Couldn't read %s\n", path.c_str());
+            return false;
+        }
+
+        // Chunks end right after a line break so no line is split between two tasks. A few chunks per
+        // thread keep the workers busy when some parts of the file are denser than others.
+        TaskSystem& tasks = GetTaskSystem();
+        const size_t minChunkSize = 1 << 20;
+        const size_t chunkCount = std::max<size_t>(1,
+            std::min<size_t>(static_cast<size_t>(tasks.GetThreadCount()) * 4, data.size() / minChunkSize));
+        std::vector<std::pair<size_t, size_t>> ranges;
+        size_t begin = 0;
+        for (size_t i = 0; i < chunkCount && begin < data.size(); i++)
+        {
+            size_t end = data.size();
+            if (i + 1 < chunkCount)
+            {
+                end = std::max(begin, data.size() / chunkCount * (i + 1));
+                const void* lineBreak = memchr(data.data() + end, '\n', data.size() - end);
+                end = lineBreak != nullptr ? static_cast<const char*>(lineBreak) - data.data() + 1 : data.size();
+            }
+            ranges.push_back({ begin, end });
+            begin = end;
+        }
+
+        const uint64_t fileBytes = data.size();
+        std::vector<ObjChunk> chunks(ranges.size());
+        tasks.ParallelFor(static_cast<uint32_t>(ranges.size()), [&](uint32_t i) {
+            ParseObjChunk(data.data() + ranges[i].first, data.data() + ranges[i].second, chunks[i]);
+        });
+        data = std::vector<char>();
+
+        // Where every chunk's vertices and indices start in the whole file
+        std::vector<size_t> vertexBase(chunks.size());
+        std::vector<size_t> indexBase(chunks.size());
+        size_t vertexCount = 0;
+        size_t indexCount = 0;
+        bool hasObjects = false;
+        uint32_t skippedLines = 0;
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            vertexBase[i] = vertexCount;
+            indexBase[i] = indexCount;
+            vertexCount += chunks[i].positions.size();
+            indexCount += chunks[i].indices.size();
+            skippedLines += chunks[i].skippedLines;
+            for (const ObjGroup& group : chunks[i].groups)
+            {
+                hasObjects |= group.isObject;
+            }
+        }
+        if (vertexCount > UINT32_MAX)
+        {
+            fprintf(stderr, "[mesh loader] %s has more vertices than 32 bit indices can address\n", path.c_str());
+            return false;
+        }
+
+        std::vector<Vertex> positions(vertexCount);
+        std::vector<uint32_t> faceIndices(indexCount);
+        std::atomic<bool> badIndex{ false };
+        tasks.ParallelFor(static_cast<uint32_t>(chunks.size()), [&](uint32_t i) {
+            ObjChunk& chunk = chunks[i];
+            for (size_t relative : chunk.relativeIndices)
+            {
+                int64_t index = static_cast<int64_t>(vertexBase[i]) + static_cast<int32_t>(chunk.indices[relative]);
+                chunk.indices[relative] = index < 0 ? UINT32_MAX : static_cast<uint32_t>(index);
+            }
+            bool outOfRange = chunk.badIndex;
+            for (uint32_t index : chunk.indices)
+            {
+                outOfRange |= index >= vertexCount;
+            }
+            if (outOfRange)
+            {
+                badIndex = true;
+            }
+            std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + vertexBase[i]);
+            std::copy(chunk.indices.begin(), chunk.indices.end(), faceIndices.begin() + indexBase[i]);
+            chunk.positions = std::vector<Vertex>();
+            chunk.indices = std::vector<uint32_t>();
+        });
+        if (badIndex)
+        {
+            fprintf(stderr, "[mesh loader] %s references vertices that don't exist\n", path.c_str());
+            return false;
+        }
+
+        // Split the faces up into meshes, starting with an unnamed one for faces before the first statement
+        std::vector<ObjGroup> groups = { { std::filesystem::path(path).stem().string(), 0, hasObjects } };
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            for (ObjGroup& group : chunks[i].groups)
+            {
+                if (group.isObject == hasObjects)
+                {
+                    group.firstIndex += indexBase[i];
+                    groups.push_back(std::move(group));
+                }
+            }
+        }
+        std::vector<std::pair<size_t, size_t>> meshRanges;
+        std::vector<std::string> meshNames;
+        for (size_t i = 0; i < groups.size(); i++)
+        {
+            size_t first = groups[i].firstIndex;
+            size_t last = i + 1 < groups.size() ? groups[i + 1].firstIndex : indexCount;
+            if (last > first)
+            {
+                meshRanges.push_back({ first, last });
+                meshNames.push_back(groups[i].name);
+            }
+        }
+
+        if (meshRanges.size() == 1)
+        {
+            // Everything is one mesh, which is the common case for big scans, so no need to remap anything
+            MeshData mesh;
+            mesh.name = meshNames[0];
+            mesh.vertices = std::move(positions);
+            mesh.indices = std::move(faceIndices);
+            meshes.push_back(std::move(mesh));
+        }
+        else
+        {
+            // Every mesh gets its own compact vertex array. remapOwner says which mesh the entry in remap
+            // belongs to, so the array never has to be cleared between meshes.
+            std::vector<uint32_t> remap(vertexCount);
+            std::vector<uint32_t> remapOwner(vertexCount, UINT32_MAX);
+            for (size_t m = 0; m < meshRanges.size(); m++)
+            {
+                MeshData mesh;
+                mesh.name = meshNames[m];
+                mesh.indices.reserve(meshRanges[m].second - meshRanges[m].first);
+                for (size_t i = meshRanges[m].first; i < meshRanges[m].second; i++)
+                {
+                    uint32_t index = faceIndices[i];
+                    if (remapOwner[index] != m)
+                    {
+                        remapOwner[index] = static_cast<uint32_t>(m);
+                        remap[index] = static_cast<uint32_t>(mesh.vertices.size());
+                        mesh.vertices.push_back(positions[index]);
+                    }
+                    mesh.indices.push_back(remap[index]);
+                }
+                meshes.push_back(std::move(mesh));
+            }
+        }
+
+        if (skippedLines > 0)
+        {
+            fprintf(stderr, "[mesh loader] Skipped %u malformed lines in %s\n", skippedLines, path.c_str());
+        }
+        if (stats != nullptr)
+        {
+            stats->parseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            stats->fileBytes = fileBytes;
+            stats->threadCount = tasks.GetThreadCount();
+            stats->skippedCount = skippedLines;
+        }
+        return true;
+    }
+
+    bool LoadGLTF(const std::string& path, std::vector<MeshData>& meshes, MeshLoadStats* stats)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<char> file;
+        if (!ReadFile(path, file))
+        {
+            fprintf(stderr, "[mesh loader] Couldn't read %s\n", path.c_str());
+            return false;
+        }
+
+        const char* jsonBegin = file.data();
+        const char* jsonEnd = file.data() + file.size();
+        std::vector<uint8_t> glbBinary;
+        bool isGlb = false;
+
+        uint32_t magic = 0;
+        if (file.size() >= 12)
+        {
+            memcpy(&magic, file.data(), sizeof(magic));
+        }
+        if (magic == GlbMagic)
+        {
+            // 12 byte header followed by a JSON chunk and an optional binary chunk
+            isGlb = true;
+            uint32_t version;
+            memcpy(&version, file.data() + 4, sizeof(version));
+            if (version != 2)
+            {
+                fprintf(stderr, "[mesh loader] %s is glTF version %u, only 2 is supported\n", path.c_str(), version);
+                return false;
+            }
+
+            size_t offset = 12;
+            bool hasJson = false;
+            while (offset + 8 <= file.size())
+            {
+                uint32_t chunkLength, chunkType;
+                memcpy(&chunkLength, file.data() + offset, sizeof(chunkLength));
+                memcpy(&chunkType, file.data() + offset + 4, sizeof(chunkType));
+                offset += 8;
+                if (chunkLength > file.size() - offset)
+                {
+                    fprintf(stderr, "[mesh loader] %s has a truncated chunk\n", path.c_str());
+                    return false;
+                }
+                if (chunkType == GlbChunkJson && !hasJson)
+                {
+                    jsonBegin = file.data() + offset;
+                    jsonEnd = jsonBegin + chunkLength;
+                    hasJson = true;
+                }
+                else if (chunkType == GlbChunkBin && glbBinary.empty())
+                {
+                    glbBinary.assign(file.data() + offset, file.data() + offset + chunkLength);
+                }
+                offset += (chunkLength + 3) & ~3u;
+            }
+            if (!hasJson)
+            {
+                fprintf(stderr, "[mesh loader] %s has no JSON chunk\n", path.c_str());
+                return false;
+            }
+        }
+
+        GltfDocument document;
+        JsonParser parser(jsonBegin, jsonEnd);
+        if (!parser.Parse(document.json) || document.json.type != JsonValue::Object)
+        {
+            fprintf(stderr, "[mesh loader] %s isn't valid JSON\n", path.c_str());
+            return false;
+        }
+        const JsonValue* asset = document.json.Find("asset");
+        if (asset == nullptr || asset->GetString("version").compare(0, 1, "2") != 0)
+        {
+            fprintf(stderr, "[mesh loader] %s isn't glTF 2.0\n", path.c_str());
+            return false;
+        }
+        if (!LoadGltfBuffers(path, isGlb ? &glbBinary : nullptr, document))
+        {
+            return false;
+        }
+        uint64_t fileBytes = static_cast<uint64_t>(jsonEnd - jsonBegin);
+        for (const std::vector<uint8_t>& buffer : document.buffers)
+        {
+            fileBytes += buffer.size();
+        }
+        file = std::vector<char>();
+
+        std::vector<GltfInstance> instances;
+        CollectInstances(document.json, instances);
+
+        // Every instance is independent, so each one is read on its own task
+        const std::vector<JsonValue>& gltfMeshes = document.json.GetArray("meshes");
+        const std::vector<JsonValue>& nodes = document.json.GetArray("nodes");
+        std::vector<MeshData> loaded(instances.size());
+        std::atomic<uint32_t> skippedPrimitives{ 0 };
+        GetTaskSystem().ParallelFor(static_cast<uint32_t>(instances.size()), [&](uint32_t i) {
+            const GltfInstance& instance = instances[i];
+            if (instance.mesh >= static_cast<int64_t>(gltfMeshes.size()))
+            {
+                skippedPrimitives++;
+                return;
+            }
+            const JsonValue& gltfMesh = gltfMeshes[instance.mesh];
+            MeshData& mesh = loaded[i];
+            mesh.name = gltfMesh.GetString("name");
+            if (mesh.name.empty())
+            {
+                mesh.name = nodes[instance.node].GetString("name");
+            }
+            if (mesh.name.empty())
+            {
+                mesh.name = "mesh_" + std::to_string(instance.mesh);
+            }
+
+            for (const JsonValue& primitive : gltfMesh.GetArray("primitives"))
+            {
+                const JsonValue* attributes = primitive.Find("attributes");
+                const JsonValue* extensions = primitive.Find("extensions");
+                if (primitive.GetInt("mode", ModeTriangles) != ModeTriangles || attributes == nullptr ||
+                    (extensions != nullptr && extensions->Find("KHR_draco_mesh_compression") != nullptr))
+                {
+                    skippedPrimitives++;
+                    continue;
+                }
+
+                const uint32_t vertexOffset = static_cast<uint32_t>(mesh.vertices.size());
+                if (!ReadPositions(document, attributes->GetInt("POSITION", -1), instance.transform, mesh.vertices))
+                {
+                    skippedPrimitives++;
+                    continue;
+                }
+                const uint32_t vertexCount = static_cast<uint32_t>(mesh.vertices.size()) - vertexOffset;
+
+                const int64_t indices = primitive.GetInt("indices", -1);
+                if (indices < 0)
+                {
+                    // Non indexed, every three vertices are a triangle
+                    for (uint32_t v = 0; v + 2 < vertexCount; v += 3)
+                    {
+                        mesh.indices.push_back(vertexOffset + v);
+                        mesh.indices.push_back(vertexOffset + v + 1);
+                        mesh.indices.push_back(vertexOffset + v + 2);
+                    }
+                }
+                else if (!ReadIndices(document, indices, vertexOffset, vertexCount, mesh.indices))
+                {
+                    mesh.vertices.resize(vertexOffset);
+                    skippedPrimitives++;
+                }
+            }
+        });
+
+        for (MeshData& mesh : loaded)
+        {
+            if (!mesh.indices.empty())
+            {
+                meshes.push_back(std::move(mesh));
+            }
+        }
+
+        if (skippedPrimitives > 0)
+        {
+            fprintf(stderr, "[mesh loader] Skipped %u unsupported primitives in %s\n",
+                skippedPrimitives.load(), path.c_str());
+        }
+        if (stats != nullptr)
+        {
+            stats->parseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            stats->fileBytes = fileBytes;
+            stats->threadCount = GetTaskSystem().GetThreadCount();
+            stats->skippedCount = skippedPrimitives;
+        }
+        return true;
+    }
+
+    bool LoadMeshFile(const std::string& path, std::vector<MeshData>& meshes, MeshLoadStats* stats)
+    {
+        const std::string extension = GetLowerExtension(path);
+        if (extension == ".obj")
+        {
+            return LoadOBJ(path, meshes, stats);
+        }
+        if (extension == ".gltf" || extension == ".glb")
+        {
+            return LoadGLTF(path, meshes, stats);
+        }
+        fprintf(stderr, "[mesh loader] Don't know how to load %s\n", path.c_str());
+        return false;
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Vertex.h"
+
+// Kept free of Vulkan like Vertex.h, the CPU backend loads the same files
+namespace PBEngine
+{
+    /*
+        Triangle geometry of a single mesh, ready to be copied into a vertex and index buffer.
+        Every mesh becomes its own bottom level acceleration structure.
+    */
+    struct MeshData
+    {
+        std::string name;
+        std::vector<Vertex> vertices;
+        // Three indices per triangle into vertices
+        std::vector<uint32_t> indices;
+
+        uint32_t GetTriangleCount() const { return static_cast<uint32_t>(indices.size() / 3); }
+    };
+
+    struct MeshLoadStats
+    {
+        // Reading the file and turning it into vertex and index streams
+        double parseSeconds = 0.0;
+        uint64_t fileBytes = 0;
+        uint32_t threadCount = 1;
+        // Lines or primitives that couldn't be used and were skipped
+        uint32_t skippedCount = 0;
+    };
+
+    /**
+     * @brief Loads a Wavefront OBJ file. The file is split into chunks at line boundaries that are parsed
+     * on the task system, which is what makes multi gigabyte files bearable.
+     * Every "o" statement starts a new mesh, files without any use their "g" statements instead.
+     * Only positions are kept, polygons are triangulated as fans.
+     * @return false when the file can't be read or references vertices that don't exist
+     */
+    bool LoadOBJ(const std::string& path, std::vector<MeshData>& meshes, MeshLoadStats* stats = nullptr);
+
+    /**
+     * @brief Loads the triangle primitives of a glTF 2.0 file, either .gltf with external or embedded
+     * buffers or binary .glb. Each node that references a mesh produces one MeshData with the node's
+     * world transform baked into the positions. Only float positions are supported, primitives
+     * with other modes or compressed data are skipped.
+     * @return false when the file can't be read or isn't valid glTF 2.0
+     */
+    bool LoadGLTF(const std::string& path, std::vector<MeshData>& meshes, MeshLoadStats* stats = nullptr);
+
+    /**
+     * @brief Picks LoadOBJ or LoadGLTF from the file extension
+     */
+    bool LoadMeshFile(const std::string& path, std::vector<MeshData>& meshes, MeshLoadStats* stats = nullptr);
+}
@@ -0,0 +1,235 @@
+#include "SceneFile.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+namespace PBEngine
+{
+    namespace
+    {
+        uint64_t AlignUp(uint64_t value, uint64_t alignment)
+        {
+            return (value + alignment - 1) / alignment * alignment;
+        }
+
+        // The count comes from the file too, so it's bounded by the file size before it's multiplied
+        bool SectionIsValid(const SceneFileSection& section, uint64_t count, uint64_t elementSize, uint64_t fileSize)
+        {
+            return count <= fileSize / elementSize && section.size == count * elementSize &&
+                section.offset % SceneFileAlignment == 0 && section.offset <= fileSize &&
+                section.size <= fileSize - section.offset;
+        }
+
+        // Same as first + count <= total without the wrap around
+        bool RangeIsValid(uint64_t first, uint64_t count, uint64_t total)
+        {
+            return first <= total && count <= total - first;
+        }
+    }
+
+    bool SceneFile::Open(const std::string& path)
+    {
+        Close();
+        if (!file.Open(path))
+        {
+            std::cerr << "Failed to map scene file " << path << std::endl;
+            return false;
+        }
+
+        const uint64_t fileSize = file.GetSize();
+        const SceneFileHeader* fileHeader = reinterpret_cast<const SceneFileHeader*>(file.GetData());
+        if (fileSize < sizeof(SceneFileHeader) || fileHeader->magic != SceneFileMagic)
+        {
+            std::cerr << path << " is not a scene file" << std::endl;
+            Close();
+            return false;
+        }
+        if (fileHeader->version != SceneFileVersion)
+        {
+            std::cerr << path << " is scene file version " << fileHeader->version << ", expected "
+                << SceneFileVersion << ". Convert the source file again" << std::endl;
+            Close();
+            return false;
+        }
+
+        // The vertex pages stay untouched here, but the indices are read once so no backend gets handed
+        // one that points past its mesh's vertices
+        bool valid = fileHeader->fileSize == fileSize &&
+            SectionIsValid(fileHeader->meshes, fileHeader->meshCount, sizeof(SceneFileMesh), fileSize) &&
+            SectionIsValid(fileHeader->names, fileHeader->names.size, 1, fileSize) &&
+            SectionIsValid(fileHeader->vertices, fileHeader->vertexCount, sizeof(Vertex), fileSize) &&
+            SectionIsValid(fileHeader->indices, fileHeader->indexCount, sizeof(uint32_t), fileSize) &&
+            SectionIsValid(fileHeader->instances, fileHeader->instanceCount, sizeof(SceneFileInstance), fileSize) &&
+            SectionIsValid(fileHeader->bvhNodes, fileHeader->bvhNodeCount, sizeof(BVHNode), fileSize) &&
+            SectionIsValid(fileHeader->bvhPrimitiveIndices, fileHeader->bvhTriangleCount, sizeof(uint32_t), fileSize);
+
+        header = fileHeader;
+        for (uint32_t i = 0; valid && i < header->meshCount; i++)
+        {
+            const SceneFileMesh& mesh = GetMesh(i);
+            valid = RangeIsValid(mesh.firstVertex, mesh.vertexCount, header->vertexCount) &&
+                RangeIsValid(mesh.firstIndex, mesh.indexCount, header->indexCount) &&
+                mesh.indexCount % 3 == 0 &&
+                RangeIsValid(mesh.nameOffset, mesh.nameLength, header->names.size);
+
+            const uint32_t* indices = valid ? GetIndices(i) : nullptr;
+            for (uint32_t index = 0; valid && index < mesh.indexCount; index++)
+            {
+                valid = indices[index] < mesh.vertexCount;
+            }
+        }
+        for (uint32_t i = 0; valid && i < header->instanceCount; i++)
+        {
+            valid = GetInstance(i).mesh < header->meshCount;
+        }
+
+        if (!valid)
+        {
+            std::cerr << path << " is truncated or corrupted" << std::endl;
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    std::string_view SceneFile::GetMeshName(uint32_t mesh) const
+    {
+        const SceneFileMesh& entry = GetMesh(mesh);
+        return std::string_view(Section<char>(header->names) + entry.nameOffset, entry.nameLength);
+    }
+
+    const Vertex* SceneFile::GetVertices(uint32_t mesh) const
+    {
+        return Section<Vertex>(header->vertices) + GetMesh(mesh).firstVertex;
+    }
+
+    const uint32_t* SceneFile::GetIndices(uint32_t mesh) const
+    {
+        return Section<uint32_t>(header->indices) + GetMesh(mesh).firstIndex;
+    }
+
+    bool WriteSceneFile(const std::string& path, const std::vector<MeshData>& meshes, const BVH* bvh)
+    {
+        SceneFileHeader header = {};
+        header.magic = SceneFileMagic;
+        header.version = SceneFileVersion;
+        header.meshCount = static_cast<uint32_t>(meshes.size());
+        header.instanceCount = header.meshCount;
+
+        std::vector<SceneFileMesh> meshTable(meshes.size());
+        std::string names;
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            SceneFileMesh& entry = meshTable[i];
+            entry.firstVertex = header.vertexCount;
+            entry.firstIndex = header.indexCount;
+            entry.vertexCount = static_cast<uint32_t>(meshes[i].vertices.size());
+            entry.indexCount = static_cast<uint32_t>(meshes[i].indices.size());
+            entry.nameOffset = static_cast<uint32_t>(names.size());
+            entry.nameLength = static_cast<uint32_t>(meshes[i].name.size());
+            names += meshes[i].name;
+            header.vertexCount += entry.vertexCount;
+            header.indexCount += entry.indexCount;
+        }
+
+        std::vector<SceneFileInstance> instances(meshes.size());
+        for (uint32_t i = 0; i < header.instanceCount; i++)
+        {
+            instances[i].mesh = i;
+            instances[i].transform[0] = 1.0f;
+            instances[i].transform[5] = 1.0f;
+            instances[i].transform[10] = 1.0f;
+        }
+
+        if (bvh != nullptr && !bvh->nodes.empty())
+        {
+            header.bvhNodeCount = static_cast<uint32_t>(bvh->nodes.size());
+            header.bvhTriangleCount = bvh->GetTriangleCount();
+        }
+
+        // Lay the sections out one after another, each on its own alignment boundary
+        uint64_t offset = AlignUp(sizeof(SceneFileHeader), SceneFileAlignment);
+        auto place = [&offset](SceneFileSection& section, uint64_t size) {
+            section.offset = offset;
+            section.size = size;
+            offset = AlignUp(offset + size, SceneFileAlignment);
+        };
+        place(header.meshes, meshTable.size() * sizeof(SceneFileMesh));
+        place(header.names, names.size());
+        place(header.vertices, header.vertexCount * sizeof(Vertex));
+        place(header.indices, header.indexCount * sizeof(uint32_t));
+        place(header.instances, instances.size() * sizeof(SceneFileInstance));
+        place(header.bvhNodes, uint64_t(header.bvhNodeCount) * sizeof(BVHNode));
+        place(header.bvhPrimitiveIndices, uint64_t(header.bvhTriangleCount) * sizeof(uint32_t));
+        header.fileSize = offset;
+
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr)
+        {
+            std::cerr << "Failed to open " << path << " for writing" << std::endl;
+            return false;
+        }
+
+        bool written = true;
+        uint64_t position = 0;
+        auto write = [&](uint64_t at, const void* data, uint64_t size) {
+            static const char zeros[SceneFileAlignment] = {};
+            while (written && position < at)
+            {
+                const uint64_t padding = std::min<uint64_t>(at - position, SceneFileAlignment);
+                written = fwrite(zeros, 1, padding, file) == padding;
+                position += padding;
+            }
+            if (written && size > 0)
+            {
+                written = fwrite(data, 1, size, file) == size;
+                position += size;
+            }
+        };
+
+        write(0, &header, sizeof(header));
+        write(header.meshes.offset, meshTable.data(), header.meshes.size);
+        write(header.names.offset, names.data(), header.names.size);
+        // Geometry is streamed mesh by mesh rather than merged into one big vector first
+        write(header.vertices.offset, nullptr, 0);
+        for (const MeshData& mesh : meshes)
+        {
+            write(position, mesh.vertices.data(), mesh.vertices.size() * sizeof(Vertex));
+        }
+        write(header.indices.offset, nullptr, 0);
+        for (const MeshData& mesh : meshes)
+        {
+            write(position, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+        }
+        write(header.instances.offset, instances.data(), header.instances.size);
+        if (header.bvhNodeCount > 0)
+        {
+            write(header.bvhNodes.offset, bvh->nodes.data(), header.bvhNodes.size);
+            write(header.bvhPrimitiveIndices.offset, bvh->primitiveIndices.data(), header.bvhPrimitiveIndices.size);
+        }
+        write(header.fileSize, nullptr, 0);
+
+        written = fclose(file) == 0 && written;
+        if (!written)
+        {
+            std::cerr << "Failed to write " << path << std::endl;
+            std::remove(path.c_str());
+        }
+        return written;
+    }
+
+    bool IsSceneFilePath(const std::string& path)
+    {
+        const std::string extension = ".pbscene";
+        if (path.size() < extension.size())
+        {
+            return false;
+        }
+        std::string tail = path.substr(path.size() - extension.size());
+        std::transform(tail.begin(), tail.end(), tail.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return tail == extension;
+    }
+}
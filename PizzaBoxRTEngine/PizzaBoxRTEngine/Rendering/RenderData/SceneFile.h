@@ -0,0 +1,137 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <Core/MappedFile.h>
+#include "MeshLoader.h"
+#include "Vertex.h"
+#include "../CPU/BVH.h"
+
+// Kept free of Vulkan so the converter tool doesn't need a device
+namespace PBEngine
+{
+    /*
+        Engine native scene container (.pbscene). The file is mapped and every section is used in place,
+        vertex and index data go straight from the mapping into the upload buffers without being parsed
+        or copied into a std::vector first. Write them with Tools/SceneConverter.
+
+        Layout, every section starting on a SceneFileAlignment boundary:
+
+            SceneFileHeader
+            SceneFileMesh[meshCount]
+            char names[]                                   mesh names, not null terminated
+            Vertex[vertexCount]                            all meshes back to back
+            uint32_t indices[indexCount]                   relative to the mesh's first vertex
+            SceneFileInstance[instanceCount]
+            BVHNode[bvhNodeCount]                          optional
+            uint32_t bvhPrimitiveIndices[bvhTriangleCount] optional
+
+        The optional BVH is the CPU backend's binary BVH over every instance merged in instance order,
+        with the instance transforms applied.
+    */
+    constexpr uint32_t SceneFileMagic = 0x4E534250; // "PBSN"
+    // Bump whenever the layout of anything in the file changes, old files are rejected
+    constexpr uint32_t SceneFileVersion = 1;
+    constexpr uint64_t SceneFileAlignment = 64;
+
+    struct SceneFileSection
+    {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct SceneFileHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t fileSize;
+        uint32_t meshCount;
+        uint32_t instanceCount;
+        uint64_t vertexCount;
+        uint64_t indexCount;
+        uint32_t bvhNodeCount;
+        uint32_t bvhTriangleCount;
+
+        SceneFileSection meshes;
+        SceneFileSection names;
+        SceneFileSection vertices;
+        SceneFileSection indices;
+        SceneFileSection instances;
+        SceneFileSection bvhNodes;
+        SceneFileSection bvhPrimitiveIndices;
+    };
+
+    struct SceneFileMesh
+    {
+        uint64_t firstVertex;
+        uint64_t firstIndex;
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        uint32_t nameOffset;
+        uint32_t nameLength;
+    };
+
+    struct SceneFileInstance
+    {
+        uint32_t mesh;
+        uint32_t padding;
+        // Row major 3x4, same layout as VkTransformMatrixKHR
+        float transform[12];
+    };
+
+    static_assert(sizeof(SceneFileHeader) == 160, "SceneFileHeader layout changed, bump SceneFileVersion");
+    static_assert(sizeof(SceneFileMesh) == 32, "SceneFileMesh layout changed, bump SceneFileVersion");
+    static_assert(sizeof(SceneFileInstance) == 56, "SceneFileInstance layout changed, bump SceneFileVersion");
+    static_assert(sizeof(Vertex) == 12 && sizeof(BVHNode) == 32, "Vertex or BVHNode changed, bump SceneFileVersion");
+
+    /*
+        A mapped .pbscene file. Everything handed out points into the mapping and stays valid until Close.
+    */
+    class SceneFile
+    {
+    public:
+        /**
+         * @brief Maps the file and checks the header, that every section lies inside the file and that
+         * every index stays inside its mesh's vertices. Only the index pages get touched for that.
+         * @return false when the file can't be mapped or isn't a scene file of this version
+         */
+        bool Open(const std::string& path);
+        void Close() { file.Close(); header = nullptr; }
+
+        const SceneFileHeader& GetHeader() const { return *header; }
+        uint32_t GetMeshCount() const { return header->meshCount; }
+        uint32_t GetInstanceCount() const { return header->instanceCount; }
+
+        const SceneFileMesh& GetMesh(uint32_t mesh) const { return Section<SceneFileMesh>(header->meshes)[mesh]; }
+        std::string_view GetMeshName(uint32_t mesh) const;
+        const Vertex* GetVertices(uint32_t mesh) const;
+        const uint32_t* GetIndices(uint32_t mesh) const;
+        const SceneFileInstance& GetInstance(uint32_t instance) const { return Section<SceneFileInstance>(header->instances)[instance]; }
+
+        bool HasBVH() const { return header->bvhNodeCount > 0; }
+        const BVHNode* GetBVHNodes() const { return Section<BVHNode>(header->bvhNodes); }
+        const uint32_t* GetBVHPrimitiveIndices() const { return Section<uint32_t>(header->bvhPrimitiveIndices); }
+
+    private:
+        template <class T>
+        const T* Section(const SceneFileSection& section) const
+        {
+            return reinterpret_cast<const T*>(file.GetData() + section.offset);
+        }
+
+        MappedFile file;
+        const SceneFileHeader* header = nullptr;
+    };
+
+    /**
+     * @brief Writes the meshes as a .pbscene file with one identity instance per mesh
+     * @param bvh Optional BVH over all meshes merged in order, see SceneFile
+     */
+    bool WriteSceneFile(const std::string& path, const std::vector<MeshData>& meshes, const BVH* bvh = nullptr);
+
+    /**
+     * @brief True for paths ending in .pbscene
+     */
+    bool IsSceneFilePath(const std::string& path);
+}
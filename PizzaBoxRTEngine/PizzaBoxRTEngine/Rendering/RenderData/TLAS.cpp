@@ -1,4 +1,6 @@
 #include "TLAS.h"
+#include <Core/Trace.h>
+#include <cstring>
 #include <iostream>
 
 namespace PBEngine
@@ -8,18 +10,6 @@ namespace PBEngine
 
     }
 
-    TLAS::~TLAS()
-    {
-        if (buffer)
-        {
-            buffer.reset();
-        }
-        if (handle)
-        {
-            vkDestroyAccelerationStructureKHR(GetDevice(), handle, nullptr);
-        }
-    }
-
     /*
         Gets the device address from a buffer that's needed in many places during the ray tracing setup
     */
@@ -41,21 +31,11 @@ namespace PBEngine
         buffer_create_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
         check_vk_result(vkCreateBuffer(GetDevice(), &buffer_create_info, nullptr, &scratch_buffer.handle));
 
-        VkMemoryRequirements memory_requirements = {};
-        vkGetBufferMemoryRequirements(GetDevice(), scratch_buffer.handle, &memory_requirements);
-
-        VkMemoryAllocateFlagsInfo memory_allocate_flags_info = {};
-        memory_allocate_flags_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-        memory_allocate_flags_info.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-
-        VkBool32 memTypeFound = false;
-        VkMemoryAllocateInfo memory_allocate_info = {};
-        memory_allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        memory_allocate_info.pNext = &memory_allocate_flags_info;
-        memory_allocate_info.allocationSize = memory_requirements.size;
-        memory_allocate_info.memoryTypeIndex = GetMemoryType(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GetPhysicalDevice(), &memTypeFound);
-        check_vk_result(vkAllocateMemory(GetDevice(), &memory_allocate_info, nullptr, &scratch_buffer.memory));
-        check_vk_result(vkBindBufferMemory(GetDevice(), scratch_buffer.handle, scratch_buffer.memory, 0));
+        // Sub-allocated ranges are at least 256 byte aligned, which covers minAccelerationStructureScratchOffsetAlignment
+        if (!GetMemoryAllocator().AllocateForBuffer(scratch_buffer.handle, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scratch_buffer.allocation))
+        {
+            std::cerr << "Failed to allocate scratch buffer memory." << std::endl;
+        }
 
         VkBufferDeviceAddressInfoKHR buffer_device_address_info{};
         buffer_device_address_info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
@@ -67,80 +47,165 @@ namespace PBEngine
 
     void delete_scratch_buffer(ScratchBuffer& scratch_buffer)
     {
-        if (scratch_buffer.memory != VK_NULL_HANDLE)
-        {
-            vkFreeMemory(GetDevice(), scratch_buffer.memory, nullptr);
-        }
         if (scratch_buffer.handle != VK_NULL_HANDLE)
         {
             vkDestroyBuffer(GetDevice(), scratch_buffer.handle, nullptr);
         }
+        GetMemoryAllocator().Free(scratch_buffer.allocation);
+    }
+
+    TLAS::~TLAS()
+    {
+        if (buffer)
+        {
+            buffer.reset();
+        }
+        if (handle)
+        {
+            vkDestroyAccelerationStructureKHR(GetDevice(), handle, nullptr);
+        }
+        instanceBuffer.reset();
+        delete_scratch_buffer(scratchBuffer);
+    }
+
+    void TLAS::AddInstance(uint32_t blasIndex, const VkTransformMatrixKHR& transform)
+    {
+        VkAccelerationStructureInstanceKHR acceleration_structure_instance{};
+        acceleration_structure_instance.transform = transform;
+        acceleration_structure_instance.instanceCustomIndex = static_cast<uint32_t>(instanceRecords.size());
+        acceleration_structure_instance.mask = 0xFF;
+        acceleration_structure_instance.instanceShaderBindingTableRecordOffset = 0;
+        acceleration_structure_instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+        acceleration_structure_instance.accelerationStructureReference = blasList[blasIndex].deviceAddress;
+        instanceRecords.push_back(acceleration_structure_instance);
+        instanceBLAS.push_back(blasIndex);
+        topologyChanged = true;
+    }
+
+    void TLAS::SetInstanceTransform(uint32_t instance, const VkTransformMatrixKHR& transform)
+    {
+        instanceRecords[instance].transform = transform;
+        instancesChanged = true;
+    }
+
+    void TLAS::SetInstanceMask(uint32_t instance, uint8_t mask)
+    {
+        instanceRecords[instance].mask = mask;
+        instancesChanged = true;
+    }
+
+    void TLAS::SetInstanceFlags(uint32_t instance, VkGeometryInstanceFlagsKHR flags)
+    {
+        instanceRecords[instance].flags = flags;
+        instancesChanged = true;
+    }
+
+    void TLAS::SetInstanceBLAS(uint32_t instance, uint32_t blasIndex)
+    {
+        if (instanceBLAS[instance] != blasIndex)
+        {
+            instanceBLAS[instance] = blasIndex;
+            instanceRecords[instance].accelerationStructureReference = blasList[blasIndex].deviceAddress;
+            topologyChanged = true;
+        }
+    }
+
+    void TLAS::SetRingSize(uint32_t slotCount)
+    {
+        slotCount = std::max(slotCount, 1u);
+        if (slotCount == ringSize)
+        {
+            return;
+        }
+        ringSize = slotCount;
+        if (instanceBuffer)
+        {
+            CreateInstanceBuffer();
+            // The next update has to read from a slot that holds every instance
+            instancesChanged = true;
+        }
+    }
+
+    void TLAS::CreateInstanceBuffer()
+    {
+        // All instances go into a single buffer since a top level acceleration structure only takes one geometry
+        const size_t instances_size = static_cast<size_t>(capacity) * ringSize * sizeof(VkAccelerationStructureInstanceKHR);
+        instanceBuffer = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(),
+            instances_size,
+            VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+
+    void TLAS::WriteInstances(uint32_t slot)
+    {
+        instanceBuffer->update_elements(instanceRecords.data(), instanceRecords.size(), static_cast<size_t>(slot) * capacity);
+        instancesChanged = false;
+    }
+
+    void TLAS::RecordBuild(VkCommandBuffer commandBuffer, VkBuildAccelerationStructureModeKHR mode, uint32_t slot)
+    {
+        VkAccelerationStructureGeometryKHR acceleration_structure_geometry{};
+        acceleration_structure_geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        acceleration_structure_geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+        acceleration_structure_geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+        acceleration_structure_geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+        acceleration_structure_geometry.geometry.instances.arrayOfPointers = VK_FALSE;
+        acceleration_structure_geometry.geometry.instances.data.deviceAddress = get_buffer_device_address(instanceBuffer->get_handle()) +
+            static_cast<VkDeviceSize>(slot) * capacity * sizeof(VkAccelerationStructureInstanceKHR);
+
+        VkAccelerationStructureBuildGeometryInfoKHR acceleration_build_geometry_info{};
+        acceleration_build_geometry_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        acceleration_build_geometry_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+        acceleration_build_geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+            VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+        acceleration_build_geometry_info.mode = mode;
+        // An update refits the existing structure in place
+        acceleration_build_geometry_info.srcAccelerationStructure = mode == VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR ? handle : VK_NULL_HANDLE;
+        acceleration_build_geometry_info.dstAccelerationStructure = handle;
+        acceleration_build_geometry_info.geometryCount = 1;
+        acceleration_build_geometry_info.pGeometries = &acceleration_structure_geometry;
+        acceleration_build_geometry_info.scratchData.deviceAddress = scratchBuffer.device_address;
+
+        VkAccelerationStructureBuildRangeInfoKHR acceleration_structure_build_range_info{};
+        acceleration_structure_build_range_info.primitiveCount = GetNumInstances();
+        const VkAccelerationStructureBuildRangeInfoKHR* range_info = &acceleration_structure_build_range_info;
+
+        vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1, &acceleration_build_geometry_info, &range_info);
     }
 
     void TLAS::BuildTLAS()
     {
+        PB_TRACE_SCOPE("TLAS::BuildTLAS");
         if (blasList.size() < 1)
         {
             std::cerr << "Needs more than one BLAS." << std::endl;
         }
+        capacity = std::max(capacity, static_cast<uint32_t>(GetNumInstances()));
 
-        VkTransformMatrixKHR identityMatrix = {
-            1.0f, 0.0f, 0.0f, 0.0f,
-            0.0f, 1.0f, 0.0f, 0.0f,
-            0.0f, 0.0f, 1.0f, 0.0f };
+        CreateInstanceBuffer();
 
-        std::vector<VkAccelerationStructureInstanceKHR> instancesData;
-        std::vector<VkAccelerationStructureGeometryKHR> geometry;
-        std::vector<std::unique_ptr<Buffer>> instancesBuffers;
-        for (size_t i = 0; i < GetNumInstances(); i++)
-        {
-            VkAccelerationStructureInstanceKHR acceleration_structure_instance{};
-            acceleration_structure_instance.transform = identityMatrix;
-            acceleration_structure_instance.instanceCustomIndex = 0;
-            acceleration_structure_instance.mask = 0xFF;
-            acceleration_structure_instance.instanceShaderBindingTableRecordOffset = 0;
-            acceleration_structure_instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-            acceleration_structure_instance.accelerationStructureReference = blasList[i].deviceAddress;
-
-            std::unique_ptr<Buffer> instances_buffer = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(),
-                sizeof(VkAccelerationStructureInstanceKHR),
-                VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-            instances_buffer->update(&acceleration_structure_instance, sizeof(VkAccelerationStructureInstanceKHR));
-
-            VkDeviceOrHostAddressConstKHR instance_data_device_address{};
-            instance_data_device_address.deviceAddress = get_buffer_device_address(instances_buffer->get_handle());
-
-            // The top level acceleration structure contains (bottom level) instance as the input geometry
-            VkAccelerationStructureGeometryKHR acceleration_structure_geometry{};
-            acceleration_structure_geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-            acceleration_structure_geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-            acceleration_structure_geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-            acceleration_structure_geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-            acceleration_structure_geometry.geometry.instances.arrayOfPointers = VK_FALSE;
-            acceleration_structure_geometry.geometry.instances.data = instance_data_device_address;
-
-            instancesData.push_back(std::move(acceleration_structure_instance));
-            instancesBuffers.push_back(std::move(instances_buffer));
-            geometry.push_back(std::move(acceleration_structure_geometry));
-        }
+        // Sizes for the full capacity, so later rebuilds with more instances fit into the same structure
+        VkAccelerationStructureGeometryKHR acceleration_structure_geometry{};
+        acceleration_structure_geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        acceleration_structure_geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+        acceleration_structure_geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+        acceleration_structure_geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+        acceleration_structure_geometry.geometry.instances.arrayOfPointers = VK_FALSE;
 
-        // Get the size requirements for buffers involved in the acceleration structure build process
         VkAccelerationStructureBuildGeometryInfoKHR acceleration_structure_build_geometry_info{};
         acceleration_structure_build_geometry_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
         acceleration_structure_build_geometry_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        acceleration_structure_build_geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        acceleration_structure_build_geometry_info.geometryCount = GetNumInstances();
-        acceleration_structure_build_geometry_info.pGeometries = geometry.data();
-
-        const uint32_t primitive_count = GetNumInstances();
+        acceleration_structure_build_geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+            VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+        acceleration_structure_build_geometry_info.geometryCount = 1;
+        acceleration_structure_build_geometry_info.pGeometries = &acceleration_structure_geometry;
 
         VkAccelerationStructureBuildSizesInfoKHR acceleration_structure_build_sizes_info{};
         acceleration_structure_build_sizes_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
         vkGetAccelerationStructureBuildSizesKHR(
             GetDevice(), VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
             &acceleration_structure_build_geometry_info,
-            &primitive_count,
+            &capacity,
             &acceleration_structure_build_sizes_info);
 
         // Create a buffer to hold the acceleration structure
@@ -148,7 +213,7 @@ namespace PBEngine
             GetDevice(), GetPhysicalDevice(),
             acceleration_structure_build_sizes_info.accelerationStructureSize,
             VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+            0);
 
         // Create the acceleration structure
         VkAccelerationStructureCreateInfoKHR acceleration_structure_create_info{};
@@ -158,36 +223,21 @@ namespace PBEngine
         acceleration_structure_create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
         vkCreateAccelerationStructureKHR(GetDevice(), &acceleration_structure_create_info, nullptr, &handle);
 
-        // The actual build process starts here
-
-        // Create a scratch buffer as a temporary storage for the acceleration structure build
-        ScratchBuffer scratch_buffer = create_scratch_buffer(acceleration_structure_build_sizes_info.buildScratchSize);
-
-        VkAccelerationStructureBuildGeometryInfoKHR acceleration_build_geometry_info{};
-        acceleration_build_geometry_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        acceleration_build_geometry_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        acceleration_build_geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        acceleration_build_geometry_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        acceleration_build_geometry_info.dstAccelerationStructure = handle;
-        acceleration_build_geometry_info.geometryCount = GetNumInstances();
-        acceleration_build_geometry_info.pGeometries = geometry.data();
-        acceleration_build_geometry_info.scratchData.deviceAddress = scratch_buffer.device_address;
+        // Kept around, every update and rebuild reuses it
+        scratchBuffer = create_scratch_buffer(std::max(acceleration_structure_build_sizes_info.buildScratchSize,
+            acceleration_structure_build_sizes_info.updateScratchSize));
 
-        VkAccelerationStructureBuildRangeInfoKHR acceleration_structure_build_range_info;
-        acceleration_structure_build_range_info.primitiveCount = GetNumInstances();
-        acceleration_structure_build_range_info.primitiveOffset = 0;
-        acceleration_structure_build_range_info.firstVertex = 0;
-        acceleration_structure_build_range_info.transformOffset = 0;
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR*> acceleration_build_structure_range_infos = { &acceleration_structure_build_range_info };
+        WriteInstances(0);
 
         // Build the acceleration structure on the device via a one-time command buffer submission
         // Some implementations may support acceleration structure building on the host (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands), but we prefer device builds
-        // Create the command pool
+        // Create the command pool. The refits that follow run on the ray tracing queue and the buffers are
+        // exclusive, so the first build goes to the same queue family instead of the compute one
         VkCommandPool commandPool;
         VkCommandBuffer commandBuffer;
         VkCommandPoolCreateInfo poolCreateInfo = {};
         poolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        poolCreateInfo.queueFamilyIndex = GetApp().g_QueueFamily[1];
+        poolCreateInfo.queueFamilyIndex = GetApp().g_QueueFamily[0];
         poolCreateInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
         check_vk_result(vkCreateCommandPool(GetDevice(), &poolCreateInfo, nullptr, &commandPool));
 
@@ -202,11 +252,7 @@ namespace PBEngine
         VkCommandBufferBeginInfo cmdBufferBeginInfo = {};
         cmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
         vkBeginCommandBuffer(commandBuffer, &cmdBufferBeginInfo);
-        vkCmdBuildAccelerationStructuresKHR(
-            commandBuffer,
-            1,
-            &acceleration_build_geometry_info,
-            acceleration_build_structure_range_infos.data());
+        RecordBuild(commandBuffer, VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR, 0);
 
         // Flush command buffer
         check_vk_result(vkEndCommandBuffer(commandBuffer));
@@ -224,7 +270,7 @@ namespace PBEngine
         check_vk_result(vkCreateFence(GetDevice(), &fence_info, nullptr, &fence));
 
         // Submit to the queue
-        VkResult result = vkQueueSubmit(GetComputeQueue(), 1, &submit_info, fence);
+        check_vk_result(vkQueueSubmit(GetRTQueue(), 1, &submit_info, fence));
         // Wait for the fence to signal that command buffer has finished executing
         check_vk_result(vkWaitForFences(GetDevice(), 1, &fence, VK_TRUE, UINT64_MAX));
 
@@ -232,7 +278,8 @@ namespace PBEngine
         vkFreeCommandBuffers(GetDevice(), commandPool, 1, &commandBuffer);
         vkDestroyCommandPool(GetDevice(), commandPool, nullptr);
 
-        delete_scratch_buffer(scratch_buffer);
+        topologyChanged = false;
+        updatesSinceBuild = 0;
 
         // Get the top acceleration structure's handle, which will be used to setup it's descriptor
         VkAccelerationStructureDeviceAddressInfoKHR acceleration_device_address_info{};
@@ -240,4 +287,47 @@ namespace PBEngine
         acceleration_device_address_info.accelerationStructure = handle;
         deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(GetDevice(), &acceleration_device_address_info);
     }
-}
\ No newline at end of file
+
+    bool TLAS::RecordUpdate(VkCommandBuffer commandBuffer, uint32_t slot)
+    {
+        PB_TRACE_SCOPE("TLAS::RecordUpdate");
+        if (!IsDirty() || handle == VK_NULL_HANDLE)
+        {
+            return false;
+        }
+        if (static_cast<uint32_t>(GetNumInstances()) > capacity)
+        {
+            std::cerr << "TLAS has " << GetNumInstances() << " instances but was built for " << capacity
+                << ", Reserve more before BuildTLAS." << std::endl;
+            return false;
+        }
+
+        const bool rebuild = topologyChanged || (rebuildInterval != 0 && updatesSinceBuild >= rebuildInterval);
+        slot %= ringSize;
+        WriteInstances(slot);
+
+        // Earlier frames may still be tracing against the structure that is about to change,
+        // or updating it through the shared scratch buffer
+        VkMemoryBarrier before_barrier{};
+        before_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        before_barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        before_barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &before_barrier, 0, nullptr, 0, nullptr);
+
+        RecordBuild(commandBuffer, rebuild ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR, slot);
+
+        VkMemoryBarrier after_barrier{};
+        after_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        after_barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        after_barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+            0, 1, &after_barrier, 0, nullptr, 0, nullptr);
+
+        topologyChanged = false;
+        updatesSinceBuild = rebuild ? 0 : updatesSinceBuild + 1;
+        return true;
+    }
+}
@@ -1,36 +1,115 @@
 #pragma once
 #include "AccelerationStructure.h"
+#include <algorithm>
 #include <vector>
 
 namespace PBEngine
 {
+    /*
+        Top level acceleration structure over instances of the bottom level ones. BuildTLAS does the first
+        build with a blocking submission, after that instances can be moved, hidden or changed every frame
+        and RecordUpdate puts the work into the caller's command buffer:
+
+            - Only transforms, masks or flags changed: an in place MODE_UPDATE, which is much cheaper than a build
+            - Instances were added or point at a different BLAS: a full rebuild into the same structure
+            - After rebuildInterval updates in a row: a full rebuild, since refitting never improves the
+              tree and quality slowly drops as instances move away from where they were built
+    */
     class TLAS {
         public:
             TLAS();
             ~TLAS();
 
-            void AddBLAS(AccelerationStructure* blas) {
+            // Takes ownership of the BLAS and adds one instance of it, returns its index for AddInstance
+            uint32_t AddBLAS(AccelerationStructure* blas, const VkTransformMatrixKHR& transform = IdentityTransform()) {
                 blasList.push_back(std::move(*blas));
+                const uint32_t blasIndex = static_cast<uint32_t>(blasList.size() - 1);
+                AddInstance(blasIndex, transform);
+                return blasIndex;
             }
 
+            // Places another copy of an already added BLAS, instances share the BLAS memory
+            void AddInstance(uint32_t blasIndex, const VkTransformMatrixKHR& transform);
+
+            static VkTransformMatrixKHR IdentityTransform() {
+                return {
+                    1.0f, 0.0f, 0.0f, 0.0f,
+                    0.0f, 1.0f, 0.0f, 0.0f,
+                    0.0f, 0.0f, 1.0f, 0.0f };
+            }
+
+            /*
+                Instance changes that RecordUpdate picks up. Transforms, masks and flags only need an update,
+                pointing an instance at a different BLAS needs a rebuild.
+            */
+            void SetInstanceTransform(uint32_t instance, const VkTransformMatrixKHR& transform);
+            void SetInstanceMask(uint32_t instance, uint8_t mask);
+            void SetInstanceFlags(uint32_t instance, VkGeometryInstanceFlagsKHR flags);
+            void SetInstanceBLAS(uint32_t instance, uint32_t blasIndex);
+
+            /*
+                Room for instances added after BuildTLAS without having to create a new structure, which
+                would change the handle that the descriptor sets point at. Call before BuildTLAS.
+            */
+            void Reserve(uint32_t instanceCount) { capacity = std::max(capacity, instanceCount); }
+
+            /*
+                How many copies of the instance array the instance buffer holds. Every update writes into the
+                copy of the slot it's given, so with one copy per frame in flight the host never overwrites
+                instances a frame still in flight is building from. Recreates the buffer when it's already
+                built, so nothing may be using it then.
+            */
+            void SetRingSize(uint32_t slotCount);
+
+            // Blocking first build, creates the structure and everything updates reuse
             void BuildTLAS();
 
+            // Whether RecordUpdate has anything to do
+            bool IsDirty() const { return instancesChanged || topologyChanged; }
+
+            /**
+             * @brief Records an update or rebuild of the changed instances, with barriers against earlier ray
+             * tracing reads before it and later ones after it. The instances are copied into the ring slot
+             * right away, so the last submission that used the same slot has to be finished.
+             * @param slot Ring slot to write the instances into, usually the index of the frame in flight
+             * @return false when nothing was recorded, because nothing changed or the instances outgrew the capacity
+             */
+            bool RecordUpdate(VkCommandBuffer commandBuffer, uint32_t slot);
+
             VkAccelerationStructureKHR GetHandle()
             {
                 return handle;
             }
 
             //int numInstances{ get {return blasList.Count; } };
-            int GetNumInstances() { return blasList.size(); }
+            int GetNumInstances() { return instanceRecords.size(); }
 
-            //std::vector<VkAccelerationStructureInstanceKHR> instancesData;
-            //std::vector<VkAccelerationStructureGeometryKHR> geometry;
+            // Updates in a row before RecordUpdate does a full rebuild instead, 0 never forces one
+            uint32_t rebuildInterval = 64;
+            uint32_t updatesSinceBuild = 0;
 
         private:
+            void CreateInstanceBuffer();
+            // One memcpy of every record into the slot's part of the instance buffer
+            void WriteInstances(uint32_t slot);
+            void RecordBuild(VkCommandBuffer commandBuffer, VkBuildAccelerationStructureModeKHR mode, uint32_t slot);
+
             std::vector<AccelerationStructure> blasList;
+            // Kept in the exact layout the device reads, so changing an instance is a field write
+            // and uploading all of them is a single copy
+            std::vector<VkAccelerationStructureInstanceKHR> instanceRecords;
+            std::vector<uint32_t> instanceBLAS;
+            bool instancesChanged = false;
+            bool topologyChanged = true;
+            uint32_t capacity = 0;
+            uint32_t ringSize = 1;
 
-            VkAccelerationStructureKHR handle;
+            VkAccelerationStructureKHR handle = VK_NULL_HANDLE;
             uint64_t deviceAddress;
             std::unique_ptr<Buffer> buffer;
+            // Persistently mapped, ringSize arrays of capacity instances back to back
+            std::unique_ptr<Buffer> instanceBuffer;
+            // Sized for whichever of build and update needs more, kept for the lifetime of the TLAS
+            ScratchBuffer scratchBuffer{};
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Kept free of Vulkan so the CPU backend and offline tools can share the geometry types
+namespace PBEngine
+{
+    struct Vertex
+    {
+        float pos[3];
+    };
+
+    // Define the vertex data for the triangle
+    const std::vector<Vertex> triangleVertices = {
+        {{-0.5f, -0.5f, 0.0f}},
+        {{0.5f, -0.5f, 0.0f}},
+        {{0.0f,  0.5f, 0.0f}}};
+    const std::vector<uint32_t> indices = { 0, 1, 2 };
+}
@@ -1,14 +1,28 @@
 #include "Renderer.h"
 
 #include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <Core/Trace.h>
 #include <VulkanHelp/GLSLCompiler.h>
+#include <VulkanHelp/UploadManager.h>
+#include "ImageWriter.h"
+#include "RenderData/BLASBuilder.h"
+#include "RenderData/MeshLoader.h"
+#include "RenderData/SceneFile.h"
+#include "CPU/Backend_CPU.h"
 
 namespace PBEngine
 {
 #pragma region Renderer definitions
-    Renderer::Renderer(float *width, float *height)
+    Renderer::Renderer(float *width, float *height, Backend::RendererBackendType type, const std::string& scenePath)
     {
-        renderingBackend = std::make_unique<Backend_FullRT>();
+        if (type == Backend::RendererBackendType_Custom)
+            renderingBackend = std::make_unique<Backend_CPU>();
+        else
+            renderingBackend = std::make_unique<Backend_FullRT>();
+        renderingBackend->scenePath = scenePath;
         if (!renderingBackend->Init(width, height)) {
             fprintf(stderr, "Trouble loading rendering backend of type: %d",
                 renderingBackend->backendType);
@@ -39,143 +53,47 @@ namespace PBEngine
         CleanupBackend();
     }
 
-    void Backend_FullRT::CreateViewImage(bool resize = false)
+    // Images are allocated in steps of this many pixels, so dragging a window edge only reallocates now and then
+    static constexpr uint32_t ImageBucketSize = 256;
+
+    static uint32_t GetImageBucket(uint32_t size)
     {
-        viewImage.width = static_cast<uint32_t>(truncf(*viewportWidth));
-        viewImage.height = static_cast<uint32_t>(truncf(*viewportHeight));
+        return std::max(1u, (size + ImageBucketSize - 1) / ImageBucketSize) * ImageBucketSize;
+    }
 
-        VkImageCreateInfo image{};
-        image.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-        image.flags = 0;
-        image.imageType = VK_IMAGE_TYPE_2D;
-        image.format = VK_FORMAT_B8G8R8A8_UNORM;
-        image.extent.width = viewImage.width;
-        image.extent.height = viewImage.height;
-        image.extent.depth = 1;
-        image.mipLevels = 1;
-        image.arrayLayers = 1;
-        image.samples = VK_SAMPLE_COUNT_1_BIT;
-        image.tiling = VK_IMAGE_TILING_OPTIMAL;
-        image.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-        image.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        check_vk_result(vkCreateImage(GetDevice(), &image, nullptr, &viewImage.image));
-
-        VkMemoryRequirements memory_requirements;
-        vkGetImageMemoryRequirements(GetDevice(), viewImage.image, &memory_requirements);
-        VkMemoryAllocateInfo memory_allocate_info{};
-        memory_allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        memory_allocate_info.allocationSize = memory_requirements.size;
-        VkBool32 memFound = false;
-        memory_allocate_info.memoryTypeIndex = GetMemoryType(memory_requirements.memoryTypeBits,
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GetPhysicalDevice(), &memFound);
-        check_vk_result(vkAllocateMemory(GetDevice(), &memory_allocate_info, nullptr, &viewImage.memory));
-        check_vk_result(vkBindImageMemory(GetDevice(), viewImage.image, viewImage.memory, 0));
-
-        if (!resize)
-        {
-            VkImageViewCreateInfo color_image_view{};
-            color_image_view.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-            color_image_view.viewType = VK_IMAGE_VIEW_TYPE_2D;
-            color_image_view.format = VK_FORMAT_B8G8R8A8_UNORM;
-            color_image_view.subresourceRange = {};
-            color_image_view.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            color_image_view.subresourceRange.baseMipLevel = 0;
-            color_image_view.subresourceRange.levelCount = 1;
-            color_image_view.subresourceRange.baseArrayLayer = 0;
-            color_image_view.subresourceRange.layerCount = 1;
-            color_image_view.image = viewImage.image;
-            check_vk_result(vkCreateImageView(GetDevice(), &color_image_view, nullptr, &viewImage.view));
-        }
+    static uint32_t ToPixels(float size)
+    {
+        return std::max(1u, static_cast<uint32_t>(truncf(std::max(size, 0.0f))));
+    }
 
+    void Backend_FullRT::CreateOutputSampler()
+    {
         VkSamplerCreateInfo sampler_info{};
         sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
         sampler_info.magFilter = VK_FILTER_LINEAR;
         sampler_info.minFilter = VK_FILTER_LINEAR;
         sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-        sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT; // outside image bounds just use border color
-        sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-        sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        // Only the rendered corner is shown, clamping keeps the filter from picking up the rest of the image
+        sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
         sampler_info.minLod = -1000;
         sampler_info.maxLod = 1000;
         sampler_info.maxAnisotropy = 1.0f;
-        vkCreateSampler(GetDevice(), &sampler_info, nullptr, &viewImage.sampler);
-
-        VkCommandPool imageCmdPool;
-        // Create the command pool
-        VkCommandPoolCreateInfo poolCreateInfo = {};
-        poolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        poolCreateInfo.queueFamilyIndex = GetApp().g_QueueFamily[1];
-        poolCreateInfo.flags = 0; // Optional flags, such as VK_COMMAND_POOL_CREATE_TRANSIENT_BIT or VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT
-
-        VkResult result = vkCreateCommandPool(GetDevice(), &poolCreateInfo, nullptr, &imageCmdPool);
-        if (result != VK_SUCCESS) {
-            // Handle command pool creation failure
-            fprintf(stdout, "Couldn't create Command Pool: %d\n", result);
-        }
-
-        VkCommandBufferAllocateInfo cmd_buf_allocate_info{};
-        cmd_buf_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        cmd_buf_allocate_info.commandPool = imageCmdPool;
-        cmd_buf_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        cmd_buf_allocate_info.commandBufferCount = 1;
-
-        VkCommandBuffer command_buffer;
-        check_vk_result(vkAllocateCommandBuffers(GetDevice(), &cmd_buf_allocate_info, &command_buffer));
-
-        VkCommandBufferBeginInfo command_buffer_info{};
-        command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        check_vk_result(vkBeginCommandBuffer(command_buffer, &command_buffer_info));
-
-        // Create an image barrier object
-        VkImageMemoryBarrier image_memory_barrier{};
-        image_memory_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        image_memory_barrier.srcAccessMask = {};
-        image_memory_barrier.dstAccessMask = {};
-        image_memory_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        image_memory_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        image_memory_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        image_memory_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        image_memory_barrier.image = viewImage.image;
-        image_memory_barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-
-        // Put barrier inside setup command buffer
-        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            0, 0, nullptr, 0, nullptr, 1, &image_memory_barrier);
-
-        check_vk_result(vkEndCommandBuffer(command_buffer));
-        VkSubmitInfo submit_info{};
-        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &command_buffer;
-
-        // Create fence to ensure that the command buffer has finished executing
-        VkFenceCreateInfo fence_info{};
-        fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fence_info.flags = 0;
-
-        VkFence fence;
-        check_vk_result(vkCreateFence(GetDevice(), &fence_info, nullptr, &fence));
-
-        // Submit to the queue
-        result = vkQueueSubmit(GetComputeQueue(), 1, &submit_info, fence);
-        // Wait for the fence to signal that command buffer has finished executing
-        check_vk_result(vkWaitForFences(GetDevice(), 1, &fence, VK_TRUE, UINT64_MAX));
-
-        vkDestroyFence(GetDevice(), fence, nullptr);
-        vkFreeCommandBuffers(GetDevice(), imageCmdPool, 1, &command_buffer);
-        vkDestroyCommandPool(GetDevice(), imageCmdPool, nullptr);
+        check_vk_result(vkCreateSampler(GetDevice(), &sampler_info, nullptr, &outputSampler));
     }
 
-    void Backend_FullRT::CreateStorageImage()
+    void Backend_FullRT::CreateStorageImage(StorageImage& storage_image, VkFormat format, VkImageLayout layout)
     {
-        storage_image.width = static_cast<uint32_t>(truncf(*viewportWidth));
-        storage_image.height = static_cast<uint32_t>(truncf(*viewportHeight));
+        storage_image.width = imageWidth;
+        storage_image.height = imageHeight;
+        storage_image.format = format;
 
         VkImageCreateInfo image{};
         image.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
         image.flags = 0;
         image.imageType = VK_IMAGE_TYPE_2D;
-        image.format = VK_FORMAT_B8G8R8A8_UNORM;
+        image.format = format;
         image.extent.width = storage_image.width;
         image.extent.height = storage_image.height;
         image.extent.depth = 1;
@@ -187,21 +105,15 @@ namespace PBEngine
         image.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
         check_vk_result(vkCreateImage(GetDevice(), &image, nullptr, &storage_image.image));
 
-        VkMemoryRequirements memory_requirements;
-        vkGetImageMemoryRequirements(GetDevice(), storage_image.image, &memory_requirements);
-        VkMemoryAllocateInfo memory_allocate_info{};
-        memory_allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        memory_allocate_info.allocationSize = memory_requirements.size;
-        VkBool32 memFound = false;
-        memory_allocate_info.memoryTypeIndex = GetMemoryType(memory_requirements.memoryTypeBits, 
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GetPhysicalDevice(), &memFound);
-        check_vk_result(vkAllocateMemory(GetDevice(), &memory_allocate_info, nullptr, &storage_image.memory));
-        check_vk_result(vkBindImageMemory(GetDevice(), storage_image.image, storage_image.memory, 0));
+        if (!GetMemoryAllocator().AllocateForImage(storage_image.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, storage_image.allocation))
+        {
+            fprintf(stderr, "Failed to allocate image memory\n");
+        }
 
         VkImageViewCreateInfo color_image_view{};
         color_image_view.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
         color_image_view.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        color_image_view.format = VK_FORMAT_B8G8R8A8_UNORM;
+        color_image_view.format = format;
         color_image_view.subresourceRange = {};
         color_image_view.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
         color_image_view.subresourceRange.baseMipLevel = 0;
@@ -211,70 +123,93 @@ namespace PBEngine
         color_image_view.image = storage_image.image;
         check_vk_result(vkCreateImageView(GetDevice(), &color_image_view, nullptr, &storage_image.view));
 
-        VkCommandPool imageCmdPool;
-        // Create the command pool
-        VkCommandPoolCreateInfo poolCreateInfo = {};
-        poolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        poolCreateInfo.queueFamilyIndex = GetApp().g_QueueFamily[1];
-        poolCreateInfo.flags = 0; // Optional flags, such as VK_COMMAND_POOL_CREATE_TRANSIENT_BIT or VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT
-
-        VkResult result = vkCreateCommandPool(GetDevice(), &poolCreateInfo, nullptr, &imageCmdPool);
-        if (result != VK_SUCCESS) {
-            // Handle command pool creation failure
-            fprintf(stdout, "Couldn't create Command Pool: %d\n", result);
-        }
-
-        VkCommandBufferAllocateInfo cmd_buf_allocate_info{};
-        cmd_buf_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        cmd_buf_allocate_info.commandPool = imageCmdPool;
-        cmd_buf_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        cmd_buf_allocate_info.commandBufferCount = 1;
-
-        VkCommandBuffer command_buffer;
-        check_vk_result(vkAllocateCommandBuffers(GetDevice(), &cmd_buf_allocate_info, &command_buffer));
-
-        VkCommandBufferBeginInfo command_buffer_info{};
-        command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        check_vk_result(vkBeginCommandBuffer(command_buffer, &command_buffer_info));
-
-        // Create an image barrier object
-        VkImageMemoryBarrier image_memory_barrier{};
-        image_memory_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        image_memory_barrier.srcAccessMask = {};
-        image_memory_barrier.dstAccessMask = {};
-        image_memory_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        image_memory_barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-        image_memory_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        image_memory_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        image_memory_barrier.image = storage_image.image;
-        image_memory_barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-
-        // Put barrier inside setup command buffer
-        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 
-            0, 0, nullptr, 0, nullptr, 1, &image_memory_barrier);
+        pendingTransitions.push_back({ storage_image.image, layout });
+    }
 
-        check_vk_result(vkEndCommandBuffer(command_buffer));
-        VkSubmitInfo submit_info{};
-        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submit_info.commandBufferCount = 1;
-        submit_info.pCommandBuffers = &command_buffer;
+    void Backend_FullRT::DestroyStorageImage(StorageImage& storage_image)
+    {
+        // An image that never made it into a submission must not be transitioned after it's gone
+        pendingTransitions.erase(std::remove_if(pendingTransitions.begin(), pendingTransitions.end(),
+            [&](const PendingTransition& transition) { return transition.image == storage_image.image; }),
+            pendingTransitions.end());
+        vkDestroyImageView(GetDevice(), storage_image.view, nullptr);
+        vkDestroyImage(GetDevice(), storage_image.image, nullptr);
+        GetMemoryAllocator().Free(storage_image.allocation);
+        storage_image.image = VK_NULL_HANDLE;
+    }
 
-        // Create fence to ensure that the command buffer has finished executing
-        VkFenceCreateInfo fence_info{};
-        fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fence_info.flags = 0;
+    void Backend_FullRT::RetireStorageImage(StorageImage& storage_image)
+    {
+        // Submitted frames and the UI frames before the next submission can still be using it
+        DeletionQueue& deletion_queue = GetDeletionQueue();
+        deletion_queue.EnqueueImageView(deletion_queue.GetNextValue(), storage_image.view);
+        deletion_queue.EnqueueImage(deletion_queue.GetNextValue(), storage_image.image, storage_image.allocation);
+        storage_image.image = VK_NULL_HANDLE;
+        storage_image.view = VK_NULL_HANDLE;
+        storage_image.allocation = {};
+    }
 
-        VkFence fence;
-        check_vk_result(vkCreateFence(GetDevice(), &fence_info, nullptr, &fence));
+    void Backend_FullRT::RecordPendingTransitions(VkCommandBuffer commandBuffer)
+    {
+        std::vector<VkImageMemoryBarrier> barriers;
+        for (const PendingTransition& transition : pendingTransitions)
+        {
+            VkImageMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = transition.layout == VK_IMAGE_LAYOUT_GENERAL ?
+                VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT : VK_ACCESS_SHADER_READ_BIT;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            barrier.newLayout = transition.layout;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.image = transition.image;
+            barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+            barriers.push_back(barrier);
+        }
+        if (!barriers.empty())
+        {
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                0, 0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+        }
+        pendingTransitions.clear();
+    }
 
-        // Submit to the queue
-        result = vkQueueSubmit(GetComputeQueue(), 1, &submit_info, fence);
-        // Wait for the fence to signal that command buffer has finished executing
-        check_vk_result(vkWaitForFences(GetDevice(), 1, &fence, VK_TRUE, UINT64_MAX));
+    void Backend_FullRT::CreateFrames()
+    {
+        VkPhysicalDeviceProperties device_properties;
+        vkGetPhysicalDeviceProperties(GetPhysicalDevice(), &device_properties);
+        const VkDeviceSize alignment = device_properties.limits.minUniformBufferOffsetAlignment;
+        uniform_slice_size = (sizeof(UniformData) + alignment - 1) / alignment * alignment;
+        uniform_ring = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(), uniform_slice_size * framesInFlight,
+            VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+        frames.resize(framesInFlight);
+        for (uint32_t i = 0; i < framesInFlight; i++)
+        {
+            CreateStorageImage(frames[i].storage_image, VK_FORMAT_B8G8R8A8_UNORM, OutputImageLayout);
+            frames[i].uniform_offset = uniform_slice_size * i;
+        }
+        currentFrame = 0;
+        lastSubmittedFrame = 0;
+
+        // A query slot per frame in flight, so reading one frame's times never waits on another. The trace is
+        // the only region recorded per frame, so one region per slot is enough
+        const uint32_t render_family = GetApp().g_QueueFamily[0];
+        frameProfiler.Init(framesInFlight, 1, render_family, "Render queue");
+        updateProfiler.Init(framesInFlight, 1, render_family, "Render queue");
+    }
 
-        vkDestroyFence(GetDevice(), fence, nullptr);
-        vkFreeCommandBuffers(GetDevice(), imageCmdPool, 1, &command_buffer);
-        vkDestroyCommandPool(GetDevice(), imageCmdPool, nullptr);
+    void Backend_FullRT::DestroyFrames()
+    {
+        for (FrameData& frame : frames)
+        {
+            DestroyStorageImage(frame.storage_image);
+        }
+        frames.clear();
+        uniform_ring.reset();
+        frameProfiler.Destroy();
+        updateProfiler.Destroy();
     }
 
     /*
@@ -295,15 +230,23 @@ namespace PBEngine
         result_image_layout_binding.descriptorCount = 1;
         result_image_layout_binding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
 
-        /*VkDescriptorSetLayoutBinding uniform_buffer_binding{};
+        VkDescriptorSetLayoutBinding uniform_buffer_binding{};
         uniform_buffer_binding.binding = 2;
         uniform_buffer_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
         uniform_buffer_binding.descriptorCount = 1;
-        uniform_buffer_binding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;*/
+        uniform_buffer_binding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+
+        VkDescriptorSetLayoutBinding accumulation_image_layout_binding{};
+        accumulation_image_layout_binding.binding = 3;
+        accumulation_image_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        accumulation_image_layout_binding.descriptorCount = 1;
+        accumulation_image_layout_binding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
 
         std::vector<VkDescriptorSetLayoutBinding> bindings = {
             acceleration_structure_layout_binding,
-            result_image_layout_binding };
+            result_image_layout_binding,
+            uniform_buffer_binding,
+            accumulation_image_layout_binding };
 
         VkDescriptorSetLayoutCreateInfo layout_info{};
         layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -320,121 +263,126 @@ namespace PBEngine
 
         /*
             Setup ray tracing shader groups
-            Each shader group points at the corresponding shader in the pipeline
+            Each shader group points at the corresponding shader in its library. The linked pipeline numbers
+            the groups in the order the libraries are added: raygen, miss, then the hit groups.
         */
-        std::vector<VkPipelineShaderStageCreateInfo> shader_stages;
+        // Payload is a single vec4
+        pipelineBuilder = std::make_unique<RayTracingPipelineBuilder>(pipeline_layout, 1, static_cast<uint32_t>(sizeof(float) * 4));
 
-        // Ray generation group
+        // Ray generation and miss groups, shared by every material
         {
-            const char* source = R"(
-#version 460
-#extension GL_EXT_ray_tracing : enable
-
-layout(binding = 0, set = 0) uniform accelerationStructureEXT topLevelAS;
-layout(binding = 1, set = 0, rgba8) uniform image2D image;
-
-layout(location = 0) rayPayloadEXT vec4 hitValue;
+            RayTracingPipelineBuilder::Library library;
+            library.shaders = {
+                { GLSLCompiler::get_shader_path("raygen.rgen"), VK_SHADER_STAGE_RAYGEN_BIT_KHR },
+                { GLSLCompiler::get_shader_path("miss.rmiss"), VK_SHADER_STAGE_MISS_BIT_KHR } };
 
-void main() 
-{
-	const vec2 pixelCenter = vec2(gl_LaunchIDEXT.xy) + vec2(0.5);
-	const vec2 inUV = pixelCenter/vec2(gl_LaunchSizeEXT.xy);
-	vec2 d = inUV * 2.0 - 1.0;
-
-    vec4 origin = vec4(d.x, -d.y, -2.438, 1);
-	vec4 direction = vec4(0, 0, 1, 0);
-
-	float tmin = 0.001;
-	float tmax = 10000.0;
-
-    hitValue = vec4(0.0);
-
-    traceRayEXT(topLevelAS, // Top level acceleraion structure
-        gl_RayFlagsOpaqueEXT, // No flags
-        0xff, // Instance mask
-        0, // Ray type
-        0, // Number of ray types
-        0, // Miss shader index
-        origin.xyz, // Ray origin
-        tmin, // Minimum t value
-        direction.xyz, // Direction
-        tmax, // Minimum t value
-        0); // Payload location
-
-	imageStore(image, ivec2(gl_LaunchIDEXT.xy), hitValue);
-})";
-            VkPipelineShaderStageCreateInfo shaderStage = GLSLCompiler::load_shader(source, VK_SHADER_STAGE_RAYGEN_BIT_KHR, false);
-            shader_stages.push_back(std::move(shaderStage));
-            shaderModules.push_back(shaderStage.module);
             VkRayTracingShaderGroupCreateInfoKHR raygen_group_ci{};
             raygen_group_ci.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
             raygen_group_ci.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
-            raygen_group_ci.generalShader = static_cast<uint32_t>(shader_stages.size()) - 1;
+            raygen_group_ci.generalShader = 0;
             raygen_group_ci.closestHitShader = VK_SHADER_UNUSED_KHR;
             raygen_group_ci.anyHitShader = VK_SHADER_UNUSED_KHR;
             raygen_group_ci.intersectionShader = VK_SHADER_UNUSED_KHR;
-            shader_groups.push_back(raygen_group_ci);
-        }
-
-        // Ray miss group
-        {
-            const char* source = R"(
-#version 460 core
-#extension GL_EXT_ray_tracing : enable
-layout(location = 0) rayPayloadInEXT vec4 payload;
+            library.groups.push_back(raygen_group_ci);
 
-void main() {
-    payload = vec4(51./255, 51./255, 51./255, 1.0);
-})";
-            VkPipelineShaderStageCreateInfo shaderStage = GLSLCompiler::load_shader(source, VK_SHADER_STAGE_MISS_BIT_KHR, false);
-            shader_stages.push_back(std::move(shaderStage));
-            shaderModules.push_back(shaderStage.module);
             VkRayTracingShaderGroupCreateInfoKHR miss_group_ci{};
             miss_group_ci.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
             miss_group_ci.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
-            miss_group_ci.generalShader = static_cast<uint32_t>(shader_stages.size()) - 1;
+            miss_group_ci.generalShader = 1;
             miss_group_ci.closestHitShader = VK_SHADER_UNUSED_KHR;
             miss_group_ci.anyHitShader = VK_SHADER_UNUSED_KHR;
             miss_group_ci.intersectionShader = VK_SHADER_UNUSED_KHR;
-            shader_groups.push_back(miss_group_ci);
+            library.groups.push_back(miss_group_ci);
+
+            pipelineBuilder->AddLibrary(library);
         }
 
-        // Ray closest hit group
+        // Ray closest hit group, one library per material
         {
-            const char* source = R"(
-#version 460 core
-#extension GL_EXT_ray_tracing : enable
-layout(location = 0) rayPayloadInEXT vec4 payload;
+            RayTracingPipelineBuilder::Library library;
+            library.shaders = {
+                { GLSLCompiler::get_shader_path("closesthit.rchit"), VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR } };
 
-void main() {
-    payload = vec4(0.0, 1.0, 0.0, 1.0);
-})";
-            VkPipelineShaderStageCreateInfo shaderStage = GLSLCompiler::load_shader(source, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, false);
-            shader_stages.push_back(std::move(shaderStage));
-            shaderModules.push_back(shaderStage.module);
             VkRayTracingShaderGroupCreateInfoKHR closes_hit_group_ci{};
             closes_hit_group_ci.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
             closes_hit_group_ci.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
             closes_hit_group_ci.generalShader = VK_SHADER_UNUSED_KHR;
-            closes_hit_group_ci.closestHitShader = static_cast<uint32_t>(shader_stages.size()) - 1;
+            closes_hit_group_ci.closestHitShader = 0;
             closes_hit_group_ci.anyHitShader = VK_SHADER_UNUSED_KHR;
             closes_hit_group_ci.intersectionShader = VK_SHADER_UNUSED_KHR;
-            shader_groups.push_back(closes_hit_group_ci);
+            library.groups.push_back(closes_hit_group_ci);
+
+            pipelineBuilder->AddLibrary(library);
         }
 
-        /*
-            Create the ray tracing pipeline
-        */
-        VkRayTracingPipelineCreateInfoKHR raytracing_pipeline_create_info{};
-        raytracing_pipeline_create_info.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
-        raytracing_pipeline_create_info.stageCount = static_cast<uint32_t>(shader_stages.size());
-        raytracing_pipeline_create_info.pStages = shader_stages.data();
-        raytracing_pipeline_create_info.groupCount = static_cast<uint32_t>(shader_groups.size());
-        raytracing_pipeline_create_info.pGroups = shader_groups.data();
-        raytracing_pipeline_create_info.maxPipelineRayRecursionDepth = 1;
-        raytracing_pipeline_create_info.layout = pipeline_layout;
-        check_vk_result(vkCreateRayTracingPipelinesKHR(GetDevice(), VK_NULL_HANDLE, VK_NULL_HANDLE, 1,
-            &raytracing_pipeline_create_info, nullptr, &pipeline));
+        PipelineBuild build = BuildPipeline();
+        if (build.pipeline == VK_NULL_HANDLE)
+        {
+            fprintf(stderr, "Couldn't create the ray tracing pipeline from the shaders in %s\n", PB_SHADER_DIRECTORY);
+            abort();
+        }
+        pipeline = build.pipeline;
+
+        // Picks up edits to the shaders from now on
+        shaderWatcher = std::make_unique<FileWatcher>();
+        for (const char* name : { "raygen.rgen", "miss.rmiss", "closesthit.rchit" })
+        {
+            shaderWatcher->Watch(GLSLCompiler::get_shader_path(name));
+        }
+    }
+
+    Backend_FullRT::PipelineBuild Backend_FullRT::BuildPipeline()
+    {
+        PB_TRACE_SCOPE("Build ray tracing pipeline");
+        PipelineBuild build;
+        build.pipeline = pipelineBuilder->Build(build.replaced);
+        if (build.pipeline != VK_NULL_HANDLE)
+        {
+            const RayTracingPipelineBuilder::Statistics& stats = pipelineBuilder->GetStatistics();
+            printf("Ray tracing pipeline: compiled %u of %u libraries in %.2f ms, linked in %.2f ms\n", stats.compiledLibraries,
+                stats.totalLibraries, stats.compileSeconds * 1000.0, stats.linkSeconds * 1000.0);
+        }
+        return build;
+    }
+
+    void Backend_FullRT::UpdateShaderHotReload()
+    {
+        if (shaderWatcher && shaderWatcher->ConsumeChanges() && !pipelineBuild.valid())
+        {
+            // Compiling takes long enough to notice, so it stays off the render thread
+            pipelineBuild = std::async(std::launch::async, [this]() { return BuildPipeline(); });
+        }
+
+        if (pipelineBuild.valid() && pipelineBuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            PipelineBuild build = pipelineBuild.get();
+            if (build.pipeline == VK_NULL_HANDLE)
+            {
+                fprintf(stderr, "Shader reload failed, keeping the previous pipeline\n");
+            }
+            else
+            {
+                // Frames in flight still reference the old pipeline and binding tables. Every frame re-records
+                // before it's submitted again, so nothing after the last submission touches them.
+                DeletionQueue& deletion_queue = GetDeletionQueue();
+                const uint64_t last_use = deletion_queue.GetSubmittedValue();
+                deletion_queue.EnqueuePipeline(last_use, pipeline);
+                deletion_queue.Enqueue(last_use, [replaced = std::move(build.replaced)]() mutable
+                    {
+                        RayTracingPipelineBuilder::Release(replaced);
+                    });
+                deletion_queue.Enqueue(last_use, std::move(raygen_shader_binding_table));
+                deletion_queue.Enqueue(last_use, std::move(miss_shader_binding_table));
+                deletion_queue.Enqueue(last_use, std::move(hit_shader_binding_table));
+                pipelineGeneration++;
+
+                // Each frame picks the new pipeline up in Render once it's done with the old one
+                pipeline = build.pipeline;
+                CreateShaderBindingTables();
+                ResetAccumulation();
+                printf("Reloaded shaders\n");
+            }
+        }
     }
 
     inline uint32_t aligned_size(uint32_t value, uint32_t alignment)
@@ -447,11 +395,13 @@ void main() {
         const uint32_t           handle_size = ray_tracing_pipeline_properties.shaderGroupHandleSize;
         const uint32_t           handle_size_aligned = aligned_size(ray_tracing_pipeline_properties.shaderGroupHandleSize, ray_tracing_pipeline_properties.shaderGroupHandleAlignment);
         const uint32_t           handle_alignment = ray_tracing_pipeline_properties.shaderGroupHandleAlignment;
-        const uint32_t           group_count = static_cast<uint32_t>(shader_groups.size());
+        const uint32_t           group_count = pipelineBuilder->GetGroupCount();
         const uint32_t           sbt_size = group_count * handle_size_aligned;
-        const VkBufferUsageFlags sbt_buffer_usage_flags = VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+        const VkBufferUsageFlags sbt_buffer_usage_flags = VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
 
-        VkBufferCreateFlags bufferCreateFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        // Read by every ray, so they live in device local memory
+        VkMemoryPropertyFlags bufferCreateFlags = GetUploadManager().GetDeviceLocalProperties();
         // Raygen
         // Create binding table buffers for each shader type
         raygen_shader_binding_table = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(), handle_size, sbt_buffer_usage_flags,
@@ -465,38 +415,42 @@ void main() {
         std::vector<uint8_t> shader_handle_storage(sbt_size);
         check_vk_result(vkGetRayTracingShaderGroupHandlesKHR(GetDevice(), pipeline, 0, group_count, sbt_size, shader_handle_storage.data()));
 
-        // Copy the shader handles from the host buffer to the binding tables
-        uint8_t* data = static_cast<uint8_t*>(raygen_shader_binding_table->map());
-        memcpy(data, shader_handle_storage.data(), handle_size);
-        data = static_cast<uint8_t*>(miss_shader_binding_table->map());
-        memcpy(data, shader_handle_storage.data() + handle_size_aligned, handle_size);
-        data = static_cast<uint8_t*>(hit_shader_binding_table->map());
-        memcpy(data, shader_handle_storage.data() + handle_size_aligned * 2, handle_size);
-        raygen_shader_binding_table->unmap();
-        miss_shader_binding_table->unmap();
-        hit_shader_binding_table->unmap();
+        // Copy the shader handles from the host buffer to the binding tables, handed over to the render family
+        // that traces with them. Frames submitted afterwards are ordered behind the copies.
+        const uint32_t render_family = GetApp().g_QueueFamily[0];
+        GetUploadManager().Upload(*raygen_shader_binding_table, shader_handle_storage.data(), handle_size, 0, render_family);
+        GetUploadManager().Upload(*miss_shader_binding_table, shader_handle_storage.data() + handle_size_aligned, handle_size, 0, render_family);
+        GetUploadManager().Upload(*hit_shader_binding_table, shader_handle_storage.data() + handle_size_aligned * 2, handle_size, 0, render_family);
+        GetUploadManager().Flush();
     }
 
     void Backend_FullRT::CreateDescriptorSets()
     {
+        const uint32_t frame_count = static_cast<uint32_t>(frames.size());
         std::vector<VkDescriptorPoolSize> pool_sizes = {
-            {VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
-            {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1} };// ,
-            //{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1} };
+            {VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, frame_count},
+            {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, frame_count * 2},
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frame_count} };
         VkDescriptorPoolCreateInfo descriptor_pool_create_info{};
         descriptor_pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
         descriptor_pool_create_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
         descriptor_pool_create_info.pPoolSizes = pool_sizes.data();
-        descriptor_pool_create_info.maxSets = 1;
+        descriptor_pool_create_info.maxSets = frame_count;
         descriptor_pool_create_info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
         check_vk_result(vkCreateDescriptorPool(GetDevice(), &descriptor_pool_create_info, nullptr, &descriptor_pool));
 
+        std::vector<VkDescriptorSetLayout> set_layouts(frame_count, descriptor_set_layout);
+        std::vector<VkDescriptorSet> descriptor_sets(frame_count);
         VkDescriptorSetAllocateInfo descriptor_set_allocate_info{};
         descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
         descriptor_set_allocate_info.descriptorPool = descriptor_pool;
-        descriptor_set_allocate_info.pSetLayouts = &descriptor_set_layout;
-        descriptor_set_allocate_info.descriptorSetCount = 1;
-        check_vk_result(vkAllocateDescriptorSets(GetDevice(), &descriptor_set_allocate_info, &descriptor_set));
+        descriptor_set_allocate_info.pSetLayouts = set_layouts.data();
+        descriptor_set_allocate_info.descriptorSetCount = frame_count;
+        check_vk_result(vkAllocateDescriptorSets(GetDevice(), &descriptor_set_allocate_info, descriptor_sets.data()));
+        for (uint32_t i = 0; i < frame_count; i++)
+        {
+            frames[i].descriptor_set = descriptor_sets[i];
+        }
 
         // Setup the descriptor for binding our top level acceleration structure to the ray tracing shaders
         VkAccelerationStructureKHR sceneHandle = (*scene).GetHandle();
@@ -505,44 +459,71 @@ void main() {
         descriptor_acceleration_structure_info.accelerationStructureCount = 1;
         descriptor_acceleration_structure_info.pAccelerationStructures = &sceneHandle;
 
-        VkWriteDescriptorSet acceleration_structure_write{};
-        acceleration_structure_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        acceleration_structure_write.dstSet = descriptor_set;
-        acceleration_structure_write.dstBinding = 0;
-        acceleration_structure_write.descriptorCount = 1;
-        acceleration_structure_write.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
-        // The acceleration structure descriptor has to be chained via pNext
-        acceleration_structure_write.pNext = &descriptor_acceleration_structure_info;
+        std::vector<VkDescriptorBufferInfo> buffer_descriptors(frames.size());
+        std::vector<VkWriteDescriptorSet> write_descriptor_sets;
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            FrameData& frame = frames[i];
+            VkWriteDescriptorSet acceleration_structure_write{};
+            acceleration_structure_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            acceleration_structure_write.dstSet = frame.descriptor_set;
+            acceleration_structure_write.dstBinding = 0;
+            acceleration_structure_write.descriptorCount = 1;
+            acceleration_structure_write.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+            // The acceleration structure descriptor has to be chained via pNext
+            acceleration_structure_write.pNext = &descriptor_acceleration_structure_info;
+            write_descriptor_sets.push_back(acceleration_structure_write);
+
+            VkDescriptorBufferInfo& buffer_descriptor = buffer_descriptors[i];
+            buffer_descriptor.buffer = uniform_ring->get_handle();
+            buffer_descriptor.offset = frame.uniform_offset;
+            buffer_descriptor.range = sizeof(UniformData);
+
+            VkWriteDescriptorSet uniform_buffer_write{};
+            uniform_buffer_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            uniform_buffer_write.dstSet = frame.descriptor_set;
+            uniform_buffer_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            uniform_buffer_write.dstBinding = 2;
+            uniform_buffer_write.pBufferInfo = &buffer_descriptor;
+            uniform_buffer_write.descriptorCount = 1;
+            write_descriptor_sets.push_back(uniform_buffer_write);
+        }
 
+        vkUpdateDescriptorSets(GetDevice(), static_cast<uint32_t>(write_descriptor_sets.size()), write_descriptor_sets.data(), 0, VK_NULL_HANDLE);
+        for (FrameData& frame : frames)
+        {
+            UpdateStorageImageDescriptors(frame);
+        }
+    }
+
+    void Backend_FullRT::UpdateStorageImageDescriptors(FrameData& frame)
+    {
+        // Each frame's set points at that frame's own storage image, and all of them at the one accumulation image
         VkDescriptorImageInfo image_descriptor{};
-        image_descriptor.imageView = storage_image.view;
+        image_descriptor.imageView = frame.storage_image.view;
         image_descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
-        /*VkDescriptorBufferInfo buffer_descriptor{};
-        buffer_descriptor.buffer = (*ubo).get_handle();
-        buffer_descriptor.range = (*ubo).get_size();*/
+        VkDescriptorImageInfo accumulation_descriptor{};
+        accumulation_descriptor.imageView = accumulation_image.view;
+        accumulation_descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 
-        VkWriteDescriptorSet result_image_write{};
+        VkWriteDescriptorSet write_descriptor_sets[2]{};
+        VkWriteDescriptorSet& result_image_write = write_descriptor_sets[0];
         result_image_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        result_image_write.dstSet = descriptor_set;
+        result_image_write.dstSet = frame.descriptor_set;
         result_image_write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
         result_image_write.dstBinding = 1;
         result_image_write.pImageInfo = &image_descriptor;
         result_image_write.descriptorCount = 1;
 
-        /*VkWriteDescriptorSet uniform_buffer_write{};
-        uniform_buffer_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        uniform_buffer_write.dstSet = descriptor_set;
-        uniform_buffer_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        uniform_buffer_write.dstBinding = 2;
-        uniform_buffer_write.pBufferInfo = &buffer_descriptor;
-        uniform_buffer_write.descriptorCount = 1;*/
-
-        std::vector<VkWriteDescriptorSet> write_descriptor_sets = {
-            acceleration_structure_write,
-            result_image_write };//,
-            //uniform_buffer_write };
-        vkUpdateDescriptorSets(GetDevice(), static_cast<uint32_t>(write_descriptor_sets.size()), write_descriptor_sets.data(), 0, VK_NULL_HANDLE);
+        VkWriteDescriptorSet& accumulation_image_write = write_descriptor_sets[1];
+        accumulation_image_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        accumulation_image_write.dstSet = frame.descriptor_set;
+        accumulation_image_write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        accumulation_image_write.dstBinding = 3;
+        accumulation_image_write.pImageInfo = &accumulation_descriptor;
+        accumulation_image_write.descriptorCount = 1;
+        vkUpdateDescriptorSets(GetDevice(), 2, write_descriptor_sets, 0, VK_NULL_HANDLE);
     }
 
     void Backend_FullRT::CreateCommandPool()
@@ -550,6 +531,8 @@ void main() {
         VkCommandPoolCreateInfo command_pool_info = {};
         command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
         command_pool_info.queueFamilyIndex = GetApp().g_QueueFamily[0];
+        // The scene update command buffers are re-recorded individually whenever instances change
+        command_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
         check_vk_result(vkCreateCommandPool(GetDevice(), &command_pool_info, nullptr, &cmd_pool));
     }
 
@@ -631,12 +614,12 @@ void main() {
             // If the view port size has changed, we need to recreate the storage image
             vkDestroyImageView(GetDevice(), storage_image.view, nullptr);
             vkDestroyImage(GetDevice(), storage_image.image, nullptr);
-            vkFreeMemory(GetDevice(), storage_image.memory, nullptr);
+            GetMemoryAllocator().Free(storage_image.allocation);
             CreateStorageImage();
             // The view image too
             vkDestroyImageView(GetDevice(), storage_image.view, nullptr);
             vkDestroyImage(GetDevice(), storage_image.image, nullptr);
-            vkFreeMemory(GetDevice(), storage_image.memory, nullptr);
+            GetMemoryAllocator().Free(storage_image.allocation);
             CreateViewImage();
             // The descriptor also needs to be updated to reference the new image
             VkDescriptorImageInfo image_descriptor{};
@@ -652,134 +635,292 @@ void main() {
             vkUpdateDescriptorSets(GetDevice(), 1, &result_image_write, 0, VK_NULL_HANDLE);
         }*/
 
-        uint32_t imagesInFlight = 1;
-
-        // Create one command buffer for each swap chain image and reuse for rendering
-        draw_cmd_buffers.resize(imagesInFlight);
-        drawBuffersFences.resize(imagesInFlight);
+        // One command buffer per frame in flight, each tracing into its own storage image
+        std::vector<VkCommandBuffer> command_buffers(frames.size());
 
         VkCommandBufferAllocateInfo allocate_info{};
         allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
         allocate_info.commandPool = cmd_pool;
         allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocate_info.commandBufferCount = static_cast<uint32_t>(draw_cmd_buffers.size());
+        allocate_info.commandBufferCount = static_cast<uint32_t>(command_buffers.size());
+
+        check_vk_result(vkAllocateCommandBuffers(GetDevice(), &allocate_info, command_buffers.data()));
 
-        check_vk_result(vkAllocateCommandBuffers(GetDevice(), &allocate_info, draw_cmd_buffers.data()));
+        // Recorded in Render, only on frames where the scene changed
+        std::vector<VkCommandBuffer> update_command_buffers(frames.size());
+        check_vk_result(vkAllocateCommandBuffers(GetDevice(), &allocate_info, update_command_buffers.data()));
+        for (size_t i = 0; i < frames.size(); ++i)
+        {
+            frames[i].update_command_buffer = update_command_buffers[i];
+        }
 
+        for (size_t i = 0; i < frames.size(); ++i)
+        {
+            FrameData& frame = frames[i];
+            frame.command_buffer = command_buffers[i];
+
+            // Created signaled so the first Render of every frame doesn't wait on anything
+            VkFenceCreateInfo fenceCreateInfo{};
+            fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+            check_vk_result(vkCreateFence(GetDevice(), &fenceCreateInfo, nullptr, &frame.fence));
+
+            RecordFrameCommands(frame);
+        }
+    }
+
+    void Backend_FullRT::RecordFrameCommands(FrameData& frame)
+    {
         VkCommandBufferBeginInfo command_buffer_begin_info{};
         command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
         VkImageSubresourceRange subresource_range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
 
-        for (int32_t i = 0; i < draw_cmd_buffers.size(); ++i)
-        {
-            check_vk_result(vkBeginCommandBuffer(draw_cmd_buffers[i], &command_buffer_begin_info));
-
-            /*
-                Setup the strided device address regions pointing at the shader identifiers in the shader binding table
-            */
+        check_vk_result(vkBeginCommandBuffer(frame.command_buffer, &command_buffer_begin_info));
+        const uint32_t slot = static_cast<uint32_t>(&frame - frames.data());
+        frameProfiler.BeginSlot(frame.command_buffer, slot);
 
-            const uint32_t handle_size_aligned = aligned_size(ray_tracing_pipeline_properties.shaderGroupHandleSize, ray_tracing_pipeline_properties.shaderGroupHandleAlignment);
+        /*
+            Setup the strided device address regions pointing at the shader identifiers in the shader binding table
+        */
 
-            VkStridedDeviceAddressRegionKHR raygen_shader_sbt_entry{};
-            raygen_shader_sbt_entry.deviceAddress = GetBufferDeviceAddress_Renderer(raygen_shader_binding_table->get_handle());
-            raygen_shader_sbt_entry.stride = handle_size_aligned;
-            raygen_shader_sbt_entry.size = handle_size_aligned;
+        const uint32_t handle_size_aligned = aligned_size(ray_tracing_pipeline_properties.shaderGroupHandleSize, ray_tracing_pipeline_properties.shaderGroupHandleAlignment);
+
+        VkStridedDeviceAddressRegionKHR raygen_shader_sbt_entry{};
+        raygen_shader_sbt_entry.deviceAddress = GetBufferDeviceAddress_Renderer(raygen_shader_binding_table->get_handle());
+        raygen_shader_sbt_entry.stride = handle_size_aligned;
+        raygen_shader_sbt_entry.size = handle_size_aligned;
+
+        VkStridedDeviceAddressRegionKHR miss_shader_sbt_entry{};
+        miss_shader_sbt_entry.deviceAddress = GetBufferDeviceAddress_Renderer(miss_shader_binding_table->get_handle());
+        miss_shader_sbt_entry.stride = handle_size_aligned;
+        miss_shader_sbt_entry.size = handle_size_aligned;
+
+        VkStridedDeviceAddressRegionKHR hit_shader_sbt_entry{};
+        hit_shader_sbt_entry.deviceAddress = GetBufferDeviceAddress_Renderer(hit_shader_binding_table->get_handle());
+        hit_shader_sbt_entry.stride = handle_size_aligned;
+        hit_shader_sbt_entry.size = handle_size_aligned;
+
+        VkStridedDeviceAddressRegionKHR callable_shader_sbt_entry{};
+
+        /*VkDebugUtilsLabelEXT debuggerMessage{};
+        debuggerMessage.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT;
+        debuggerMessage.pLabelName = "RT Rendering \"Swapchain\" Image";
+        vkCmdInsertDebugUtilsLabelEXT(frame.command_buffer, &debuggerMessage);*/
+
+        // The previous frame may still be adding its sample to the accumulation image
+        VkMemoryBarrier accumulation_barrier{};
+        accumulation_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        accumulation_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        accumulation_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+        // UI frames submitted before this one may still be sampling this frame's image from its last trace
+        VkImageMemoryBarrier output_barrier{};
+        output_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        output_barrier.srcAccessMask = 0;
+        output_barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        output_barrier.oldLayout = OutputImageLayout;
+        output_barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        output_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        output_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        output_barrier.image = frame.storage_image.image;
+        output_barrier.subresourceRange = subresource_range;
+        vkCmdPipelineBarrier(frame.command_buffer,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &accumulation_barrier, 0, nullptr, 1, &output_barrier);
 
-            VkStridedDeviceAddressRegionKHR miss_shader_sbt_entry{};
-            miss_shader_sbt_entry.deviceAddress = GetBufferDeviceAddress_Renderer(miss_shader_binding_table->get_handle());
-            miss_shader_sbt_entry.stride = handle_size_aligned;
-            miss_shader_sbt_entry.size = handle_size_aligned;
+        /*
+            Dispatch the ray tracing commands
+        */
+        {
+            vkCmdBindPipeline(frame.command_buffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline);
+            vkCmdBindDescriptorSets(frame.command_buffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline_layout, 0, 1, &frame.descriptor_set, 0, 0);
+        }
 
-            VkStridedDeviceAddressRegionKHR hit_shader_sbt_entry{};
-            hit_shader_sbt_entry.deviceAddress = GetBufferDeviceAddress_Renderer(hit_shader_binding_table->get_handle());
-            hit_shader_sbt_entry.stride = handle_size_aligned;
-            hit_shader_sbt_entry.size = handle_size_aligned;
+        const uint32_t trace_region = frameProfiler.BeginRegion(frame.command_buffer, slot, "Trace rays");
+        vkCmdTraceRaysKHR(
+            frame.command_buffer,
+            &raygen_shader_sbt_entry,
+            &miss_shader_sbt_entry,
+            &hit_shader_sbt_entry,
+            &callable_shader_sbt_entry,
+            renderWidth,
+            renderHeight,
+            1);
+        frameProfiler.EndRegion(frame.command_buffer, slot, trace_region);
+
+        // Hand the image over to the UI, which samples it without a copy in its next submission
+        output_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        output_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        output_barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        output_barrier.newLayout = OutputImageLayout;
+        vkCmdPipelineBarrier(frame.command_buffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &output_barrier);
+
+        check_vk_result(vkEndCommandBuffer(frame.command_buffer));
+        frame.pipeline_generation = pipelineGeneration;
+        frame.image_generation = imageGeneration;
+        frame.trace_width = renderWidth;
+        frame.trace_height = renderHeight;
+    }
 
-            VkStridedDeviceAddressRegionKHR callable_shader_sbt_entry{};
+    void Backend_FullRT::DestroyDrawBuffers()
+    {
+        for (FrameData& frame : frames)
+        {
+            vkDestroyFence(GetDevice(), frame.fence, nullptr);
+            vkFreeCommandBuffers(GetDevice(), cmd_pool, 1, &frame.command_buffer);
+            vkFreeCommandBuffers(GetDevice(), cmd_pool, 1, &frame.update_command_buffer);
+            frame.fence = VK_NULL_HANDLE;
+            frame.command_buffer = VK_NULL_HANDLE;
+            frame.update_command_buffer = VK_NULL_HANDLE;
+        }
+    }
 
-            /*VkDebugUtilsLabelEXT debuggerMessage{};
-            debuggerMessage.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT;
-            debuggerMessage.pLabelName = "RT Rendering \"Swapchain\" Image";
-            vkCmdInsertDebugUtilsLabelEXT(draw_cmd_buffers[i], &debuggerMessage);*/
+    // Memory saved by compaction, per mesh and in total
+    static void PrintCompaction(const BLASBuilder& builder, const std::vector<std::string>& names)
+    {
+        const std::vector<BLASCompaction>& compactions = builder.GetCompactions();
+        if (compactions.empty())
+        {
+            return;
+        }
+        for (size_t i = 0; i < compactions.size(); i++)
+        {
+            const BLASCompaction& compaction = compactions[i];
+            printf("  %-24s %8.2f KB -> %8.2f KB\n", i < names.size() ? names[i].c_str() : "", compaction.originalSize / 1024.0,
+                compaction.compactedSize / 1024.0);
+        }
+        const BLASBuildStats& stats = builder.GetStats();
+        const double saved = static_cast<double>(stats.originalBytes - stats.compactedBytes);
+        printf("  BLAS compaction: %.2f MB -> %.2f MB, saved %.1f%% in %.2f ms\n", stats.originalBytes / (1024.0 * 1024.0),
+            stats.compactedBytes / (1024.0 * 1024.0), stats.originalBytes > 0 ? saved * 100.0 / stats.originalBytes : 0.0,
+            stats.compactSeconds * 1000.0);
+    }
 
-            /*
-                Dispatch the ray tracing commands
-            */
+    void Backend_FullRT::LoadScene()
+    {
+        // One copy of the instances per frame in flight, so moving them never has to wait for the GPU
+        scene = std::make_unique<TLAS>();
+        (*scene).SetRingSize(framesInFlight);
+        if (IsSceneFilePath(scenePath))
+        {
+            if (LoadSceneFile())
             {
-                std::vector<VkDescriptorSet> descSetArray;
-                descSetArray.push_back(descriptor_set);
-                vkCmdBindPipeline(draw_cmd_buffers[i], VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline);
-                vkCmdBindDescriptorSets(draw_cmd_buffers[i], VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline_layout, 0, 1, descSetArray.data(), 0, 0);
+                (*scene).BuildTLAS();
+                return;
             }
+            fprintf(stderr, "Couldn't load %s, rendering the built in triangle instead\n", scenePath.c_str());
+            scene = std::make_unique<TLAS>();
+            (*scene).SetRingSize(framesInFlight);
+        }
 
-            vkCmdTraceRaysKHR(
-                draw_cmd_buffers[i],
-                &raygen_shader_sbt_entry,
-                &miss_shader_sbt_entry,
-                &hit_shader_sbt_entry,
-                &callable_shader_sbt_entry,
-                static_cast<uint32_t>(truncf(*viewportWidth)),
-                static_cast<uint32_t>(truncf(*viewportHeight)),
-                1);
-
-            auto FormatTransfer = [=](VkImage image, VkImageLayout src = VK_IMAGE_LAYOUT_UNDEFINED,
-                VkImageLayout dst = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
-
-                VkImageMemoryBarrier barrier{};
-                barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-                barrier.srcAccessMask = {};
-                barrier.dstAccessMask = {};
-                barrier.oldLayout = src;
-                barrier.newLayout = dst;
-                barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-                barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-                barrier.image = image;
-                barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-
-                vkCmdPipelineBarrier(draw_cmd_buffers[i],
-                    VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
-                    VK_PIPELINE_STAGE_TRANSFER_BIT,
-                    0, 0, nullptr, 0, nullptr, 1, &barrier);
-            };
-
-            FormatTransfer(storage_image.image);
-            FormatTransfer(viewImage.image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-
-            VkImageCopy copyRegion{};
-
-            // Image extent 
-            copyRegion.extent.width = static_cast<uint32_t>(truncf(*viewportWidth));
-            copyRegion.extent.height = static_cast<uint32_t>(truncf(*viewportHeight));
-            copyRegion.extent.depth = 1;
-
-            // Aspect mask, typically COLOR for an RGB image
-            copyRegion.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            copyRegion.srcSubresource.layerCount = 1;
-            copyRegion.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            copyRegion.dstSubresource.layerCount = 1;
-
-            vkCmdCopyImage(draw_cmd_buffers[i],
-                storage_image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                viewImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                1, &copyRegion);
-
-            FormatTransfer(storage_image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
-            FormatTransfer(viewImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-            VkFenceCreateInfo fenceCreateInfo{};
-            fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-            fenceCreateInfo.flags = i == 0 ? VK_FENCE_CREATE_SIGNALED_BIT : 0;
-            vkCreateFence(GetDevice(), &fenceCreateInfo, nullptr, &drawBuffersFences[i]);
+        std::vector<MeshData> meshes;
+        MeshLoadStats load_stats;
+        if (!scenePath.empty() && !IsSceneFilePath(scenePath) && !LoadMeshFile(scenePath, meshes, &load_stats))
+        {
+            fprintf(stderr, "Couldn't load %s, rendering the built in triangle instead\n", scenePath.c_str());
+        }
+        if (meshes.empty())
+        {
+            AccelerationStructure structure = AccelerationStructure();
+            (*scene).AddBLAS(&structure);
+        }
+        else
+        {
+            BLASBuilder builder(App::g_CompactAccelerationStructures, BLASBuilder::DefaultScratchBudget,
+                App::g_HostAccelerationStructureBuilds);
+            std::vector<std::string> names;
+            uint64_t triangle_count = 0;
+            for (MeshData& mesh : meshes)
+            {
+                builder.Add(mesh.vertices.data(), static_cast<uint32_t>(mesh.vertices.size()),
+                    mesh.indices.data(), static_cast<uint32_t>(mesh.indices.size()));
+                names.push_back(std::move(mesh.name));
+                triangle_count += mesh.GetTriangleCount();
 
-            check_vk_result(vkEndCommandBuffer(draw_cmd_buffers[i]));
+                // The GPU has its own copy now
+                mesh = MeshData();
+            }
+            builder.Submit();
+            for (AccelerationStructure& structure : builder.TakeResults())
+            {
+                (*scene).AddBLAS(&structure);
+            }
+            const BLASBuildStats& build_stats = builder.GetStats();
+            printf("Scene %s: %zu meshes, %llu triangles, %.1f MB\n", scenePath.c_str(), meshes.size(),
+                static_cast<unsigned long long>(triangle_count), load_stats.fileBytes / (1024.0 * 1024.0));
+            printf("  parse %.2f ms on %u threads, upload %.2f ms, BLAS build %.2f ms on the %s in %u batches (%.2f ms GPU time)\n",
+                load_stats.parseSeconds * 1000.0, load_stats.threadCount, build_stats.uploadSeconds * 1000.0,
+                build_stats.buildSeconds * 1000.0, App::g_HostAccelerationStructureBuilds ? "CPU" : "GPU", build_stats.batchCount,
+                build_stats.gpuBuildSeconds * 1000.0);
+            PrintCompaction(builder, names);
         }
+        (*scene).BuildTLAS();
     }
 
-    void Backend_FullRT::DestroyDrawBuffers()
+    bool Backend_FullRT::LoadSceneFile()
     {
-        vkDestroyFence(GetDevice(), drawBuffersFences[0], nullptr);
-        vkFreeCommandBuffers(GetDevice(), cmd_pool, static_cast<uint32_t>(draw_cmd_buffers.size()), draw_cmd_buffers.data());
+        auto open_start = std::chrono::steady_clock::now();
+        SceneFile file;
+        if (!file.Open(scenePath))
+        {
+            return false;
+        }
+        const double open_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - open_start).count();
+
+        // Every mesh an instance uses is uploaded straight from the mapping once and built in one batch,
+        // later instances of the same mesh only add another TLAS instance
+        BLASBuilder builder(App::g_CompactAccelerationStructures, BLASBuilder::DefaultScratchBudget,
+            App::g_HostAccelerationStructureBuilds);
+        std::vector<uint32_t> structure_indices(file.GetMeshCount(), UINT32_MAX);
+        std::vector<std::string> names;
+        uint64_t triangle_count = 0;
+        for (uint32_t i = 0; i < file.GetInstanceCount(); i++)
+        {
+            const uint32_t mesh_index = file.GetInstance(i).mesh;
+            const SceneFileMesh& mesh = file.GetMesh(mesh_index);
+            triangle_count += mesh.indexCount / 3;
+            if (structure_indices[mesh_index] == UINT32_MAX)
+            {
+                structure_indices[mesh_index] = builder.Add(file.GetVertices(mesh_index), mesh.vertexCount,
+                    file.GetIndices(mesh_index), mesh.indexCount);
+                names.emplace_back(file.GetMeshName(mesh_index));
+            }
+        }
+        if (builder.GetStats().structureCount == 0)
+        {
+            return false;
+        }
+        builder.Submit();
+        std::vector<AccelerationStructure> structures = builder.TakeResults();
+
+        std::vector<uint32_t> blas_indices(structures.size(), UINT32_MAX);
+        for (uint32_t i = 0; i < file.GetInstanceCount(); i++)
+        {
+            const SceneFileInstance& instance = file.GetInstance(i);
+            VkTransformMatrixKHR transform;
+            memcpy(&transform, instance.transform, sizeof(transform));
+            const uint32_t structure_index = structure_indices[instance.mesh];
+            if (blas_indices[structure_index] == UINT32_MAX)
+            {
+                blas_indices[structure_index] = (*scene).AddBLAS(&structures[structure_index], transform);
+            }
+            else
+            {
+                (*scene).AddInstance(blas_indices[structure_index], transform);
+            }
+        }
+        const BLASBuildStats& build_stats = builder.GetStats();
+
+        printf("Scene %s: %u meshes, %u instances, %llu triangles, %.1f MB\n", scenePath.c_str(), file.GetMeshCount(),
+            file.GetInstanceCount(), static_cast<unsigned long long>(triangle_count),
+            file.GetHeader().fileSize / (1024.0 * 1024.0));
+        printf("  map %.2f ms, upload %.2f ms, BLAS build %.2f ms in %u batches (%.2f ms GPU time)\n", open_seconds * 1000.0,
+            build_stats.uploadSeconds * 1000.0, build_stats.buildSeconds * 1000.0, build_stats.batchCount,
+            build_stats.gpuBuildSeconds * 1000.0);
+        PrintCompaction(builder, names);
+        return true;
     }
 
     bool Backend_FullRT::Init(float *width, float *height) {
@@ -797,19 +938,19 @@ void main() {
         device_features.pNext = &acceleration_structure_features;
         vkGetPhysicalDeviceFeatures2(GetPhysicalDevice(), &device_features);
 
-        // This is where Acceleration Structures get generated from the secene's
-        // MeshRenderers (or whatever). This is not there yet.
-        AccelerationStructure structure = AccelerationStructure();
-        scene = std::make_unique<TLAS>();
-        (*scene).AddBLAS(&structure);
-        (*scene).BuildTLAS();
+        LoadScene();
 
         viewportWidth = width;
         viewportHeight = height;
+        renderWidth = ToPixels(*viewportWidth);
+        renderHeight = ToPixels(*viewportHeight);
+        imageWidth = GetImageBucket(renderWidth);
+        imageHeight = GetImageBucket(renderHeight);
 
         // Prepare Ray Tracing Pipeline
-        CreateStorageImage();
-        CreateViewImage();
+        CreateFrames();
+        CreateStorageImage(accumulation_image, VK_FORMAT_R32G32B32A32_SFLOAT);
+        CreateOutputSampler();
         CreateRayTracingPipeline();
         CreateShaderBindingTables();
         CreateDescriptorSets();
@@ -821,87 +962,349 @@ void main() {
 
     bool Backend_FullRT::Render()
     {
-        VkResult err = vkGetFenceStatus(GetDevice(), drawBuffersFences[0]);
-        if (err == VK_SUCCESS)
+        PB_TRACE_SCOPE("Backend_FullRT::Render");
+        UpdateShaderHotReload();
+
+        // A resized image or a new view makes the accumulated samples stale, including a converged image
+        camera.SetAspectRatio(static_cast<float>(renderWidth) / static_cast<float>(renderHeight));
+        if (camera.GetVersion() != cameraVersion)
+        {
+            cameraVersion = camera.GetVersion();
+            ResetAccumulation();
+        }
+
+        // Nothing left to add, the view image keeps showing the converged result
+        const bool scene_changed = scene && (*scene).IsDirty();
+        if (IsConverged() && !scene_changed && pendingTransitions.empty())
+        {
+            // No fence gets waited on while converged, so check them here or the deletion queue never drains
+            uint64_t finished_value = 0;
+            for (const FrameData& in_flight : frames)
+            {
+                if (vkGetFenceStatus(GetDevice(), in_flight.fence) == VK_SUCCESS)
+                {
+                    finished_value = std::max(finished_value, in_flight.submit_value);
+                }
+            }
+            GetDeletionQueue().Complete(finished_value);
+            return true;
+        }
+
+        // Only blocks when the GPU is a full framesInFlight behind, instead of dropping the frame.
+        // It also frees this frame's slot of the TLAS instance ring for the update below.
+        FrameData& frame = frames[currentFrame];
         {
-            vkWaitForFences(GetDevice(), 1, &drawBuffersFences[0], true, UINT32_MAX);
-            vkResetFences(GetDevice(), 1, &drawBuffersFences[0]);
+            PB_TRACE_SCOPE("Wait for frame fence");
+            check_vk_result(vkWaitForFences(GetDevice(), 1, &frame.fence, VK_TRUE, UINT64_MAX));
+        }
+        check_vk_result(vkResetFences(GetDevice(), 1, &frame.fence));
+        // Frees whatever was last used by this frame's previous submission or anything before it
+        GetDeletionQueue().Complete(frame.submit_value);
 
-            VkSubmitInfo submit_info{};
-            submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-            submit_info.commandBufferCount = 1;
-            submit_info.pCommandBuffers = &draw_cmd_buffers[0];
-            check_vk_result(vkQueueSubmit(GetRTQueue(), 1, &submit_info,  drawBuffersFences[0]));
+        // This frame's last submission is done, so its timestamps can be read without waiting
+        if (frameProfiler.Resolve(currentFrame))
+        {
+            profiledFrames++;
+        }
+        if (updateProfiler.Resolve(currentFrame))
+        {
+            profiledUpdates++;
         }
+
+        // The GPU is done with this frame's old command buffer and descriptor set, so they can move over to a
+        // reloaded pipeline, resized images or a new traced region
+        const bool images_changed = frame.image_generation != imageGeneration;
+        if (images_changed)
+        {
+            UpdateStorageImageDescriptors(frame);
+        }
+        if (images_changed || frame.pipeline_generation != pipelineGeneration || frame.trace_width != renderWidth ||
+            frame.trace_height != renderHeight)
+        {
+            check_vk_result(vkResetCommandBuffer(frame.command_buffer, 0));
+            RecordFrameCommands(frame);
+        }
+
+        // Moved instances and the first layout of new images go into the same submission as the trace, ahead of it
+        VkCommandBuffer command_buffers[2];
+        uint32_t command_buffer_count = 0;
+        const bool transitions = !pendingTransitions.empty();
+        if (scene_changed || transitions)
+        {
+            check_vk_result(vkResetCommandBuffer(frame.update_command_buffer, 0));
+            VkCommandBufferBeginInfo begin_info{};
+            begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            check_vk_result(vkBeginCommandBuffer(frame.update_command_buffer, &begin_info));
+            RecordPendingTransitions(frame.update_command_buffer);
+            bool recorded = false;
+            if (scene_changed)
+            {
+                updateProfiler.BeginSlot(frame.update_command_buffer, currentFrame);
+                const uint32_t update_region = updateProfiler.BeginRegion(frame.update_command_buffer, currentFrame, "TLAS update");
+                recorded = (*scene).RecordUpdate(frame.update_command_buffer, currentFrame);
+                updateProfiler.EndRegion(frame.update_command_buffer, currentFrame, update_region);
+            }
+            check_vk_result(vkEndCommandBuffer(frame.update_command_buffer));
+            if (recorded)
+            {
+                updateProfiler.MarkSubmitted(currentFrame);
+                ResetAccumulation();
+            }
+            if (recorded || transitions)
+            {
+                command_buffers[command_buffer_count++] = frame.update_command_buffer;
+            }
+        }
+        command_buffers[command_buffer_count++] = frame.command_buffer;
+
+        // The fence wait above means the GPU is done reading this frame's slice of the uniforms
+        uniform_data.view_inverse = camera.GetViewInverse();
+        uniform_data.proj_inverse = camera.GetProjectionInverse();
+        uniform_data.sample_count = sampleCount;
+        uniform_data.frame_index = frameIndex;
+        uniform_ring->convert_and_update(uniform_data, static_cast<size_t>(frame.uniform_offset));
+
+        VkSubmitInfo submit_info{};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.commandBufferCount = command_buffer_count;
+        submit_info.pCommandBuffers = command_buffers;
+        check_vk_result(vkQueueSubmit(GetRTQueue(), 1, &submit_info, frame.fence));
+        frameProfiler.MarkSubmitted(currentFrame);
+        frame.submit_value = GetDeletionQueue().Submit();
+
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (frameIndex > 0)
+        {
+            cpuFrameMilliseconds = std::chrono::duration<double, std::milli>(now - lastFrameTime).count();
+        }
+        lastFrameTime = now;
+
+        lastSubmittedFrame = currentFrame;
+        currentFrame = (currentFrame + 1) % static_cast<uint32_t>(frames.size());
+        sampleCount++;
+        frameIndex++;
         return true;
     }
 
-    bool Backend_FullRT::ResizeViewImage()
+    double Backend_FullRT::GetRaysPerSecond() const
     {
-        if (static_cast<uint32_t>(truncf(*viewportWidth)) != storage_image.width || static_cast<uint32_t>(truncf(*viewportHeight)) != storage_image.height)
+        const double trace_milliseconds = frameProfiler.GetMilliseconds("Trace rays");
+        if (trace_milliseconds <= 0.0 || frames.empty())
         {
-            // TODO: Make this use vkResetCommandBuffer or something like that (performance)
-            vkWaitForFences(GetDevice(), 1, &drawBuffersFences[0], false, UINT32_MAX);
-            DestroyDrawBuffers();
+            return 0.0;
+        }
+        // One primary ray per pixel and sample
+        const double rays = static_cast<double>(renderWidth) * renderHeight;
+        return rays * 1000.0 / trace_milliseconds;
+    }
 
-            // If the view port size has changed, we need to recreate the storage image
-            vkDestroyImageView(GetDevice(), storage_image.view, nullptr);
-            vkDestroyImage(GetDevice(), storage_image.image, nullptr);
-            vkFreeMemory(GetDevice(), storage_image.memory, nullptr);
-            CreateStorageImage();
-            // The view image too
-            vkDestroyImageView(GetDevice(), viewImage.view, nullptr);
-            vkDestroyImage(GetDevice(), viewImage.image, nullptr);
-            vkFreeMemory(GetDevice(), viewImage.memory, nullptr);
-            vkDestroySampler(GetDevice(), viewImage.sampler, nullptr);
-            CreateViewImage();
-            // The descriptor also needs to be updated to reference the new image
-            VkDescriptorImageInfo image_descriptor{};
-            image_descriptor.imageView = storage_image.view;
-            image_descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-            VkWriteDescriptorSet result_image_write{};
-            result_image_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            result_image_write.dstSet = descriptor_set;
-            result_image_write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-            result_image_write.dstBinding = 1;
-            result_image_write.pImageInfo = &image_descriptor;
-            result_image_write.descriptorCount = 1;
-            vkUpdateDescriptorSets(GetDevice(), 1, &result_image_write, 0, VK_NULL_HANDLE);
+    void Backend_FullRT::ResetAccumulation()
+    {
+        // The shader overwrites instead of adding when it sees a sample count of 0, so the image needs no clear
+        sampleCount = 0;
+    }
 
-            BuildCommandBuffers();
-            return true;
+    void Backend_FullRT::WaitForRender()
+    {
+        PB_TRACE_SCOPE("Backend_FullRT::WaitForRender");
+        std::vector<VkFence> fences;
+        uint64_t last_submit_value = 0;
+        for (const FrameData& frame : frames)
+        {
+            fences.push_back(frame.fence);
+            last_submit_value = std::max(last_submit_value, frame.submit_value);
+        }
+        if (!fences.empty())
+        {
+            check_vk_result(vkWaitForFences(GetDevice(), static_cast<uint32_t>(fences.size()), fences.data(),
+                VK_TRUE, UINT64_MAX));
+        }
+        GetDeletionQueue().Complete(last_submit_value);
+    }
+
+    void Backend_FullRT::SetFramesInFlight(uint32_t count)
+    {
+        count = count == 0 ? 1 : count;
+        if (count == framesInFlight && !frames.empty())
+        {
+            return;
+        }
+
+        WaitForRender();
+        DestroyDrawBuffers();
+        vkDestroyDescriptorPool(GetDevice(), descriptor_pool, nullptr);
+        DestroyFrames();
+
+        framesInFlight = count;
+        // Textures made from the old frames' images are stale
+        imageGeneration++;
+        if (scene)
+        {
+            (*scene).SetRingSize(framesInFlight);
+        }
+        CreateFrames();
+        CreateDescriptorSets();
+        BuildCommandBuffers();
+    }
+
+    bool Backend_FullRT::SaveStorageImage(const std::string& path)
+    {
+        WaitForRender();
+        const StorageImage& storage_image = GetOutputImage();
+
+        // Only the traced region, the images can be bigger than the view
+        const uint32_t row_pitch = renderWidth * 4;
+        const VkDeviceSize readback_size = static_cast<VkDeviceSize>(row_pitch) * renderHeight;
+        Buffer readback_buffer(GetDevice(), GetPhysicalDevice(), readback_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+        VkCommandBufferAllocateInfo cmd_buf_allocate_info{};
+        cmd_buf_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        cmd_buf_allocate_info.commandPool = cmd_pool;
+        cmd_buf_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        cmd_buf_allocate_info.commandBufferCount = 1;
+
+        VkCommandBuffer command_buffer;
+        check_vk_result(vkAllocateCommandBuffers(GetDevice(), &cmd_buf_allocate_info, &command_buffer));
+
+        VkCommandBufferBeginInfo command_buffer_info{};
+        command_buffer_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        command_buffer_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        check_vk_result(vkBeginCommandBuffer(command_buffer, &command_buffer_info));
+
+        // The frame's command buffer already made the trace's writes available when it handed the image to the UI,
+        // this only has to wait for the UI's reads before changing the layout
+        VkImageMemoryBarrier image_memory_barrier{};
+        image_memory_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        image_memory_barrier.srcAccessMask = 0;
+        image_memory_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        image_memory_barrier.oldLayout = OutputImageLayout;
+        image_memory_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        image_memory_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        image_memory_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        image_memory_barrier.image = storage_image.image;
+        image_memory_barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            0, 0, nullptr, 0, nullptr, 1, &image_memory_barrier);
+
+        VkBufferImageCopy copy_region{};
+        copy_region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        copy_region.imageSubresource.layerCount = 1;
+        copy_region.imageExtent.width = renderWidth;
+        copy_region.imageExtent.height = renderHeight;
+        copy_region.imageExtent.depth = 1;
+        vkCmdCopyImageToBuffer(command_buffer, storage_image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            readback_buffer.get_handle(), 1, &copy_region);
+
+        image_memory_barrier.srcAccessMask = 0;
+        image_memory_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        image_memory_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        image_memory_barrier.newLayout = OutputImageLayout;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+            0, 0, nullptr, 0, nullptr, 1, &image_memory_barrier);
+
+        check_vk_result(vkEndCommandBuffer(command_buffer));
+
+        VkSubmitInfo submit_info{};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &command_buffer;
+
+        VkFenceCreateInfo fence_info{};
+        fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        VkFence fence;
+        check_vk_result(vkCreateFence(GetDevice(), &fence_info, nullptr, &fence));
+
+        // Same queue as the ray tracing dispatch, so the copy is ordered after the last frame
+        check_vk_result(vkQueueSubmit(GetRTQueue(), 1, &submit_info, fence));
+        const uint64_t submit_value = GetDeletionQueue().Submit();
+        check_vk_result(vkWaitForFences(GetDevice(), 1, &fence, VK_TRUE, UINT64_MAX));
+        GetDeletionQueue().Complete(submit_value);
+
+        vkDestroyFence(GetDevice(), fence, nullptr);
+        vkFreeCommandBuffers(GetDevice(), cmd_pool, 1, &command_buffer);
+
+        readback_buffer.invalidate();
+        const uint8_t* pixels = static_cast<const uint8_t*>(readback_buffer.map());
+        return WritePPM(path, renderWidth, renderHeight, pixels, row_pitch, true);
+    }
+
+    bool Backend_FullRT::ResizeImages()
+    {
+        PB_TRACE_SCOPE("Backend_FullRT::ResizeImages");
+        const uint32_t width = ToPixels(*viewportWidth);
+        const uint32_t height = ToPixels(*viewportHeight);
+        if (width == renderWidth && height == renderHeight)
+        {
+            return false;
+        }
+        // Frames re-record their trace size after their fence wait in Render, the camera's new aspect ratio
+        // restarts the accumulation
+        renderWidth = width;
+        renderHeight = height;
+        ResetAccumulation();
+
+        // Smaller sizes keep rendering into the corner of the current images. They're only replaced when the
+        // view outgrows them, or shrinks to a quarter of their area so a big window doesn't pin its memory.
+        const uint32_t bucket_width = GetImageBucket(width);
+        const uint32_t bucket_height = GetImageBucket(height);
+        const bool grow = bucket_width > imageWidth || bucket_height > imageHeight;
+        const bool shrink = static_cast<uint64_t>(bucket_width) * bucket_height * 4 <=
+            static_cast<uint64_t>(imageWidth) * imageHeight;
+        if (!grow && !shrink)
+        {
+            return false;
+        }
+        imageWidth = bucket_width;
+        imageHeight = bucket_height;
+
+        // Submitted frames and the UI keep using the old images, they go once a frame submitted from here on has
+        // finished. Every frame moves its descriptor set and command buffer over after its next fence wait.
+        for (FrameData& frame : frames)
+        {
+            RetireStorageImage(frame.storage_image);
+            CreateStorageImage(frame.storage_image, VK_FORMAT_B8G8R8A8_UNORM, OutputImageLayout);
         }
-        return false;
+        RetireStorageImage(accumulation_image);
+        CreateStorageImage(accumulation_image, VK_FORMAT_R32G32B32A32_SFLOAT);
+
+        imageGeneration++;
+        return true;
     }
 
     bool Backend_FullRT::CleanupBackend()
     {
-        vkWaitForFences(GetDevice(), drawBuffersFences.size(), drawBuffersFences.data(), true, UINT32_MAX);
+        WaitForRender();
 
-        for (size_t i = 0; i < shaderModules.size(); i++)
+        // Stop watching and let a rebuild that's still compiling finish before tearing down
+        shaderWatcher.reset();
+        if (pipelineBuild.valid())
         {
-            vkDestroyShaderModule(GetDevice(), shaderModules[i], nullptr);
+            PipelineBuild build = pipelineBuild.get();
+            if (build.pipeline != VK_NULL_HANDLE)
+            {
+                vkDestroyPipeline(GetDevice(), build.pipeline, nullptr);
+            }
+            RayTracingPipelineBuilder::Release(build.replaced);
         }
 
-        std::vector<VkDescriptorSet> descSets = {descriptor_set};
-        vkFreeDescriptorSets(GetDevice(), descriptor_pool, 1, descSets.data());
+        // Destroying the pool frees every frame's descriptor set with it
         vkDestroyDescriptorPool(GetDevice(), descriptor_pool, nullptr);
 
         DestroyDrawBuffers();
         vkDestroyCommandPool(GetDevice(), cmd_pool, nullptr);
 
         vkDestroyPipeline(GetDevice(), pipeline, nullptr);
+        // The libraries go after the pipeline linked from them
+        pipelineBuilder.reset();
         vkDestroyPipelineLayout(GetDevice(), pipeline_layout, nullptr);
         vkDestroyDescriptorSetLayout(GetDevice(), descriptor_set_layout, nullptr);
-        vkDestroyImageView(GetDevice(), storage_image.view, nullptr);
-        vkDestroyImage(GetDevice(), storage_image.image, nullptr);
-        vkFreeMemory(GetDevice(), storage_image.memory, nullptr);
-        
-        vkDestroyImageView(GetDevice(), viewImage.view, nullptr);
-        vkDestroySampler(GetDevice(), viewImage.sampler, nullptr);
-        vkDestroyImage(GetDevice(), viewImage.image, nullptr);
-        vkFreeMemory(GetDevice(), viewImage.memory, nullptr);
-        
+        DestroyFrames();
+        DestroyStorageImage(accumulation_image);
+        vkDestroySampler(GetDevice(), outputSampler, nullptr);
+        pendingTransitions.clear();
+
         return true;
     }
 #pragma endregion
@@ -2,6 +2,14 @@
 #define VK_NO_PROTOTYPES
 #include "app.h"
 #include <glm/mat4x4.hpp>
+#include <chrono>
+#include <future>
+#include <string>
+#include <Core/FileWatcher.h>
+#include <VulkanHelp/DeletionQueue.h>
+#include <VulkanHelp/GpuProfiler.h>
+#include <VulkanHelp/RayTracingPipelineBuilder.h>
+#include "Camera.h"
 #include "RenderData/AccelerationStructure.h"
 #include "RenderData/TLAS.h"
 
@@ -19,17 +27,71 @@ namespace PBEngine
         virtual bool Render();
         virtual bool CleanupBackend();
         const RendererBackendType backendType = RendererBackendType_None;
+
+        // OBJ, glTF or .pbscene file that Init loads the scene from, empty uses the built in triangle
+        std::string scenePath;
     };
 
     class Backend_FullRT : public Backend {
     public:
         ~Backend_FullRT() override;
         bool Init(float *width, float *height) override;
-        bool ResizeViewImage();
+
+        /*
+            Follows the viewport size without waiting for the GPU. Sizes that fit the current images only change
+            the traced region, only outgrowing them (or shrinking far below them) allocates new ones, and the old
+            ones are destroyed once the frames still using them have finished.
+            Returns true when the storage images were replaced, textures made from them have to be made again.
+        */
+        bool ResizeImages();
         bool Render() override;
         bool CleanupBackend() override;
         const RendererBackendType backendType = RendererBackendType_FullRT;
 
+        /*
+            Blocks until every submitted frame has finished executing on the GPU
+        */
+        void WaitForRender();
+
+        /*
+            Changes how many frames the CPU may run ahead of the GPU. Every frame in flight gets its own
+            storage image, descriptor set, command buffer and fence, so this recreates all of them.
+        */
+        void SetFramesInFlight(uint32_t count);
+
+        /*
+            Throws away the accumulated samples so the image starts converging again from scratch.
+            Has to be called whenever the camera or the scene changes, otherwise old samples bleed into the new view.
+        */
+        void ResetAccumulation();
+
+        /*
+            True once targetSampleCount samples have been accumulated, Render stops dispatching from then on
+        */
+        bool IsConverged() const { return targetSampleCount != 0 && sampleCount >= targetSampleCount; }
+
+        /*
+            GPU times of the passes in the frame command buffers and of TLAS updates. Render resolves them
+            after each fence wait, so they're from the frame framesInFlight submissions back.
+        */
+        GpuProfiler frameProfiler;
+        GpuProfiler updateProfiler;
+        // Bumped whenever the profilers have new times
+        uint32_t profiledFrames = 0;
+        uint32_t profiledUpdates = 0;
+        // Wall time between the last two frames Render submitted
+        double cpuFrameMilliseconds = 0.0;
+
+        /*
+            Primary rays traced per second, from the trace time of the last profiled frame
+        */
+        double GetRaysPerSecond() const;
+
+        /*
+            Copies the storage image back to the host and writes it to disk as a PPM file
+        */
+        bool SaveStorageImage(const std::string& path);
+
         float *viewportWidth;
         float *viewportHeight;
 
@@ -38,71 +100,206 @@ namespace PBEngine
         VkPhysicalDeviceRayTracingPipelinePropertiesKHR  ray_tracing_pipeline_properties{};
         VkPhysicalDeviceAccelerationStructureFeaturesKHR acceleration_structure_features{};
 
-        std::vector<VkRayTracingShaderGroupCreateInfoKHR> shader_groups{};
-
         std::unique_ptr<Buffer> raygen_shader_binding_table;
         std::unique_ptr<Buffer> miss_shader_binding_table;
         std::unique_ptr<Buffer> hit_shader_binding_table;
 
+        /*
+            Images are allocated at imageWidth x imageHeight, rounded up from the viewport, and the rays only
+            go into the renderWidth x renderHeight region at their top left corner
+        */
         struct StorageImage
         {
-            VkDeviceMemory memory;
+            Allocation     allocation;
             VkImage        image = VK_NULL_HANDLE;
             VkImageView    view;
             VkFormat       format;
             uint32_t       width;
             uint32_t       height;
-        } storage_image;
+        };
 
-        struct ViewImage
-        {
-            VkDeviceMemory memory;
-            VkImage        image = VK_NULL_HANDLE;
-            VkImageView    view;
-            VkFormat       format;
-            uint32_t       width;
-            uint32_t       height;
-            VkSampler      sampler;
-        } viewImage;
+        /*
+            The UI draws the frames' storage images directly. Each trace leaves its image in OutputImageLayout,
+            the next trace into the same image moves it back to the general layout first.
+        */
+        static constexpr VkImageLayout OutputImageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        // Clamps, only the traced corner of an image is ever shown
+        VkSampler outputSampler = VK_NULL_HANDLE;
 
+        // Matches the FrameUniforms block in the ray generation shader (std140)
         struct UniformData
         {
             glm::mat4 view_inverse;
             glm::mat4 proj_inverse;
+            // Samples already in the accumulation image, 0 starts a new accumulation
+            uint32_t  sample_count;
+            uint32_t  frame_index;
+            uint32_t  padding[2];
         } uniform_data;
-        std::unique_ptr<Buffer> ubo;
+
+        /*
+            The view the primary rays start from. Its matrices only go into the uniforms, so moving it never
+            re-records command buffers, Render notices the new version and restarts the accumulation.
+        */
+        Camera camera;
+
+        /*
+            One persistently mapped buffer holding a UniformData slice per frame in flight. A frame's slice is
+            rewritten right after its fence wait, while the GPU may still read the other slices.
+        */
+        std::unique_ptr<Buffer> uniform_ring;
+        // Size of a slice, rounded up to minUniformBufferOffsetAlignment
+        VkDeviceSize uniform_slice_size = 0;
+
+        /*
+            RGBA32F running sum of every sample since the last ResetAccumulation. Shared by all frames in flight,
+            which is fine because they all go to the same queue and each frame's trace waits on the previous one's.
+        */
+        StorageImage accumulation_image;
+        // Samples per pixel that have been submitted since the last reset
+        uint32_t sampleCount = 0;
+        // Render stops dispatching after this many samples per pixel, 0 keeps accumulating forever
+        uint32_t targetSampleCount = 1024;
+        // Frames submitted since Init, never reset
+        uint32_t frameIndex = 0;
 
         VkPipeline            pipeline;
         VkPipelineLayout      pipeline_layout;
-        VkDescriptorSet       descriptor_set;
         VkDescriptorSetLayout descriptor_set_layout;
 
+        /*
+            Instances can be changed between calls to Render through SetInstanceTransform and friends, the next
+            Render records the TLAS update into its own submission and restarts the accumulation
+        */
         std::unique_ptr<TLAS> scene;
-        std::vector<VkShaderModule> shaderModules;
+        // Owns the shader modules and pipeline libraries the current pipeline is linked from
+        std::unique_ptr<RayTracingPipelineBuilder> pipelineBuilder;
+
+        /*
+            Everything a single frame writes to. While the GPU traces one frame the next one can already be
+            submitted into its own storage image instead of waiting for the previous frame to finish.
+        */
+        struct FrameData
+        {
+            StorageImage    storage_image;
+            // Start of the frame's slice of uniform_ring, the descriptor set points at it
+            VkDeviceSize    uniform_offset = 0;
+            VkDescriptorSet descriptor_set = VK_NULL_HANDLE;
+            VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+            // TLAS update or rebuild, only submitted on frames where the scene's instances changed
+            VkCommandBuffer update_command_buffer = VK_NULL_HANDLE;
+            VkFence         fence = VK_NULL_HANDLE;
+            // Pipeline the command buffer was recorded with, re-recorded once its fence has signalled when hot reload replaced it
+            uint32_t        pipeline_generation = 0;
+            // Images and traced region the command buffer and descriptor set were set up for, same idea
+            uint32_t        image_generation = 0;
+            uint32_t        trace_width = 0;
+            uint32_t        trace_height = 0;
+            // Deletion queue value of the last submission, reported as complete once the fence has signalled
+            uint64_t        submit_value = 0;
+        };
+        std::vector<FrameData> frames;
+        uint32_t framesInFlight = 2;
+        // Frame that the next call to Render will submit
+        uint32_t currentFrame = 0;
+        // Frame holding the newest image, the one the viewport and SaveStorageImage show
+        uint32_t lastSubmittedFrame = 0;
+
+        const StorageImage& GetOutputImage() const { return frames[lastSubmittedFrame].storage_image; }
+        // Changes whenever the frames' storage images are replaced
+        uint32_t GetImageGeneration() const { return imageGeneration; }
+
+        // Size of the traced region, the viewport size in pixels
+        uint32_t renderWidth = 1;
+        uint32_t renderHeight = 1;
+        // Size every storage image is allocated with
+        uint32_t imageWidth = 0;
+        uint32_t imageHeight = 0;
 
-        // Command buffers and pool used for rendering
-        std::vector<VkCommandBuffer> draw_cmd_buffers;
-        std::vector<VkFence> drawBuffersFences;
         VkCommandPool cmd_pool;
 
         uint16_t displayImage = UINT16_MAX;
 
     private:
+        struct PipelineBuild
+        {
+            VkPipeline pipeline = VK_NULL_HANDLE;
+            RayTracingPipelineBuilder::Replaced replaced;
+        };
+
+        /*
+            Shader hot reload. The watcher notices edits to the shader files, the pipeline is rebuilt in the
+            background and Render swaps it in at the start of a frame without waiting for the GPU.
+        */
+        std::unique_ptr<FileWatcher> shaderWatcher;
+        std::future<PipelineBuild> pipelineBuild;
+        // Bumped on every swap
+        uint32_t pipelineGeneration = 0;
+
+        // Bumped whenever the images are reallocated
+        uint32_t imageGeneration = 0;
+
+        /*
+            New images still in VK_IMAGE_LAYOUT_UNDEFINED. The next Render moves them into their layout ahead
+            of its trace in the same submission, instead of a separate submission and fence wait per image.
+        */
+        struct PendingTransition
+        {
+            VkImage image;
+            VkImageLayout layout;
+        };
+        std::vector<PendingTransition> pendingTransitions;
+
+        std::chrono::steady_clock::time_point lastFrameTime;
+        // Camera version the accumulated samples were traced with
+        uint32_t cameraVersion = 0;
+
+        /*
+            Build one bottom level acceleration structure per mesh in scenePath and the top level one over them.
+            Falls back to the built in triangle when there is no scene or it fails to load.
+        */
+        void LoadScene();
         /*
-            Set up a storage image that the ray generation shader will be writing to
+            Builds straight out of a mapped .pbscene file, returns false when it can't be opened
         */
-        void CreateStorageImage();
+        bool LoadSceneFile();
 
         /*
-            Set up a view image that will be shown to the user
+            Set up a storage image that the ray generation shader will be writing to. Its first submission moves it
+            into layout.
         */
-        void CreateViewImage(bool resize);
+        void CreateStorageImage(StorageImage& storage_image, VkFormat format = VK_FORMAT_B8G8R8A8_UNORM,
+            VkImageLayout layout = VK_IMAGE_LAYOUT_GENERAL);
+        void DestroyStorageImage(StorageImage& storage_image);
+        // Hands the image to the deletion queue, submissions from here on only use its replacement
+        void RetireStorageImage(StorageImage& storage_image);
+        void RecordPendingTransitions(VkCommandBuffer commandBuffer);
+
+        /*
+            Create and destroy the storage images and uniform buffers of every frame in flight
+        */
+        void CreateFrames();
+        void DestroyFrames();
+
+        void CreateOutputSampler();
 
         /*
             Create our ray tracing pipeline
         */
         void CreateRayTracingPipeline();
 
+        /*
+            Recompiles the pipeline libraries whose shaders changed and links the pipeline from them. Only one
+            may run at a time, returns an empty build when a shader doesn't compile.
+        */
+        PipelineBuild BuildPipeline();
+
+        /*
+            Starts a background rebuild when a shader file changed and swaps in a finished one. The replaced
+            pipeline goes to the deletion queue, every frame re-records before its next submission.
+        */
+        void UpdateShaderHotReload();
+
         /*
             Create the Shader Binding Tables that connects the ray tracing pipelines' programs and the  top-level acceleration structure
 
@@ -119,14 +316,16 @@ namespace PBEngine
         void CreateShaderBindingTables();
 
         /*
-            Create the descriptor sets used for the ray tracing dispatch
+            Create the descriptor sets used for the ray tracing dispatch, one per frame in flight
         */
         void CreateDescriptorSets();
+        void UpdateStorageImageDescriptors(FrameData& frame);
 
         /*
             Command buffer generation
         */
         void BuildCommandBuffers();
+        void RecordFrameCommands(FrameData& frame);
 
         void CreateCommandPool();
         void DestroyDrawBuffers();
@@ -135,7 +334,9 @@ namespace PBEngine
     class Renderer {
     public:
         Renderer();
-        Renderer(float *width, float *height);
+        Renderer(float *width, float *height,
+            Backend::RendererBackendType type = Backend::RendererBackendType_FullRT,
+            const std::string& scenePath = "");
         ~Renderer();
         std::unique_ptr<Backend> renderingBackend; // Don't forget to keep an eye on the memory for
         // this. A memory leak here probably wouldn't be
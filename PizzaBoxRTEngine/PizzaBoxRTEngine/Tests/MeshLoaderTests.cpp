@@ -0,0 +1,135 @@
+// Feeds LoadGLTF documents whose accessors and strings come straight from a hostile file.
+// Every broken one has to be rejected or skipped without reading outside its buffer, run it
+// under AddressSanitizer and UndefinedBehaviorSanitizer to catch the reads that don't crash.
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <Rendering/RenderData/MeshLoader.h>
+
+using namespace PBEngine;
+
+namespace
+{
+    int failures = 0;
+
+    void Check(bool condition, const char* test, const char* what)
+    {
+        if (!condition)
+        {
+            fprintf(stderr, "FAILED %s: %s\n", test, what);
+            failures++;
+        }
+    }
+
+    std::filesystem::path GetTestDirectory()
+    {
+        std::filesystem::path directory = std::filesystem::temp_directory_path() / "pizzabox_mesh_loader_tests";
+        std::filesystem::create_directories(directory);
+        return directory;
+    }
+
+    // One triangle, 36 bytes of positions followed by 6 bytes of unsigned short indices
+    void WriteTriangleBuffer(const std::filesystem::path& path)
+    {
+        const float positions[9] = { 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f };
+        const uint16_t indices[3] = { 0, 1, 2 };
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(positions), sizeof(positions));
+        file.write(reinterpret_cast<const char*>(indices), sizeof(indices));
+    }
+
+    /*
+        A single node and mesh whose position accessor and its buffer view are spliced in, so every test
+        only spells out the part it breaks
+    */
+    std::string MakeDocument(const std::string& positionAccessor, const std::string& positionView,
+        const std::string& meshName = "\"triangle\"")
+    {
+        return R"({
+            "asset": { "version": "2.0" },
+            "buffers": [ { "uri": "triangle.bin", "byteLength": 42 } ],
+            "bufferViews": [ )" + positionView + R"(, { "buffer": 0, "byteOffset": 36, "byteLength": 6 } ],
+            "accessors": [ )" + positionAccessor + R"(,
+                { "bufferView": 1, "componentType": 5123, "type": "SCALAR", "count": 3 } ],
+            "meshes": [ { "name": )" + meshName + R"(, "primitives": [ { "attributes": { "POSITION": 0 }, "indices": 1 } ] } ],
+            "nodes": [ { "mesh": 0 } ],
+            "scenes": [ { "nodes": [ 0 ] } ]
+        })";
+    }
+
+    const std::string ValidAccessor = R"({ "bufferView": 0, "componentType": 5126, "type": "VEC3", "count": 3 })";
+    const std::string ValidView = R"({ "buffer": 0, "byteOffset": 0, "byteLength": 36 })";
+
+    bool Load(const std::string& name, const std::string& document, std::vector<MeshData>& meshes)
+    {
+        const std::filesystem::path directory = GetTestDirectory();
+        const std::filesystem::path path = directory / (name + ".gltf");
+        {
+            std::ofstream file(path, std::ios::binary);
+            file << document;
+        }
+        meshes.clear();
+        return LoadGLTF(path.string(), meshes);
+    }
+
+    // A broken position accessor must leave the file loadable but without the primitive
+    void ExpectSkipped(const char* name, const std::string& accessor, const std::string& view)
+    {
+        std::vector<MeshData> meshes;
+        Check(Load(name, MakeDocument(accessor, view), meshes), name, "document should still load");
+        Check(meshes.empty(), name, "primitive should have been skipped");
+    }
+}
+
+int main()
+{
+    WriteTriangleBuffer(GetTestDirectory() / "triangle.bin");
+
+    {
+        std::vector<MeshData> meshes;
+        Check(Load("valid", MakeDocument(ValidAccessor, ValidView), meshes), "valid", "should load");
+        Check(meshes.size() == 1 && meshes[0].GetTriangleCount() == 1, "valid", "should have one triangle");
+    }
+
+    ExpectSkipped("negative_view_offset", ValidAccessor,
+        R"({ "buffer": 0, "byteOffset": -36, "byteLength": 36 })");
+    ExpectSkipped("wrapping_view_length", ValidAccessor,
+        R"({ "buffer": 0, "byteOffset": 8, "byteLength": 18446744073709551608 })");
+    ExpectSkipped("view_past_buffer", ValidAccessor,
+        R"({ "buffer": 0, "byteOffset": 12, "byteLength": 36 })");
+    ExpectSkipped("huge_count", R"({ "bufferView": 0, "componentType": 5126, "type": "VEC3", "count": 1e30 })",
+        ValidView);
+    ExpectSkipped("count_past_view", R"({ "bufferView": 0, "componentType": 5126, "type": "VEC3", "count": 4 })",
+        ValidView);
+    ExpectSkipped("fractional_count", R"({ "bufferView": 0, "componentType": 5126, "type": "VEC3", "count": 2.5 })",
+        ValidView);
+    ExpectSkipped("negative_accessor_offset",
+        R"({ "bufferView": 0, "byteOffset": -12, "componentType": 5126, "type": "VEC3", "count": 3 })", ValidView);
+    ExpectSkipped("accessor_offset_past_view",
+        R"({ "bufferView": 0, "byteOffset": 40, "componentType": 5126, "type": "VEC3", "count": 1 })", ValidView);
+    ExpectSkipped("wrapping_stride", ValidAccessor,
+        R"({ "buffer": 0, "byteLength": 36, "byteStride": 9223372036854775808 })");
+    ExpectSkipped("stride_past_view", ValidAccessor,
+        R"({ "buffer": 0, "byteLength": 36, "byteStride": 16 })");
+
+    {
+        std::vector<MeshData> meshes;
+        Check(!Load("lone_high_surrogate", MakeDocument(ValidAccessor, ValidView, R"("\ud83d")"), meshes),
+            "lone_high_surrogate", "should be rejected");
+        Check(!Load("bad_low_surrogate", MakeDocument(ValidAccessor, ValidView, R"("\ud83d\u0041")"), meshes),
+            "bad_low_surrogate", "should be rejected");
+        Check(!Load("lone_low_surrogate", MakeDocument(ValidAccessor, ValidView, R"("\ude00")"), meshes),
+            "lone_low_surrogate", "should be rejected");
+        Check(Load("surrogate_pair", MakeDocument(ValidAccessor, ValidView, R"("\ud83d\ude00")"), meshes),
+            "surrogate_pair", "should load");
+    }
+
+    if (failures == 0)
+    {
+        printf("All mesh loader tests passed\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+// Converts OBJ and glTF files into the engine's .pbscene format, see Rendering/RenderData/SceneFile.h
+//
+//     PizzaBoxSceneConverter input.obj|input.gltf|input.glb output.pbscene [--no-bvh]
+//
+// The BVH for the CPU backend is built here and stored in the file unless --no-bvh is given.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <Rendering/RenderData/MeshLoader.h>
+#include <Rendering/RenderData/SceneFile.h>
+#include <Rendering/CPU/BVH.h>
+
+int main(int argc, char** argv)
+{
+    std::string inputPath;
+    std::string outputPath;
+    bool buildBVH = true;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--no-bvh") == 0)
+            buildBVH = false;
+        else if (inputPath.empty())
+            inputPath = argv[i];
+        else if (outputPath.empty())
+            outputPath = argv[i];
+        else
+        {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (inputPath.empty() || outputPath.empty())
+    {
+        fprintf(stderr, "Usage: %s input.obj|input.gltf|input.glb output.pbscene [--no-bvh]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<PBEngine::MeshData> meshes;
+    PBEngine::MeshLoadStats loadStats;
+    if (!PBEngine::LoadMeshFile(inputPath, meshes, &loadStats) || meshes.empty())
+    {
+        fprintf(stderr, "Couldn't load any meshes from %s\n", inputPath.c_str());
+        return 1;
+    }
+
+    uint64_t triangleCount = 0;
+    for (const PBEngine::MeshData& mesh : meshes)
+    {
+        triangleCount += mesh.GetTriangleCount();
+    }
+    printf("%s: %zu meshes, %llu triangles, parsed in %.2f ms on %u threads\n", inputPath.c_str(), meshes.size(),
+        static_cast<unsigned long long>(triangleCount), loadStats.parseSeconds * 1000.0, loadStats.threadCount);
+
+    // The stored BVH covers every mesh merged in order, which is how the CPU backend lays out the instances
+    PBEngine::BVH bvh;
+    std::vector<PBEngine::Vertex> vertices;
+    std::vector<uint32_t> indices;
+    if (buildBVH)
+    {
+        for (const PBEngine::MeshData& mesh : meshes)
+        {
+            const uint32_t vertexOffset = static_cast<uint32_t>(vertices.size());
+            vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+            for (uint32_t index : mesh.indices)
+            {
+                indices.push_back(vertexOffset + index);
+            }
+        }
+        bvh.Build(vertices, indices);
+        const PBEngine::BVHBuildStats& stats = bvh.GetStats();
+        printf("BVH: %u nodes, %u leaves, depth %u, SAH cost %.2f, built in %.2f ms\n", stats.nodeCount,
+            stats.leafCount, stats.maxDepth, stats.sahCost, stats.buildSeconds * 1000.0);
+    }
+
+    auto writeStart = std::chrono::steady_clock::now();
+    if (!PBEngine::WriteSceneFile(outputPath, meshes, buildBVH ? &bvh : nullptr))
+    {
+        return 1;
+    }
+    printf("Wrote %s in %.2f ms\n", outputPath.c_str(),
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - writeStart).count() * 1000.0);
+    return 0;
+}
@@ -1,23 +1,30 @@
 #include "Buffer.h"
+#include <cstring>
 #include <iostream>
 
 namespace PBEngine
 {
 	Buffer::~Buffer()
 	{
-        unmap();
-		vkDestroyBuffer(GetApp().g_Device, buffer, nullptr);
-		vkFreeMemory(GetApp().g_Device, bufferMemory, nullptr);
+        if (buffer != VK_NULL_HANDLE)
+        {
+		    vkDestroyBuffer(GetApp().g_Device, buffer, nullptr);
+        }
+		GetMemoryAllocator().Free(allocation);
 	}
 
     Buffer::Buffer(Buffer&& other) :
-        bufferMemory{ other.bufferMemory },
+        buffer{ other.buffer },
+        allocation{ other.allocation },
+        device{ other.device },
+        physicalDevice{ other.physicalDevice },
         bufferSize{ other.bufferSize },
-        mapped_data{ other.mapped_data },
-        mapped{ other.mapped }
+        mapped{ other.mapped },
+        mapped_data{ other.mapped_data }
     {
         // Reset other handles to avoid releasing on destruction
-        other.bufferMemory = VK_NULL_HANDLE;
+        other.buffer = VK_NULL_HANDLE;
+        other.allocation = {};
         other.mapped_data = nullptr;
         other.mapped = false;
     }
@@ -55,32 +62,12 @@ namespace PBEngine
             return;
         }
 
-        // Allocate memory for the buffer
-        VkMemoryRequirements memoryRequirements;
-        vkGetBufferMemoryRequirements(device, buffer, &memoryRequirements);
-
-        VkMemoryAllocateFlagsInfo allocateFlags = {};
-        VkMemoryAllocateInfo allocateInfo = {};
-        allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocateInfo.pNext = &allocateFlags;
-        allocateInfo.allocationSize = memoryRequirements.size;
-        allocateInfo.memoryTypeIndex = findMemoryType(physicalDevice, memoryRequirements.memoryTypeBits, properties);
-
-        allocateFlags.pNext = nullptr;
-        allocateFlags.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-
-        if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT)
-        {
-            allocateFlags.flags |= VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
-        }
-
-        if (vkAllocateMemory(device, &allocateInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
+        // Sub-allocate and bind memory for the buffer
+        if (!GetMemoryAllocator().AllocateForBuffer(buffer, properties, allocation)) {
             std::cerr << "Failed to allocate memory for Vulkan buffer." << std::endl;
             return;
         }
-
-        // Bind the memory to the buffer
-        vkBindBufferMemory(device, buffer, bufferMemory, 0);
+        mapped_data = allocation.mapped;
     }
 
 	Buffer::Buffer(VkDevice g_Device, VkPhysicalDevice g_PhysicalDevice, VkDeviceSize size,
@@ -91,7 +78,7 @@ namespace PBEngine
         bufferSize = size;
 
         // Set up the buffer
-        VkBufferCreateInfo bufferCreateInfo;
+        VkBufferCreateInfo bufferCreateInfo = {};
         bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
         bufferCreateInfo.size = size;
         bufferCreateInfo.usage = usage;
@@ -103,22 +90,12 @@ namespace PBEngine
             return;
         }
 
-        // Allocate memory for the buffer
-        VkMemoryRequirements memoryRequirements;
-        vkGetBufferMemoryRequirements(device, buffer, &memoryRequirements);
-
-        VkMemoryAllocateInfo allocateInfo = {};
-        allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocateInfo.allocationSize = memoryRequirements.size;
-        allocateInfo.memoryTypeIndex = findMemoryType(physicalDevice, memoryRequirements.memoryTypeBits, properties);
-
-        if (vkAllocateMemory(device, &allocateInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
+        // Sub-allocate and bind memory for the buffer
+        if (!GetMemoryAllocator().AllocateForBuffer(buffer, properties, allocation)) {
             std::cerr << "Failed to allocate memory for Vulkan buffer." << std::endl;
             return;
         }
-
-        // Bind the memory to the buffer
-        vkBindBufferMemory(device, buffer, bufferMemory, 0);
+        mapped_data = allocation.mapped;
 	}
 
     const VkBuffer* Buffer::get() const
@@ -138,30 +115,23 @@ namespace PBEngine
 
     VkDeviceMemory Buffer::get_memory() const
     {
-        return bufferMemory;
+        return allocation.memory;
+    }
+
+    VkDeviceSize Buffer::get_memory_offset() const
+    {
+        return allocation.offset;
     }
 
     void* Buffer::map()
     {
-        if (!mapped && !mapped_data)
-        {
-            VkResult err;
-            void* mappedMemory;
-            vkMapMemory(GetApp().g_Device, bufferMemory, 0, bufferSize, 0, &mapped_data);
-            
-            mapped = true;
-        }
+        mapped = mapped_data != nullptr;
         return mapped_data;
     }
 
     void Buffer::unmap()
     {
-        if (mapped)
-        {
-            vkUnmapMemory(GetApp().g_Device, bufferMemory);
-            mapped_data = nullptr;
-            mapped = false;
-        }
+        mapped = false;
     }
 
     const void* Buffer::get_data() const
@@ -181,15 +151,35 @@ namespace PBEngine
 
     void Buffer::update(const uint8_t* data, const size_t size, const size_t offset)
     {
-        map();
-        memcpy(mapped_data, data, bufferSize);
-        unmap();
+        if (mapped_data == nullptr)
+        {
+            std::cerr << "Buffer::update needs a host visible buffer." << std::endl;
+            return;
+        }
+        if (offset + size > bufferSize)
+        {
+            std::cerr << "Buffer::update of " << size << " bytes at " << offset << " is outside the "
+                << bufferSize << " byte buffer." << std::endl;
+            return;
+        }
+
+        memcpy(static_cast<uint8_t*>(mapped_data) + offset, data, size);
+        flush(offset, size);
+    }
+
+    bool Buffer::is_coherent() const
+    {
+        return allocation.coherent;
+    }
+
+    void Buffer::flush(VkDeviceSize offset, VkDeviceSize size)
+    {
+        GetMemoryAllocator().Flush(allocation, offset, size);
     }
 
-    template <class T>
-    void Buffer::convert_and_update(const T& object, size_t offset)
+    void Buffer::invalidate(VkDeviceSize offset, VkDeviceSize size)
     {
-        update(reinterpret_cast<const uint8_t*>(&object), sizeof(T), offset);
+        GetMemoryAllocator().Invalidate(allocation, offset, size);
     }
 
     uint64_t Buffer::get_device_address()
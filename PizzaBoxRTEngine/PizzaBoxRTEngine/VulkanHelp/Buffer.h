@@ -1,5 +1,7 @@
 #pragma once
 #include "vk_common.h"
+#include "MemoryAllocator.h"
+#include <type_traits>
 #include <vector>
 
 namespace PBEngine
@@ -32,23 +34,44 @@ namespace PBEngine
 		const VkBuffer* get() const;
 		VkBuffer get_handle();
 		VkDeviceMemory get_memory() const;
+		VkDeviceSize get_memory_offset() const;
 		VkDeviceSize get_size();
 
 		/**
-		* @brief Maps buffer if it isn't already mapped to a host visible address.
-		* @return Pointer to host visible memory
+		* @brief Host visible buffers live in persistently mapped memory, so this only hands out the pointer.
+		* @return Pointer to host visible memory, nullptr for device local buffers
 		*/
 		void* map();
 
 		/**
-		* @brief Unmaps vulkan memory from the host visible address
+		* @brief Kept for existing callers, the memory stays mapped until the buffer is destroyed
 		*/
 		void unmap();
 
 		const void* get_data() const;
 
 		/**
-		 * @brief Copies byte data into the buffer
+		* @return Whether host writes need flush and device writes need invalidate before the other side sees them
+		*/
+		bool is_coherent() const;
+
+		/**
+		 * @brief Makes host writes to the range visible to the device, does nothing for coherent memory
+		 * @param offset Offset in bytes from the start of the buffer
+		 * @param size Bytes to flush, VK_WHOLE_SIZE for the rest of the buffer
+		 */
+		void flush(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+		/**
+		 * @brief Makes device writes to the range visible to the host, call it before reading back non coherent memory
+		 * @param offset Offset in bytes from the start of the buffer
+		 * @param size Bytes to invalidate, VK_WHOLE_SIZE for the rest of the buffer
+		 */
+		void invalidate(VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+		/**
+		 * @brief Copies byte data into the mapped memory and flushes the written range. Only works on host
+		 * visible buffers, device local ones go through the UploadManager.
 		 * @param data The data to copy from
 		 * @param size The amount of bytes to copy
 		 * @param offset The offset to start the copying into the mapped data
@@ -76,7 +99,35 @@ namespace PBEngine
 		 * @param offset The offset to start the copying into the mapped data
 		 */
 		template <class T>
-		void convert_and_update(const T& object, size_t offset = 0);
+		void convert_and_update(const T& object, size_t offset = 0)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be copied into a buffer");
+			update(reinterpret_cast<const uint8_t*>(&object), sizeof(T), offset);
+		}
+
+		/**
+		 * @brief Copies an array of elements into the buffer, e.g. one slot of a per frame ring
+		 * @param elements The elements to copy from
+		 * @param count Number of elements to copy
+		 * @param firstElement Index of the element, in units of T, the copy starts at
+		 */
+		template <class T>
+		void update_elements(const T* elements, size_t count, size_t firstElement = 0)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be copied into a buffer");
+			update(reinterpret_cast<const uint8_t*>(elements), count * sizeof(T), firstElement * sizeof(T));
+		}
+
+		/**
+		 * @brief Typed view of the mapped memory for writing in place, flush the written range afterwards
+		 * @return nullptr for device local buffers
+		 */
+		template <class T>
+		T* map_as(size_t offset = 0)
+		{
+			uint8_t* data = static_cast<uint8_t*>(map());
+			return data ? reinterpret_cast<T*>(data + offset) : nullptr;
+		}
 
 		/**
 		 * @return Return the buffer's device address (note: requires that the buffer has been created with the VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT usage fla)
@@ -84,13 +135,13 @@ namespace PBEngine
 		uint64_t get_device_address();
 
 	private:
-		VkBuffer buffer;
-		VkDeviceMemory bufferMemory;
+		VkBuffer buffer{ VK_NULL_HANDLE };
+		Allocation allocation;
 
-		VkDevice device;
-		VkPhysicalDevice physicalDevice;
+		VkDevice device{ VK_NULL_HANDLE };
+		VkPhysicalDevice physicalDevice{ VK_NULL_HANDLE };
 
-		VkDeviceSize bufferSize;
+		VkDeviceSize bufferSize{ 0 };
 
 		bool mapped{ false };
 		void* mapped_data{ nullptr };
@@ -0,0 +1,131 @@
+#include "DeletionQueue.h"
+#include <algorithm>
+
+namespace PBEngine
+{
+	DeletionQueue& GetDeletionQueue()
+	{
+		static DeletionQueue deletionQueue;
+		return deletionQueue;
+	}
+
+	uint64_t DeletionQueue::Submit()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return ++submitted;
+	}
+
+	void DeletionQueue::Complete(uint64_t value)
+	{
+		std::vector<Entry> ready;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			// Submissions finish in order, a late report of an older one changes nothing
+			completed = std::max(completed, std::min(value, submitted));
+
+			auto kept = std::stable_partition(entries.begin(), entries.end(),
+				[this](const Entry& entry) { return entry.lastUse > completed; });
+			ready.assign(std::make_move_iterator(kept), std::make_move_iterator(entries.end()));
+			entries.erase(kept, entries.end());
+		}
+		Destroy(ready);
+	}
+
+	uint64_t DeletionQueue::GetSubmittedValue() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return submitted;
+	}
+
+	uint64_t DeletionQueue::GetCompletedValue() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return completed;
+	}
+
+	void DeletionQueue::EnqueueImage(uint64_t lastUse, VkImage image, const Allocation& allocation)
+	{
+		Enqueue(lastUse, [image, allocation]() mutable
+			{
+				vkDestroyImage(GetDevice(), image, nullptr);
+				GetMemoryAllocator().Free(allocation);
+			});
+	}
+
+	void DeletionQueue::EnqueueImageView(uint64_t lastUse, VkImageView view)
+	{
+		Enqueue(lastUse, [view]() { vkDestroyImageView(GetDevice(), view, nullptr); });
+	}
+
+	void DeletionQueue::EnqueueSampler(uint64_t lastUse, VkSampler sampler)
+	{
+		Enqueue(lastUse, [sampler]() { vkDestroySampler(GetDevice(), sampler, nullptr); });
+	}
+
+	void DeletionQueue::EnqueueBuffer(uint64_t lastUse, VkBuffer buffer, const Allocation& allocation)
+	{
+		Enqueue(lastUse, [buffer, allocation]() mutable
+			{
+				vkDestroyBuffer(GetDevice(), buffer, nullptr);
+				GetMemoryAllocator().Free(allocation);
+			});
+	}
+
+	void DeletionQueue::EnqueueAccelerationStructure(uint64_t lastUse, VkAccelerationStructureKHR accelerationStructure)
+	{
+		Enqueue(lastUse, [accelerationStructure]()
+			{
+				vkDestroyAccelerationStructureKHR(GetDevice(), accelerationStructure, nullptr);
+			});
+	}
+
+	void DeletionQueue::EnqueuePipeline(uint64_t lastUse, VkPipeline pipeline)
+	{
+		Enqueue(lastUse, [pipeline]() { vkDestroyPipeline(GetDevice(), pipeline, nullptr); });
+	}
+
+	void DeletionQueue::EnqueueDescriptorSet(uint64_t lastUse, VkDescriptorPool pool, VkDescriptorSet set)
+	{
+		Enqueue(lastUse, [pool, set]() { vkFreeDescriptorSets(GetDevice(), pool, 1, &set); });
+	}
+
+	void DeletionQueue::Enqueue(uint64_t lastUse, std::function<void()> destroy)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.push_back({ lastUse, std::move(destroy) });
+	}
+
+	void DeletionQueue::Flush()
+	{
+		// Destroying a wrapper can enqueue what it owns, so keep going until nothing comes back
+		for (;;)
+		{
+			std::vector<Entry> ready;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				ready.swap(entries);
+				completed = submitted;
+			}
+			if (ready.empty())
+			{
+				return;
+			}
+			Destroy(ready);
+		}
+	}
+
+	size_t DeletionQueue::GetPendingCount() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return entries.size();
+	}
+
+	void DeletionQueue::Destroy(std::vector<Entry>& ready)
+	{
+		for (Entry& entry : ready)
+		{
+			entry.destroy();
+		}
+		ready.clear();
+	}
+}
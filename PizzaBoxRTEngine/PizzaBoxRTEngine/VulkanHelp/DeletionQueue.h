@@ -0,0 +1,104 @@
+#pragma once
+#include "vk_common.h"
+#include "MemoryAllocator.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace PBEngine
+{
+	/*
+		Destroys Vulkan objects once the GPU is done with them, without ever waiting for it.
+
+		Tracked submissions are numbered on one timeline. Whoever submits calls Submit right after
+		vkQueueSubmit and keeps the value, and reports it with Complete once the submission's fence has been
+		seen signalled. Objects are enqueued with the value of the last submission that may use them and are
+		destroyed by the Complete call that reaches it.
+
+			vkQueueSubmit(GetRTQueue(), 1, &submit_info, frame.fence);
+			frame.submit_value = GetDeletionQueue().Submit();
+			...
+			GetDeletionQueue().EnqueueImage(GetDeletionQueue().GetNextValue(), old_image, old_allocation);
+			...
+			vkWaitForFences(GetDevice(), 1, &frame.fence, VK_TRUE, UINT64_MAX);
+			GetDeletionQueue().Complete(frame.submit_value);
+
+		Tracked submissions all go to the ray tracing queue, which ImGui draws with too. A finished submission
+		means everything submitted to that queue before it has finished as well, UI frames included, so an
+		object last used by a UI frame can be enqueued with GetNextValue.
+	*/
+	class DeletionQueue
+	{
+	public:
+		DeletionQueue() = default;
+		DeletionQueue(const DeletionQueue&) = delete;
+		DeletionQueue& operator=(const DeletionQueue&) = delete;
+
+		/*
+			Numbers a tracked submission, call it after vkQueueSubmit and keep the value for Complete
+		*/
+		uint64_t Submit();
+
+		/*
+			Reports that the tracked submission with this value has finished and destroys everything that was
+			enqueued with it or an earlier value
+		*/
+		void Complete(uint64_t value);
+
+		uint64_t GetSubmittedValue() const;
+		uint64_t GetCompletedValue() const;
+		// Reached once the next tracked submission finishes, covers work recorded or submitted until then
+		uint64_t GetNextValue() const { return GetSubmittedValue() + 1; }
+
+		void EnqueueImage(uint64_t lastUse, VkImage image, const Allocation& allocation);
+		void EnqueueImageView(uint64_t lastUse, VkImageView view);
+		void EnqueueSampler(uint64_t lastUse, VkSampler sampler);
+		void EnqueueBuffer(uint64_t lastUse, VkBuffer buffer, const Allocation& allocation);
+		void EnqueueAccelerationStructure(uint64_t lastUse, VkAccelerationStructureKHR accelerationStructure);
+		void EnqueuePipeline(uint64_t lastUse, VkPipeline pipeline);
+		// The pool has to be created with VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT
+		void EnqueueDescriptorSet(uint64_t lastUse, VkDescriptorPool pool, VkDescriptorSet set);
+
+		// Anything else, destroy runs on the thread that calls Complete or Flush
+		void Enqueue(uint64_t lastUse, std::function<void()> destroy);
+
+		// Owning wrappers like Buffer, whose destructor frees the Vulkan objects
+		template <typename T>
+		void Enqueue(uint64_t lastUse, std::unique_ptr<T> object)
+		{
+			if (object)
+			{
+				T* released = object.release();
+				Enqueue(lastUse, [released]() { delete released; });
+			}
+		}
+
+		/*
+			Destroys everything still queued. Only once the device is idle, before the memory allocator goes.
+		*/
+		void Flush();
+
+		size_t GetPendingCount() const;
+
+	private:
+		struct Entry
+		{
+			uint64_t lastUse = 0;
+			std::function<void()> destroy;
+		};
+
+		// Runs the entries outside the lock, destroying a wrapper may enqueue again
+		static void Destroy(std::vector<Entry>& ready);
+
+		std::vector<Entry> entries;
+		uint64_t submitted = 0;
+		uint64_t completed = 0;
+		mutable std::mutex mutex;
+	};
+
+	/*
+		The deletion queue every engine resource goes through
+	*/
+	DeletionQueue& GetDeletionQueue();
+}
@@ -1,15 +1,149 @@
 #include "GLSLCompiler.h"
+#include "PipelineCache.h"
 
 #include <memory>
 #include <iostream>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <Core/TaskSystem.h>
+#include <Core/Trace.h>
+#if __has_include(<glslang/build_info.h>)
+#include <glslang/build_info.h>
+#endif
+
+// Set by the build to the SDK version shaderc came with, builds that don't set it rely on SpirvCacheVersion
+#ifndef PB_SHADER_TOOLCHAIN_VERSION
+#define PB_SHADER_TOOLCHAIN_VERSION ""
+#endif
 
 namespace PBEngine
 {
+    namespace
+    {
+        // Bump when anything about how shaders are compiled changes that the hash below doesn't see, including a
+        // shaderc or glslang upgrade on a build that has neither PB_SHADER_TOOLCHAIN_VERSION nor glslang/build_info.h
+        constexpr uint32_t SpirvCacheVersion = 1;
+        constexpr uint32_t SpirvCacheMagic = 0x43535042; // "PBSC"
+
+        struct SpirvCacheHeader
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t key;
+            uint64_t wordCount;
+        };
+
+        // FNV-1a, stable across runs and platforms unlike std::hash
+        uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+        {
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            for (size_t i = 0; i < size; i++)
+            {
+                hash ^= bytes[i];
+                hash *= 0x100000001b3ull;
+            }
+            return hash;
+        }
+
+        // Everything that changes the SPIR-V coming out of compile_file
+        uint64_t GetSpirvCacheKey(shaderc_shader_kind kind, const std::string& source, bool optimize)
+        {
+            // shaderc_get_spv_version only reports the SPIR-V version it emits, the compiler itself is identified
+            // by the toolchain version the build passes in and by glslang's own version where it's installed
+            const uint32_t options[] = { SpirvCacheVersion, static_cast<uint32_t>(kind), optimize ? 1u : 0u,
+                static_cast<uint32_t>(shaderc_spirv_version_1_4) };
+#ifdef GLSLANG_VERSION_MAJOR
+            const uint32_t glslangVersion[] = { GLSLANG_VERSION_MAJOR, GLSLANG_VERSION_MINOR, GLSLANG_VERSION_PATCH };
+#else
+            const uint32_t glslangVersion[] = { 0, 0, 0 };
+#endif
+            const char toolchainVersion[] = PB_SHADER_TOOLCHAIN_VERSION;
+
+            uint64_t hash = 0xcbf29ce484222325ull;
+            hash = HashBytes(hash, options, sizeof(options));
+            hash = HashBytes(hash, glslangVersion, sizeof(glslangVersion));
+            hash = HashBytes(hash, toolchainVersion, sizeof(toolchainVersion));
+            hash = HashBytes(hash, source.data(), source.size());
+            return hash;
+        }
+
+        // shaderc compilers can't be shared between threads, and creating one per call is slow
+        shaderc::Compiler& GetThreadCompiler()
+        {
+            thread_local shaderc::Compiler compiler;
+            return compiler;
+        }
+
+        std::string GetSpirvCachePath(uint64_t key)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "%016llx.spv", static_cast<unsigned long long>(key));
+            return GetCacheDirectory() + "/spirv/" + name;
+        }
+
+        bool ReadCachedSpirv(uint64_t key, std::vector<uint32_t>& spirv)
+        {
+            std::ifstream file(GetSpirvCachePath(key), std::ios::binary | std::ios::ate);
+            const std::streamoff fileSize = file.tellg();
+            SpirvCacheHeader header;
+            if (!file || fileSize < static_cast<std::streamoff>(sizeof(header)) || !file.seekg(0) ||
+                !file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+            {
+                return false;
+            }
+            // A truncated or corrupted file must not size the allocation, so the word count has to account for
+            // exactly the bytes after the header. Dividing first keeps a huge count from wrapping.
+            const uint64_t remaining = static_cast<uint64_t>(fileSize) - sizeof(header);
+            if (header.magic != SpirvCacheMagic || header.version != SpirvCacheVersion || header.key != key ||
+                header.wordCount == 0 || header.wordCount > remaining / sizeof(uint32_t) ||
+                header.wordCount * sizeof(uint32_t) != remaining)
+            {
+                return false;
+            }
+
+            spirv.resize(static_cast<size_t>(header.wordCount));
+            if (!file.read(reinterpret_cast<char*>(spirv.data()), spirv.size() * sizeof(uint32_t)) ||
+                spirv[0] != 0x07230203)
+            {
+                spirv.clear();
+                return false;
+            }
+            return true;
+        }
+
+        void WriteCachedSpirv(uint64_t key, const std::vector<uint32_t>& spirv)
+        {
+            const std::string path = GetSpirvCachePath(key);
+            std::error_code error;
+            std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+            // Renamed into place so other threads and processes never read a half written file
+            const std::string tempPath = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+            {
+                std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+                SpirvCacheHeader header = { SpirvCacheMagic, SpirvCacheVersion, key, spirv.size() };
+                file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                file.write(reinterpret_cast<const char*>(spirv.data()), spirv.size() * sizeof(uint32_t));
+                if (!file)
+                {
+                    return;
+                }
+            }
+            std::filesystem::rename(tempPath, path, error);
+            if (error)
+            {
+                std::filesystem::remove(tempPath, error);
+            }
+        }
+    }
+
     // Returns GLSL shader source text after preprocessing.
     std::string GLSLCompiler::preprocess_shader(const std::string& source_name,
         shaderc_shader_kind kind,
         const std::string& source) {
-        shaderc::Compiler compiler;
+        shaderc::Compiler& compiler = GetThreadCompiler();
         shaderc::CompileOptions options;
 
         // Like -DMY_DEFINE=1
@@ -32,7 +166,7 @@ namespace PBEngine
         shaderc_shader_kind kind,
         const std::string& source,
         bool optimize = false) {
-        shaderc::Compiler compiler;
+        shaderc::Compiler& compiler = GetThreadCompiler();
         shaderc::CompileOptions options;
 
         // Like -DMY_DEFINE=1
@@ -51,12 +185,20 @@ namespace PBEngine
     }
 
     // Compiles a shader to a SPIR-V binary. Returns the binary as
-    // a vector of 32-bit words.
+    // a vector of 32-bit words. Results are cached on disk by a hash
+    // of the source and compile options.
     std::vector<uint32_t> GLSLCompiler::compile_file(const std::string& source_name,
         shaderc_shader_kind kind,
         const std::string& source,
         bool optimize = false) {
-        shaderc::Compiler compiler;
+        PB_TRACE_SCOPE("Compile shader");
+        const uint64_t cache_key = GetSpirvCacheKey(kind, source, optimize);
+        std::vector<uint32_t> cached;
+        if (ReadCachedSpirv(cache_key, cached)) {
+            return cached;
+        }
+
+        shaderc::Compiler& compiler = GetThreadCompiler();
         shaderc::CompileOptions options;
 
         // Like -DMY_DEFINE=1
@@ -72,7 +214,9 @@ namespace PBEngine
             return std::vector<uint32_t>();
         }
 
-        return { module.cbegin(), module.cend() };
+        std::vector<uint32_t> spirv(module.cbegin(), module.cend());
+        WriteCachedSpirv(cache_key, spirv);
+        return spirv;
     }
 
     shaderc_shader_kind GetShaderKind(VkShaderStageFlagBits stage)
@@ -126,6 +270,7 @@ namespace PBEngine
         default:
             break;
         }
+        return shaderc_glsl_infer_from_source;
     }
 
     VkShaderModule GLSLCompiler::load_shader(const std::string& source, VkDevice device,
@@ -157,4 +302,59 @@ namespace PBEngine
         assert(shader_stage.module != VK_NULL_HANDLE);
         return shader_stage;
     }
-}
\ No newline at end of file
+
+    std::string GLSLCompiler::get_shader_path(const std::string& name)
+    {
+        return std::string(PB_SHADER_DIRECTORY) + "/" + name;
+    }
+
+    bool GLSLCompiler::read_shader_file(const std::string& path, std::string& source)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            std::cerr << "Couldn't open shader " << path << std::endl;
+            return false;
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        source = contents.str();
+        return true;
+    }
+
+    bool GLSLCompiler::load_shader_files(const std::vector<ShaderFile>& files, bool optimize, std::vector<VkShaderModule>& modules)
+    {
+        PB_TRACE_SCOPE("Load shader files");
+        std::vector<std::vector<uint32_t>> spirv(files.size());
+        GetTaskSystem().ParallelFor(static_cast<uint32_t>(files.size()), [&](uint32_t i) {
+            std::string source;
+            if (read_shader_file(files[i].path, source))
+            {
+                spirv[i] = compile_file(files[i].path, GetShaderKind(files[i].stage), source, optimize);
+            }
+        });
+
+        modules.clear();
+        for (const std::vector<uint32_t>& code : spirv)
+        {
+            if (code.empty())
+            {
+                for (VkShaderModule module : modules)
+                {
+                    vkDestroyShaderModule(GetDevice(), module, nullptr);
+                }
+                modules.clear();
+                return false;
+            }
+
+            VkShaderModule           shader_module;
+            VkShaderModuleCreateInfo module_create_info{};
+            module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+            module_create_info.codeSize = code.size() * sizeof(uint32_t);
+            module_create_info.pCode = code.data();
+            check_vk_result(vkCreateShaderModule(GetDevice(), &module_create_info, NULL, &shader_module));
+            modules.push_back(shader_module);
+        }
+        return true;
+    }
+}
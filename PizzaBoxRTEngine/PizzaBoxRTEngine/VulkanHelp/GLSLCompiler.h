@@ -1,11 +1,23 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include "vk_common.h"
 #include <shaderc/shaderc.hpp>
 
+// Where the shader sources live, the build points this at the source tree so edits are picked up by hot reload
+#ifndef PB_SHADER_DIRECTORY
+#define PB_SHADER_DIRECTORY "Shaders"
+#endif
+
 namespace PBEngine
 {
+	struct ShaderFile
+	{
+		std::string path;
+		VkShaderStageFlagBits stage;
+	};
+
 	static class GLSLCompiler
 	{
 	public:
@@ -15,6 +27,17 @@ namespace PBEngine
 		static VkPipelineShaderStageCreateInfo load_shader(const std::string& source, VkShaderStageFlagBits stage, bool optimize);
 		static VkShaderModule load_shader(const std::string& source, VkDevice device, VkShaderStageFlagBits stage, bool optimize);
 
+		// Path of a file in the shader directory
+		static std::string get_shader_path(const std::string& name);
+		static bool read_shader_file(const std::string& path, std::string& source);
+
+		/**
+		 * @brief Reads and compiles the files in parallel on the task system, every thread has its own shaderc compiler
+		 * @param modules One module per file in the same order, left empty when any of them fails
+		 * @return false when a file is missing or doesn't compile, the errors are written to stderr
+		 */
+		static bool load_shader_files(const std::vector<ShaderFile>& files, bool optimize, std::vector<VkShaderModule>& modules);
+
 	private:
 			
 	};
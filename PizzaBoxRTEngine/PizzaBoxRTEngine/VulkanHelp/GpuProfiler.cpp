@@ -0,0 +1,196 @@
+#include "GpuProfiler.h"
+#include <Core/Trace.h>
+
+namespace PBEngine
+{
+	void GpuProfiler::Init(uint32_t slotCount, uint32_t maxRegions, uint32_t queueFamily, const std::string& trackName)
+	{
+		Destroy();
+		this->trackName = trackName;
+
+		uint32_t family_count = 0;
+		vkGetPhysicalDeviceQueueFamilyProperties(GetPhysicalDevice(), &family_count, nullptr);
+		std::vector<VkQueueFamilyProperties> families(family_count);
+		vkGetPhysicalDeviceQueueFamilyProperties(GetPhysicalDevice(), &family_count, families.data());
+		if (queueFamily >= family_count || families[queueFamily].timestampValidBits == 0 || slotCount == 0)
+		{
+			return;
+		}
+		const uint32_t valid_bits = families[queueFamily].timestampValidBits;
+		timestampMask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(GetPhysicalDevice(), &properties);
+		timestampPeriod = properties.limits.timestampPeriod;
+
+		this->maxRegions = maxRegions;
+		slots.assign(slotCount, Slot{});
+
+		// Two timestamps per region
+		VkQueryPoolCreateInfo query_pool_info{};
+		query_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		query_pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		query_pool_info.queryCount = slotCount * maxRegions * 2;
+		check_vk_result(vkCreateQueryPool(GetDevice(), &query_pool_info, nullptr, &queryPool));
+
+		Calibrate();
+	}
+
+	void GpuProfiler::Calibrate()
+	{
+		calibrated = false;
+		if (!App::g_CalibratedTimestamps)
+		{
+			return;
+		}
+
+		// Reading only the device clock, bracketed by the host clock, avoids having to know which host
+		// time domain the steady clock uses. The error is half the time the call takes.
+		VkCalibratedTimestampInfoEXT timestamp_info{};
+		timestamp_info.sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+		timestamp_info.timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+		uint64_t timestamp = 0;
+		uint64_t deviation = 0;
+		const uint64_t before = Tracer::Now();
+		if (vkGetCalibratedTimestampsEXT(GetDevice(), 1, &timestamp_info, &timestamp, &deviation) != VK_SUCCESS)
+		{
+			return;
+		}
+		const uint64_t after = Tracer::Now();
+
+		const double device_nanoseconds = (timestamp & timestampMask) * timestampPeriod;
+		hostOffset = static_cast<int64_t>(before + (after - before) / 2) - static_cast<int64_t>(device_nanoseconds);
+		calibrated = true;
+	}
+
+	void GpuProfiler::Trace(const Slot& slot, const std::vector<uint64_t>& ticks)
+	{
+		// Clocks drift apart over a long session, so every traced frame measures again
+		Calibrate();
+
+		const uint64_t first = ticks.empty() ? 0 : ticks[0];
+		for (size_t i = 0; i < slot.names.size(); i++)
+		{
+			uint64_t start;
+			uint64_t end;
+			if (calibrated)
+			{
+				start = static_cast<uint64_t>(static_cast<int64_t>(ticks[i * 2] * timestampPeriod) + hostOffset);
+				end = static_cast<uint64_t>(static_cast<int64_t>(ticks[i * 2 + 1] * timestampPeriod) + hostOffset);
+			}
+			else
+			{
+				start = slot.submitTime + static_cast<uint64_t>(((ticks[i * 2] - first) & timestampMask) * timestampPeriod);
+				end = slot.submitTime + static_cast<uint64_t>(((ticks[i * 2 + 1] - first) & timestampMask) * timestampPeriod);
+			}
+			GetTracer().AddGpuEvent(slot.names[i], trackName, start, end);
+		}
+	}
+
+	void GpuProfiler::Destroy()
+	{
+		if (queryPool != VK_NULL_HANDLE)
+		{
+			vkDestroyQueryPool(GetDevice(), queryPool, nullptr);
+			queryPool = VK_NULL_HANDLE;
+		}
+		slots.clear();
+	}
+
+	void GpuProfiler::BeginSlot(VkCommandBuffer commandBuffer, uint32_t slot)
+	{
+		if (!IsEnabled())
+		{
+			return;
+		}
+		slots[slot].names.clear();
+		vkCmdResetQueryPool(commandBuffer, queryPool, slot * maxRegions * 2, maxRegions * 2);
+	}
+
+	uint32_t GpuProfiler::BeginRegion(VkCommandBuffer commandBuffer, uint32_t slot, const char* name, VkPipelineStageFlagBits stage)
+	{
+		if (!IsEnabled() || slots[slot].names.size() >= maxRegions)
+		{
+			return UINT32_MAX;
+		}
+		const uint32_t region = static_cast<uint32_t>(slots[slot].names.size());
+		slots[slot].names.push_back(name);
+		vkCmdWriteTimestamp(commandBuffer, stage, queryPool, (slot * maxRegions + region) * 2);
+		return region;
+	}
+
+	void GpuProfiler::EndRegion(VkCommandBuffer commandBuffer, uint32_t slot, uint32_t region, VkPipelineStageFlagBits stage)
+	{
+		if (!IsEnabled() || region == UINT32_MAX)
+		{
+			return;
+		}
+		vkCmdWriteTimestamp(commandBuffer, stage, queryPool, (slot * maxRegions + region) * 2 + 1);
+	}
+
+	void GpuProfiler::MarkSubmitted(uint32_t slot)
+	{
+		if (IsEnabled())
+		{
+			slots[slot].submitted = true;
+			slots[slot].submitTime = Tracer::Now();
+		}
+	}
+
+	bool GpuProfiler::Resolve(uint32_t slot)
+	{
+		if (!IsEnabled() || !slots[slot].submitted || slots[slot].names.empty())
+		{
+			return false;
+		}
+
+		// Every timestamp followed by its availability, so nothing waits on a region that hasn't finished
+		const uint32_t query_count = static_cast<uint32_t>(slots[slot].names.size()) * 2;
+		results.resize(query_count * 2);
+		const VkResult result = vkGetQueryPoolResults(GetDevice(), queryPool, slot * maxRegions * 2, query_count,
+			results.size() * sizeof(uint64_t), results.data(), sizeof(uint64_t) * 2,
+			VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+		if (result != VK_SUCCESS && result != VK_NOT_READY)
+		{
+			check_vk_result(result);
+		}
+		for (uint32_t i = 0; i < query_count; i++)
+		{
+			if (results[i * 2 + 1] == 0)
+			{
+				return false;
+			}
+		}
+
+		slots[slot].submitted = false;
+		regions.resize(slots[slot].names.size());
+		std::vector<uint64_t> ticks(query_count);
+		for (size_t i = 0; i < regions.size(); i++)
+		{
+			ticks[i * 2] = results[i * 4] & timestampMask;
+			ticks[i * 2 + 1] = results[i * 4 + 2] & timestampMask;
+			// The counter may wrap between the two timestamps
+			const uint64_t duration = (ticks[i * 2 + 1] - ticks[i * 2]) & timestampMask;
+			regions[i].name = slots[slot].names[i];
+			regions[i].milliseconds = duration * timestampPeriod / 1000000.0;
+		}
+
+		if (GetTracer().IsEnabled())
+		{
+			Trace(slots[slot], ticks);
+		}
+		return true;
+	}
+
+	double GpuProfiler::GetMilliseconds(const char* name) const
+	{
+		for (const Region& region : regions)
+		{
+			if (region.name == name)
+			{
+				return region.milliseconds;
+			}
+		}
+		return 0.0;
+	}
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include "vk_common.h"
+#include <string>
+#include <vector>
+
+namespace PBEngine
+{
+	/*
+		Times regions of command buffers with vkCmdWriteTimestamp.
+
+		The queries are split into slots, usually one per frame in flight, so recording into a slot never
+		touches timestamps of a submission the GPU may still be working on. Resolve reads a slot back without
+		waiting once the caller knows its submission finished, e.g. right after the frame's fence wait.
+
+			profiler.BeginSlot(cmd, frame);
+			uint32_t trace = profiler.BeginRegion(cmd, frame, "Trace rays");
+			vkCmdTraceRaysKHR(cmd, ...);
+			profiler.EndRegion(cmd, frame, trace);
+			...
+			profiler.MarkSubmitted(frame);
+			// Later, after the fence wait
+			profiler.Resolve(frame);
+
+		Command buffers that are recorded once and submitted many times work too, the queries are reset
+		by the command buffer itself.
+
+		While the tracer records, resolved regions also go into the trace on the profiler's queue track.
+		With VK_EXT_calibrated_timestamps they're placed on the host timeline exactly, without it they
+		start at the time the slot was submitted, which hides how long the work sat in the queue.
+	*/
+	class GpuProfiler
+	{
+	public:
+		struct Region
+		{
+			std::string name;
+			double milliseconds = 0.0;
+		};
+
+		GpuProfiler() = default;
+		GpuProfiler(const GpuProfiler&) = delete;
+		GpuProfiler& operator=(const GpuProfiler&) = delete;
+		~GpuProfiler() { Destroy(); }
+
+		/**
+		 * @param slotCount Independent sets of queries, one per submission that can be in flight at once
+		 * @param maxRegions Regions a single slot can hold, regions past that are skipped
+		 * @param queueFamily Family the command buffers go to, profiling stays off when it can't write timestamps
+		 * @param trackName Row the regions appear on in traces
+		 */
+		void Init(uint32_t slotCount, uint32_t maxRegions, uint32_t queueFamily, const std::string& trackName = "GPU");
+		void Destroy();
+
+		bool IsEnabled() const { return queryPool != VK_NULL_HANDLE; }
+
+		// Resets the slot's queries, recorded ahead of its regions in the same command buffer
+		void BeginSlot(VkCommandBuffer commandBuffer, uint32_t slot);
+
+		// Returns the region for EndRegion
+		uint32_t BeginRegion(VkCommandBuffer commandBuffer, uint32_t slot, const char* name,
+			VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+		void EndRegion(VkCommandBuffer commandBuffer, uint32_t slot, uint32_t region,
+			VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+		// The slot's command buffer was submitted, so Resolve has something to read
+		void MarkSubmitted(uint32_t slot);
+
+		/**
+		 * @brief Reads the timestamps of the slot's last submission without blocking
+		 * @return true when they were available, GetRegions then holds the new times
+		 */
+		bool Resolve(uint32_t slot);
+
+		// Times of the most recently resolved slot, in the order the regions were begun
+		const std::vector<Region>& GetRegions() const { return regions; }
+
+		// Time of the named region in the last resolve, 0 when there's no such region
+		double GetMilliseconds(const char* name) const;
+
+	private:
+		struct Slot
+		{
+			std::vector<std::string> names;
+			bool submitted = false;
+			// Host time of MarkSubmitted, the trace falls back to it without calibrated timestamps
+			uint64_t submitTime = 0;
+		};
+
+		// Measures the offset between device timestamps and the tracer's clock
+		void Calibrate();
+		// Adds the resolved regions to the trace, begin and end ticks of every region
+		void Trace(const Slot& slot, const std::vector<uint64_t>& ticks);
+
+		VkQueryPool queryPool = VK_NULL_HANDLE;
+		uint32_t maxRegions = 0;
+		// Nanoseconds per tick
+		double timestampPeriod = 1.0;
+		uint64_t timestampMask = ~0ull;
+		std::string trackName;
+		bool calibrated = false;
+		// Host nanoseconds minus device nanoseconds
+		int64_t hostOffset = 0;
+		std::vector<Slot> slots;
+		std::vector<Region> regions;
+		std::vector<uint64_t> results;
+	};
+}
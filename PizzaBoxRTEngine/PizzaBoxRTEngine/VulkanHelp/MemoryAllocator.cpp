@@ -0,0 +1,494 @@
+#include "MemoryAllocator.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace PBEngine
+{
+	namespace
+	{
+		VkDeviceSize RoundUpToPowerOfTwo(VkDeviceSize value)
+		{
+			VkDeviceSize result = 1;
+			while (result < value)
+			{
+				result <<= 1;
+			}
+			return result;
+		}
+
+		VkDeviceSize RoundDownToPowerOfTwo(VkDeviceSize value)
+		{
+			VkDeviceSize result = 1;
+			while ((result << 1) <= value)
+			{
+				result <<= 1;
+			}
+			return result;
+		}
+
+		uint32_t Log2(VkDeviceSize value)
+		{
+			uint32_t result = 0;
+			while (value > 1)
+			{
+				value >>= 1;
+				result++;
+			}
+			return result;
+		}
+	}
+
+	MemoryAllocator& GetMemoryAllocator()
+	{
+		static MemoryAllocator allocator;
+		return allocator;
+	}
+
+	void MemoryAllocator::Init(VkDevice device, VkPhysicalDevice physicalDevice)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->device = device;
+		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		nonCoherentAtomSize = properties.limits.nonCoherentAtomSize;
+	}
+
+	void MemoryAllocator::EnsureInitialised()
+	{
+		if (device == VK_NULL_HANDLE)
+		{
+			device = GetDevice();
+			vkGetPhysicalDeviceMemoryProperties(GetPhysicalDevice(), &memoryProperties);
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(GetPhysicalDevice(), &properties);
+			nonCoherentAtomSize = properties.limits.nonCoherentAtomSize;
+		}
+	}
+
+	void MemoryAllocator::Destroy()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (device == VK_NULL_HANDLE)
+		{
+			return;
+		}
+
+		uint32_t leaked = 0;
+		for (Pool& pool : pools)
+		{
+			for (std::unique_ptr<Block>& block : pool.blocks)
+			{
+				if (!block)
+				{
+					continue;
+				}
+				leaked += block->allocationCount;
+				vkFreeMemory(device, block->memory, nullptr);
+			}
+		}
+		for (VkDeviceMemory memory : dedicatedAllocations)
+		{
+			leaked++;
+			vkFreeMemory(device, memory, nullptr);
+		}
+		if (leaked > 0)
+		{
+			fprintf(stderr, "[memory] %u allocations were still alive when the allocator was destroyed\n", leaked);
+		}
+
+		pools.clear();
+		dedicatedAllocations.clear();
+		dedicatedBytes = 0;
+		device = VK_NULL_HANDLE;
+	}
+
+	bool MemoryAllocator::AllocateForBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, Allocation& allocation)
+	{
+		VkMemoryRequirements requirements;
+		vkGetBufferMemoryRequirements(GetDevice(), buffer, &requirements);
+		if (!Allocate(requirements, properties, true, allocation))
+		{
+			return false;
+		}
+
+		VkResult err = vkBindBufferMemory(GetDevice(), buffer, allocation.memory, allocation.offset);
+		check_vk_result(err);
+		return true;
+	}
+
+	bool MemoryAllocator::AllocateForImage(VkImage image, VkMemoryPropertyFlags properties, Allocation& allocation)
+	{
+		VkMemoryRequirements requirements;
+		vkGetImageMemoryRequirements(GetDevice(), image, &requirements);
+		if (!Allocate(requirements, properties, false, allocation))
+		{
+			return false;
+		}
+
+		VkResult err = vkBindImageMemory(GetDevice(), image, allocation.memory, allocation.offset);
+		check_vk_result(err);
+		return true;
+	}
+
+	bool MemoryAllocator::Allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties,
+		bool linear, Allocation& allocation)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		EnsureInitialised();
+		allocation = {};
+
+		// Try every memory type that fits, a full heap shouldn't fail the allocation if another heap works
+		for (uint32_t type = 0; type < memoryProperties.memoryTypeCount; type++)
+		{
+			if ((requirements.memoryTypeBits & (1u << type)) == 0 ||
+				(memoryProperties.memoryTypes[type].propertyFlags & properties) != properties)
+			{
+				continue;
+			}
+
+			const uint32_t poolIndex = GetPool(type, linear);
+			if (requirements.size * 2 > pools[poolIndex].blockSize)
+			{
+				if (AllocateDedicated(type, requirements.size, linear, allocation))
+				{
+					return true;
+				}
+			}
+			else if (AllocateFromPool(poolIndex, requirements.size, requirements.alignment, allocation))
+			{
+				return true;
+			}
+		}
+
+		fprintf(stderr, "[memory] Failed to allocate %llu bytes\n", static_cast<unsigned long long>(requirements.size));
+		return false;
+	}
+
+	uint32_t MemoryAllocator::GetPool(uint32_t memoryType, bool linear)
+	{
+		for (uint32_t i = 0; i < pools.size(); i++)
+		{
+			if (pools[i].memoryType == memoryType && pools[i].linear == linear)
+			{
+				return i;
+			}
+		}
+
+		// Small heaps (like the 256MB device local + host visible one) get smaller blocks
+		const VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[memoryType].heapIndex].size;
+		VkDeviceSize blockSize = RoundDownToPowerOfTwo(preferredBlockSize);
+		while (blockSize > heapSize / 8 && blockSize > minAllocationSize * 64)
+		{
+			blockSize >>= 1;
+		}
+
+		Pool pool;
+		pool.memoryType = memoryType;
+		pool.linear = linear;
+		pool.blockSize = blockSize;
+		pool.maxOrder = Log2(blockSize / minAllocationSize);
+		pools.push_back(std::move(pool));
+		return static_cast<uint32_t>(pools.size() - 1);
+	}
+
+	bool MemoryAllocator::AllocateMemory(uint32_t memoryType, VkDeviceSize size, bool linear, VkDeviceMemory& memory,
+		void** mapped)
+	{
+		VkMemoryAllocateFlagsInfo allocateFlags = {};
+		allocateFlags.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+		allocateFlags.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+
+		VkMemoryAllocateInfo allocateInfo = {};
+		allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocateInfo.pNext = linear ? &allocateFlags : nullptr;
+		allocateInfo.allocationSize = size;
+		allocateInfo.memoryTypeIndex = memoryType;
+
+		if (vkAllocateMemory(device, &allocateInfo, nullptr, &memory) != VK_SUCCESS)
+		{
+			memory = VK_NULL_HANDLE;
+			return false;
+		}
+
+		*mapped = nullptr;
+		if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+		{
+			VkResult err = vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, mapped);
+			check_vk_result(err);
+		}
+		return true;
+	}
+
+	bool MemoryAllocator::AllocateDedicated(uint32_t memoryType, VkDeviceSize size, bool linear, Allocation& allocation)
+	{
+		VkDeviceMemory memory;
+		void* mapped;
+		if (!AllocateMemory(memoryType, size, linear, memory, &mapped))
+		{
+			return false;
+		}
+
+		dedicatedAllocations.insert(memory);
+		dedicatedBytes += size;
+
+		allocation.memory = memory;
+		allocation.offset = 0;
+		allocation.size = size;
+		allocation.mapped = mapped;
+		allocation.coherent = (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+		allocation.pool = UINT32_MAX;
+		allocation.block = UINT32_MAX;
+		return true;
+	}
+
+	MemoryAllocator::Block* MemoryAllocator::CreateBlock(Pool& pool, uint32_t& blockIndex)
+	{
+		VkDeviceMemory memory;
+		void* mapped;
+		if (!AllocateMemory(pool.memoryType, pool.blockSize, pool.linear, memory, &mapped))
+		{
+			return nullptr;
+		}
+
+		std::unique_ptr<Block> block = std::make_unique<Block>();
+		block->memory = memory;
+		block->mapped = static_cast<uint8_t*>(mapped);
+		block->freeLists.resize(pool.maxOrder + 1);
+		block->freeLists[pool.maxOrder].insert(0);
+
+		// Reuse the slot of a freed block if there is one
+		for (blockIndex = 0; blockIndex < pool.blocks.size(); blockIndex++)
+		{
+			if (!pool.blocks[blockIndex])
+			{
+				pool.blocks[blockIndex] = std::move(block);
+				return pool.blocks[blockIndex].get();
+			}
+		}
+		pool.blocks.push_back(std::move(block));
+		return pool.blocks.back().get();
+	}
+
+	bool MemoryAllocator::AllocateFromPool(uint32_t poolIndex, VkDeviceSize size, VkDeviceSize alignment,
+		Allocation& allocation)
+	{
+		Pool& pool = pools[poolIndex];
+
+		// Buddy ranges start at a multiple of their own size, so rounding up to the alignment aligns them too
+		const VkDeviceSize rangeSize = RoundUpToPowerOfTwo(std::max(std::max(size, alignment), minAllocationSize));
+		const uint32_t order = Log2(rangeSize / minAllocationSize);
+
+		// Take the smallest free range that fits from any block
+		Block* block = nullptr;
+		uint32_t blockIndex = 0;
+		uint32_t foundOrder = UINT32_MAX;
+		for (uint32_t i = 0; i < pool.blocks.size() && foundOrder != order; i++)
+		{
+			if (!pool.blocks[i])
+			{
+				continue;
+			}
+			for (uint32_t o = order; o < foundOrder && o <= pool.maxOrder; o++)
+			{
+				if (!pool.blocks[i]->freeLists[o].empty())
+				{
+					block = pool.blocks[i].get();
+					blockIndex = i;
+					foundOrder = o;
+					break;
+				}
+			}
+		}
+
+		if (!block)
+		{
+			block = CreateBlock(pool, blockIndex);
+			if (!block)
+			{
+				return false;
+			}
+			foundOrder = pool.maxOrder;
+		}
+
+		std::set<VkDeviceSize>& freeList = block->freeLists[foundOrder];
+		const VkDeviceSize offset = *freeList.begin();
+		freeList.erase(freeList.begin());
+
+		// Split down to the requested size, the upper halves become free buddies
+		for (uint32_t o = foundOrder; o > order; o--)
+		{
+			block->freeLists[o - 1].insert(offset + (minAllocationSize << (o - 1)));
+		}
+		block->allocationCount++;
+
+		allocation.memory = block->memory;
+		allocation.offset = offset;
+		allocation.size = size;
+		allocation.mapped = block->mapped ? block->mapped + offset : nullptr;
+		allocation.coherent = (memoryProperties.memoryTypes[pool.memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+		allocation.pool = poolIndex;
+		allocation.block = blockIndex;
+		allocation.order = order;
+		return true;
+	}
+
+	void MemoryAllocator::Free(Allocation& allocation)
+	{
+		if (!allocation.IsValid())
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (device == VK_NULL_HANDLE)
+		{
+			// Destroy already released the memory
+			allocation = {};
+			return;
+		}
+
+		if (allocation.IsDedicated())
+		{
+			dedicatedAllocations.erase(allocation.memory);
+			dedicatedBytes -= allocation.size;
+			vkFreeMemory(device, allocation.memory, nullptr);
+			allocation = {};
+			return;
+		}
+
+		Pool& pool = pools[allocation.pool];
+		Block& block = *pool.blocks[allocation.block];
+
+		// Merge with the buddy for as long as it's free too
+		VkDeviceSize offset = allocation.offset;
+		uint32_t order = allocation.order;
+		while (order < pool.maxOrder)
+		{
+			const VkDeviceSize buddy = offset ^ (minAllocationSize << order);
+			std::set<VkDeviceSize>::iterator it = block.freeLists[order].find(buddy);
+			if (it == block.freeLists[order].end())
+			{
+				break;
+			}
+			block.freeLists[order].erase(it);
+			offset = std::min(offset, buddy);
+			order++;
+		}
+		block.freeLists[order].insert(offset);
+		block.allocationCount--;
+
+		// Give empty blocks back to the driver, but keep one around so a pool doesn't thrash
+		if (block.allocationCount == 0)
+		{
+			uint32_t liveBlocks = 0;
+			for (const std::unique_ptr<Block>& other : pool.blocks)
+			{
+				liveBlocks += other ? 1 : 0;
+			}
+			if (liveBlocks > 1)
+			{
+				vkFreeMemory(device, block.memory, nullptr);
+				pool.blocks[allocation.block].reset();
+			}
+		}
+
+		allocation = {};
+	}
+
+	VkMappedMemoryRange MemoryAllocator::GetMappedRange(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size)
+	{
+		// Buddy ranges are a power of two of at least minAllocationSize and aligned to their size, so widening
+		// to the atom stays inside them. Dedicated allocations end with their memory, there VK_WHOLE_SIZE covers the tail.
+		const VkDeviceSize rangeEnd = allocation.IsDedicated() ? allocation.size :
+			allocation.offset + (minAllocationSize << allocation.order);
+		const VkDeviceSize start = allocation.offset + offset;
+		const VkDeviceSize end = size == VK_WHOLE_SIZE ? allocation.offset + allocation.size : start + size;
+
+		VkMappedMemoryRange range = {};
+		range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+		range.memory = allocation.memory;
+		range.offset = start / nonCoherentAtomSize * nonCoherentAtomSize;
+		const VkDeviceSize alignedEnd = (end + nonCoherentAtomSize - 1) / nonCoherentAtomSize * nonCoherentAtomSize;
+		range.size = alignedEnd > rangeEnd ? VK_WHOLE_SIZE : alignedEnd - range.offset;
+		return range;
+	}
+
+	void MemoryAllocator::Flush(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size)
+	{
+		if (allocation.coherent || allocation.mapped == nullptr || size == 0)
+		{
+			return;
+		}
+
+		const VkMappedMemoryRange range = GetMappedRange(allocation, offset, size);
+		VkResult err = vkFlushMappedMemoryRanges(device, 1, &range);
+		check_vk_result(err);
+	}
+
+	void MemoryAllocator::Invalidate(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size)
+	{
+		if (allocation.coherent || allocation.mapped == nullptr || size == 0)
+		{
+			return;
+		}
+
+		const VkMappedMemoryRange range = GetMappedRange(allocation, offset, size);
+		VkResult err = vkInvalidateMappedMemoryRanges(device, 1, &range);
+		check_vk_result(err);
+	}
+
+	MemoryAllocator::Statistics MemoryAllocator::GetStatistics()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Statistics stats;
+		VkDeviceSize totalFree = 0;
+		VkDeviceSize largestFreeSum = 0;
+
+		for (const Pool& pool : pools)
+		{
+			for (const std::unique_ptr<Block>& block : pool.blocks)
+			{
+				if (!block)
+				{
+					continue;
+				}
+				stats.blockCount++;
+				stats.allocationCount += block->allocationCount;
+				stats.bytesReserved += pool.blockSize;
+
+				VkDeviceSize blockFree = 0;
+				VkDeviceSize blockLargest = 0;
+				for (uint32_t order = 0; order <= pool.maxOrder; order++)
+				{
+					const VkDeviceSize rangeSize = minAllocationSize << order;
+					blockFree += rangeSize * block->freeLists[order].size();
+					if (!block->freeLists[order].empty())
+					{
+						blockLargest = rangeSize;
+					}
+				}
+				stats.bytesInUse += pool.blockSize - blockFree;
+				stats.largestFreeRange = std::max(stats.largestFreeRange, blockLargest);
+				totalFree += blockFree;
+				largestFreeSum += blockLargest;
+			}
+		}
+
+		stats.dedicatedAllocationCount = static_cast<uint32_t>(dedicatedAllocations.size());
+		stats.allocationCount += stats.dedicatedAllocationCount;
+		stats.bytesReserved += dedicatedBytes;
+		stats.bytesInUse += dedicatedBytes;
+		stats.fragmentation = totalFree > 0 ? 1.0f - static_cast<float>(largestFreeSum) / static_cast<float>(totalFree) : 0.0f;
+		return stats;
+	}
+
+	void MemoryAllocator::PrintStatistics()
+	{
+		const Statistics stats = GetStatistics();
+		printf("[memory] %u allocations (%u dedicated) in %u blocks, %.2f / %.2f MB in use, largest free range %.2f MB, fragmentation %.1f%%\n",
+			stats.allocationCount, stats.dedicatedAllocationCount, stats.blockCount,
+			stats.bytesInUse / (1024.0 * 1024.0), stats.bytesReserved / (1024.0 * 1024.0),
+			stats.largestFreeRange / (1024.0 * 1024.0), stats.fragmentation * 100.0f);
+	}
+}
@@ -0,0 +1,161 @@
+#pragma once
+#include "vk_common.h"
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_set>
+#include <vector>
+
+namespace PBEngine
+{
+	/*
+		A range of device memory handed out by the MemoryAllocator. Resources are bound at memory + offset.
+	*/
+	struct Allocation
+	{
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize offset = 0;
+		VkDeviceSize size = 0;
+		// Host pointer to the start of the range, only set for host visible memory
+		void* mapped = nullptr;
+		// Host writes and reads of non coherent memory need MemoryAllocator::Flush and Invalidate
+		bool coherent = true;
+
+		// Where the range came from, dedicated allocations have no block
+		uint32_t pool = UINT32_MAX;
+		uint32_t block = UINT32_MAX;
+		uint32_t order = 0;
+
+		bool IsValid() const { return memory != VK_NULL_HANDLE; }
+		bool IsDedicated() const { return block == UINT32_MAX; }
+	};
+
+	/*
+		Sub-allocates buffers and images out of large VkDeviceMemory blocks instead of calling vkAllocateMemory
+		per resource, which keeps us far away from maxMemoryAllocationCount and the driver cost of each call.
+
+		There is one pool per memory type and resource kind, so linear buffers and optimal images never share
+		a block and bufferImageGranularity never matters. Each block is split up by a buddy allocator, which
+		keeps every range aligned to its own power of two size. Requests of half a block or more get their own
+		dedicated allocation. Host visible blocks stay mapped for their whole lifetime.
+	*/
+	class MemoryAllocator
+	{
+	public:
+		struct Statistics
+		{
+			uint32_t blockCount = 0;
+			uint32_t dedicatedAllocationCount = 0;
+			uint32_t allocationCount = 0;
+			// Memory allocated from the driver
+			VkDeviceSize bytesReserved = 0;
+			// Memory handed out to resources, including the padding up to the buddy size
+			VkDeviceSize bytesInUse = 0;
+			// Biggest single free range in any block
+			VkDeviceSize largestFreeRange = 0;
+			// 0 when the free memory of every block is one range, approaching 1 the more it's split up
+			float fragmentation = 0.0f;
+		};
+
+		MemoryAllocator() = default;
+		MemoryAllocator(const MemoryAllocator&) = delete;
+		MemoryAllocator& operator=(const MemoryAllocator&) = delete;
+
+		/*
+			Only needed when the allocator should use a different device than GetDevice()
+		*/
+		void Init(VkDevice device, VkPhysicalDevice physicalDevice);
+
+		/*
+			Frees every block. Anything still allocated at this point is reported as a leak.
+			Must run before the device is destroyed, the allocator can be used again afterwards.
+		*/
+		void Destroy();
+
+		/**
+		 * @brief Allocates memory for a buffer and binds it. Buffer memory is always allocated with
+		 * VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT so any buffer can share a block with any other.
+		 * @param properties Required memory properties
+		 * @return false when no memory could be found, allocation is left invalid
+		 */
+		bool AllocateForBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, Allocation& allocation);
+
+		/**
+		 * @brief Allocates memory for an optimally tiled image and binds it
+		 * @return false when no memory could be found, allocation is left invalid
+		 */
+		bool AllocateForImage(VkImage image, VkMemoryPropertyFlags properties, Allocation& allocation);
+
+		/**
+		 * @brief Returns the range and resets the allocation. Safe to call on invalid allocations.
+		 */
+		void Free(Allocation& allocation);
+
+		/**
+		 * @brief Makes host writes to part of a mapped allocation visible to the device. Does nothing for
+		 * coherent memory. The range is widened to nonCoherentAtomSize, which never reaches past memory
+		 * owned by the allocation's buddy range or dedicated allocation.
+		 * @param offset Relative to the start of the allocation
+		 * @param size Bytes from offset, VK_WHOLE_SIZE for the rest of the allocation
+		 */
+		void Flush(const Allocation& allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+		/**
+		 * @brief Makes device writes to part of a mapped allocation visible to the host, the counterpart of Flush
+		 */
+		void Invalidate(const Allocation& allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+		Statistics GetStatistics();
+		void PrintStatistics();
+
+		// Largest block that small allocations are carved from, smaller heaps use smaller blocks
+		VkDeviceSize preferredBlockSize = 64ull * 1024 * 1024;
+		// Smallest range handed out, also covers the alignment of most resources
+		VkDeviceSize minAllocationSize = 256;
+
+	private:
+		struct Block
+		{
+			VkDeviceMemory memory = VK_NULL_HANDLE;
+			uint8_t* mapped = nullptr;
+			// Free range offsets by order, order n is minAllocationSize << n bytes
+			std::vector<std::set<VkDeviceSize>> freeLists;
+			uint32_t allocationCount = 0;
+		};
+
+		struct Pool
+		{
+			uint32_t memoryType = 0;
+			bool linear = true;
+			VkDeviceSize blockSize = 0;
+			// Order of a whole block
+			uint32_t maxOrder = 0;
+			// Freed blocks leave an empty slot so the indices in live allocations stay valid
+			std::vector<std::unique_ptr<Block>> blocks;
+		};
+
+		bool Allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear,
+			Allocation& allocation);
+		bool AllocateFromPool(uint32_t poolIndex, VkDeviceSize size, VkDeviceSize alignment, Allocation& allocation);
+		bool AllocateDedicated(uint32_t memoryType, VkDeviceSize size, bool linear, Allocation& allocation);
+		uint32_t GetPool(uint32_t memoryType, bool linear);
+		Block* CreateBlock(Pool& pool, uint32_t& blockIndex);
+		bool AllocateMemory(uint32_t memoryType, VkDeviceSize size, bool linear, VkDeviceMemory& memory, void** mapped);
+		void EnsureInitialised();
+		// The atom aligned range of memory that Flush and Invalidate pass to Vulkan
+		VkMappedMemoryRange GetMappedRange(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size);
+
+		VkDevice device = VK_NULL_HANDLE;
+		VkPhysicalDeviceMemoryProperties memoryProperties{};
+		VkDeviceSize nonCoherentAtomSize = 1;
+		std::vector<Pool> pools;
+		std::unordered_set<VkDeviceMemory> dedicatedAllocations;
+		VkDeviceSize dedicatedBytes = 0;
+		std::mutex mutex;
+	};
+
+	/*
+		The allocator every engine resource draws from. Picks up GetDevice() on first use.
+	*/
+	MemoryAllocator& GetMemoryAllocator();
+}
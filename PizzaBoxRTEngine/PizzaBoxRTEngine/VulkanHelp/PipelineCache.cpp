@@ -0,0 +1,121 @@
+#include "PipelineCache.h"
+#include "vk_common.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace PBEngine
+{
+	namespace
+	{
+		std::string GetPipelineCachePath()
+		{
+			return GetCacheDirectory() + "/pipeline_cache.bin";
+		}
+
+		// The header every implementation puts at the start of vkGetPipelineCacheData
+		bool IsPipelineCacheCompatible(const std::vector<uint8_t>& data, const VkPhysicalDeviceProperties& properties)
+		{
+			VkPipelineCacheHeaderVersionOne header;
+			if (data.size() < sizeof(header))
+			{
+				return false;
+			}
+			memcpy(&header, data.data(), sizeof(header));
+
+			return header.headerSize >= sizeof(header) &&
+				header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+				header.vendorID == properties.vendorID &&
+				header.deviceID == properties.deviceID &&
+				memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+		}
+	}
+
+	const std::string& GetCacheDirectory()
+	{
+		static const std::string directory = "cache";
+		return directory;
+	}
+
+	VkPipelineCache LoadPipelineCache(VkDevice device, VkPhysicalDevice physicalDevice)
+	{
+		std::vector<uint8_t> data;
+		std::ifstream file(GetPipelineCachePath(), std::ios::binary | std::ios::ate);
+		if (file)
+		{
+			data.resize(static_cast<size_t>(file.tellg()));
+			file.seekg(0);
+			if (!file.read(reinterpret_cast<char*>(data.data()), data.size()))
+			{
+				data.clear();
+			}
+		}
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		if (!data.empty() && !IsPipelineCacheCompatible(data, properties))
+		{
+			printf("[pipeline cache] Cache on disk is from a different GPU or driver, starting empty\n");
+			data.clear();
+		}
+
+		VkPipelineCacheCreateInfo create_info{};
+		create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		create_info.initialDataSize = data.size();
+		create_info.pInitialData = data.empty() ? nullptr : data.data();
+
+		VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+		VkResult err = vkCreatePipelineCache(device, &create_info, nullptr, &pipelineCache);
+		if (err != VK_SUCCESS && !data.empty())
+		{
+			// The header matched but the driver still didn't like the contents
+			create_info.initialDataSize = 0;
+			create_info.pInitialData = nullptr;
+			err = vkCreatePipelineCache(device, &create_info, nullptr, &pipelineCache);
+		}
+		check_vk_result(err);
+		return pipelineCache;
+	}
+
+	bool SavePipelineCache(VkDevice device, VkPipelineCache pipelineCache)
+	{
+		if (pipelineCache == VK_NULL_HANDLE)
+		{
+			return false;
+		}
+
+		size_t size = 0;
+		if (vkGetPipelineCacheData(device, pipelineCache, &size, nullptr) != VK_SUCCESS || size == 0)
+		{
+			return false;
+		}
+		std::vector<uint8_t> data(size);
+		if (vkGetPipelineCacheData(device, pipelineCache, &size, data.data()) != VK_SUCCESS)
+		{
+			return false;
+		}
+
+		// Written next to the real file and renamed over it, so a crash mid write can't leave a torn cache
+		std::error_code error;
+		std::filesystem::create_directories(GetCacheDirectory(), error);
+		const std::string path = GetPipelineCachePath();
+		const std::string tempPath = path + ".tmp";
+		{
+			std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+			if (!file.write(reinterpret_cast<const char*>(data.data()), size))
+			{
+				fprintf(stderr, "[pipeline cache] Failed to write %s\n", tempPath.c_str());
+				return false;
+			}
+		}
+		std::filesystem::rename(tempPath, path, error);
+		if (error)
+		{
+			fprintf(stderr, "[pipeline cache] Failed to replace %s: %s\n", path.c_str(), error.message().c_str());
+			return false;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "../../../External/volk/volk.h"
+#include <string>
+
+namespace PBEngine
+{
+	/*
+		The "cache" directory inside the working directory, holds everything we cache between runs
+		(compiled SPIR-V and the serialized pipeline cache). Safe to delete at any time.
+	*/
+	const std::string& GetCacheDirectory();
+
+	/**
+	 * @brief Creates a pipeline cache, seeded from the file written by the last SavePipelineCache.
+	 * The file is only used when its header matches this device's vendor, device id and pipelineCacheUUID,
+	 * since drivers aren't required to survive data from another GPU or driver version.
+	 * @return An empty pipeline cache when the file is missing or doesn't match
+	 */
+	VkPipelineCache LoadPipelineCache(VkDevice device, VkPhysicalDevice physicalDevice);
+
+	/**
+	 * @brief Writes the contents of the pipeline cache to disk so the next run can skip pipeline compilation
+	 * @return false when the data couldn't be read back or written
+	 */
+	bool SavePipelineCache(VkDevice device, VkPipelineCache pipelineCache);
+}
@@ -0,0 +1,253 @@
+#include "RayTracingPipelineBuilder.h"
+#include <Core/TaskSystem.h>
+#include <Core/Trace.h>
+#include <chrono>
+#include <functional>
+
+namespace PBEngine
+{
+	RayTracingPipelineBuilder::RayTracingPipelineBuilder(VkPipelineLayout layout, uint32_t maxRecursionDepth,
+		uint32_t payloadSize, uint32_t attributeSize) :
+		layout(layout), maxRecursionDepth(maxRecursionDepth), payloadSize(payloadSize), attributeSize(attributeSize),
+		useLibraries(App::g_PipelineLibraries)
+	{
+	}
+
+	RayTracingPipelineBuilder::~RayTracingPipelineBuilder()
+	{
+		Destroy();
+	}
+
+	uint32_t RayTracingPipelineBuilder::AddLibrary(const Library& library)
+	{
+		LibraryState state;
+		state.description = library;
+		state.firstGroup = groupCount;
+		libraries.push_back(std::move(state));
+		groupCount += static_cast<uint32_t>(library.groups.size());
+		return libraries.back().firstGroup;
+	}
+
+	VkRayTracingPipelineInterfaceCreateInfoKHR RayTracingPipelineBuilder::GetInterface() const
+	{
+		// Has to be identical for every library and the pipeline they're linked into
+		VkRayTracingPipelineInterfaceCreateInfoKHR interface_info{};
+		interface_info.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_INTERFACE_CREATE_INFO_KHR;
+		interface_info.maxPipelineRayPayloadSize = payloadSize;
+		interface_info.maxPipelineRayHitAttributeSize = attributeSize;
+		return interface_info;
+	}
+
+	std::vector<VkPipelineShaderStageCreateInfo> RayTracingPipelineBuilder::GetStages(const Library& library,
+		const std::vector<VkShaderModule>& modules) const
+	{
+		std::vector<VkPipelineShaderStageCreateInfo> stages(library.shaders.size());
+		for (size_t i = 0; i < stages.size(); i++)
+		{
+			stages[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+			stages[i].stage = library.shaders[i].stage;
+			stages[i].module = modules[i];
+			stages[i].pName = "main";
+		}
+		return stages;
+	}
+
+	VkPipeline RayTracingPipelineBuilder::CreateLibrary(const Library& library, const std::vector<VkShaderModule>& modules) const
+	{
+		const std::vector<VkPipelineShaderStageCreateInfo> stages = GetStages(library, modules);
+		const VkRayTracingPipelineInterfaceCreateInfoKHR interface_info = GetInterface();
+
+		VkRayTracingPipelineCreateInfoKHR create_info{};
+		create_info.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+		create_info.flags = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR;
+		create_info.stageCount = static_cast<uint32_t>(stages.size());
+		create_info.pStages = stages.data();
+		create_info.groupCount = static_cast<uint32_t>(library.groups.size());
+		create_info.pGroups = library.groups.data();
+		create_info.maxPipelineRayRecursionDepth = maxRecursionDepth;
+		create_info.pLibraryInterface = &interface_info;
+		create_info.layout = layout;
+
+		VkPipeline pipeline;
+		check_vk_result(vkCreateRayTracingPipelinesKHR(GetDevice(), VK_NULL_HANDLE, GetPipelineCache(), 1,
+			&create_info, nullptr, &pipeline));
+		return pipeline;
+	}
+
+	VkPipeline RayTracingPipelineBuilder::Link() const
+	{
+		std::vector<VkPipeline> handles;
+		for (const LibraryState& state : libraries)
+		{
+			handles.push_back(state.library);
+		}
+
+		VkPipelineLibraryCreateInfoKHR library_info{};
+		library_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+		library_info.libraryCount = static_cast<uint32_t>(handles.size());
+		library_info.pLibraries = handles.data();
+
+		const VkRayTracingPipelineInterfaceCreateInfoKHR interface_info = GetInterface();
+
+		// No stages or groups of its own, everything comes from the libraries
+		VkRayTracingPipelineCreateInfoKHR create_info{};
+		create_info.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+		create_info.maxPipelineRayRecursionDepth = maxRecursionDepth;
+		create_info.pLibraryInfo = &library_info;
+		create_info.pLibraryInterface = &interface_info;
+		create_info.layout = layout;
+
+		VkPipeline pipeline;
+		check_vk_result(vkCreateRayTracingPipelinesKHR(GetDevice(), VK_NULL_HANDLE, GetPipelineCache(), 1,
+			&create_info, nullptr, &pipeline));
+		return pipeline;
+	}
+
+	VkPipeline RayTracingPipelineBuilder::CreateMonolithic() const
+	{
+		std::vector<VkPipelineShaderStageCreateInfo> stages;
+		std::vector<VkRayTracingShaderGroupCreateInfoKHR> groups;
+		for (const LibraryState& state : libraries)
+		{
+			// Group shader indices move along by the stages of the libraries before this one
+			const uint32_t stage_offset = static_cast<uint32_t>(stages.size());
+			auto Offset = [stage_offset](uint32_t index) {
+				return index == VK_SHADER_UNUSED_KHR ? index : index + stage_offset;
+			};
+			for (VkRayTracingShaderGroupCreateInfoKHR group : state.description.groups)
+			{
+				group.generalShader = Offset(group.generalShader);
+				group.closestHitShader = Offset(group.closestHitShader);
+				group.anyHitShader = Offset(group.anyHitShader);
+				group.intersectionShader = Offset(group.intersectionShader);
+				groups.push_back(group);
+			}
+			const std::vector<VkPipelineShaderStageCreateInfo> library_stages = GetStages(state.description, state.modules);
+			stages.insert(stages.end(), library_stages.begin(), library_stages.end());
+		}
+
+		VkRayTracingPipelineCreateInfoKHR create_info{};
+		create_info.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+		create_info.stageCount = static_cast<uint32_t>(stages.size());
+		create_info.pStages = stages.data();
+		create_info.groupCount = static_cast<uint32_t>(groups.size());
+		create_info.pGroups = groups.data();
+		create_info.maxPipelineRayRecursionDepth = maxRecursionDepth;
+		create_info.layout = layout;
+
+		VkPipeline pipeline;
+		check_vk_result(vkCreateRayTracingPipelinesKHR(GetDevice(), VK_NULL_HANDLE, GetPipelineCache(), 1,
+			&create_info, nullptr, &pipeline));
+		return pipeline;
+	}
+
+	VkPipeline RayTracingPipelineBuilder::Build(Replaced& replaced)
+	{
+		PB_TRACE_SCOPE("RayTracingPipelineBuilder::Build");
+		const auto compile_start = std::chrono::high_resolution_clock::now();
+
+		// Find the libraries whose sources changed, by hashing what's on disk now
+		std::vector<uint32_t> changed;
+		std::vector<size_t> hashes(libraries.size());
+		std::vector<ShaderFile> files;
+		for (uint32_t i = 0; i < libraries.size(); i++)
+		{
+			size_t hash = 0;
+			for (const ShaderFile& file : libraries[i].description.shaders)
+			{
+				std::string source;
+				if (!GLSLCompiler::read_shader_file(file.path, source))
+				{
+					return VK_NULL_HANDLE;
+				}
+				hash = hash * 31 + std::hash<std::string>()(source);
+			}
+			hashes[i] = hash;
+			if (hash != libraries[i].sourceHash || libraries[i].modules.empty())
+			{
+				changed.push_back(i);
+				files.insert(files.end(), libraries[i].description.shaders.begin(), libraries[i].description.shaders.end());
+			}
+		}
+
+		// Every changed shader compiles in parallel, whichever library it belongs to
+		std::vector<VkShaderModule> modules;
+		if (!files.empty() && !GLSLCompiler::load_shader_files(files, false, modules))
+		{
+			return VK_NULL_HANDLE;
+		}
+
+		std::vector<std::vector<VkShaderModule>> library_modules(changed.size());
+		size_t next_module = 0;
+		for (size_t i = 0; i < changed.size(); i++)
+		{
+			const size_t count = libraries[changed[i]].description.shaders.size();
+			library_modules[i].assign(modules.begin() + next_module, modules.begin() + next_module + count);
+			next_module += count;
+		}
+
+		// Libraries don't depend on each other, so they're created in parallel too
+		std::vector<VkPipeline> library_pipelines(changed.size(), VK_NULL_HANDLE);
+		if (useLibraries)
+		{
+			GetTaskSystem().ParallelFor(static_cast<uint32_t>(changed.size()), [&](uint32_t i) {
+				library_pipelines[i] = CreateLibrary(libraries[changed[i]].description, library_modules[i]);
+			});
+		}
+
+		for (size_t i = 0; i < changed.size(); i++)
+		{
+			LibraryState& state = libraries[changed[i]];
+			replaced.modules.insert(replaced.modules.end(), state.modules.begin(), state.modules.end());
+			if (state.library != VK_NULL_HANDLE)
+			{
+				replaced.libraries.push_back(state.library);
+			}
+			state.modules = std::move(library_modules[i]);
+			state.library = library_pipelines[i];
+			state.sourceHash = hashes[changed[i]];
+		}
+
+		const auto link_start = std::chrono::high_resolution_clock::now();
+		VkPipeline pipeline = useLibraries ? Link() : CreateMonolithic();
+		const auto link_end = std::chrono::high_resolution_clock::now();
+
+		statistics.compiledLibraries = static_cast<uint32_t>(changed.size());
+		statistics.totalLibraries = static_cast<uint32_t>(libraries.size());
+		statistics.compileSeconds = std::chrono::duration<double>(link_start - compile_start).count();
+		statistics.linkSeconds = std::chrono::duration<double>(link_end - link_start).count();
+		return pipeline;
+	}
+
+	void RayTracingPipelineBuilder::Release(Replaced& replaced)
+	{
+		for (VkPipeline library : replaced.libraries)
+		{
+			vkDestroyPipeline(GetDevice(), library, nullptr);
+		}
+		for (VkShaderModule module : replaced.modules)
+		{
+			vkDestroyShaderModule(GetDevice(), module, nullptr);
+		}
+		replaced.libraries.clear();
+		replaced.modules.clear();
+	}
+
+	void RayTracingPipelineBuilder::Destroy()
+	{
+		for (LibraryState& state : libraries)
+		{
+			if (state.library != VK_NULL_HANDLE)
+			{
+				vkDestroyPipeline(GetDevice(), state.library, nullptr);
+			}
+			for (VkShaderModule module : state.modules)
+			{
+				vkDestroyShaderModule(GetDevice(), module, nullptr);
+			}
+			state.library = VK_NULL_HANDLE;
+			state.modules.clear();
+			state.sourceHash = 0;
+		}
+	}
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include "vk_common.h"
+#include "GLSLCompiler.h"
+#include <string>
+#include <vector>
+
+namespace PBEngine
+{
+	/*
+		Assembles a ray tracing pipeline out of pipeline libraries (VK_KHR_pipeline_library).
+
+		Every library holds a few shader groups, raygen and miss in one and a hit group per material in the
+		others. Build only compiles the libraries whose shader files changed since the last Build and then
+		links all of them, which is cheap next to compiling. Adding or editing a material costs one library
+		and a relink instead of the whole pipeline.
+
+		Without the extension Build creates one monolithic pipeline, still reusing the shader modules of
+		libraries that didn't change.
+
+		The linked pipeline numbers its groups library by library in the order they were added, so the
+		shader binding table layout is the same either way.
+	*/
+	class RayTracingPipelineBuilder
+	{
+	public:
+		struct Library
+		{
+			std::vector<ShaderFile> shaders;
+			// Shader indices are into this library's shaders
+			std::vector<VkRayTracingShaderGroupCreateInfoKHR> groups;
+		};
+
+		// What Build replaced. Whatever was linked before may still use them, so the caller frees them
+		// with Release once the old pipeline is gone.
+		struct Replaced
+		{
+			std::vector<VkPipeline> libraries;
+			std::vector<VkShaderModule> modules;
+		};
+
+		struct Statistics
+		{
+			uint32_t compiledLibraries = 0;
+			uint32_t totalLibraries = 0;
+			double compileSeconds = 0.0;
+			double linkSeconds = 0.0;
+		};
+
+		/**
+		 * @param payloadSize Largest ray payload any of the shaders uses, in bytes
+		 * @param attributeSize Largest hit attribute, 8 for the built in triangle barycentrics
+		 */
+		RayTracingPipelineBuilder(VkPipelineLayout layout, uint32_t maxRecursionDepth, uint32_t payloadSize,
+			uint32_t attributeSize = 8);
+		RayTracingPipelineBuilder(const RayTracingPipelineBuilder&) = delete;
+		RayTracingPipelineBuilder& operator=(const RayTracingPipelineBuilder&) = delete;
+		~RayTracingPipelineBuilder();
+
+		// Returns the index of the library's first group in the linked pipeline
+		uint32_t AddLibrary(const Library& library);
+
+		uint32_t GetGroupCount() const { return groupCount; }
+
+		/**
+		 * @brief Compiles the libraries that are new or whose shader files changed, then links everything.
+		 * Nothing is kept from a Build that fails, the next one starts from the previous libraries again.
+		 * @param replaced Libraries and modules that the new ones took over from
+		 * @return The linked pipeline owned by the caller, VK_NULL_HANDLE when a shader doesn't compile
+		 */
+		VkPipeline Build(Replaced& replaced);
+
+		static void Release(Replaced& replaced);
+
+		// Frees every library, pipelines linked from them have to be destroyed already
+		void Destroy();
+
+		const Statistics& GetStatistics() const { return statistics; }
+
+	private:
+		struct LibraryState
+		{
+			Library description;
+			uint32_t firstGroup = 0;
+			// Of the sources the current modules came from, 0 before the first Build
+			size_t sourceHash = 0;
+			std::vector<VkShaderModule> modules;
+			// VK_NULL_HANDLE without pipeline library support
+			VkPipeline library = VK_NULL_HANDLE;
+		};
+
+		VkRayTracingPipelineInterfaceCreateInfoKHR GetInterface() const;
+		std::vector<VkPipelineShaderStageCreateInfo> GetStages(const Library& library, const std::vector<VkShaderModule>& modules) const;
+		VkPipeline CreateLibrary(const Library& library, const std::vector<VkShaderModule>& modules) const;
+		VkPipeline Link() const;
+		VkPipeline CreateMonolithic() const;
+
+		VkPipelineLayout layout;
+		uint32_t maxRecursionDepth;
+		uint32_t payloadSize;
+		uint32_t attributeSize;
+		uint32_t groupCount = 0;
+		bool useLibraries;
+		std::vector<LibraryState> libraries;
+		Statistics statistics;
+	};
+}
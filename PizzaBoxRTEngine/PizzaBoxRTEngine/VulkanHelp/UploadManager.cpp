@@ -0,0 +1,339 @@
+#include "UploadManager.h"
+#include <algorithm>
+#include <cstring>
+
+namespace PBEngine
+{
+	namespace
+	{
+		VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment)
+		{
+			return (value + alignment - 1) / alignment * alignment;
+		}
+	}
+
+	UploadManager& GetUploadManager()
+	{
+		static UploadManager uploadManager;
+		return uploadManager;
+	}
+
+	void UploadManager::EnsureInitialised()
+	{
+		if (staging)
+		{
+			return;
+		}
+
+		segmentCount = std::max(segmentCount, 1u);
+		segmentSize = AlignUp(std::max<VkDeviceSize>(segmentSize, 16), 16);
+		staging = std::make_unique<Buffer>(GetDevice(), GetPhysicalDevice(), segmentSize * segmentCount,
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+		VkCommandPoolCreateInfo pool_info{};
+		pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+		pool_info.queueFamilyIndex = GetApp().g_QueueFamily[1];
+		check_vk_result(vkCreateCommandPool(GetDevice(), &pool_info, nullptr, &commandPool));
+		pool_info.queueFamilyIndex = GetApp().g_QueueFamily[0];
+		check_vk_result(vkCreateCommandPool(GetDevice(), &pool_info, nullptr, &acquireCommandPool));
+
+		segments.resize(segmentCount);
+		for (Segment& segment : segments)
+		{
+			VkCommandBufferAllocateInfo allocate_info{};
+			allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+			allocate_info.commandBufferCount = 1;
+			allocate_info.commandPool = commandPool;
+			check_vk_result(vkAllocateCommandBuffers(GetDevice(), &allocate_info, &segment.commandBuffer));
+			allocate_info.commandPool = acquireCommandPool;
+			check_vk_result(vkAllocateCommandBuffers(GetDevice(), &allocate_info, &segment.acquireCommandBuffer));
+
+			VkFenceCreateInfo fence_info{};
+			fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+			check_vk_result(vkCreateFence(GetDevice(), &fence_info, nullptr, &segment.fence));
+
+			VkSemaphoreCreateInfo semaphore_info{};
+			semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+			check_vk_result(vkCreateSemaphore(GetDevice(), &semaphore_info, nullptr, &segment.semaphore));
+		}
+		currentSegment = 0;
+	}
+
+	VkMemoryPropertyFlags UploadManager::GetDeviceLocalProperties()
+	{
+		const VkMemoryPropertyFlags mappable_device_local = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (unifiedMemory < 0)
+		{
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(GetPhysicalDevice(), &properties);
+			VkPhysicalDeviceMemoryProperties memory_properties;
+			vkGetPhysicalDeviceMemoryProperties(GetPhysicalDevice(), &memory_properties);
+
+			bool mappable = false;
+			for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+			{
+				if ((memory_properties.memoryTypes[i].propertyFlags & mappable_device_local) == mappable_device_local)
+				{
+					mappable = true;
+				}
+			}
+			// Discrete cards can map a window of their memory too, but that's small and slow for the host to write
+			const bool integrated = properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU ||
+				properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU;
+			unifiedMemory = mappable && integrated ? 1 : 0;
+		}
+		return unifiedMemory ? mappable_device_local : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+	}
+
+	void UploadManager::Upload(Buffer& dst, const void* data, VkDeviceSize size, VkDeviceSize offset, uint32_t dstQueueFamily)
+	{
+		if (size == 0)
+		{
+			return;
+		}
+
+		// Unified memory, or a destination that is host visible anyway
+		if (dst.map() != nullptr)
+		{
+			dst.update(static_cast<const uint8_t*>(data), static_cast<size_t>(size), static_cast<size_t>(offset));
+			std::lock_guard<std::mutex> lock(mutex);
+			statistics.directBytes += size;
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		EnsureInitialised();
+
+		// Bigger uploads are split over as many segments as they need
+		const uint8_t* source = static_cast<const uint8_t*>(data);
+		uint8_t* staging_data = static_cast<uint8_t*>(staging->map());
+		VkDeviceSize copied = 0;
+		while (copied < size)
+		{
+			Segment& segment = GetRecordingSegment();
+			if (segment.used >= segmentSize)
+			{
+				SubmitSegment(segment);
+				continue;
+			}
+
+			const VkDeviceSize chunk = std::min(size - copied, segmentSize - segment.used);
+			const VkDeviceSize staging_offset = currentSegment * segmentSize + segment.used;
+			memcpy(staging_data + staging_offset, source + copied, static_cast<size_t>(chunk));
+
+			VkBufferCopy region{};
+			region.srcOffset = staging_offset;
+			region.dstOffset = offset + copied;
+			region.size = chunk;
+			vkCmdCopyBuffer(segment.commandBuffer, staging->get_handle(), dst.get_handle(), 1, &region);
+
+			segment.used = std::min(AlignUp(segment.used + chunk, 16), segmentSize);
+			copied += chunk;
+		}
+		statistics.stagedBytes += size;
+
+		if (dstQueueFamily == UINT32_MAX)
+		{
+			return;
+		}
+		segments[currentSegment].usedByRenderQueue = true;
+
+		// Earlier chunks went out in earlier submissions to the same queue, so releasing in the last one covers them
+		const uint32_t upload_family = GetApp().g_QueueFamily[1];
+		if (dstQueueFamily != upload_family)
+		{
+			VkBufferMemoryBarrier release{};
+			release.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+			release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			release.dstAccessMask = 0;
+			release.srcQueueFamilyIndex = upload_family;
+			release.dstQueueFamilyIndex = dstQueueFamily;
+			release.buffer = dst.get_handle();
+			release.offset = offset;
+			release.size = size;
+			segments[currentSegment].releases.push_back(release);
+		}
+	}
+
+	void UploadManager::Release(Buffer& buffer, VkAccessFlags srcAccess, uint32_t dstQueueFamily)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		EnsureInitialised();
+
+		// An otherwise empty segment is fine, it then only carries the release and the acquire
+		Segment& segment = GetRecordingSegment();
+		segment.usedByRenderQueue = true;
+
+		const uint32_t upload_family = GetApp().g_QueueFamily[1];
+		if (dstQueueFamily != upload_family)
+		{
+			VkBufferMemoryBarrier release{};
+			release.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+			release.srcAccessMask = srcAccess;
+			release.dstAccessMask = 0;
+			release.srcQueueFamilyIndex = upload_family;
+			release.dstQueueFamilyIndex = dstQueueFamily;
+			release.buffer = buffer.get_handle();
+			release.offset = 0;
+			release.size = VK_WHOLE_SIZE;
+			segment.releases.push_back(release);
+		}
+	}
+
+	UploadManager::Segment& UploadManager::GetRecordingSegment()
+	{
+		Segment& segment = segments[currentSegment];
+		if (!segment.recording)
+		{
+			WaitForSegment(segment);
+			check_vk_result(vkResetCommandBuffer(segment.commandBuffer, 0));
+
+			VkCommandBufferBeginInfo begin_info{};
+			begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+			check_vk_result(vkBeginCommandBuffer(segment.commandBuffer, &begin_info));
+			segment.used = 0;
+			segment.recording = true;
+		}
+		return segment;
+	}
+
+	void UploadManager::WaitForSegment(Segment& segment)
+	{
+		if (!segment.inFlight)
+		{
+			return;
+		}
+		if (vkGetFenceStatus(GetDevice(), segment.fence) != VK_SUCCESS)
+		{
+			statistics.stallCount++;
+			check_vk_result(vkWaitForFences(GetDevice(), 1, &segment.fence, VK_TRUE, UINT64_MAX));
+		}
+		check_vk_result(vkResetFences(GetDevice(), 1, &segment.fence));
+		segment.inFlight = false;
+	}
+
+	void UploadManager::SubmitSegment(Segment& segment)
+	{
+		// Covers consumers on the compute queue, like the BLAS builds, that are submitted after this
+		VkMemoryBarrier copy_barrier{};
+		copy_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		copy_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		copy_barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+		vkCmdPipelineBarrier(segment.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+			0, 1, &copy_barrier, 0, nullptr, 0, nullptr);
+		// Released buffers may also have been written by earlier submissions, like acceleration structure builds
+		if (!segment.releases.empty())
+		{
+			vkCmdPipelineBarrier(segment.commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+				0, 0, nullptr, static_cast<uint32_t>(segment.releases.size()), segment.releases.data(), 0, nullptr);
+		}
+		check_vk_result(vkEndCommandBuffer(segment.commandBuffer));
+
+		VkSubmitInfo submit_info{};
+		submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submit_info.commandBufferCount = 1;
+		submit_info.pCommandBuffers = &segment.commandBuffer;
+		if (!segment.usedByRenderQueue)
+		{
+			check_vk_result(vkQueueSubmit(GetComputeQueue(), 1, &submit_info, segment.fence));
+		}
+		else
+		{
+			submit_info.signalSemaphoreCount = 1;
+			submit_info.pSignalSemaphores = &segment.semaphore;
+			check_vk_result(vkQueueSubmit(GetComputeQueue(), 1, &submit_info, VK_NULL_HANDLE));
+
+			// The matching acquire, everything submitted to the ray tracing queue afterwards is ordered behind it.
+			// With a single family there is no ownership to move and the semaphore wait alone does the job.
+			std::vector<VkBufferMemoryBarrier> acquires = segment.releases;
+			for (VkBufferMemoryBarrier& acquire : acquires)
+			{
+				acquire.srcAccessMask = 0;
+				acquire.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+			}
+			check_vk_result(vkResetCommandBuffer(segment.acquireCommandBuffer, 0));
+			VkCommandBufferBeginInfo begin_info{};
+			begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+			check_vk_result(vkBeginCommandBuffer(segment.acquireCommandBuffer, &begin_info));
+			if (!acquires.empty())
+			{
+				vkCmdPipelineBarrier(segment.acquireCommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+					0, 0, nullptr, static_cast<uint32_t>(acquires.size()), acquires.data(), 0, nullptr);
+			}
+			check_vk_result(vkEndCommandBuffer(segment.acquireCommandBuffer));
+
+			// The fence goes on the acquire, which can't finish before the copies it waits for
+			const VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+			VkSubmitInfo acquire_submit_info{};
+			acquire_submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			acquire_submit_info.waitSemaphoreCount = 1;
+			acquire_submit_info.pWaitSemaphores = &segment.semaphore;
+			acquire_submit_info.pWaitDstStageMask = &wait_stage;
+			acquire_submit_info.commandBufferCount = 1;
+			acquire_submit_info.pCommandBuffers = &segment.acquireCommandBuffer;
+			check_vk_result(vkQueueSubmit(GetRTQueue(), 1, &acquire_submit_info, segment.fence));
+			segment.releases.clear();
+			segment.usedByRenderQueue = false;
+		}
+
+		segment.recording = false;
+		segment.inFlight = true;
+		statistics.submissionCount++;
+		currentSegment = (currentSegment + 1) % static_cast<uint32_t>(segments.size());
+	}
+
+	void UploadManager::FlushLocked()
+	{
+		if (!segments.empty() && segments[currentSegment].recording)
+		{
+			SubmitSegment(segments[currentSegment]);
+		}
+	}
+
+	void UploadManager::Flush()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		FlushLocked();
+	}
+
+	void UploadManager::WaitIdle()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		FlushLocked();
+		for (Segment& segment : segments)
+		{
+			WaitForSegment(segment);
+		}
+	}
+
+	void UploadManager::Destroy()
+	{
+		WaitIdle();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (Segment& segment : segments)
+		{
+			vkDestroyFence(GetDevice(), segment.fence, nullptr);
+			vkDestroySemaphore(GetDevice(), segment.semaphore, nullptr);
+		}
+		segments.clear();
+		if (commandPool != VK_NULL_HANDLE)
+		{
+			// Frees the command buffers along with them
+			vkDestroyCommandPool(GetDevice(), commandPool, nullptr);
+			vkDestroyCommandPool(GetDevice(), acquireCommandPool, nullptr);
+			commandPool = VK_NULL_HANDLE;
+			acquireCommandPool = VK_NULL_HANDLE;
+		}
+		staging.reset();
+		currentSegment = 0;
+		unifiedMemory = -1;
+	}
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include "vk_common.h"
+#include "Buffer.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace PBEngine
+{
+	/*
+		Copies data into DEVICE_LOCAL buffers through a persistently mapped staging ring.
+
+		The ring is split into segments, each collecting its copies in one command buffer. A full segment is
+		submitted to the compute queue and the next one takes over, waiting on its fence only when the GPU
+		hasn't caught up with it yet. Many small uploads end up in a handful of submissions and the host only
+		stalls when it's a whole ring ahead of the copies.
+
+		Copies run on the compute queue family. Buffers the render family reads are released at the end of the
+		copy submission and acquired by a short submission on the ray tracing queue that waits for it. Buffers
+		other compute queue work wrote, like built acceleration structures, are handed over the same way through
+		Release. On unified memory devices, where device local memory is also host visible, the data is written
+		straight into the destination instead.
+	*/
+	class UploadManager
+	{
+	public:
+		struct Statistics
+		{
+			// Bytes that went through the staging ring
+			VkDeviceSize stagedBytes = 0;
+			// Bytes written straight into host visible destinations
+			VkDeviceSize directBytes = 0;
+			uint32_t submissionCount = 0;
+			// Times a segment was still in flight when the ring came back around to it
+			uint32_t stallCount = 0;
+		};
+
+		UploadManager() = default;
+		UploadManager(const UploadManager&) = delete;
+		UploadManager& operator=(const UploadManager&) = delete;
+
+		/**
+		 * @brief Queues a copy into dst, the source data can be freed as soon as this returns
+		 * @param dst Destination, needs VK_BUFFER_USAGE_TRANSFER_DST_BIT unless it's host visible
+		 * @param dstQueueFamily Family that uses the buffer afterwards, UINT32_MAX for the compute family that copies
+		 */
+		void Upload(Buffer& dst, const void* data, VkDeviceSize size, VkDeviceSize offset = 0,
+			uint32_t dstQueueFamily = UINT32_MAX);
+
+		/**
+		 * @brief Hands a buffer written or read by compute queue work submitted before the next Flush over to
+		 * another queue family. The release goes into the next copy submission and the acquire into the ray
+		 * tracing queue submission that waits for it, same as for an upload with dstQueueFamily.
+		 * @param srcAccess How the compute queue accessed the buffer, e.g. VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR
+		 */
+		void Release(Buffer& buffer, VkAccessFlags srcAccess, uint32_t dstQueueFamily);
+
+		/**
+		 * @brief Submits the copies queued so far. Work submitted afterwards to the compute queue, or to the
+		 * ray tracing queue for buffers uploaded for the render family, sees the data without further synchronisation.
+		 */
+		void Flush();
+
+		/*
+			Flushes and blocks until every copy has finished
+		*/
+		void WaitIdle();
+
+		/*
+			Waits for outstanding copies and frees the ring. Must run before the device is destroyed,
+			the manager can be used again afterwards.
+		*/
+		void Destroy();
+
+		/*
+			Memory properties for buffers that are filled once through Upload and then only read by the GPU.
+			DEVICE_LOCAL everywhere, plus HOST_VISIBLE on unified memory devices so uploads skip the ring.
+		*/
+		VkMemoryPropertyFlags GetDeviceLocalProperties();
+
+		const Statistics& GetStatistics() const { return statistics; }
+
+		// Only read when the ring is created on first use
+		VkDeviceSize segmentSize = 16ull * 1024 * 1024;
+		uint32_t segmentCount = 4;
+
+	private:
+		struct Segment
+		{
+			VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+			VkCommandBuffer acquireCommandBuffer = VK_NULL_HANDLE;
+			VkFence fence = VK_NULL_HANDLE;
+			// Signalled by the copies, waited on by the acquire submission
+			VkSemaphore semaphore = VK_NULL_HANDLE;
+			VkDeviceSize used = 0;
+			bool recording = false;
+			bool inFlight = false;
+			// Something in here is read on the ray tracing queue, which has to wait for the copies
+			bool usedByRenderQueue = false;
+			// Buffers handed over to the render family once the copies are done, empty when both families are the same
+			std::vector<VkBufferMemoryBarrier> releases;
+		};
+
+		void EnsureInitialised();
+		void FlushLocked();
+		// The segment taking copies, waits for it and starts recording when needed
+		Segment& GetRecordingSegment();
+		void SubmitSegment(Segment& segment);
+		void WaitForSegment(Segment& segment);
+
+		std::unique_ptr<Buffer> staging;
+		VkCommandPool commandPool = VK_NULL_HANDLE;
+		VkCommandPool acquireCommandPool = VK_NULL_HANDLE;
+		std::vector<Segment> segments;
+		uint32_t currentSegment = 0;
+		// -1 until checked
+		int unifiedMemory = -1;
+		Statistics statistics;
+		std::mutex mutex;
+	};
+
+	/*
+		The upload manager every engine resource goes through. Creates its ring on first use.
+	*/
+	UploadManager& GetUploadManager();
+}
@@ -57,7 +57,8 @@ namespace PBEngine
 	}
 	VkQueue GetRTQueue()
 	{
-		return app.g_RenderQueue[1];
+		// Same queue ImGui draws with, so submission order alone orders the traced image against the UI sampling it
+		return app.g_RenderQueue[0];
 	}
 	VkQueue GetComputeQueue()
 	{
@@ -73,4 +74,9 @@ namespace PBEngine
 	{
 		return app.g_PhysicalDevice;
 	}
+
+	VkPipelineCache GetPipelineCache()
+	{
+		return app.g_PipelineCache;
+	}
 }
\ No newline at end of file
@@ -25,4 +25,6 @@ namespace PBEngine
 	VkDevice GetDevice();
 	
 	VkPhysicalDevice GetPhysicalDevice();
+
+	VkPipelineCache GetPipelineCache();
 }
\ No newline at end of file
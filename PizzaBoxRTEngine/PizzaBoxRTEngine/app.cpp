@@ -1,11 +1,19 @@
 #include "app.h"
 
+#include <chrono>
 #include <functional>
 #include <list>
 
 // My header files
 #include "Panels/Panel.h"
 #include "Panels/Viewport.h"
+#include "Panels/ProfilerPanel.h"
+#include "Rendering/CPU/Backend_CPU.h"
+#include <Core/TaskSystem.h>
+#include <Core/Trace.h>
+#include <VulkanHelp/MemoryAllocator.h>
+#include <VulkanHelp/DeletionQueue.h>
+#include <VulkanHelp/UploadManager.h>
 
 namespace PBEngine
 {
@@ -20,6 +28,12 @@ namespace PBEngine
     VkDebugReportCallbackEXT App::g_DebugReport = VK_NULL_HANDLE;
     VkPipelineCache App::g_PipelineCache = VK_NULL_HANDLE;
     VkDescriptorPool App::g_DescriptorPool = VK_NULL_HANDLE;
+    std::string App::g_ScenePath;
+    bool App::g_CompactAccelerationStructures = false;
+    bool App::g_HostAccelerationStructureBuilds = false;
+    bool App::g_PipelineLibraries = false;
+    bool App::g_CalibratedTimestamps = false;
+    std::string App::g_TracePath;
 
     ImGui_ImplVulkanH_Window App::g_MainWindowData;
     int App::g_MinImageCount = 2;
@@ -169,6 +183,10 @@ namespace PBEngine
 
 	int App::Start()
 	{
+        GetTracer().SetThreadName("Main");
+        if (!g_TracePath.empty())
+            GetTracer().SetEnabled(true);
+
         glfwSetErrorCallback(glfw_error_callback);
         if (!glfwInit())
             return 1;
@@ -280,7 +298,9 @@ namespace PBEngine
         std::list<std::unique_ptr<Panel>> panels;
 
         std::unique_ptr<Viewport> viewport = std::make_unique<Viewport>();
+        std::unique_ptr<ProfilerPanel> profiler = std::make_unique<ProfilerPanel>(*viewport);
         panels.push_back(std::move(viewport));
+        panels.push_back(std::move(profiler));
 
         for (auto& panelPtr : panels) {
             Panel& panel = *panelPtr;
@@ -289,12 +309,16 @@ namespace PBEngine
 
         // Main loop
         while (!glfwWindowShouldClose(window)) {
+            PB_TRACE_SCOPE("Frame");
             // Poll events
             glfwPollEvents();
 
-            for (auto& panelPtr : panels) {
-                Panel& panel = *panelPtr;
-                panel.PreRender();
+            {
+                PB_TRACE_SCOPE("Panels PreRender");
+                for (auto& panelPtr : panels) {
+                    Panel& panel = *panelPtr;
+                    panel.PreRender();
+                }
             }
 
             // Resize swap chain?
@@ -361,9 +385,12 @@ namespace PBEngine
 
             // ImGUI code goes here
             ImGui::ShowStackToolWindow();
-            for (auto& panelPtr : panels) {
-                Panel& panel = *panelPtr;
-                panel.Show();
+            {
+                PB_TRACE_SCOPE("Panels Show");
+                for (auto& panelPtr : panels) {
+                    Panel& panel = *panelPtr;
+                    panel.Show();
+                }
             }
 
             // Rendering
@@ -376,8 +403,10 @@ namespace PBEngine
             wd->ClearValue.color.float32[1] = clear_color.y * clear_color.w;
             wd->ClearValue.color.float32[2] = clear_color.z * clear_color.w;
             wd->ClearValue.color.float32[3] = clear_color.w;
-            if (!main_is_minimized)
+            if (!main_is_minimized) {
+                PB_TRACE_SCOPE("FrameRender");
                 FrameRender(wd, main_draw_data);
+            }
 
             // Update and Render additional Platform Windows
             if (io.ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
@@ -386,8 +415,10 @@ namespace PBEngine
             }
 
             // Present Main Platform Window
-            if (!main_is_minimized)
+            if (!main_is_minimized) {
+                PB_TRACE_SCOPE("FramePresent");
                 FramePresent(wd);
+            }
         }
 
         // Cleanup
@@ -396,12 +427,18 @@ namespace PBEngine
 
         // So I'm injecting some code here
         panels.clear();
+        if (!g_TracePath.empty())
+            GetTracer().WriteChromeTrace(g_TracePath);
 
         ImGui_ImplVulkan_Shutdown();
         ImGui_ImplGlfw_Shutdown();
         ImGui::DestroyContext();
 
         CleanupVulkanWindow();
+        // Everything the renderers handed over, the device is idle by now
+        GetDeletionQueue().Flush();
+        GetUploadManager().Destroy();
+        GetMemoryAllocator().Destroy();
         CleanupVulkan();
 
         glfwDestroyWindow(window);
@@ -409,4 +446,109 @@ namespace PBEngine
 
         return 0;
     }
+
+    int App::StartHeadless(const HeadlessOptions& options)
+    {
+        GetTracer().SetThreadName("Main");
+        if (!g_TracePath.empty())
+            GetTracer().SetEnabled(true);
+
+        if (options.useCPUBackend)
+        {
+            int result = StartHeadlessCPU(options);
+            if (!g_TracePath.empty())
+                GetTracer().WriteChromeTrace(g_TracePath);
+            return result;
+        }
+
+        // No GLFW here, so the only instance extensions are the ones SetupVulkan adds itself
+        ImVector<const char*> extensions;
+        SetupVulkan(extensions, true);
+
+        float width = static_cast<float>(options.width);
+        float height = static_cast<float>(options.height);
+        {
+            Renderer renderer(&width, &height, Backend::RendererBackendType_FullRT, options.scenePath);
+            Backend_FullRT* backend = dynamic_cast<Backend_FullRT*>(renderer.renderingBackend.get());
+            if (backend == nullptr)
+            {
+                std::cerr << "Headless rendering needs the ray tracing backend." << std::endl;
+                GetDeletionQueue().Flush();
+                GetUploadManager().Destroy();
+                GetMemoryAllocator().Destroy();
+                CleanupVulkan();
+                return 1;
+            }
+            backend->SetFramesInFlight(options.framesInFlight);
+            backend->targetSampleCount = options.samplesPerPixel;
+
+            auto start = std::chrono::steady_clock::now();
+            for (uint32_t frame = 0; frame < options.frameCount; frame++)
+            {
+                PB_TRACE_SCOPE("Frame");
+                // Render only blocks once framesInFlight frames are queued, so the traces of consecutive
+                // frames overlap on the GPU
+                backend->Render();
+
+                bool lastFrame = frame + 1 == options.frameCount;
+                bool saveFrame = options.saveInterval != 0 && (frame + 1) % options.saveInterval == 0;
+                if (saveFrame || lastFrame)
+                {
+                    std::string path = options.outputPrefix + "_" + std::to_string(frame) + ".ppm";
+                    if (!backend->SaveStorageImage(path))
+                        std::cerr << "Failed to write " << path << std::endl;
+                }
+            }
+            backend->WaitForRender();
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            printf("Rendered %u frames at %ux%u in %.3fs (%.2f fps)\n", options.frameCount, options.width,
+                options.height, seconds, seconds > 0.0 ? options.frameCount / seconds : 0.0);
+            printf("Accumulated %u samples per pixel\n", backend->sampleCount);
+            GetMemoryAllocator().PrintStatistics();
+        }
+        if (!g_TracePath.empty())
+            GetTracer().WriteChromeTrace(g_TracePath);
+
+        VkResult err = vkDeviceWaitIdle(g_Device);
+        check_vk_result(err);
+        GetDeletionQueue().Flush();
+        GetUploadManager().Destroy();
+        GetMemoryAllocator().Destroy();
+        CleanupVulkan();
+
+        return 0;
+    }
+
+    int App::StartHeadlessCPU(const HeadlessOptions& options)
+    {
+        float width = static_cast<float>(options.width);
+        float height = static_cast<float>(options.height);
+        Renderer renderer(&width, &height, Backend::RendererBackendType_Custom, options.scenePath);
+        Backend_CPU* backend = dynamic_cast<Backend_CPU*>(renderer.renderingBackend.get());
+
+        double totalSeconds = 0.0;
+        uint64_t totalRays = 0;
+        for (uint32_t frame = 0; frame < options.frameCount; frame++)
+        {
+            PB_TRACE_SCOPE("Frame");
+            backend->Render();
+            totalSeconds += backend->frameSeconds;
+            totalRays += backend->raysTraced;
+
+            bool lastFrame = frame + 1 == options.frameCount;
+            bool saveFrame = options.saveInterval != 0 && (frame + 1) % options.saveInterval == 0;
+            if (saveFrame || lastFrame)
+            {
+                std::string path = options.outputPrefix + "_" + std::to_string(frame) + ".ppm";
+                if (!backend->SaveImage(path))
+                    std::cerr << "Failed to write " << path << std::endl;
+            }
+        }
+
+        printf("CPU rendered %u frames at %ux%u in %.3fs, %.2f Mrays/s on %u threads\n", options.frameCount,
+            options.width, options.height, totalSeconds, totalSeconds > 0.0 ? totalRays / totalSeconds / 1e6 : 0.0,
+            GetTaskSystem().GetThreadCount());
+        return 0;
+    }
 }
@@ -19,8 +19,10 @@
 #include <GLFW/glfw3.h>
 #endif
 #include "../../External/volk/volk.h"
+#include "VulkanHelp/PipelineCache.h"
 //#include "VulkanHelp/vk_common.h"
 //#include <vulkan/vulkan.h>
+#include <string>
 #include <vector>
 // #include <vulkan/vulkan_beta.h>
 
@@ -31,10 +33,35 @@
 
 namespace PBEngine
 {
+    // Settings for rendering without a window, see App::StartHeadless
+    struct HeadlessOptions
+    {
+        uint32_t width = 1280;
+        uint32_t height = 720;
+        uint32_t frameCount = 1;
+        // Write every Nth frame to disk, 0 only writes the last frame
+        uint32_t saveInterval = 0;
+        std::string outputPrefix = "frame";
+        // Use the CPU reference backend, which needs no Vulkan device at all
+        bool useCPUBackend = false;
+        // How many frames the ray tracing backend may queue up before Render blocks
+        uint32_t framesInFlight = 2;
+        // Accumulation stops once every pixel has this many samples, 0 keeps tracing every frame
+        uint32_t samplesPerPixel = 0;
+        // OBJ or glTF file to render, empty renders the built in triangle
+        std::string scenePath;
+    };
+
 	class App
 	{
 	public:
 		int Start();
+        /*
+            Renders straight into the backend's storage image with no window, surface or swapchain
+            and writes the frames to disk as PPM files
+        */
+        int StartHeadless(const HeadlessOptions& options);
+        int StartHeadlessCPU(const HeadlessOptions& options);
 
         // Vulkan Data
         static VkAllocationCallbacks* g_Allocator;
@@ -48,6 +75,20 @@ namespace PBEngine
         static VkPipelineCache g_PipelineCache;
         static VkDescriptorPool g_DescriptorPool;
 
+        // Mesh file the viewport's renderer loads, set with --scene
+        static std::string g_ScenePath;
+        // Compact bottom level acceleration structures after building them, set with --compact-as
+        static bool g_CompactAccelerationStructures;
+        // Build bottom level acceleration structures on CPU threads, set with --host-as-build.
+        // Cleared again by SetupVulkan when the device doesn't support host commands.
+        static bool g_HostAccelerationStructureBuilds;
+        // Whether VK_KHR_pipeline_library is enabled, set by SetupVulkan
+        static bool g_PipelineLibraries;
+        // Whether VK_EXT_calibrated_timestamps is enabled, set by SetupVulkan
+        static bool g_CalibratedTimestamps;
+        // Chrome trace written on exit, set with --trace. Recording starts right away when it's set.
+        static std::string g_TracePath;
+
         static ImGui_ImplVulkanH_Window g_MainWindowData;
         static int g_MinImageCount;
         static bool g_SwapChainRebuild;
@@ -113,10 +154,12 @@ namespace PBEngine
                 if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
                     return device;
             }
-            return VK_NULL_HANDLE;
+
+            // Fall back to whatever is there, e.g. an integrated GPU or a software ICD like lavapipe
+            return gpus[0];
         }
 
-        static void SetupVulkan(ImVector<const char*> instance_extensions) {
+        static void SetupVulkan(ImVector<const char*> instance_extensions, bool headless = false) {
             VkResult err;
 
             // Create Vulkan Instance
@@ -217,7 +260,8 @@ namespace PBEngine
             // Create Logical Device (with 1 queue)
             {
                 ImVector<const char*> device_extensions;
-                device_extensions.push_back("VK_KHR_swapchain");
+                if (!headless)
+                    device_extensions.push_back("VK_KHR_swapchain");
                 device_extensions.push_back(VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME);
                 device_extensions.push_back(VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME);
                 device_extensions.push_back(VK_KHR_SPIRV_1_4_EXTENSION_NAME);
@@ -239,6 +283,20 @@ namespace PBEngine
                     VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME))
                     device_extensions.push_back(VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME);
 #endif
+                // Lets the ray tracing pipeline be linked from separately compiled libraries
+                auto has_extension = [&properties](const char* extension) {
+                    for (const VkExtensionProperties& p : properties)
+                        if (strcmp(p.extensionName, extension) == 0)
+                            return true;
+                    return false;
+                };
+                g_PipelineLibraries = has_extension(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+                if (g_PipelineLibraries)
+                    device_extensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+                // Puts GPU timestamps on the same timeline as the CPU in traces
+                g_CalibratedTimestamps = has_extension(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+                if (g_CalibratedTimestamps)
+                    device_extensions.push_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
                 VkPhysicalDeviceFeatures2 enabledFeatures = {};
 
                 VkPhysicalDeviceBufferDeviceAddressFeaturesKHR addrFeatures = {};
@@ -258,6 +316,26 @@ namespace PBEngine
                 accelStructureFeatures.pNext = &rayTracingFeatures;
                 accelStructureFeatures.accelerationStructure = VK_TRUE;
 
+                // Host builds are optional, software drivers tend to have them and most GPUs don't
+                if (g_HostAccelerationStructureBuilds)
+                {
+                    VkPhysicalDeviceAccelerationStructureFeaturesKHR supportedAccelStructureFeatures = {};
+                    supportedAccelStructureFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+                    VkPhysicalDeviceFeatures2 supportedFeatures = {};
+                    supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+                    supportedFeatures.pNext = &supportedAccelStructureFeatures;
+                    vkGetPhysicalDeviceFeatures2(g_PhysicalDevice, &supportedFeatures);
+                    if (supportedAccelStructureFeatures.accelerationStructureHostCommands)
+                    {
+                        accelStructureFeatures.accelerationStructureHostCommands = VK_TRUE;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "[vulkan] accelerationStructureHostCommands isn't supported, building acceleration structures on the GPU\n");
+                        g_HostAccelerationStructureBuilds = false;
+                    }
+                }
+
                 // Add the features to the enabledFeatures structure
                 enabledFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
                 enabledFeatures.pNext = &accelStructureFeatures;
@@ -315,6 +393,9 @@ namespace PBEngine
                     &g_DescriptorPool);
                 check_vk_result(err);
             }
+
+            // Pipelines compiled by the last run on this GPU
+            g_PipelineCache = LoadPipelineCache(g_Device, g_PhysicalDevice);
         }
 
         // All the ImGui_ImplVulkanH_XXX structures/functions are optional helpers used
@@ -364,6 +445,10 @@ namespace PBEngine
         }
 
         static void CleanupVulkan() {
+            SavePipelineCache(g_Device, g_PipelineCache);
+            vkDestroyPipelineCache(g_Device, g_PipelineCache, g_Allocator);
+            g_PipelineCache = VK_NULL_HANDLE;
+
             vkDestroyDescriptorPool(g_Device, g_DescriptorPool, g_Allocator);
 
 #ifdef IMGUI_VULKAN_DEBUG_REPORT
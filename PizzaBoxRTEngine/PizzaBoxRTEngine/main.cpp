@@ -2,15 +2,105 @@
 
 #include "app.h"
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
 PBEngine::App app;
 
-int main()
+static void PrintUsage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [--headless] [--cpu] [--width N] [--height N] [--frames N] [--save-every N]\n"
+        "    [--output prefix] [--frames-in-flight N] [--spp N] [--scene file.obj|file.gltf|file.glb|file.pbscene]\n"
+        "    [--compact-as] [--host-as-build] [--trace file.json]\n"
+        "--width, --height, --frames and --frames-in-flight take a positive number, --save-every and --spp\n"
+        "also take 0. --cpu needs --headless\n";
+}
+
+// atoi would turn "abc" into 0 and "-1" into 4294967295 once cast, so the whole argument has to be a number
+static bool ParseCount(const char* text, bool allowZero, uint32_t& value)
+{
+    if (text[0] < '0' || text[0] > '9')
+        return false;
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (errno != 0 || *end != '\0' || parsed > UINT32_MAX || (parsed == 0 && !allowZero))
+        return false;
+    value = static_cast<uint32_t>(parsed);
+    return true;
+}
+
+int main(int argc, char** argv)
 {
+    // --headless [--cpu] [--width N] [--height N] [--frames N] [--save-every N] [--output prefix]
+    //     [--frames-in-flight N] [--spp N]
+    // [--scene file.obj|file.gltf|file.glb|file.pbscene] [--compact-as] [--host-as-build] [--trace file.json]
+    //     work with and without --headless
+    bool headless = false;
+    PBEngine::HeadlessOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        bool validCount = true;
+        if (strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else if (strcmp(argv[i], "--width") == 0 && hasValue)
+            validCount = ParseCount(argv[++i], false, options.width);
+        else if (strcmp(argv[i], "--height") == 0 && hasValue)
+            validCount = ParseCount(argv[++i], false, options.height);
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue)
+            validCount = ParseCount(argv[++i], false, options.frameCount);
+        else if (strcmp(argv[i], "--save-every") == 0 && hasValue)
+            validCount = ParseCount(argv[++i], true, options.saveInterval);
+        else if (strcmp(argv[i], "--output") == 0 && hasValue)
+            options.outputPrefix = argv[++i];
+        else if (strcmp(argv[i], "--frames-in-flight") == 0 && hasValue)
+            validCount = ParseCount(argv[++i], false, options.framesInFlight);
+        else if (strcmp(argv[i], "--spp") == 0 && hasValue)
+            validCount = ParseCount(argv[++i], true, options.samplesPerPixel);
+        else if (strcmp(argv[i], "--scene") == 0 && hasValue)
+            options.scenePath = argv[++i];
+        else if (strcmp(argv[i], "--compact-as") == 0)
+            PBEngine::App::g_CompactAccelerationStructures = true;
+        else if (strcmp(argv[i], "--host-as-build") == 0)
+            PBEngine::App::g_HostAccelerationStructureBuilds = true;
+        else if (strcmp(argv[i], "--trace") == 0 && hasValue)
+            PBEngine::App::g_TracePath = argv[++i];
+        else if (strcmp(argv[i], "--cpu") == 0)
+            options.useCPUBackend = true;
+        else
+            std::cerr << "Unknown argument: " << argv[i] << "\n";
+
+        if (!validCount)
+        {
+            std::cerr << "Invalid value for " << argv[i - 1] << ": " << argv[i] << "\n";
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    // The windowed app always renders with the ray tracing backend, so --cpu would silently do nothing there
+    if (options.useCPUBackend && !headless)
+    {
+        std::cerr << "--cpu only works together with --headless\n";
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    // The CPU backend doesn't touch Vulkan, so it also runs where there is no loader installed
+    if (headless && options.useCPUBackend)
+        return app.StartHeadless(options);
+
     VkResult err = volkInitialize();
 	if (err != VK_SUCCESS)
 	{
 		std::cout << "Volk initialisation failed" << "\n";
 		return 0;
 	}
+
+    if (headless)
+        return app.StartHeadless(options);
+    PBEngine::App::g_ScenePath = options.scenePath;
     return app.Start();
 }